@@ -0,0 +1,965 @@
+/**
+ *  blkcache.c
+ *
+ *  Caches the blocks of the device that hold metadata: the FAT, and the
+ *  clusters of directories. The unit of caching is the larger of the
+ *  volume's sector size and the device's logical block size, so that a
+ *  4 byte FAT entry or a 32 byte directory entry is written by merging
+ *  it into a cached block in memory, and then writing that block out
+ *  whole. On devices with 4K sectors, a partial block write costs a read
+ *  and a write inside the device (or the kernel), so this turns two
+ *  device operations into one, and avoids the read entirely when the
+ *  block is already cached.
+ *
+ *  The cache is write through, so the device is always up to date, and
+ *  file data can be read from the device directly. The exception is new
+ *  directory entries, which are written with blk_write_back. Those
+ *  blocks are kept dirty until BLK_DIRTY_LIMIT of them have built up, or
+ *  the flusher thread wakes, and are then written out together, with
+ *  runs of adjacent blocks going in a single request. A burst of creates
+ *  then fills a directory's blocks in memory, instead of writing a
+ *  block for every entry. Blocks are looked up in a hash table, and
+ *  evicted on an LRU basis when the memory accountant (memacct.c) wants
+ *  memory back; dirty blocks are written out first.
+ *
+ *  Blocks can be pinned, by blk_pin, to keep them in the cache whatever
+ *  the memory accountant wants. Pinned blocks are counted, so that
+ *  regions pinned more than once stay pinned until they have all been
+ *  unpinned, and are kept on a list of their own, off the LRU list, so
+ *  that eviction never has to step over them.
+ *
+ *  Blocks that are about to be needed, such as the FAT and first clusters
+ *  of the files in a directory being listed, can be queued with
+ *  blk_prefetch, for the flusher thread to read in between write backs,
+ *  while the caller gets on with other things.
+ *
+ *  If the backend keeps the volume in memory, the cache is bypassed.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "fat.h"
+#include "device.h"
+#include "memacct.h"
+#include "volume.h"
+#include "iosched.h"
+#include "blkcache.h"
+
+
+// A cached block. Each block is on a hash chain, and on the LRU list,
+// or the pinned list if it has been pinned.
+struct blk_entry
+{
+    uint64_t                key;
+    unsigned char           *data;
+    bool                    dirty;
+    unsigned int            pins;
+    struct blk_entry        *hash_next;
+    struct blk_entry        *prev;
+    struct blk_entry        *next;
+};
+
+// The cache for one volume. The lru end of the list is where blocks are
+// evicted from, and blocks are moved to the mru end when used.
+struct blk_cache
+{
+    // the device holding the volume, and the size of the blocks cached.
+    fat_device_t            *device;
+    size_t                  block_size;
+
+    // true if the volume's image is in memory, and the cache is not used.
+    bool                    bypass;
+
+    // true if a block can hold both metadata and file data, which happens
+    // when the volume's sectors are smaller than the device's blocks.
+    bool                    shared_blocks;
+
+    struct blk_entry        *hash [BLK_HASH_BUCKETS];
+    struct blk_entry        *lru;
+    struct blk_entry        *mru;
+    struct blk_entry        *pinned;
+    size_t                  nr_blocks;
+    size_t                  nr_dirty;
+    size_t                  nr_pinned;
+    mem_cache_t             mem;
+    pthread_mutex_t         lock;
+
+    // blocks waiting to be read ahead, in a ring starting at
+    // prefetch_head.
+    uint64_t                prefetch [BLK_PREFETCH_MAX];
+    unsigned int            prefetch_head;
+    unsigned int            nr_prefetch;
+
+    // the flusher thread, which sleeps on wakeup between write backs, and
+    // is woken early to read ahead.
+    pthread_t               flusher;
+    pthread_cond_t          wakeup;
+    bool                    running;
+    bool                    stopping;
+};
+
+
+// local procedures.
+PRIVATE struct blk_entry * find_block (struct blk_cache *cache,
+  uint64_t key);
+PRIVATE struct blk_entry * get_block (struct blk_cache *cache, uint64_t key,
+  bool fill);
+PRIVATE void unlink_block (struct blk_cache *cache, struct blk_entry *b);
+PRIVATE void add_to_mru (struct blk_cache *cache, struct blk_entry *b);
+PRIVATE void add_to_pinned (struct blk_cache *cache, struct blk_entry *b);
+PRIVATE void drop_block (struct blk_cache *cache, struct blk_entry *b);
+PRIVATE void evict_lru (struct blk_cache *cache);
+PRIVATE size_t cache_shrink (mem_cache_t *mem, size_t nbytes);
+PRIVATE size_t block_length (const struct blk_cache *cache, uint64_t key);
+PRIVATE void clean_block (struct blk_cache *cache, struct blk_entry *b);
+PRIVATE void flush_dirty (struct blk_cache *cache);
+PRIVATE void read_ahead (struct blk_cache *cache);
+PRIVATE void * flusher_main (void *arg);
+
+// memory used by one cached block.
+#define ITEM_SIZE(c)        (sizeof (struct blk_entry) + (c)->block_size)
+
+// which hash chain a block is on.
+#define HASH(key)           ((key) % BLK_HASH_BUCKETS)
+
+
+/**
+ *  Set up the cache for a volume, and start its flusher thread. Should
+ *  only be called once, at mount time, after the daemon has forked.
+ */
+    PUBLIC void
+blk_init (v)
+    fat_volume_t *v;            // pointer to volume information.
+{
+    struct blk_cache *cache = safe_malloc (sizeof (struct blk_cache));
+
+    v->blk_cache = cache;
+    cache->device = v->dev;
+    cache->block_size = MAX (SECTOR_SIZE (v), cache->device->block_size);
+    cache->shared_blocks = (cache->block_size > SECTOR_SIZE (v));
+
+    memset (cache->hash, 0, sizeof (cache->hash));
+    cache->lru = cache->mru = cache->pinned = NULL;
+    cache->nr_blocks = 0;
+    cache->nr_dirty = 0;
+    cache->nr_pinned = 0;
+    cache->prefetch_head = 0;
+    cache->nr_prefetch = 0;
+    cache->running = false;
+    cache->stopping = false;
+    pthread_mutex_init (&(cache->lock), NULL);
+    pthread_cond_init (&(cache->wakeup), NULL);
+
+    // if the whole volume is mapped, metadata can be updated in place,
+    // and there is nothing to gain from caching it.
+    cache->bypass = (dev_map (cache->device, 0,
+      (size_t) cache->device->size) != NULL);
+
+    if (cache->bypass == true)
+        return;
+
+    cache->mem.name = "metadata";
+    cache->mem.shrink = cache_shrink;
+    cache->mem.priv = cache;
+    mem_register (&(cache->mem));
+
+    // without the thread, dirty blocks wait for the limit or blk_flush.
+    if (pthread_create (&(cache->flusher), NULL, flusher_main, cache) == 0)
+        cache->running = true;
+    else
+        warnx ("Couldn't start the metadata flusher");
+}
+
+/**
+ *  Stop the flusher thread, and write out any dirty blocks. Called when
+ *  the volume is unmounted, before its device is closed.
+ */
+    PUBLIC void
+blk_close (v)
+    fat_volume_t *v;            // volume being unmounted.
+{
+    struct blk_cache *cache = v->blk_cache;
+
+    if (cache->bypass == true)
+        return;
+
+    if (cache->running == true)
+    {
+        pthread_mutex_lock (&(cache->lock));
+        cache->stopping = true;
+        pthread_cond_signal (&(cache->wakeup));
+        pthread_mutex_unlock (&(cache->lock));
+
+        pthread_join (cache->flusher, NULL);
+        cache->running = false;
+    }
+
+    pthread_mutex_lock (&(cache->lock));
+    flush_dirty (cache);
+    pthread_mutex_unlock (&(cache->lock));
+}
+
+/**
+ *  Read metadata from the device, through the cache.
+ */
+    PUBLIC void
+blk_read (offset, buf, count)
+    off_t offset;               // byte offset on the device.
+    void *buf;                  // buffer to read into.
+    size_t count;               // number of bytes to read.
+{
+    struct blk_cache *cache = vol_current ()->blk_cache;
+    struct blk_entry *b;
+    size_t skip, chunk;
+
+    if (cache->bypass == true)
+    {
+        dev_read (cache->device, offset, buf, count);
+        return;
+    }
+
+    while (count > 0)
+    {
+        skip = offset % cache->block_size;
+        chunk = MIN (count, cache->block_size - skip);
+
+        // the lock stops the block being evicted while we copy from it.
+        pthread_mutex_lock (&(cache->lock));
+        b = get_block (cache, offset / cache->block_size, true);
+        memcpy (buf, b->data + skip, chunk);
+        pthread_mutex_unlock (&(cache->lock));
+
+        offset += chunk;
+        buf += chunk;
+        count -= chunk;
+    }
+}
+
+/**
+ *  Write metadata to the device. The bytes are merged into the cached
+ *  copy of each block they fall in, reading the block in first if it is
+ *  only partly overwritten, and then the whole block is written out.
+ */
+    PUBLIC void
+blk_write (offset, buf, count)
+    off_t offset;               // byte offset on the device.
+    const void *buf;            // data to write.
+    size_t count;               // number of bytes to write.
+{
+    struct blk_cache *cache = vol_current ()->blk_cache;
+    struct blk_entry *b;
+    size_t skip, chunk;
+
+    if (cache->bypass == true)
+    {
+        dev_write (cache->device, offset, buf, count);
+        return;
+    }
+
+    while (count > 0)
+    {
+        skip = offset % cache->block_size;
+        chunk = MIN (count, cache->block_size - skip);
+
+        // the block only needs reading in if some of it is kept. The lock
+        // is held until the block is written, so that writes to different
+        // parts of one block cannot overtake each other on the way to the
+        // device.
+        pthread_mutex_lock (&(cache->lock));
+        b = get_block (cache, offset / cache->block_size,
+          (chunk < block_length (cache, offset / cache->block_size)));
+        memcpy (b->data + skip, buf, chunk);
+        dev_write (cache->device, (off_t) b->key * cache->block_size,
+          b->data, block_length (cache, b->key));
+
+        if (b->dirty == true)
+        {
+            b->dirty = false;
+            cache->nr_dirty --;
+        }
+
+        pthread_mutex_unlock (&(cache->lock));
+
+        offset += chunk;
+        buf += chunk;
+        count -= chunk;
+    }
+}
+
+/**
+ *  Write metadata into the cache only, leaving the blocks dirty to be
+ *  written out later along with others. Used for new directory entries,
+ *  which are usually added in bursts.
+ */
+    PUBLIC void
+blk_write_back (offset, buf, count)
+    off_t offset;               // byte offset on the device.
+    const void *buf;            // data to write.
+    size_t count;               // number of bytes to write.
+{
+    struct blk_cache *cache = vol_current ()->blk_cache;
+    struct blk_entry *b;
+    size_t skip, chunk;
+
+    if (cache->bypass == true)
+    {
+        dev_write (cache->device, offset, buf, count);
+        return;
+    }
+
+    pthread_mutex_lock (&(cache->lock));
+
+    while (count > 0)
+    {
+        skip = offset % cache->block_size;
+        chunk = MIN (count, cache->block_size - skip);
+
+        b = get_block (cache, offset / cache->block_size,
+          (chunk < block_length (cache, offset / cache->block_size)));
+        memcpy (b->data + skip, buf, chunk);
+
+        if (b->dirty == false)
+        {
+            b->dirty = true;
+            cache->nr_dirty ++;
+        }
+
+        offset += chunk;
+        buf += chunk;
+        count -= chunk;
+    }
+
+    if (cache->nr_dirty >= BLK_DIRTY_LIMIT)
+        flush_dirty (cache);
+
+    pthread_mutex_unlock (&(cache->lock));
+}
+
+/**
+ *  Write out all dirty blocks. This must be done before the device is
+ *  synced, for the sync to cover them.
+ */
+    PUBLIC void
+blk_flush (void)
+{
+    struct blk_cache *cache = vol_current ()->blk_cache;
+
+    if (cache->bypass == true)
+        return;
+
+    pthread_mutex_lock (&(cache->lock));
+    flush_dirty (cache);
+    pthread_mutex_unlock (&(cache->lock));
+}
+
+/**
+ *  Write file data to the device. Where the data falls in a block that
+ *  also holds metadata, or in a pinned file's block, the cached copy of
+ *  the block is updated as well, otherwise the next metadata write to
+ *  that block would put the old data back, or the pinned copy would go
+ *  stale.
+ */
+    PUBLIC void
+blk_write_data (offset, buf, count)
+    off_t offset;               // byte offset on the device.
+    const void *buf;            // data to write.
+    size_t count;               // number of bytes to write.
+{
+    struct blk_cache *cache = vol_current ()->blk_cache;
+    struct blk_entry *b;
+    off_t bsize = (off_t) cache->block_size, last = offset + (off_t) count;
+    off_t start, end;
+    uint64_t key;
+
+    // with nothing pinned, blocks of file data are never cached unless
+    // they share metadata. The count is only changed under the lock.
+    if ((cache->bypass == true) || ((cache->shared_blocks == false) &&
+          (__atomic_load_n (&(cache->nr_pinned), __ATOMIC_RELAXED) == 0)))
+    {
+        dev_write (cache->device, offset, buf, count);
+        return;
+    }
+
+    // the lock is held across the write, so that no block can be read in
+    // from the device between it being patched here and the data
+    // reaching the device.
+    pthread_mutex_lock (&(cache->lock));
+
+    for (key = (uint64_t) (offset / bsize); (off_t) key * bsize < last;
+      key ++)
+    {
+        if ((b = find_block (cache, key)) == NULL)
+            continue;
+
+        start = MAX (offset, (off_t) key * bsize);
+        end = MIN (last, (off_t) (key + 1) * bsize);
+        memcpy (b->data + (start - (off_t) key * bsize),
+          buf + (start - offset), (size_t) (end - start));
+    }
+
+    dev_write (cache->device, offset, buf, count);
+    pthread_mutex_unlock (&(cache->lock));
+}
+
+/**
+ *  Drop any cached blocks that overlap a given region of the device.
+ *  Dirty blocks are written out first, so this must be called before
+ *  the region is written other than through the cache.
+ */
+    PUBLIC void
+blk_invalidate (offset, length)
+    off_t offset;               // start of the region.
+    off_t length;               // length in bytes.
+{
+    struct blk_cache *cache = vol_current ()->blk_cache;
+    struct blk_entry *b, *next;
+    uint64_t first, last, key;
+
+    if ((cache->bypass == true) || (length <= 0))
+        return;
+
+    first = offset / cache->block_size;
+    last = (offset + length - 1) / cache->block_size;
+
+    pthread_mutex_lock (&(cache->lock));
+
+    // look up each block in the region, unless there are fewer blocks in
+    // the cache than that, in which case check each of those instead.
+    // Pinned blocks go as well, since their contents are about to be
+    // out of date; whoever pinned them pins the region again afterwards.
+    if (last - first < cache->nr_blocks)
+    {
+        for (key = first; key <= last; key ++)
+        {
+            if ((b = find_block (cache, key)) != NULL)
+                drop_block (cache, b);
+        }
+    }
+    else
+    {
+        for (b = cache->lru; b != NULL; b = next)
+        {
+            next = b->next;
+
+            if ((b->key >= first) && (b->key <= last))
+                drop_block (cache, b);
+        }
+
+        for (b = cache->pinned; b != NULL; b = next)
+        {
+            next = b->next;
+
+            if ((b->key >= first) && (b->key <= last))
+                drop_block (cache, b);
+        }
+    }
+
+    pthread_mutex_unlock (&(cache->lock));
+}
+
+/**
+ *  Read the blocks of a region of the device into the cache, if they are
+ *  not there already, and keep them there until they are unpinned. Reads
+ *  and writes of the region are then served from memory, whether or not
+ *  the region holds metadata.
+ */
+    PUBLIC void
+blk_pin (offset, length)
+    off_t offset;               // start of the region.
+    off_t length;               // length in bytes.
+{
+    struct blk_cache *cache = vol_current ()->blk_cache;
+    struct blk_entry *b;
+    uint64_t key;
+
+    if ((cache->bypass == true) || (length <= 0))
+        return;
+
+    pthread_mutex_lock (&(cache->lock));
+
+    for (key = offset / cache->block_size;
+      (off_t) (key * cache->block_size) < offset + length; key ++)
+    {
+        b = get_block (cache, key, true);
+
+        // the block is at the MRU end of the LRU list, and moves to the
+        // pinned list when it is first pinned.
+        if (b->pins == 0)
+        {
+            unlink_block (cache, b);
+            add_to_pinned (cache, b);
+            cache->nr_pinned ++;
+        }
+
+        b->pins ++;
+    }
+
+    pthread_mutex_unlock (&(cache->lock));
+}
+
+/**
+ *  Undo blk_pin for a region. Blocks that are no longer pinned at all go
+ *  back on the LRU list, as if just used. Blocks in the region that are
+ *  not pinned, such as those dropped by blk_invalidate, are left alone.
+ */
+    PUBLIC void
+blk_unpin (offset, length)
+    off_t offset;               // start of the region.
+    off_t length;               // length in bytes.
+{
+    struct blk_cache *cache = vol_current ()->blk_cache;
+    struct blk_entry *b;
+    uint64_t key;
+
+    if ((cache->bypass == true) || (length <= 0))
+        return;
+
+    pthread_mutex_lock (&(cache->lock));
+
+    for (key = offset / cache->block_size;
+      (off_t) (key * cache->block_size) < offset + length; key ++)
+    {
+        if (((b = find_block (cache, key)) == NULL) || (b->pins == 0))
+            continue;
+
+        if (b->pins == 1)
+        {
+            unlink_block (cache, b);
+            add_to_mru (cache, b);
+            cache->nr_pinned --;
+        }
+
+        b->pins --;
+    }
+
+    pthread_mutex_unlock (&(cache->lock));
+}
+
+/**
+ *  Queue the blocks of a region of the device to be read into the cache
+ *  by the flusher thread, without waiting for them. Blocks already
+ *  cached or queued are skipped, and once BLK_PREFETCH_MAX blocks are
+ *  queued, the rest of the region is left to be read when it is used.
+ */
+    PUBLIC void
+blk_prefetch (offset, length)
+    off_t offset;               // start of the region.
+    off_t length;               // length in bytes.
+{
+    struct blk_cache *cache = vol_current ()->blk_cache;
+    unsigned int queued = 0, i;
+    uint64_t key;
+
+    if ((cache->bypass == true) || (cache->running == false) ||
+      (length <= 0))
+    {
+        return;
+    }
+
+    pthread_mutex_lock (&(cache->lock));
+
+    for (key = offset / cache->block_size;
+      ((off_t) (key * cache->block_size) < MIN (offset + length,
+        cache->device->size)) && (cache->nr_prefetch < BLK_PREFETCH_MAX);
+      key ++)
+    {
+        if (find_block (cache, key) != NULL)
+            continue;
+
+        for (i = 0; (i < cache->nr_prefetch) && (cache->prefetch [
+              (cache->prefetch_head + i) % BLK_PREFETCH_MAX] != key); i ++)
+        {
+            ;
+        }
+
+        if (i < cache->nr_prefetch)
+            continue;
+
+        cache->prefetch [(cache->prefetch_head + cache->nr_prefetch) %
+          BLK_PREFETCH_MAX] = key;
+        cache->nr_prefetch ++;
+        queued ++;
+    }
+
+    if (queued > 0)
+        pthread_cond_signal (&(cache->wakeup));
+
+    pthread_mutex_unlock (&(cache->lock));
+}
+
+/**
+ *  Return value is the number of bytes of memory held by pinned blocks.
+ */
+    PUBLIC size_t
+blk_pinned_bytes (void)
+{
+    struct blk_cache *cache = vol_current ()->blk_cache;
+
+    return cache->nr_pinned * ITEM_SIZE (cache);
+}
+
+/**
+ *  Find a block in the hash table, without counting it as a use.
+ *
+ *  Return value is the block, or NULL if it is not cached.
+ */
+    PRIVATE struct blk_entry *
+find_block (cache, key)
+    struct blk_cache *cache;    // cache to search.
+    uint64_t key;               // block index on the device.
+{
+    struct blk_entry *b;
+
+    for (b = cache->hash [HASH (key)]; (b != NULL) && (b->key != key);
+      b = b->hash_next)
+    {
+        ;
+    }
+
+    return b;
+}
+
+/**
+ *  Fetch a block, adding it to the cache if it is not already there.
+ *  Called with the cache lock held.
+ *
+ *  Return value is the cached block, which is now at the MRU end.
+ */
+    PRIVATE struct blk_entry *
+get_block (cache, key, fill)
+    struct blk_cache *cache;    // cache concerned.
+    uint64_t key;               // block index on the device.
+    bool fill;                  // read the contents in on a miss?
+{
+    struct blk_entry *b;
+
+    if ((b = find_block (cache, key)) != NULL)
+    {
+        mem_hit (&(cache->mem));
+
+        if ((b->pins == 0) && (b != cache->mru))
+        {
+            unlink_block (cache, b);
+            add_to_mru (cache, b);
+        }
+
+        return b;
+    }
+
+    // not cached. Make room for it first, if the memory accountant will
+    // not let the cache grow. If everything left is pinned, the cache
+    // grows anyway, and the accountant takes the memory from elsewhere.
+    mem_miss (&(cache->mem), key);
+
+    while (mem_charge (&(cache->mem), ITEM_SIZE (cache)) == false)
+    {
+        if (cache->lru == NULL)
+        {
+            mem_force_charge (&(cache->mem), ITEM_SIZE (cache));
+            break;
+        }
+
+        evict_lru (cache);
+    }
+
+    b = safe_malloc (sizeof (struct blk_entry));
+    b->key = key;
+    b->data = safe_malloc (cache->block_size);
+    b->dirty = false;
+    b->pins = 0;
+
+    if (fill == true)
+        dev_read (cache->device, (off_t) key * cache->block_size, b->data,
+          block_length (cache, key));
+
+    b->hash_next = cache->hash [HASH (key)];
+    cache->hash [HASH (key)] = b;
+    cache->nr_blocks ++;
+    add_to_mru (cache, b);
+
+    return b;
+}
+
+/**
+ *  Remove a block from the LRU list, or the pinned list if it is pinned.
+ */
+    PRIVATE void
+unlink_block (cache, b)
+    struct blk_cache *cache;    // cache concerned.
+    struct blk_entry *b;        // block to unlink.
+{
+    if (b->prev != NULL)
+        b->prev->next = b->next;
+    else if (b->pins > 0)
+        cache->pinned = b->next;
+    else
+        cache->lru = b->next;
+
+    if (b->next != NULL)
+        b->next->prev = b->prev;
+    else if (b->pins == 0)
+        cache->mru = b->prev;
+}
+
+/**
+ *  Add a block to the MRU end of the LRU list.
+ */
+    PRIVATE void
+add_to_mru (cache, b)
+    struct blk_cache *cache;    // cache concerned.
+    struct blk_entry *b;        // block to add.
+{
+    b->next = NULL;
+    b->prev = cache->mru;
+
+    if (cache->mru == NULL)
+        cache->lru = b;
+    else
+        cache->mru->next = b;
+
+    cache->mru = b;
+}
+
+/**
+ *  Add a block to the pinned list. The order of the list does not matter.
+ */
+    PRIVATE void
+add_to_pinned (cache, b)
+    struct blk_cache *cache;    // cache concerned.
+    struct blk_entry *b;        // block to add.
+{
+    b->prev = NULL;
+    b->next = cache->pinned;
+
+    if (cache->pinned != NULL)
+        cache->pinned->prev = b;
+
+    cache->pinned = b;
+}
+
+/**
+ *  Remove a block from the cache altogether, and release its memory. A
+ *  dirty block is written out first.
+ */
+    PRIVATE void
+drop_block (cache, b)
+    struct blk_cache *cache;    // cache concerned.
+    struct blk_entry *b;        // block to drop.
+{
+    struct blk_entry **bp;
+
+    clean_block (cache, b);
+
+    for (bp = &(cache->hash [HASH (b->key)]); *bp != b;
+      bp = &((*bp)->hash_next))
+    {
+        ;
+    }
+
+    *bp = b->hash_next;
+    unlink_block (cache, b);
+    cache->nr_blocks --;
+
+    if (b->pins > 0)
+        cache->nr_pinned --;
+
+    mem_uncharge (&(cache->mem), ITEM_SIZE (cache));
+
+    safe_free ((void **) &(b->data));
+    safe_free ((void **) &b);
+}
+
+/**
+ *  Evict the least recently used block.
+ */
+    PRIVATE void
+evict_lru (cache)
+    struct blk_cache *cache;    // cache concerned.
+{
+    mem_evicted (&(cache->mem), cache->lru->key, ITEM_SIZE (cache));
+    drop_block (cache, cache->lru);
+}
+
+/**
+ *  Called by the memory accountant to make the cache smaller. Gives up
+ *  straight away if the cache is in use.
+ *
+ *  Return value is the number of bytes released.
+ */
+    PRIVATE size_t
+cache_shrink (mem, nbytes)
+    mem_cache_t *mem;           // the cache's accounting structure.
+    size_t nbytes;              // bytes to release.
+{
+    struct blk_cache *cache = mem->priv;
+    size_t freed = 0;
+
+    if (pthread_mutex_trylock (&(cache->lock)) != 0)
+        return 0;
+
+    while ((freed < nbytes) && (cache->lru != NULL))
+    {
+        evict_lru (cache);
+        freed += ITEM_SIZE (cache);
+    }
+
+    pthread_mutex_unlock (&(cache->lock));
+
+    return freed;
+}
+
+/**
+ *  Number of bytes of a block that are on the device. Only the last
+ *  block can be short, if the device is not a whole number of blocks.
+ */
+    PRIVATE size_t
+block_length (cache, key)
+    const struct blk_cache *cache;  // cache concerned.
+    uint64_t key;               // block index on the device.
+{
+    off_t start = (off_t) key * cache->block_size;
+
+    return (size_t) MIN ((off_t) cache->block_size,
+      cache->device->size - start);
+}
+
+/**
+ *  Write a block out, if it is dirty. Called with the cache lock held.
+ */
+    PRIVATE void
+clean_block (cache, b)
+    struct blk_cache *cache;    // cache concerned.
+    struct blk_entry *b;        // block to write.
+{
+    if (b->dirty == false)
+        return;
+
+    dev_write (cache->device, (off_t) b->key * cache->block_size, b->data,
+      block_length (cache, b->key));
+    b->dirty = false;
+    cache->nr_dirty --;
+}
+
+/**
+ *  Write out every dirty block. The scheduler writes them in order of
+ *  position on the device, with each run of adjacent blocks in one
+ *  request. Called with the cache lock held.
+ */
+    PRIVATE void
+flush_dirty (cache)
+    struct blk_cache *cache;    // cache concerned.
+{
+    struct blk_entry *b;
+    dev_request_t *reqs;
+    unsigned int nr_reqs = 0;
+
+    if (cache->nr_dirty == 0)
+        return;
+
+    reqs = safe_malloc (sizeof (dev_request_t) * cache->nr_dirty);
+
+    for (int i = 0; i < 2; i ++)
+    {
+        for (b = (i == 0) ? cache->lru : cache->pinned; b != NULL;
+          b = b->next)
+        {
+            if (b->dirty == false)
+                continue;
+
+            reqs [nr_reqs].op = DEV_OP_WRITE;
+            reqs [nr_reqs].offset = (off_t) b->key * cache->block_size;
+            reqs [nr_reqs].buf = b->data;
+            reqs [nr_reqs].count = block_length (cache, b->key);
+            nr_reqs ++;
+            b->dirty = false;
+        }
+    }
+
+    sched_write_back (cache->device, reqs, nr_reqs);
+    cache->nr_dirty = 0;
+
+    safe_free ((void **) &reqs);
+}
+
+/**
+ *  Read in the blocks queued by blk_prefetch. Each is read in as it
+ *  would be on a miss, with the lock held, so that nothing can change
+ *  it on the device meanwhile, but the lock is let go between blocks,
+ *  so that requests are not held up for more than one read at a time.
+ *  Called with the cache lock held.
+ */
+    PRIVATE void
+read_ahead (cache)
+    struct blk_cache *cache;    // cache concerned.
+{
+    uint64_t key;
+
+    while ((cache->nr_prefetch > 0) && (cache->stopping == false))
+    {
+        key = cache->prefetch [cache->prefetch_head];
+        cache->prefetch_head = (cache->prefetch_head + 1) % BLK_PREFETCH_MAX;
+        cache->nr_prefetch --;
+
+        if (find_block (cache, key) == NULL)
+            get_block (cache, key, true);
+
+        pthread_mutex_unlock (&(cache->lock));
+        pthread_mutex_lock (&(cache->lock));
+    }
+}
+
+/**
+ *  Body of the flusher thread. Wakes up every BLK_WRITEBACK_INTERVAL
+ *  seconds to write out dirty blocks, and in between whenever there are
+ *  blocks to read ahead, until told to stop by blk_close.
+ */
+    PRIVATE void *
+flusher_main (arg)
+    void *arg;                  // the cache.
+{
+    struct blk_cache *cache = arg;
+    struct timespec deadline, now;
+
+    pthread_mutex_lock (&(cache->lock));
+
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += BLK_WRITEBACK_INTERVAL;
+
+    while (cache->stopping == false)
+    {
+        // read ahead if asked to, otherwise sleep until the next write
+        // back is due, or something else turns up.
+        if (cache->nr_prefetch > 0)
+            read_ahead (cache);
+        else if (pthread_cond_timedwait (&(cache->wakeup), &(cache->lock),
+              &deadline) != ETIMEDOUT)
+            continue;
+
+        clock_gettime (CLOCK_REALTIME, &now);
+
+        if ((now.tv_sec < deadline.tv_sec) || ((now.tv_sec ==
+              deadline.tv_sec) && (now.tv_nsec < deadline.tv_nsec)))
+        {
+            continue;
+        }
+
+        flush_dirty (cache);
+
+        deadline = now;
+        deadline.tv_sec += BLK_WRITEBACK_INTERVAL;
+    }
+
+    pthread_mutex_unlock (&(cache->lock));
+
+    return NULL;
+}
+
+// vim: ts=4 sw=4 et
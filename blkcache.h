@@ -0,0 +1,64 @@
+/**
+ *  blkcache.h
+ *
+ *  The metadata block cache. The FAT and directories are read and
+ *  written through here, a whole device block at a time, so that small
+ *  updates like a single FAT entry or directory entry never reach the
+ *  device as a partial block write, which a large sector device would
+ *  have to turn into a read-modify-write of its own.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#ifndef MFATIC_BLKCACHE_H
+#define MFATIC_BLKCACHE_H
+
+
+// need type definitions for fat_volume_t.
+#include "fat.h"
+
+
+// set up the cache for a mounted volume. Must be called after the device
+// has been started, and before any metadata is read. blk_close writes
+// out anything still dirty when the volume is unmounted.
+extern void blk_init (fat_volume_t *v);
+extern void blk_close (fat_volume_t *v);
+
+// read or write metadata at a given byte offset on the device of the
+// calling thread's volume. Writes are merged into the cached blocks, and
+// the whole blocks written through to the device.
+extern void blk_read (off_t offset, void *buf, size_t count);
+extern void blk_write (off_t offset, const void *buf, size_t count);
+
+// write metadata into the cache, to be written out later, together with
+// other dirty blocks. blk_flush writes out everything still dirty, and
+// must come before a device sync that is meant to cover it.
+extern void blk_write_back (off_t offset, const void *buf, size_t count);
+extern void blk_flush (void);
+
+// write file data, keeping any cached block that the data shares with
+// metadata, or that is pinned, up to date. This only costs more than
+// dev_write on volumes with sectors smaller than the device's blocks, or
+// with files pinned.
+extern void blk_write_data (off_t offset, const void *buf, size_t count);
+
+// forget any cached blocks within a region of the device, such as the
+// clusters of a directory that has been deleted. Dirty blocks are written
+// out first, so call this before writing the region around the cache.
+extern void blk_invalidate (off_t offset, off_t length);
+
+// ask for the blocks of a region of the device to be read into the cache
+// in the background, as they are about to be needed.
+extern void blk_prefetch (off_t offset, off_t length);
+
+// keep the blocks of a region of the device in the cache, reading them
+// in now, until each blk_pin of the region has been matched by a
+// blk_unpin. blk_pinned_bytes is the memory they take up.
+extern void blk_pin (off_t offset, off_t length);
+extern void blk_unpin (off_t offset, off_t length);
+extern size_t blk_pinned_bytes (void);
+
+
+#endif // MFATIC_BLKCACHE_H
+
+// vim: ts=4 sw=4 et
@@ -21,6 +21,15 @@ typedef int bool;
 #define true            (1 != 0)
 #define false           (0 != 0)
 
+// smaller and larger of two values.
+#ifndef MIN
+#define MIN(a, b)       (((a) < (b)) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a, b)       (((a) > (b)) ? (a) : (b))
+#endif
+
 
 #endif // MFATIC_CONST_H
 
@@ -0,0 +1,351 @@
+/**
+ *  control.c
+ *
+ *  Dispatch of control commands, which are given to the daemon as
+ *  extended attributes. Each command is named by the part of the
+ *  attribute name following CONTROL_PREFIX; the attribute value holds
+ *  any arguments the command takes. Queries are named in the same way,
+ *  and answered by getting the attribute.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "fat.h"
+#include "device.h"
+#include "blkcache.h"
+#include "dostimes.h"
+#include "fileio.h"
+#include "create.h"
+#include "fat_alloc.h"
+#include "qos.h"
+#include "pin.h"
+#include "volume.h"
+#include "control.h"
+
+
+// a control command, and the procedure that carries it out.
+struct control_cmd
+{
+    const char          *name;
+    int                 (*handler) (const char *path, const char *value,
+                            size_t size);
+};
+
+
+// a query, and the procedure that answers it. The answer is written into
+// value, and its length returned, as for getxattr.
+struct control_query
+{
+    const char          *name;
+    int                 (*handler) (const char *path, char *value,
+                            size_t size);
+};
+
+
+// command handlers.
+PRIVATE int cmd_flush (const char *path, const char *value, size_t size);
+PRIVATE int cmd_copy (const char *path, const char *value, size_t size);
+PRIVATE int cmd_trim (const char *path, const char *value, size_t size);
+PRIVATE int cmd_pin (const char *path, const char *value, size_t size);
+PRIVATE int cmd_unpin (const char *path, const char *value, size_t size);
+
+// query handlers.
+PRIVATE int query_qos (const char *path, char *value, size_t size);
+PRIVATE int query_pins (const char *path, char *value, size_t size);
+
+
+// table of commands.
+PRIVATE const struct control_cmd commands [] =
+{
+    {"flush",       cmd_flush},
+    {"copy",        cmd_copy},
+    {"trim",        cmd_trim},
+    {"pin",         cmd_pin},
+    {"unpin",       cmd_unpin},
+    {NULL,          NULL}
+};
+
+// table of queries.
+PRIVATE const struct control_query queries [] =
+{
+    {"qos",         query_qos},
+    {"pins",        query_pins},
+    {NULL,          NULL}
+};
+
+
+/**
+ *  Look up the command named by an extended attribute, and carry it out.
+ *  Attributes outside our namespace are not supported, since FAT has
+ *  nowhere to store them.
+ *
+ *  Return value is 0 on success, or a negative errno.
+ */
+    PUBLIC int
+control_command (path, name, value, size)
+    const char *path;       // file the attribute was set on.
+    const char *name;       // attribute name.
+    const char *value;      // attribute value, not null terminated.
+    size_t size;            // length of value.
+{
+    size_t prefix_len = strlen (CONTROL_PREFIX);
+
+    if (strncmp (name, CONTROL_PREFIX, prefix_len) != 0)
+        return -ENOTSUP;
+
+    for (int i = 0; commands [i].name != NULL; i ++)
+    {
+        if (strcmp (name + prefix_len, commands [i].name) == 0)
+            return commands [i].handler (path, value, size);
+    }
+
+    return -EINVAL;
+}
+
+/**
+ *  Look up the query named by an extended attribute, and answer it.
+ *
+ *  Return value is the length of the answer, or a negative errno. If
+ *  size is 0, the answer is not written, only measured.
+ */
+    PUBLIC int
+control_query (path, name, value, size)
+    const char *path;       // file the attribute was asked for on.
+    const char *name;       // attribute name.
+    char *value;            // buffer for the answer.
+    size_t size;            // size of the buffer.
+{
+    size_t prefix_len = strlen (CONTROL_PREFIX);
+
+    if (strncmp (name, CONTROL_PREFIX, prefix_len) != 0)
+        return -ENOTSUP;
+
+    for (int i = 0; queries [i].name != NULL; i ++)
+    {
+        if (strcmp (name + prefix_len, queries [i].name) == 0)
+            return queries [i].handler (path, value, size);
+    }
+
+    return -ENODATA;
+}
+
+/**
+ *  Checkpoint the volume: write back everything held in memory, and wait
+ *  for it to reach the device.
+ */
+    PRIVATE int
+cmd_flush (path, value, size)
+    const char *path;       // ignored.
+    const char *value;      // ignored.
+    size_t size;            // ignored.
+{
+    (void) path;
+    (void) value;
+    (void) size;
+
+    blk_flush ();
+    dev_sync (vol_current ()->dev);
+
+    return 0;
+}
+
+/**
+ *  Copy the file the attribute is set on to the path within the volume
+ *  given as the value, creating the destination if it does not exist.
+ *  The data is copied on the device, rather than being read and written
+ *  back through FUSE, eg.
+ *
+ *      setfattr -n user.mfatic.copy -v /backup/data.bin /mnt/vol/data.bin
+ */
+    PRIVATE int
+cmd_copy (path, value, size)
+    const char *path;       // file to copy.
+    const char *value;      // absolute path within the volume to copy to.
+    size_t size;            // length of value.
+{
+    char *dst_path = strndupa (value, size);
+    fat_file_t *src, *dst;
+    int retval;
+
+    if (dst_path [0] != '/')
+        return -EINVAL;
+
+    if ((retval = fat_open (path, &src)) != 0)
+        return retval;
+
+    if ((retval = fat_open (dst_path, &dst)) == -ENOENT)
+    {
+        if ((retval = fat_create (dst_path, 0)) == 0)
+            retval = fat_open (dst_path, &dst);
+    }
+
+    if (retval != 0)
+    {
+        fat_close (src);
+        return retval;
+    }
+
+    if ((dst->attributes & ATTR_READ_ONLY) != 0)
+    {
+        retval = -EACCES;
+    }
+    else
+    {
+        retval = fat_copy (src, dst);
+        update_mtime (dst, time (NULL));
+    }
+
+    fat_close (dst);
+    fat_close (src);
+
+    return retval;
+}
+
+/**
+ *  Discard the free space on the device, like fstrim. The value is the
+ *  shortest free run worth discarding, in bytes; free runs are discarded
+ *  whatever their length if it is empty or 0, eg.
+ *
+ *      setfattr -n user.mfatic.trim -v 1048576 /mnt/vol
+ */
+    PRIVATE int
+cmd_trim (path, value, size)
+    const char *path;       // ignored.
+    const char *value;      // shortest run to discard, in bytes.
+    size_t size;            // length of value.
+{
+    fat_volume_t *v = vol_current ();
+    char *min_bytes = strndupa (value, size), *end;
+    unsigned long long min_length;
+    int64_t retval;
+
+    (void) path;
+
+    min_length = strtoull (min_bytes, &end, 10);
+
+    if (*end != '\0')
+        return -EINVAL;
+
+    min_length = (min_length + CLUSTER_SIZE (v) - 1) / CLUSTER_SIZE (v);
+
+    if ((retval = trim_free_space ((uint32_t) MIN (min_length,
+          UINT32_MAX))) < 0)
+    {
+        return (int) retval;
+    }
+
+    return 0;
+}
+
+/**
+ *  Pin the file the attribute is set on in memory, along with the
+ *  directories leading to it, eg.
+ *
+ *      setfattr -n user.mfatic.pin /mnt/vol/index.db
+ */
+    PRIVATE int
+cmd_pin (path, value, size)
+    const char *path;       // file to pin.
+    const char *value;      // ignored.
+    size_t size;            // ignored.
+{
+    (void) value;
+    (void) size;
+
+    return pin_add (path);
+}
+
+/**
+ *  Unpin the file the attribute is set on, eg.
+ *
+ *      setfattr -n user.mfatic.unpin /mnt/vol/index.db
+ */
+    PRIVATE int
+cmd_unpin (path, value, size)
+    const char *path;       // file to unpin.
+    const char *value;      // ignored.
+    size_t size;            // ignored.
+{
+    (void) value;
+    (void) size;
+
+    return pin_remove (path);
+}
+
+/**
+ *  Report the number of requests, bytes and latencies of each client of
+ *  the volume, eg.
+ *
+ *      getfattr --only-values -n user.mfatic.qos /mnt/vol
+ */
+    PRIVATE int
+query_qos (path, value, size)
+    const char *path;       // ignored.
+    char *value;            // buffer for the report.
+    size_t size;            // size of the buffer.
+{
+    char *report;
+    size_t len;
+
+    (void) path;
+
+    if (vol_current ()->qos == NULL)
+        return -ENODATA;
+
+    // the report ends with a null byte, which the answer has no room for
+    // when it fills the buffer exactly, so it goes into one a byte
+    // longer first.
+    report = safe_malloc (size + 1);
+    len = qos_report (vol_current ()->qos, report, size + 1);
+
+    if (len <= size)
+        memcpy (value, report, len);
+
+    safe_free ((void **) &report);
+
+    if (size == 0)
+        return (int) len;
+
+    return (len <= size) ? (int) len : -ERANGE;
+}
+
+/**
+ *  List the pinned files, and how much of each is held in memory, eg.
+ *
+ *      getfattr --only-values -n user.mfatic.pins /mnt/vol
+ */
+    PRIVATE int
+query_pins (path, value, size)
+    const char *path;       // ignored.
+    char *value;            // buffer for the list.
+    size_t size;            // size of the buffer.
+{
+    char *report = safe_malloc (size + 1);
+    size_t len;
+
+    (void) path;
+
+    // as for query_qos, the list goes into a buffer a byte longer, for
+    // the null byte at its end.
+    len = pin_report (report, size + 1);
+
+    if (len <= size)
+        memcpy (value, report, len);
+
+    safe_free ((void **) &report);
+
+    if (size == 0)
+        return (int) len;
+
+    return (len <= size) ? (int) len : -ERANGE;
+}
+
+
+// vim: ts=4 sw=4 et
@@ -0,0 +1,40 @@
+/**
+ *  control.h
+ *
+ *  Control commands, which are sent to a mounted volume by setting an
+ *  extended attribute on any file within it, eg.
+ *
+ *      setfattr -n user.mfatic.flush -v 1 /mnt/volume
+ *
+ *  and queries, which are answered by getting one, eg.
+ *
+ *      getfattr -n user.mfatic.qos /mnt/volume
+ *
+ *  Author: Matthew Signorini
+ */
+
+#ifndef MFATIC_CONTROL_H
+#define MFATIC_CONTROL_H
+
+// needed for the fat_volume_t definition.
+#include "fat.h"
+
+
+// prefix of the extended attribute names used for control commands.
+#define CONTROL_PREFIX          "user.mfatic."
+
+
+// carry out the command named by an extended attribute set on path.
+// Return value is 0 on success, or a negative errno.
+extern int control_command (const char *path, const char *name,
+  const char *value, size_t size);
+
+// answer the query named by an extended attribute asked for on path.
+// Return value is the length of the answer, or a negative errno.
+extern int control_query (const char *path, const char *name,
+  char *value, size_t size);
+
+
+#endif // MFATIC_CONTROL_H
+
+// vim: ts=4 sw=4 et
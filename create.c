@@ -8,15 +8,18 @@
 
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "mfatic-config.h"
 #include "const.h"
 #include "utils.h"
 #include "fat.h"
+#include "blkcache.h"
 #include "dostimes.h"
 #include "fileio.h"
 #include "directory.h"
 #include "fat_alloc.h"
+#include "pin.h"
 #include "create.h"
 
 
@@ -55,14 +58,36 @@ fat_create (path, attributes)
     // created.
     file = decompose_path (parent);
 
+    // a leading escape byte would read back as 0xE5.
+    if ((uint8_t) file [0] == DIR_ENTRY_E5_ESCAPE)
+        return -EINVAL;
+
     // attempt to open the parent dir. Return an error code if this fails.
-    if ((retval = fat_open (parent, &parent_fd)) != 0)
+    // Files are usually created in bursts in one directory, so dir_open
+    // keeps it open for the next time.
+    if ((retval = dir_open (parent, &parent_fd)) != 0)
         return retval;
 
+    // allocate the new file's first cluster next to the last file made
+    // in the same directory, or a new directory's next to its parent.
+    if ((attributes & ATTR_DIRECTORY) != 0)
+        new_node = dir_alloc_dir (parent_fd);
+    else
+        new_node = dir_alloc_node (parent_fd);
+
+    if (new_node == 0)
+    {
+        fat_close (parent_fd);
+        return -ENOSPC;
+    }
+
+    // a new directory may be reusing the first cluster of one that has
+    // been deleted.
+    if ((attributes & ATTR_DIRECTORY) != 0)
+        dir_forget (new_node);
+
     // build the directory entry for the new file.
-    new_node = fat_alloc_node ();
-    strncpy (new_entry.fname, file, DIR_NAME_LEN);
-    new_entry.fname [DIR_NAME_LEN - 1] = '\0';
+    put_direntry_name (&new_entry, file);
     new_entry.attributes = attributes;
     new_entry.creation_tenths = 0;
     new_entry.creation_time = time_now;
@@ -74,10 +99,12 @@ fat_create (path, attributes)
     new_entry.size = 0;
 
     // write in the new directory entry.
-    dir_write_entry (parent_fd, &new_entry);
+    if ((retval = dir_write_entry (parent_fd, &new_entry, NULL)) != 0)
+        release_cluster (new_node);
+
     fat_close (parent_fd);
 
-    return 0;
+    return retval;
 }
 
 /**
@@ -96,14 +123,18 @@ fat_rename (oldpath, newpath)
     char *newparent = strdupa (newpath), *newfile;
     fat_file_t *newfd, *oldfd;
     fat_direntry_t entry;
-    unsigned int index;
+    unsigned int index, new_index;
     int retval;
 
     // break the paths into a path to a parent dir, and a file name.
     newfile = decompose_path (newparent);
 
-    // open the destination directory.
-    if ((retval = fat_open (newparent, &newfd)) != 0)
+    if ((uint8_t) newfile [0] == DIR_ENTRY_E5_ESCAPE)
+        return -EINVAL;
+
+    // open the destination directory. Like creates, renames tend to come
+    // in bursts into the same directory, which dir_open keeps open.
+    if ((retval = dir_open (newparent, &newfd)) != 0)
         return retval;
 
     // look up the file to rename in the source directory.
@@ -119,21 +150,45 @@ fat_rename (oldpath, newpath)
         return retval;
     }
 
-    // delete the entry from the source directory.
-    dir_delete_entry (oldfd, index);
+    // the root directory has no parent, and cannot be renamed.
+    if (oldfd == NULL)
+    {
+        fat_close (newfd);
+        return -EBUSY;
+    }
 
     // apply the new name.
-    strncpy (entry.fname, newfile, DIR_NAME_LEN);
-    entry.fname [DIR_NAME_LEN - 1] = '\0';
+    put_direntry_name (&entry, newfile);
+
+    if (oldfd->inode == newfd->inode)
+    {
+        // within one directory, the entry is just renamed where it is.
+        dir_rename_entry (oldfd, index, entry.fname);
+        new_index = index;
+    }
+    else if ((retval = dir_write_entry (newfd, &entry, &new_index)) == 0)
+    {
+        // the new entry goes out, along with anything else pending,
+        // before the old one is deleted, so that a crash can leave the
+        // file in both directories but never in neither. The deletion
+        // then goes out with the next batch.
+        blk_flush ();
+        dir_delete_entry (oldfd, index, true);
+    }
 
-    // write the entry to the destination of the move operation.
-    dir_write_entry (newfd, &entry);
+    // fix up the cached path and the file's open handle, rather than
+    // forgetting them.
+    if (retval == 0)
+    {
+        dir_entry_moved (oldpath, newpath, &entry, newfd, new_index);
+        pin_moved (oldpath, newpath);
+    }
 
     // finished.
     fat_close (oldfd);
     fat_close (newfd);
 
-    return 0;
+    return retval;
 }
 
 /**
@@ -165,11 +220,17 @@ fat_unlink (filename)
     }
 
     // if it is a directory, we need to verify that the directory is empty.
+    // It may also be the one that dir_open is keeping open.
     if ((fd->attributes & ATTR_DIRECTORY) != 0)
+    {
+        dir_forget_paths ();
         return fat_rmdir (fd);
+    }
 
     // set the flags bit to indicate that this file is to be released once
-    // all open references have been closed.
+    // all open references have been closed. A pin would hold it open
+    // forever, so it goes first.
+    pin_forget (fd);
     fd->flags |= FL_DELETE_ON_CLOSE;
 
     // finished. If we have the only open reference to the file, it will
@@ -188,18 +249,13 @@ fat_unlink (filename)
 fat_release (fd)
     fat_file_t *fd;     // file that is being deleted.
 {
-    cluster_list_t *cp;
-
     // delete the file's directory entry.
     dir_delete_entry (get_parent_fd (fd->directory_inode), 
-      fd->dir_entry_index);
+      fd->dir_entry_index, false);
 
-    // step through the list of clusters, and release each one. We will
-    // not actually free the memory here; the caller has to do that.
-    for (cp = fd->clusters; cp != NULL; cp = cp->next)
-    {
-        release_cluster (cp->cluster_id);
-    }
+    // release all of the file's clusters. This also empties the file's
+    // extent map.
+    truncate_clusters (fd, 0);
 }
 
 /**
@@ -218,11 +274,15 @@ fat_rmdir (dirfd)
 
     // The directory file may have non zero size, as it could have a few
     // blank entries (identified because their name starts with a null
-    // byte). Check any entries that are present to make sure they are
-    // not important.
+    // byte), or deleted ones. Check any entries that are present to make
+    // sure they are not important. The handle may be one that has been
+    // read before, so the check starts from the beginning.
+    fat_seek (dirfd, 0, SEEK_SET);
+
     while (fat_read (dirfd, &buffer, sizeof (fat_direntry_t)) != 0)
     {
-        if (is_reserved_name (buffer.fname) != true)
+        if ((DIR_IS_DELETED (&buffer) == false) &&
+          (is_reserved_name (buffer.fname) != true))
         {
             // directory is not empty. Cannot be deleted.
             fat_close (dirfd);
@@ -230,7 +290,8 @@ fat_rmdir (dirfd)
         }
     }
 
-    // mark the directory for deletion.
+    // mark the directory for deletion, forgetting any pin of it.
+    pin_forget (dirfd);
     dirfd->flags |= FL_DELETE_ON_CLOSE;
     fat_close (dirfd);
 
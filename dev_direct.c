@@ -0,0 +1,246 @@
+/**
+ *  dev_direct.c
+ *
+ *  Device backend which opens the device with O_DIRECT, bypassing the
+ *  host's page cache. This avoids caching every block twice (once in the
+ *  kernel, and once in our own caches) and makes the cost of device IO
+ *  visible when benchmarking.
+ *
+ *  O_DIRECT requires buffers, offsets and lengths to be aligned to the
+ *  device's logical block size. Requests which already meet those rules
+ *  go straight to the device; anything else goes through an aligned
+ *  bounce buffer, with a read-modify-write of any partial blocks at
+ *  either end of a write.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "fat.h"
+#include "device.h"
+
+
+// local functions.
+PRIVATE int direct_open (fat_device_t *dev, const char *path);
+PRIVATE ssize_t direct_read (fat_device_t *dev, off_t offset, void *buf,
+  size_t count);
+PRIVATE ssize_t direct_write (fat_device_t *dev, off_t offset,
+  const void *buf, size_t count);
+PRIVATE int direct_flush (fat_device_t *dev);
+PRIVATE bool is_aligned (const fat_device_t *dev, off_t offset,
+  const void *buf, size_t count);
+PRIVATE ssize_t transfer (fat_device_t *dev, off_t offset, void *buf,
+  size_t count, bool writing);
+
+
+PUBLIC const struct dev_backend direct_backend =
+{
+    .name       = "direct",
+    .open       = direct_open,
+    .read       = direct_read,
+    .write      = direct_write,
+    .flush      = direct_flush,
+    .discard    = dev_file_discard,
+};
+
+
+/**
+ *  Open the device file for direct IO. Image files are assumed to need
+ *  page alignment, since the logical block size of the host file system
+ *  cannot easily be found out.
+ */
+    PRIVATE int
+direct_open (dev, path)
+    fat_device_t *dev;      // device being opened.
+    const char *path;       // device file name.
+{
+    int retval;
+
+    if ((retval = dev_open_file (dev, path, O_DIRECT)) != 0)
+        return retval;
+
+    if ((dev->is_blkdev == false) && (dev->block_size < DIRECT_ALIGN))
+        dev->block_size = DIRECT_ALIGN;
+
+    return 0;
+}
+
+/**
+ *  Read from the device. Unaligned requests are read into a bounce
+ *  buffer covering all the blocks touched, and copied out.
+ */
+    PRIVATE ssize_t
+direct_read (dev, offset, buf, count)
+    fat_device_t *dev;      // device to read from.
+    off_t offset;           // device offset.
+    void *buf;              // buffer to fill.
+    size_t count;           // bytes to read.
+{
+    off_t start = offset - (offset % dev->block_size);
+    size_t length = count + (offset - start);
+    ssize_t n;
+    void *bounce;
+
+    if (is_aligned (dev, offset, buf, count) == true)
+        return transfer (dev, offset, buf, count, false);
+
+    // round the length up to a whole number of blocks.
+    length += (dev->block_size - (length % dev->block_size)) %
+        dev->block_size;
+
+    if (posix_memalign (&bounce, dev->block_size, length) != 0)
+        return -ENOMEM;
+
+    if ((n = transfer (dev, start, bounce, length, false)) >= 0)
+    {
+        // work out how much of what was read belongs to the caller.
+        n -= (offset - start);
+
+        if (n < 0)
+            n = 0;
+
+        if ((size_t) n > count)
+            n = count;
+
+        memcpy (buf, (char *) bounce + (offset - start), n);
+    }
+
+    free (bounce);
+    return n;
+}
+
+/**
+ *  Write to the device. Unaligned writes read in the partial blocks at
+ *  either end, merge in the new data, and write back whole blocks.
+ */
+    PRIVATE ssize_t
+direct_write (dev, offset, buf, count)
+    fat_device_t *dev;      // device to write to.
+    off_t offset;           // device offset.
+    const void *buf;        // data to write.
+    size_t count;           // bytes to write.
+{
+    size_t bs = dev->block_size;
+    off_t start = offset - (offset % bs);
+    size_t length = count + (offset - start);
+    ssize_t n;
+    void *bounce;
+
+    if (is_aligned (dev, offset, buf, count) == true)
+        return transfer (dev, offset, (void *) buf, count, true);
+
+    length += (bs - (length % bs)) % bs;
+
+    if (posix_memalign (&bounce, bs, length) != 0)
+        return -ENOMEM;
+
+    // fetch the first and last blocks, if the write only partly covers
+    // them.
+    if ((offset != start) && ((n = transfer (dev, start, bounce, bs,
+              false)) < 0))
+    {
+        free (bounce);
+        return n;
+    }
+
+    if (((offset + count) % bs != 0) && ((n = transfer (dev,
+              start + length - bs, (char *) bounce + length - bs, bs,
+              false)) < 0))
+    {
+        free (bounce);
+        return n;
+    }
+
+    memcpy ((char *) bounce + (offset - start), buf, count);
+    n = transfer (dev, start, bounce, length, true);
+    free (bounce);
+
+    return (n < 0) ? n : (ssize_t) count;
+}
+
+/**
+ *  Direct IO bypasses the page cache, but the device may still have a
+ *  volatile write cache.
+ */
+    PRIVATE int
+direct_flush (dev)
+    fat_device_t *dev;      // device to flush.
+{
+    if (fdatasync (dev->fd) != 0)
+        return -errno;
+
+    return 0;
+}
+
+/**
+ *  Check if a request meets the alignment rules for direct IO.
+ */
+    PRIVATE bool
+is_aligned (dev, offset, buf, count)
+    const fat_device_t *dev;    // device concerned.
+    off_t offset;               // device offset.
+    const void *buf;            // user buffer.
+    size_t count;               // transfer length.
+{
+    size_t bs = dev->block_size;
+
+    return ((offset % bs) == 0) && ((count % bs) == 0) &&
+        (((uintptr_t) buf % bs) == 0);
+}
+
+/**
+ *  Carry out an aligned transfer, retrying after short transfers. A
+ *  short read means we have hit the end of the device.
+ *
+ *  Return value is the number of bytes transferred, or a negative errno.
+ */
+    PRIVATE ssize_t
+transfer (dev, offset, buf, count, writing)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // aligned device offset.
+    void *buf;              // aligned buffer.
+    size_t count;           // aligned length.
+    bool writing;           // true for a write, false for a read.
+{
+    size_t total = 0;
+    ssize_t n;
+
+    while (total < count)
+    {
+        if (writing == true)
+        {
+            n = pwrite (dev->fd, (char *) buf + total, count - total,
+              offset + total);
+        }
+        else
+        {
+            n = pread (dev->fd, (char *) buf + total, count - total,
+              offset + total);
+        }
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -errno;
+        }
+
+        if (n == 0)
+            break;
+
+        total += n;
+    }
+
+    return (ssize_t) total;
+}
+
+
+// vim: ts=4 sw=4 et
@@ -0,0 +1,187 @@
+/**
+ *  dev_memory.c
+ *
+ *  Device backend which reads the whole volume into memory when it is
+ *  opened, and serves every request from there. Changes are never
+ *  written back to the device, so the volume is effectively a scratch
+ *  copy that is thrown away at unmount. This is useful for benchmarking
+ *  the file system code on its own, without any device costs, and for
+ *  experimenting on an image without modifying it.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "fat.h"
+#include "device.h"
+
+
+// backend operations.
+PRIVATE int memory_open (fat_device_t *dev, const char *path);
+PRIVATE void memory_close (fat_device_t *dev);
+PRIVATE ssize_t memory_read (fat_device_t *dev, off_t offset, void *buf,
+  size_t count);
+PRIVATE ssize_t memory_write (fat_device_t *dev, off_t offset,
+  const void *buf, size_t count);
+PRIVATE int memory_discard (fat_device_t *dev, off_t offset, off_t length);
+PRIVATE void * memory_map (fat_device_t *dev, off_t offset, size_t count);
+
+// local functions.
+PRIVATE size_t clip (const fat_device_t *dev, off_t offset, size_t count);
+
+
+PUBLIC const struct dev_backend memory_backend =
+{
+    .name       = "memory",
+    .open       = memory_open,
+    .close      = memory_close,
+    .read       = memory_read,
+    .write      = memory_write,
+    .discard    = memory_discard,
+    .map        = memory_map,
+};
+
+
+/**
+ *  Read the entire device into memory, and close the device file.
+ */
+    PRIVATE int
+memory_open (dev, path)
+    fat_device_t *dev;      // device being opened.
+    const char *path;       // device or image file name.
+{
+    uint8_t *volume;
+    ssize_t n;
+    int retval;
+
+    if ((retval = dev_open_file (dev, path, 0)) != 0)
+        return retval;
+
+    // large reads, so that loading a big image is not dominated by system
+    // call overhead.
+    volume = safe_malloc ((size_t) dev->size);
+
+    for (off_t offset = 0; offset < dev->size; offset += n)
+    {
+        n = pread (dev->fd, volume + offset, MIN (dev->size - offset,
+              BULK_IO_SIZE), offset);
+
+        if ((n == -1) && (errno == EINTR))
+        {
+            n = 0;
+            continue;
+        }
+
+        if (n <= 0)
+        {
+            safe_free ((void **) &volume);
+            return (n == 0) ? -EIO : -errno;
+        }
+    }
+
+    safe_close (path, dev->fd);
+    dev->fd = -1;
+    dev->priv = volume;
+
+    return 0;
+}
+
+/**
+ *  Throw away the in memory copy of the volume.
+ */
+    PRIVATE void
+memory_close (dev)
+    fat_device_t *dev;      // device being closed.
+{
+    safe_free ((void **) &(dev->priv));
+}
+
+/**
+ *  Copy bytes out of memory.
+ */
+    PRIVATE ssize_t
+memory_read (dev, offset, buf, count)
+    fat_device_t *dev;      // device to read from.
+    off_t offset;           // device offset.
+    void *buf;              // buffer to fill.
+    size_t count;           // bytes to read.
+{
+    count = clip (dev, offset, count);
+    memcpy (buf, (uint8_t *) dev->priv + offset, count);
+
+    return (ssize_t) count;
+}
+
+/**
+ *  Copy bytes into memory.
+ */
+    PRIVATE ssize_t
+memory_write (dev, offset, buf, count)
+    fat_device_t *dev;      // device to write to.
+    off_t offset;           // device offset.
+    const void *buf;        // data to write.
+    size_t count;           // bytes to write.
+{
+    count = clip (dev, offset, count);
+    memcpy ((uint8_t *) dev->priv + offset, buf, count);
+
+    return (ssize_t) count;
+}
+
+/**
+ *  Discarded regions read back as zeroes.
+ */
+    PRIVATE int
+memory_discard (dev, offset, length)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of region.
+    off_t length;           // length of region.
+{
+    memset ((uint8_t *) dev->priv + offset, 0, clip (dev, offset,
+        (size_t) length));
+
+    return 0;
+}
+
+/**
+ *  The whole volume is in memory, so any region can be accessed in
+ *  place.
+ */
+    PRIVATE void *
+memory_map (dev, offset, count)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of region.
+    size_t count;           // length of region.
+{
+    if (offset + (off_t) count > dev->size)
+        return NULL;
+
+    return (uint8_t *) dev->priv + offset;
+}
+
+/**
+ *  Clip a transfer so that it does not run past the end of the volume.
+ */
+    PRIVATE size_t
+clip (dev, offset, count)
+    const fat_device_t *dev;    // device concerned.
+    off_t offset;               // start of transfer.
+    size_t count;               // requested length.
+{
+    if (offset >= dev->size)
+        return 0;
+
+    if ((off_t) count > dev->size - offset)
+        return (size_t) (dev->size - offset);
+
+    return count;
+}
+
+
+// vim: ts=4 sw=4 et
@@ -0,0 +1,339 @@
+/**
+ *  dev_mmap.c
+ *
+ *  Device backend for volumes held in a regular file (an image) rather
+ *  than on a block device. The whole image is mapped into our address
+ *  space with MAP_SHARED; reads and writes then become memory copies,
+ *  and the FAT can be accessed in place through dev_map, without a
+ *  system call per access.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "fat.h"
+#include "device.h"
+
+
+// The range of bytes that have been written through the mapping since
+// the last sync. File data and metadata are tracked separately, so that
+// the flush can write the data out before the metadata that refers to it.
+struct dirty_range
+{
+    off_t               start;
+    off_t               end;
+};
+
+// private state of a mapped device.
+struct mmap_state
+{
+    uint8_t             *image;
+    struct dirty_range  data;
+    struct dirty_range  meta;
+};
+
+#define MMAP_STATE(dev)     ((struct mmap_state *) (dev)->priv)
+
+
+// backend operations.
+PRIVATE int mmap_open (fat_device_t *dev, const char *path);
+PRIVATE void mmap_close (fat_device_t *dev);
+PRIVATE ssize_t mmap_read (fat_device_t *dev, off_t offset, void *buf,
+  size_t count);
+PRIVATE ssize_t mmap_write (fat_device_t *dev, off_t offset,
+  const void *buf, size_t count);
+PRIVATE int mmap_flush (fat_device_t *dev);
+PRIVATE int mmap_discard (fat_device_t *dev, off_t offset, off_t length);
+PRIVATE void * mmap_map (fat_device_t *dev, off_t offset, size_t count);
+PRIVATE void mmap_dirty (fat_device_t *dev, off_t offset, size_t count);
+PRIVATE void mmap_advise (fat_device_t *dev, off_t offset, size_t length,
+  int advice);
+
+// local functions.
+PRIVATE size_t clip (const fat_device_t *dev, off_t offset, size_t count);
+PRIVATE void mark_dirty (struct dirty_range *range, off_t start, off_t end);
+PRIVATE int sync_range (fat_device_t *dev, struct dirty_range *range);
+
+
+PUBLIC const struct dev_backend mmap_backend =
+{
+    .name       = "mmap",
+    .open       = mmap_open,
+    .close      = mmap_close,
+    .read       = mmap_read,
+    .write      = mmap_write,
+    .flush      = mmap_flush,
+    .discard    = mmap_discard,
+    .map        = mmap_map,
+    .dirty      = mmap_dirty,
+    .advise     = mmap_advise,
+};
+
+
+/**
+ *  Open and map an image file. Block devices cannot be mapped, and on 32
+ *  bit hosts the address space is too small to map anything but very
+ *  small images, so neither is attempted.
+ */
+    PRIVATE int
+mmap_open (dev, path)
+    fat_device_t *dev;      // device being opened.
+    const char *path;       // image file name.
+{
+    struct mmap_state *state;
+    void *image;
+    int retval;
+
+    if ((retval = dev_open_file (dev, path, 0)) != 0)
+        return retval;
+
+    if ((dev->is_blkdev == true) || (dev->size == 0) ||
+      (sizeof (void *) < 8))
+    {
+        return -ENODEV;
+    }
+
+    image = mmap (NULL, (size_t) dev->size, PROT_READ | PROT_WRITE,
+      MAP_SHARED, dev->fd, 0);
+
+    if (image == MAP_FAILED)
+        return -errno;
+
+    state = safe_malloc (sizeof (struct mmap_state));
+    memset (state, 0, sizeof (struct mmap_state));
+    state->image = image;
+    dev->priv = state;
+
+    // accesses to a file system image are mostly scattered, so don't let
+    // the kernel waste effort on readahead by default. Callers that know
+    // better will give more specific hints.
+    mmap_advise (dev, 0, (size_t) dev->size, DEV_ADV_RANDOM);
+
+    return 0;
+}
+
+/**
+ *  Unmap the image. Dirty pages have already been flushed by dev_close.
+ */
+    PRIVATE void
+mmap_close (dev)
+    fat_device_t *dev;      // device being closed.
+{
+    struct mmap_state *state = MMAP_STATE (dev);
+
+    munmap (state->image, (size_t) dev->size);
+    safe_free ((void **) &(dev->priv));
+}
+
+/**
+ *  Copy bytes out of the mapping.
+ */
+    PRIVATE ssize_t
+mmap_read (dev, offset, buf, count)
+    fat_device_t *dev;      // device to read from.
+    off_t offset;           // device offset.
+    void *buf;              // buffer to fill.
+    size_t count;           // bytes to read.
+{
+    count = clip (dev, offset, count);
+    memcpy (buf, MMAP_STATE (dev)->image + offset, count);
+
+    return (ssize_t) count;
+}
+
+/**
+ *  Copy bytes into the mapping, and record them as dirty.
+ */
+    PRIVATE ssize_t
+mmap_write (dev, offset, buf, count)
+    fat_device_t *dev;      // device to write to.
+    off_t offset;           // device offset.
+    const void *buf;        // data to write.
+    size_t count;           // bytes to write.
+{
+    count = clip (dev, offset, count);
+    memcpy (MMAP_STATE (dev)->image + offset, buf, count);
+    mmap_dirty (dev, offset, count);
+
+    return (ssize_t) count;
+}
+
+/**
+ *  Make all writes through the mapping durable. The dirty range of file
+ *  data is synced first, followed by the metadata, so that a crash part
+ *  way through never leaves the FAT pointing at clusters whose contents
+ *  were not written.
+ */
+    PRIVATE int
+mmap_flush (dev)
+    fat_device_t *dev;      // device to sync.
+{
+    struct mmap_state *state = MMAP_STATE (dev);
+    int retval;
+
+    if ((retval = sync_range (dev, &(state->data))) != 0)
+        return retval;
+
+    return sync_range (dev, &(state->meta));
+}
+
+/**
+ *  Punch a hole in the image file. The mapping will read back zeroes.
+ */
+    PRIVATE int
+mmap_discard (dev, offset, length)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of the region.
+    off_t length;           // length of the region.
+{
+    return dev_file_discard (dev, offset, length);
+}
+
+/**
+ *  Return a pointer into the mapping, if the region lies entirely
+ *  within the image.
+ */
+    PRIVATE void *
+mmap_map (dev, offset, count)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of the region.
+    size_t count;           // length of the region.
+{
+    if (offset + (off_t) count > dev->size)
+        return NULL;
+
+    return MMAP_STATE (dev)->image + offset;
+}
+
+/**
+ *  Record that a region of the mapped image has been modified in place.
+ *  Anything below the start of the data region is metadata (boot sector,
+ *  FSINFO and the FATs); everything else is treated as file data.
+ */
+    PRIVATE void
+mmap_dirty (dev, offset, count)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of the modified region.
+    size_t count;           // length of the region.
+{
+    struct mmap_state *state = MMAP_STATE (dev);
+
+    if (offset < dev->meta_end)
+    {
+        mark_dirty (&(state->meta), offset, offset + count);
+    }
+    else
+    {
+        mark_dirty (&(state->data), offset, offset + count);
+    }
+}
+
+/**
+ *  Pass a hint about the access pattern for a region on to madvise.
+ */
+    PRIVATE void
+mmap_advise (dev, offset, length, advice)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of the region.
+    size_t length;          // length of the region.
+    int advice;             // one of the DEV_ADV_* constants.
+{
+    static const int madvice [] =
+    {
+        [DEV_ADV_NORMAL]        = MADV_NORMAL,
+        [DEV_ADV_SEQUENTIAL]    = MADV_SEQUENTIAL,
+        [DEV_ADV_RANDOM]        = MADV_RANDOM,
+        [DEV_ADV_WILLNEED]      = MADV_WILLNEED,
+        [DEV_ADV_DONTNEED]      = MADV_DONTNEED,
+    };
+    size_t page = (size_t) sysconf (_SC_PAGESIZE);
+    off_t start;
+
+    length = clip (dev, offset, length);
+
+    // madvise requires a page aligned start address.
+    start = offset - (offset % page);
+    length += offset - start;
+
+    madvise (MMAP_STATE (dev)->image + start, length, madvice [advice]);
+}
+
+/**
+ *  Clip a transfer so that it does not run past the end of the image.
+ *
+ *  Return value is the number of bytes that can be transferred.
+ */
+    PRIVATE size_t
+clip (dev, offset, count)
+    const fat_device_t *dev;    // device concerned.
+    off_t offset;               // start of transfer.
+    size_t count;               // requested length.
+{
+    if (offset >= dev->size)
+        return 0;
+
+    if ((off_t) count > dev->size - offset)
+        return (size_t) (dev->size - offset);
+
+    return count;
+}
+
+/**
+ *  Extend a dirty range to include the region [start, end).
+ */
+    PRIVATE void
+mark_dirty (range, start, end)
+    struct dirty_range *range;  // range to extend.
+    off_t start;                // start of newly dirtied region.
+    off_t end;                  // end of region, exclusive.
+{
+    if (range->start == range->end)
+    {
+        range->start = start;
+        range->end = end;
+        return;
+    }
+
+    if (start < range->start)
+        range->start = start;
+
+    if (end > range->end)
+        range->end = end;
+}
+
+/**
+ *  Synchronously write back a dirty range of the mapped image, and reset
+ *  it to empty.
+ *
+ *  Return value is 0 on success, or a negative errno.
+ */
+    PRIVATE int
+sync_range (dev, range)
+    fat_device_t *dev;          // device with a mapped image.
+    struct dirty_range *range;  // range to write back.
+{
+    size_t page = (size_t) sysconf (_SC_PAGESIZE);
+    off_t start = range->start - (range->start % page);
+
+    if (range->start == range->end)
+        return 0;
+
+    if (msync (MMAP_STATE (dev)->image + start, range->end - start,
+          MS_SYNC) != 0)
+    {
+        return -errno;
+    }
+
+    range->start = range->end = 0;
+    return 0;
+}
+
+
+// vim: ts=4 sw=4 et
@@ -0,0 +1,595 @@
+/**
+ *  dev_overlay.c
+ *
+ *  Device backend which leaves the volume's device or image untouched,
+ *  and keeps every change in a separate delta file. The base is opened
+ *  read-only. Writes go to the delta a block of OVERLAY_BLOCK_SIZE bytes
+ *  at a time, a block being copied up from the base first if only part
+ *  of it is written, and reads take each block from the delta if it is
+ *  there, or from the base if not. Throwing the delta away, or truncating
+ *  it to nothing, returns the volume to the base image at once, however
+ *  large it is.
+ *
+ *  The delta file starts with a header identifying the base it belongs
+ *  to, followed by a bitmap of the blocks it holds, and then the blocks
+ *  themselves, each at the same place relative to the start of the data
+ *  as in the base. The file is sparse, so it only takes up the space of
+ *  the blocks that have been written. The bitmap is kept in memory, and
+ *  written back when the device is synced, after the blocks it covers.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <err.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "fat.h"
+#include "device.h"
+
+
+// bitmaps have one bit per block of the volume.
+#define BITS_PER_WORD       64
+#define BITMAP_WORDS(n)     (((n) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+// index of the block holding a given byte offset.
+#define BLOCK(offset)       ((size_t) ((offset) / OVERLAY_BLOCK_SIZE))
+
+// the bitmap is written back a page of this many words at a time.
+#define PAGE_WORDS          (OVERLAY_BLOCK_SIZE / sizeof (uint64_t))
+
+#define DELTA_MAGIC         "MFATDLTA"
+#define DELTA_MAGIC_LEN     8
+
+// header at the start of a delta file. base_size and base_hash identify
+// the base image, by its size and a hash of its first block.
+struct delta_header
+{
+    char                magic [DELTA_MAGIC_LEN];
+    uint32_t            block_size;
+    uint32_t            reserved;
+    uint64_t            base_size;
+    uint64_t            base_hash;
+}
+__attribute__ ((packed));
+
+// private state of an overlaid device. The base image is the device's
+// own file descriptor.
+struct overlay_state
+{
+    // the delta file, and where its bitmap and blocks start.
+    int                 delta;
+    off_t               bitmap_start;
+    off_t               data_start;
+
+    // blocks held in the delta, and which pages of that bitmap have
+    // changed since they were last written back. Bits are only ever set,
+    // with atomic operations, so readers need no lock.
+    uint64_t            *present;
+    size_t              nr_blocks;
+    uint8_t             *dirty_pages;
+    size_t              nr_pages;
+
+    // serialises writes to blocks not yet in the delta, and write backs
+    // of the bitmap.
+    pthread_mutex_t     copy_lock;
+    pthread_mutex_t     flush_lock;
+};
+
+#define OVERLAY_STATE(dev)  ((struct overlay_state *) (dev)->priv)
+
+
+// backend operations.
+PRIVATE int overlay_open (fat_device_t *dev, const char *path);
+PRIVATE void overlay_close (fat_device_t *dev);
+PRIVATE ssize_t overlay_read (fat_device_t *dev, off_t offset, void *buf,
+  size_t count);
+PRIVATE ssize_t overlay_write (fat_device_t *dev, off_t offset,
+  const void *buf, size_t count);
+PRIVATE int overlay_flush (fat_device_t *dev);
+PRIVATE int overlay_discard (fat_device_t *dev, off_t offset,
+  off_t length);
+
+// local functions.
+PRIVATE int open_delta (fat_device_t *dev, struct overlay_state *state);
+PRIVATE uint64_t hash_base (fat_device_t *dev);
+PRIVATE bool is_present (struct overlay_state *state, size_t block);
+PRIVATE void mark_present (struct overlay_state *state, size_t first,
+  size_t last);
+PRIVATE int copy_up (fat_device_t *dev, size_t block);
+PRIVATE ssize_t pread_all (int fd, void *buf, size_t count, off_t offset);
+PRIVATE ssize_t pwrite_all (int fd, const void *buf, size_t count,
+  off_t offset);
+
+
+PUBLIC const struct dev_backend overlay_backend =
+{
+    .name       = "overlay",
+    .open       = overlay_open,
+    .close      = overlay_close,
+    .read       = overlay_read,
+    .write      = overlay_write,
+    .flush      = overlay_flush,
+    .discard    = overlay_discard,
+};
+
+
+/**
+ *  Open the base image read-only, and the delta file named by the
+ *  overlay mount option, creating it if it does not exist.
+ */
+    PRIVATE int
+overlay_open (dev, path)
+    fat_device_t *dev;      // device being opened.
+    const char *path;       // base device or image file name.
+{
+    struct overlay_state *state;
+    int retval;
+
+    if (dev->params.overlay == NULL)
+        return -EINVAL;
+
+    dev->read_only = true;
+    if ((retval = dev_open_file (dev, path, 0)) != 0)
+        return retval;
+
+    if (dev->size == 0)
+        return -ENODEV;
+
+    state = safe_malloc (sizeof (struct overlay_state));
+    memset (state, 0, sizeof (struct overlay_state));
+    state->nr_blocks = BLOCK (dev->size + OVERLAY_BLOCK_SIZE - 1);
+    state->nr_pages = (BITMAP_WORDS (state->nr_blocks) + PAGE_WORDS - 1) /
+      PAGE_WORDS;
+
+    // the bitmap is allocated in whole pages, as it is written back a
+    // page at a time.
+    state->present = safe_malloc (state->nr_pages * OVERLAY_BLOCK_SIZE);
+    state->dirty_pages = safe_malloc (state->nr_pages);
+    memset (state->dirty_pages, 0, state->nr_pages);
+
+    state->bitmap_start = OVERLAY_BLOCK_SIZE;
+    state->data_start = state->bitmap_start +
+      (off_t) state->nr_pages * OVERLAY_BLOCK_SIZE;
+
+    pthread_mutex_init (&(state->copy_lock), NULL);
+    pthread_mutex_init (&(state->flush_lock), NULL);
+
+    dev->priv = state;
+
+    return open_delta (dev, state);
+}
+
+/**
+ *  Open the delta file, and read in its bitmap. An empty file is made
+ *  into a new delta for this base, with no blocks; any other file must
+ *  have been made for this base.
+ *
+ *  Return value is 0, or a negative errno.
+ */
+    PRIVATE int
+open_delta (dev, state)
+    fat_device_t *dev;              // device being opened.
+    struct overlay_state *state;    // its private state.
+{
+    const char *path = dev->params.overlay;
+    struct delta_header header;
+    size_t bitmap_bytes = state->nr_pages * OVERLAY_BLOCK_SIZE;
+    struct stat st;
+
+    if ((state->delta = open (path, O_RDWR | O_CREAT, 0644)) == -1)
+        return -errno;
+
+    if (fstat (state->delta, &st) != 0)
+        return -errno;
+
+    if (st.st_size == 0)
+    {
+        memset (&header, 0, sizeof (struct delta_header));
+        memcpy (header.magic, DELTA_MAGIC, DELTA_MAGIC_LEN);
+        header.block_size = OVERLAY_BLOCK_SIZE;
+        header.base_size = (uint64_t) dev->size;
+        header.base_hash = hash_base (dev);
+
+        memset (state->present, 0, bitmap_bytes);
+
+        // size the file to hold every block, leaving it sparse, before
+        // the header makes it valid.
+        if (ftruncate (state->delta, state->data_start + dev->size) != 0)
+            return -errno;
+
+        if (pwrite_all (state->delta, &header, sizeof (struct delta_header),
+              0) < 0)
+            return -errno;
+
+        return (fdatasync (state->delta) == 0) ? 0 : -errno;
+    }
+
+    if ((pread_all (state->delta, &header, sizeof (struct delta_header),
+          0) != sizeof (struct delta_header)) ||
+      (memcmp (header.magic, DELTA_MAGIC, DELTA_MAGIC_LEN) != 0) ||
+      (header.block_size != OVERLAY_BLOCK_SIZE))
+    {
+        errx (1, "%s is not a delta file", path);
+    }
+
+    if ((header.base_size != (uint64_t) dev->size) ||
+      (header.base_hash != hash_base (dev)))
+    {
+        errx (1, "%s was made for a different base image", path);
+    }
+
+    if (pread_all (state->delta, state->present, bitmap_bytes,
+          state->bitmap_start) != (ssize_t) bitmap_bytes)
+        return -EIO;
+
+    return 0;
+}
+
+/**
+ *  Hash the first block of the base image, to tell whether a delta file
+ *  was made for it. The base is never written, so this does not change.
+ *
+ *  Return value is the FNV-1a hash of the block.
+ */
+    PRIVATE uint64_t
+hash_base (dev)
+    fat_device_t *dev;      // device concerned.
+{
+    uint8_t block [OVERLAY_BLOCK_SIZE];
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    ssize_t n;
+
+    if ((n = pread_all (dev->fd, block, OVERLAY_BLOCK_SIZE, 0)) < 0)
+        return 0;
+
+    for (ssize_t i = 0; i < n; i ++)
+        hash = (hash ^ block [i]) * 0x100000001B3ULL;
+
+    return hash;
+}
+
+/**
+ *  Close the delta file. Its bitmap has already been written back by
+ *  dev_close.
+ */
+    PRIVATE void
+overlay_close (dev)
+    fat_device_t *dev;      // device being closed.
+{
+    struct overlay_state *state = OVERLAY_STATE (dev);
+
+    safe_close ("delta", state->delta);
+    safe_free ((void **) &(state->present));
+    safe_free ((void **) &(state->dirty_pages));
+    pthread_mutex_destroy (&(state->copy_lock));
+    pthread_mutex_destroy (&(state->flush_lock));
+    safe_free ((void **) &state);
+    dev->priv = NULL;
+}
+
+/**
+ *  Read from the volume. Each run of blocks that are all in the delta,
+ *  or all not, is read with a single call from the delta or the base.
+ */
+    PRIVATE ssize_t
+overlay_read (dev, offset, buf, count)
+    fat_device_t *dev;      // device to read from.
+    off_t offset;           // device offset.
+    void *buf;              // buffer to fill.
+    size_t count;           // bytes to read.
+{
+    struct overlay_state *state = OVERLAY_STATE (dev);
+    size_t total = 0, length;
+    bool in_delta;
+    ssize_t n;
+
+    if (offset >= dev->size)
+        return 0;
+
+    count = MIN (count, (size_t) (dev->size - offset));
+
+    while (total < count)
+    {
+        size_t block = BLOCK (offset + total);
+        off_t run_end = (off_t) (block + 1) * OVERLAY_BLOCK_SIZE;
+
+        // extend the run over the following blocks in the same place.
+        in_delta = is_present (state, block);
+        while ((run_end < offset + (off_t) count) &&
+          (is_present (state, BLOCK (run_end)) == in_delta))
+            run_end += OVERLAY_BLOCK_SIZE;
+
+        length = MIN ((size_t) (run_end - offset) - total, count - total);
+
+        if (in_delta)
+            n = pread_all (state->delta, (char *) buf + total, length,
+              state->data_start + offset + total);
+        else
+            n = pread_all (dev->fd, (char *) buf + total, length,
+              offset + total);
+
+        if (n < 0)
+            return n;
+
+        total += length;
+    }
+
+    return (ssize_t) total;
+}
+
+/**
+ *  Write to the volume. Once all the blocks written are in the delta,
+ *  this is a single write to it. Until then, blocks which are only partly
+ *  written are copied up from the base first, and the blocks are marked
+ *  as being in the delta after the write.
+ */
+    PRIVATE ssize_t
+overlay_write (dev, offset, buf, count)
+    fat_device_t *dev;      // device to write to.
+    off_t offset;           // device offset.
+    const void *buf;        // data to write.
+    size_t count;           // bytes to write.
+{
+    struct overlay_state *state = OVERLAY_STATE (dev);
+    size_t first, last, b;
+    ssize_t n;
+    int retval = 0;
+
+    if (offset >= dev->size)
+        return 0;
+
+    count = MIN (count, (size_t) (dev->size - offset));
+    if (count == 0)
+        return 0;
+
+    first = BLOCK (offset);
+    last = BLOCK (offset + count - 1);
+
+    for (b = first; (b <= last) && is_present (state, b); b ++)
+        ;
+
+    if (b > last)
+    {
+        n = pwrite_all (state->delta, buf, count, state->data_start +
+          offset);
+
+        return (n < 0) ? n : (ssize_t) count;
+    }
+
+    // a block is copied up while holding the lock, and until a block is
+    // marked, every write to it holds the lock too. Otherwise, copying up
+    // a block for one writer could undo another's write to the rest of
+    // it, which had not been marked yet.
+    pthread_mutex_lock (&(state->copy_lock));
+
+    if ((offset % OVERLAY_BLOCK_SIZE) != 0)
+        retval = copy_up (dev, first);
+
+    if ((retval == 0) && (((offset + count) % OVERLAY_BLOCK_SIZE) != 0) &&
+      ((offset + (off_t) count) != dev->size))
+        retval = copy_up (dev, last);
+
+    if ((retval == 0) && ((n = pwrite_all (state->delta, buf, count,
+          state->data_start + offset)) < 0))
+        retval = (int) n;
+
+    if (retval == 0)
+        mark_present (state, first, last);
+
+    pthread_mutex_unlock (&(state->copy_lock));
+
+    return (retval != 0) ? retval : (ssize_t) count;
+}
+
+/**
+ *  Make the writes so far durable: first the blocks in the delta, and
+ *  then the pages of the bitmap that record them.
+ */
+    PRIVATE int
+overlay_flush (dev)
+    fat_device_t *dev;      // device to flush.
+{
+    struct overlay_state *state = OVERLAY_STATE (dev);
+    int retval = 0;
+
+    pthread_mutex_lock (&(state->flush_lock));
+
+    if (fdatasync (state->delta) != 0)
+        retval = -errno;
+
+    for (size_t p = 0; (retval == 0) && (p < state->nr_pages); p ++)
+    {
+        // clear the flag before writing the page out, so that a block
+        // marked while it is being written dirties it again.
+        if (__atomic_exchange_n (&(state->dirty_pages [p]), 0,
+              __ATOMIC_ACQ_REL) == 0)
+            continue;
+
+        if (pwrite_all (state->delta, state->present + p * PAGE_WORDS,
+              OVERLAY_BLOCK_SIZE, state->bitmap_start +
+              (off_t) p * OVERLAY_BLOCK_SIZE) < 0)
+            retval = -errno;
+    }
+
+    if ((retval == 0) && (fdatasync (state->delta) != 0))
+        retval = -errno;
+
+    pthread_mutex_unlock (&(state->flush_lock));
+
+    return retval;
+}
+
+/**
+ *  Discard a region of the volume. The whole blocks within it are punched
+ *  out of the delta, and so read as zeros. They stay marked as being in
+ *  the delta, so the base's blocks do not show through again.
+ */
+    PRIVATE int
+overlay_discard (dev, offset, length)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of the region.
+    off_t length;           // length of the region.
+{
+    struct overlay_state *state = OVERLAY_STATE (dev);
+    off_t start = (offset + OVERLAY_BLOCK_SIZE - 1) / OVERLAY_BLOCK_SIZE *
+      OVERLAY_BLOCK_SIZE;
+    off_t end = MIN (offset + length, dev->size) / OVERLAY_BLOCK_SIZE *
+      OVERLAY_BLOCK_SIZE;
+
+    if (end <= start)
+        return 0;
+
+    if (fallocate (state->delta, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+          state->data_start + start, end - start) != 0)
+        return -errno;
+
+    mark_present (state, BLOCK (start), BLOCK (end - 1));
+
+    return 0;
+}
+
+/**
+ *  Return value is true if a block is in the delta.
+ */
+    PRIVATE bool
+is_present (state, block)
+    struct overlay_state *state;    // private state of the device.
+    size_t block;                   // block concerned.
+{
+    return (__atomic_load_n (&(state->present [block / BITS_PER_WORD]),
+        __ATOMIC_ACQUIRE) >> (block % BITS_PER_WORD)) & 1;
+}
+
+/**
+ *  Mark a range of blocks as being in the delta, and the pages of the
+ *  bitmap holding them as needing to be written back.
+ */
+    PRIVATE void
+mark_present (state, first, last)
+    struct overlay_state *state;    // private state of the device.
+    size_t first;                   // first block of the range.
+    size_t last;                    // last block of the range.
+{
+    for (size_t b = first; b <= last; b ++)
+    {
+        uint64_t bit = 1ULL << (b % BITS_PER_WORD);
+        size_t word = b / BITS_PER_WORD;
+
+        if ((__atomic_fetch_or (&(state->present [word]), bit,
+              __ATOMIC_RELEASE) & bit) == 0)
+            __atomic_store_n (&(state->dirty_pages [word / PAGE_WORDS]), 1,
+              __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ *  Copy a block from the base into the delta, unless it is there
+ *  already, so that part of it can be written. The caller holds the
+ *  copy lock.
+ *
+ *  Return value is 0, or a negative errno.
+ */
+    PRIVATE int
+copy_up (dev, block)
+    fat_device_t *dev;      // device concerned.
+    size_t block;           // block to copy.
+{
+    struct overlay_state *state = OVERLAY_STATE (dev);
+    uint8_t data [OVERLAY_BLOCK_SIZE];
+    off_t offset = (off_t) block * OVERLAY_BLOCK_SIZE;
+    size_t length = MIN (OVERLAY_BLOCK_SIZE, (size_t) (dev->size - offset));
+
+    if (is_present (state, block))
+        return 0;
+
+    if ((pread_all (dev->fd, data, length, offset) != (ssize_t) length) ||
+      (pwrite_all (state->delta, data, length, state->data_start +
+         offset) < 0))
+        return -EIO;
+
+    mark_present (state, block, block);
+
+    return 0;
+}
+
+/**
+ *  Read from a file, retrying after short reads until the request is
+ *  satisfied or the end of the file is reached.
+ *
+ *  Return value is the number of bytes read, or a negative errno.
+ */
+    PRIVATE ssize_t
+pread_all (fd, buf, count, offset)
+    int fd;                 // file to read from.
+    void *buf;              // buffer to fill.
+    size_t count;           // bytes to read.
+    off_t offset;           // file offset.
+{
+    size_t total = 0;
+    ssize_t n;
+
+    while (total < count)
+    {
+        n = pread (fd, (char *) buf + total, count - total, offset + total);
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -errno;
+        }
+
+        if (n == 0)
+            break;
+
+        total += n;
+    }
+
+    return (ssize_t) total;
+}
+
+/**
+ *  Write to a file, retrying after short writes.
+ *
+ *  Return value is the number of bytes written, or a negative errno.
+ */
+    PRIVATE ssize_t
+pwrite_all (fd, buf, count, offset)
+    int fd;                 // file to write to.
+    const void *buf;        // data to write.
+    size_t count;           // bytes to write.
+    off_t offset;           // file offset.
+{
+    size_t total = 0;
+    ssize_t n;
+
+    while (total < count)
+    {
+        n = pwrite (fd, (const char *) buf + total, count - total,
+          offset + total);
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -errno;
+        }
+
+        total += n;
+    }
+
+    return (ssize_t) total;
+}
+
+
+// vim: ts=4 sw=4 et
@@ -0,0 +1,209 @@
+/**
+ *  dev_pread.c
+ *
+ *  The simplest device backend, which carries out every request with a
+ *  positional read or write system call on the device file. This works
+ *  on anything, and is the fallback when other backends are unavailable.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "fat.h"
+#include "device.h"
+
+
+// backend operations.
+PRIVATE int pread_open (fat_device_t *dev, const char *path);
+PRIVATE ssize_t pread_read (fat_device_t *dev, off_t offset, void *buf,
+  size_t count);
+PRIVATE ssize_t pread_write (fat_device_t *dev, off_t offset,
+  const void *buf, size_t count);
+PRIVATE ssize_t pread_readv (fat_device_t *dev, off_t offset,
+  const struct iovec *iov, int iovcnt);
+PRIVATE ssize_t pread_writev (fat_device_t *dev, off_t offset,
+  const struct iovec *iov, int iovcnt);
+PRIVATE int pread_flush (fat_device_t *dev);
+PRIVATE void pread_advise (fat_device_t *dev, off_t offset, size_t length,
+  int advice);
+
+
+PUBLIC const struct dev_backend pread_backend =
+{
+    .name       = "pread",
+    .open       = pread_open,
+    .read       = pread_read,
+    .write      = pread_write,
+    .readv      = pread_readv,
+    .writev     = pread_writev,
+    .flush      = pread_flush,
+    .discard    = dev_file_discard,
+    .copy       = dev_file_copy,
+    .advise     = pread_advise,
+};
+
+
+/**
+ *  Open the device file.
+ */
+    PRIVATE int
+pread_open (dev, path)
+    fat_device_t *dev;      // device being opened.
+    const char *path;       // device file name.
+{
+    return dev_open_file (dev, path, 0);
+}
+
+/**
+ *  Read from the device, retrying after short reads until either the
+ *  request is satisfied or we reach the end of the device.
+ */
+    PRIVATE ssize_t
+pread_read (dev, offset, buf, count)
+    fat_device_t *dev;      // device to read from.
+    off_t offset;           // device offset.
+    void *buf;              // buffer to fill.
+    size_t count;           // bytes to read.
+{
+    size_t total = 0;
+    ssize_t n;
+
+    while (total < count)
+    {
+        n = pread (dev->fd, (char *) buf + total, count - total,
+          offset + total);
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -errno;
+        }
+
+        if (n == 0)
+            break;
+
+        total += n;
+    }
+
+    return (ssize_t) total;
+}
+
+/**
+ *  Write to the device, retrying after short writes.
+ */
+    PRIVATE ssize_t
+pread_write (dev, offset, buf, count)
+    fat_device_t *dev;      // device to write to.
+    off_t offset;           // device offset.
+    const void *buf;        // data to write.
+    size_t count;           // bytes to write.
+{
+    size_t total = 0;
+    ssize_t n;
+
+    while (total < count)
+    {
+        n = pwrite (dev->fd, (const char *) buf + total, count - total,
+          offset + total);
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -errno;
+        }
+
+        total += n;
+    }
+
+    return (ssize_t) total;
+}
+
+/**
+ *  Vectored read, with a single system call.
+ */
+    PRIVATE ssize_t
+pread_readv (dev, offset, iov, iovcnt)
+    fat_device_t *dev;          // device to read from.
+    off_t offset;               // device offset.
+    const struct iovec *iov;    // buffers to fill.
+    int iovcnt;                 // number of buffers.
+{
+    ssize_t n;
+
+    while ((n = preadv (dev->fd, iov, iovcnt, offset)) == -1)
+    {
+        if (errno != EINTR)
+            return -errno;
+    }
+
+    return n;
+}
+
+/**
+ *  Vectored write, with a single system call.
+ */
+    PRIVATE ssize_t
+pread_writev (dev, offset, iov, iovcnt)
+    fat_device_t *dev;          // device to write to.
+    off_t offset;               // device offset.
+    const struct iovec *iov;    // buffers to write.
+    int iovcnt;                 // number of buffers.
+{
+    ssize_t n;
+
+    while ((n = pwritev (dev->fd, iov, iovcnt, offset)) == -1)
+    {
+        if (errno != EINTR)
+            return -errno;
+    }
+
+    return n;
+}
+
+/**
+ *  Flush the device's write cache.
+ */
+    PRIVATE int
+pread_flush (dev)
+    fat_device_t *dev;      // device to flush.
+{
+    if (fdatasync (dev->fd) != 0)
+        return -errno;
+
+    return 0;
+}
+
+/**
+ *  Pass access pattern hints on to the page cache.
+ */
+    PRIVATE void
+pread_advise (dev, offset, length, advice)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of region.
+    size_t length;          // length of region.
+    int advice;             // DEV_ADV_* constant.
+{
+    static const int fadvice [] =
+    {
+        [DEV_ADV_NORMAL]        = POSIX_FADV_NORMAL,
+        [DEV_ADV_SEQUENTIAL]    = POSIX_FADV_SEQUENTIAL,
+        [DEV_ADV_RANDOM]        = POSIX_FADV_RANDOM,
+        [DEV_ADV_WILLNEED]      = POSIX_FADV_WILLNEED,
+        [DEV_ADV_DONTNEED]      = POSIX_FADV_DONTNEED,
+    };
+
+    posix_fadvise (dev->fd, offset, length, fadvice [advice]);
+}
+
+
+// vim: ts=4 sw=4 et
@@ -0,0 +1,852 @@
+/**
+ *  dev_ram.c
+ *
+ *  Device backend which keeps the volume resident in memory, and serves
+ *  every request from there. Unlike the memory backend, changes are kept:
+ *  modified regions are recorded in a dirty bitmap, and written back to
+ *  the device by a background thread every few seconds, whenever the
+ *  volume is synced, and at unmount.
+ *
+ *  By default the whole volume is loaded when it is opened. With the
+ *  ram_mode=meta mount option, only the metadata (boot sector, FSINFO and
+ *  FATs) is loaded up front; file data is loaded in chunks as it is used,
+ *  and the least recently used chunks are dropped again once more than
+ *  ram_hot megabytes of file data are resident, or when the memory
+ *  accountant asks for memory back.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <err.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "fat.h"
+#include "device.h"
+#include "memacct.h"
+#include "iosched.h"
+
+
+// bitmaps have one bit per chunk of the volume.
+#define BITS_PER_WORD       64
+#define BITMAP_WORDS(n)     (((n) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+#define TEST_BIT(map, i)    (((map) [(i) / BITS_PER_WORD] >> \
+                                ((i) % BITS_PER_WORD)) & 1)
+#define SET_BIT(map, i)     ((map) [(i) / BITS_PER_WORD] |= \
+                                (1ULL << ((i) % BITS_PER_WORD)))
+#define CLEAR_BIT(map, i)   ((map) [(i) / BITS_PER_WORD] &= \
+                                ~(1ULL << ((i) % BITS_PER_WORD)))
+
+// index of the chunk holding a given byte offset.
+#define CHUNK(offset)       ((size_t) ((offset) / RAM_CHUNK_SIZE))
+
+// a single load may need this many slots for file data at once, and must
+// not evict its own chunks, so this many are always allowed. Only chunks
+// beyond these are charged to the memory accountant.
+#define MIN_RESIDENT        (BULK_IO_SIZE / RAM_CHUNK_SIZE)
+
+// private state of a memory resident device.
+struct ram_state
+{
+    // copy of the volume. This is an anonymous mapping of the full size
+    // of the volume; pages for chunks which are never loaded are never
+    // allocated.
+    uint8_t             *image;
+    size_t              nr_chunks;
+
+    // chunks which are loaded, modified since the last write back, and
+    // used since the clock hand last passed them.
+    uint64_t            *present;
+    uint64_t            *dirty;
+    uint64_t            *referenced;
+
+    // when only metadata is pinned, the file data chunks that are
+    // resident, and the clock hand used to choose which to drop. The
+    // resident chunks are accounted for as a cache.
+    bool                meta_only;
+    size_t              *resident;
+    size_t              nr_resident;
+    size_t              max_resident;
+    size_t              hand;
+    mem_cache_t         mem;
+
+    // lock protects the bitmaps and the contents of the image.
+    // flush_lock serialises write backs, and protects the bounce buffer.
+    pthread_mutex_t     lock;
+    pthread_mutex_t     flush_lock;
+    uint8_t             *bounce;
+
+    // the write back thread, which sleeps on wakeup between write backs.
+    pthread_t           writer;
+    pthread_cond_t      wakeup;
+    unsigned int        interval;
+    bool                running;
+    bool                stopping;
+};
+
+#define RAM_STATE(dev)      ((struct ram_state *) (dev)->priv)
+
+
+// backend operations.
+PRIVATE int ram_open (fat_device_t *dev, const char *path);
+PRIVATE int ram_start (fat_device_t *dev);
+PRIVATE void ram_close (fat_device_t *dev);
+PRIVATE ssize_t ram_read (fat_device_t *dev, off_t offset, void *buf,
+  size_t count);
+PRIVATE ssize_t ram_write (fat_device_t *dev, off_t offset,
+  const void *buf, size_t count);
+PRIVATE int ram_flush (fat_device_t *dev);
+PRIVATE int ram_discard (fat_device_t *dev, off_t offset, off_t length);
+PRIVATE void * ram_map (fat_device_t *dev, off_t offset, size_t count);
+PRIVATE void ram_dirty (fat_device_t *dev, off_t offset, size_t count);
+PRIVATE void ram_advise (fat_device_t *dev, off_t offset, size_t length,
+  int advice);
+
+// local functions.
+PRIVATE size_t clip (const fat_device_t *dev, off_t offset, size_t count);
+PRIVATE int load_range (fat_device_t *dev, off_t offset, size_t count);
+PRIVATE int make_room (fat_device_t *dev, size_t chunk);
+PRIVATE size_t ram_shrink (mem_cache_t *mem, size_t nbytes);
+PRIVATE void mark_range (uint64_t *map, off_t offset, size_t count);
+PRIVATE int write_back (fat_device_t *dev);
+PRIVATE int write_back_chunks (fat_device_t *dev, size_t first,
+  size_t last, const struct timespec *deadline, bool *wrote);
+PRIVATE void * writer_main (void *arg);
+
+
+PUBLIC const struct dev_backend ram_backend =
+{
+    .name       = "ram",
+    .open       = ram_open,
+    .start      = ram_start,
+    .close      = ram_close,
+    .read       = ram_read,
+    .write      = ram_write,
+    .flush      = ram_flush,
+    .discard    = ram_discard,
+    .map        = ram_map,
+    .dirty      = ram_dirty,
+    .advise     = ram_advise,
+};
+
+
+/**
+ *  Open the device file, and set up the in memory copy of the volume. In
+ *  the default mode, the whole volume is read in now.
+ */
+    PRIVATE int
+ram_open (dev, path)
+    fat_device_t *dev;      // device being opened.
+    const char *path;       // device or image file name.
+{
+    struct ram_state *state;
+    size_t words;
+    void *image;
+    int retval;
+
+    if ((retval = dev_open_file (dev, path, 0)) != 0)
+        return retval;
+
+    if (dev->size == 0)
+        return -ENODEV;
+
+    image = mmap (NULL, (size_t) dev->size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (image == MAP_FAILED)
+        return -errno;
+
+    state = safe_malloc (sizeof (struct ram_state));
+    memset (state, 0, sizeof (struct ram_state));
+    state->image = image;
+    state->nr_chunks = CHUNK (dev->size + RAM_CHUNK_SIZE - 1);
+    state->meta_only = dev->params.ram_meta_only;
+
+    words = BITMAP_WORDS (state->nr_chunks);
+    state->present = safe_malloc (words * sizeof (uint64_t));
+    state->dirty = safe_malloc (words * sizeof (uint64_t));
+    state->referenced = safe_malloc (words * sizeof (uint64_t));
+    memset (state->present, 0, words * sizeof (uint64_t));
+    memset (state->dirty, 0, words * sizeof (uint64_t));
+    memset (state->referenced, 0, words * sizeof (uint64_t));
+
+    state->bounce = safe_malloc (SCHED_WRITE_SLICE);
+    state->interval = (dev->params.writeback_interval != 0) ?
+        dev->params.writeback_interval : RAM_WRITEBACK_INTERVAL;
+
+    pthread_mutex_init (&(state->lock), NULL);
+    pthread_mutex_init (&(state->flush_lock), NULL);
+    pthread_cond_init (&(state->wakeup), NULL);
+
+    dev->priv = state;
+
+    if (state->meta_only == true)
+    {
+        state->max_resident = ((size_t) ((dev->params.ram_hot_limit != 0) ?
+            dev->params.ram_hot_limit : RAM_HOT_LIMIT) * 1024 * 1024) /
+            RAM_CHUNK_SIZE;
+
+        if (state->max_resident < MIN_RESIDENT)
+            state->max_resident = MIN_RESIDENT;
+
+        state->resident = safe_malloc (state->max_resident *
+          sizeof (size_t));
+
+        state->mem.name = "ram";
+        state->mem.shrink = ram_shrink;
+        state->mem.priv = dev;
+        mem_register (&(state->mem));
+
+        return 0;
+    }
+
+    return load_range (dev, 0, (size_t) dev->size);
+}
+
+/**
+ *  Load the metadata, if it was not all loaded at open, and start the
+ *  write back thread.
+ */
+    PRIVATE int
+ram_start (dev)
+    fat_device_t *dev;      // device being started.
+{
+    struct ram_state *state = RAM_STATE (dev);
+    int retval;
+
+    pthread_mutex_lock (&(state->lock));
+    retval = load_range (dev, 0, (size_t) dev->meta_end);
+    pthread_mutex_unlock (&(state->lock));
+
+    if (retval != 0)
+        return retval;
+
+    if ((retval = pthread_create (&(state->writer), NULL, writer_main,
+          dev)) != 0)
+    {
+        return -retval;
+    }
+
+    state->running = true;
+    return 0;
+}
+
+/**
+ *  Stop the write back thread, and throw away the in memory copy. All
+ *  dirty chunks have already been written back by dev_close.
+ */
+    PRIVATE void
+ram_close (dev)
+    fat_device_t *dev;      // device being closed.
+{
+    struct ram_state *state = RAM_STATE (dev);
+
+    if (state->running == true)
+    {
+        pthread_mutex_lock (&(state->lock));
+        state->stopping = true;
+        pthread_cond_signal (&(state->wakeup));
+        pthread_mutex_unlock (&(state->lock));
+
+        pthread_join (state->writer, NULL);
+    }
+
+    // catch anything written while the thread was being stopped.
+    if (write_back (dev) != 0)
+        warnx ("Error writing back device on close");
+
+    munmap (state->image, (size_t) dev->size);
+    pthread_mutex_destroy (&(state->lock));
+    pthread_mutex_destroy (&(state->flush_lock));
+    pthread_cond_destroy (&(state->wakeup));
+
+    safe_free ((void **) &(state->present));
+    safe_free ((void **) &(state->dirty));
+    safe_free ((void **) &(state->referenced));
+    safe_free ((void **) &(state->bounce));
+
+    if (state->resident != NULL)
+        safe_free ((void **) &(state->resident));
+
+    safe_free ((void **) &(dev->priv));
+}
+
+/**
+ *  Copy bytes out of memory, loading them first if necessary.
+ */
+    PRIVATE ssize_t
+ram_read (dev, offset, buf, count)
+    fat_device_t *dev;      // device to read from.
+    off_t offset;           // device offset.
+    void *buf;              // buffer to fill.
+    size_t count;           // bytes to read.
+{
+    struct ram_state *state = RAM_STATE (dev);
+    int retval;
+
+    count = clip (dev, offset, count);
+    pthread_mutex_lock (&(state->lock));
+
+    if ((retval = load_range (dev, offset, count)) != 0)
+    {
+        pthread_mutex_unlock (&(state->lock));
+        return retval;
+    }
+
+    memcpy (buf, state->image + offset, count);
+    pthread_mutex_unlock (&(state->lock));
+
+    return (ssize_t) count;
+}
+
+/**
+ *  Copy bytes into memory, and mark them dirty. Partly written chunks
+ *  that are not resident are loaded first, so that the rest of the chunk
+ *  is intact when it is written back.
+ */
+    PRIVATE ssize_t
+ram_write (dev, offset, buf, count)
+    fat_device_t *dev;      // device to write to.
+    off_t offset;           // device offset.
+    const void *buf;        // data to write.
+    size_t count;           // bytes to write.
+{
+    struct ram_state *state = RAM_STATE (dev);
+    int retval;
+
+    count = clip (dev, offset, count);
+    pthread_mutex_lock (&(state->lock));
+
+    if ((retval = load_range (dev, offset, count)) != 0)
+    {
+        pthread_mutex_unlock (&(state->lock));
+        return retval;
+    }
+
+    memcpy (state->image + offset, buf, count);
+    mark_range (state->dirty, offset, count);
+    pthread_mutex_unlock (&(state->lock));
+
+    return (ssize_t) count;
+}
+
+/**
+ *  Write back every dirty chunk, and wait for it to reach the device.
+ */
+    PRIVATE int
+ram_flush (dev)
+    fat_device_t *dev;      // device to sync.
+{
+    return write_back (dev);
+}
+
+/**
+ *  Zero a region in memory, and pass the discard on to the device. Whole
+ *  chunks no longer need writing back; partly covered ones are marked
+ *  dirty, so that the zeroes reach the device.
+ */
+    PRIVATE int
+ram_discard (dev, offset, length)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of the region.
+    off_t length;           // length of the region.
+{
+    struct ram_state *state = RAM_STATE (dev);
+    size_t count = clip (dev, offset, (size_t) length);
+    off_t end = offset + count;
+    int retval;
+
+    pthread_mutex_lock (&(state->lock));
+
+    if ((retval = load_range (dev, offset, count)) != 0)
+    {
+        pthread_mutex_unlock (&(state->lock));
+        return retval;
+    }
+
+    memset (state->image + offset, 0, count);
+    mark_range (state->dirty, offset, count);
+
+    for (size_t i = CHUNK (offset + RAM_CHUNK_SIZE - 1);
+      (i < state->nr_chunks) && ((off_t) (i + 1) * RAM_CHUNK_SIZE <= end);
+      i ++)
+    {
+        CLEAR_BIT (state->dirty, i);
+    }
+
+    pthread_mutex_unlock (&(state->lock));
+
+    return dev_file_discard (dev, offset, (off_t) count);
+}
+
+/**
+ *  Return a pointer into the in memory copy. When file data may be
+ *  dropped from memory, only the metadata can be accessed this way,
+ *  since a pointer to file data could be left dangling.
+ */
+    PRIVATE void *
+ram_map (dev, offset, count)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of the region.
+    size_t count;           // length of the region.
+{
+    struct ram_state *state = RAM_STATE (dev);
+    int retval;
+
+    if (offset + (off_t) count > dev->size)
+        return NULL;
+
+    if ((state->meta_only == true) && (offset + (off_t) count >
+          dev->meta_end))
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock (&(state->lock));
+    retval = load_range (dev, offset, count);
+    pthread_mutex_unlock (&(state->lock));
+
+    return (retval == 0) ? state->image + offset : NULL;
+}
+
+/**
+ *  Record that a region of a mapping has been modified in place.
+ */
+    PRIVATE void
+ram_dirty (dev, offset, count)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of the modified region.
+    size_t count;           // length of the region.
+{
+    struct ram_state *state = RAM_STATE (dev);
+
+    pthread_mutex_lock (&(state->lock));
+    mark_range (state->dirty, offset, clip (dev, offset, count));
+    pthread_mutex_unlock (&(state->lock));
+}
+
+/**
+ *  Regions that are about to be used are loaded in advance. Other hints
+ *  make no difference to a volume held in memory.
+ */
+    PRIVATE void
+ram_advise (dev, offset, length, advice)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of the region.
+    size_t length;          // length of the region.
+    int advice;             // one of the DEV_ADV_* constants.
+{
+    struct ram_state *state = RAM_STATE (dev);
+
+    if (advice != DEV_ADV_WILLNEED)
+        return;
+
+    pthread_mutex_lock (&(state->lock));
+    load_range (dev, offset, clip (dev, offset, length));
+    pthread_mutex_unlock (&(state->lock));
+}
+
+/**
+ *  Clip a transfer so that it does not run past the end of the volume.
+ */
+    PRIVATE size_t
+clip (dev, offset, count)
+    const fat_device_t *dev;    // device concerned.
+    off_t offset;               // start of transfer.
+    size_t count;               // requested length.
+{
+    if (offset >= dev->size)
+        return 0;
+
+    if ((off_t) count > dev->size - offset)
+        return (size_t) (dev->size - offset);
+
+    return count;
+}
+
+/**
+ *  Make sure that every chunk overlapping a region is resident, reading
+ *  runs of missing chunks from the device, and mark them as recently
+ *  used. Called with the lock held.
+ *
+ *  Return value is 0 on success, or a negative errno.
+ */
+    PRIVATE int
+load_range (dev, offset, count)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of the region.
+    size_t count;           // length of the region.
+{
+    struct ram_state *state = RAM_STATE (dev);
+    size_t first, last, run;
+    off_t start;
+    ssize_t n;
+    int retval;
+
+    if (count == 0)
+        return 0;
+
+    first = CHUNK (offset);
+    last = CHUNK (offset + count - 1);
+
+    for (size_t i = first; i <= last; i += run)
+    {
+        SET_BIT (state->referenced, i);
+        run = 1;
+
+        if (TEST_BIT (state->present, i))
+        {
+            if ((state->meta_only == true) &&
+              ((off_t) i * RAM_CHUNK_SIZE >= dev->meta_end))
+            {
+                mem_hit (&(state->mem));
+            }
+
+            continue;
+        }
+
+        // find the run of missing chunks starting here, and read it in
+        // one go.
+        while ((i + run <= last) && ((run + 1) * RAM_CHUNK_SIZE <=
+              BULK_IO_SIZE) && !TEST_BIT (state->present, i + run))
+        {
+            run ++;
+        }
+
+        for (size_t j = i; j < i + run; j ++)
+        {
+            if ((retval = make_room (dev, j)) != 0)
+                return retval;
+        }
+
+        start = (off_t) i * RAM_CHUNK_SIZE;
+        n = pread_backend.read (dev, start, state->image + start,
+          clip (dev, start, run * RAM_CHUNK_SIZE));
+
+        if (n < 0)
+            return (int) n;
+
+        for (size_t j = i; j < i + run; j ++)
+        {
+            SET_BIT (state->present, j);
+            SET_BIT (state->referenced, j);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ *  Before a chunk of file data is loaded, when only metadata is pinned,
+ *  find it a slot among the resident chunks. Once all slots are taken,
+ *  or the memory accountant will not allow any more, a clock sweep picks
+ *  a chunk that has not been used recently, which is written back if
+ *  need be, and dropped. Chunks found to hold metadata (those loaded
+ *  before the volume layout was known) are kept, but no longer take up a
+ *  slot. Called with the lock held.
+ *
+ *  Return value is 0 on success, or a negative errno.
+ */
+    PRIVATE int
+make_room (dev, chunk)
+    fat_device_t *dev;      // device concerned.
+    size_t chunk;           // chunk about to be loaded.
+{
+    struct ram_state *state = RAM_STATE (dev);
+    size_t victim;
+    off_t start;
+    ssize_t n;
+
+    if ((state->meta_only == false) ||
+      ((off_t) chunk * RAM_CHUNK_SIZE < dev->meta_end))
+    {
+        return 0;
+    }
+
+    if (state->nr_resident < MIN_RESIDENT)
+    {
+        state->resident [state->nr_resident ++] = chunk;
+        return 0;
+    }
+
+    mem_miss (&(state->mem), chunk);
+
+    if ((state->nr_resident < state->max_resident) &&
+      (mem_charge (&(state->mem), RAM_CHUNK_SIZE) == true))
+    {
+        state->resident [state->nr_resident ++] = chunk;
+        return 0;
+    }
+
+    while (true)
+    {
+        state->hand %= state->nr_resident;
+        victim = state->resident [state->hand];
+        start = (off_t) victim * RAM_CHUNK_SIZE;
+
+        if ((start >= dev->meta_end) && TEST_BIT (state->referenced,
+              victim))
+        {
+            // give it a second chance.
+            CLEAR_BIT (state->referenced, victim);
+            state->hand += 1;
+            continue;
+        }
+
+        break;
+    }
+
+    if ((start >= dev->meta_end) && TEST_BIT (state->dirty, victim))
+    {
+        n = pread_backend.write (dev, start, state->image + start,
+          clip (dev, start, RAM_CHUNK_SIZE));
+
+        if (n < 0)
+            return (int) n;
+
+        CLEAR_BIT (state->dirty, victim);
+    }
+
+    if (start >= dev->meta_end)
+    {
+        madvise (state->image + start, RAM_CHUNK_SIZE, MADV_DONTNEED);
+        CLEAR_BIT (state->present, victim);
+        mem_evicted (&(state->mem), victim, RAM_CHUNK_SIZE);
+    }
+
+    state->resident [state->hand] = chunk;
+    state->hand += 1;
+
+    return 0;
+}
+
+/**
+ *  Called by the memory accountant to reduce the file data held in
+ *  memory. Clean chunks are dropped, starting with the most recently
+ *  loaded; dirty ones are left for the write back thread, as we may not
+ *  block here. Gives up straight away if the device is in use.
+ *
+ *  Return value is the number of bytes released.
+ */
+    PRIVATE size_t
+ram_shrink (mem, nbytes)
+    mem_cache_t *mem;       // the device's accounting structure.
+    size_t nbytes;          // bytes to release.
+{
+    fat_device_t *dev = mem->priv;
+    struct ram_state *state = RAM_STATE (dev);
+    size_t freed = 0, victim;
+    off_t start;
+
+    if (pthread_mutex_trylock (&(state->lock)) != 0)
+        return 0;
+
+    for (size_t i = state->nr_resident; (i > 0) && (freed < nbytes) &&
+      (state->nr_resident > MIN_RESIDENT); i --)
+    {
+        victim = state->resident [i - 1];
+        start = (off_t) victim * RAM_CHUNK_SIZE;
+
+        if ((start >= dev->meta_end) && TEST_BIT (state->dirty, victim))
+            continue;
+
+        // metadata chunks stay resident, but give up their slot.
+        if (start >= dev->meta_end)
+        {
+            madvise (state->image + start, RAM_CHUNK_SIZE, MADV_DONTNEED);
+            CLEAR_BIT (state->present, victim);
+            mem_evicted (mem, victim, RAM_CHUNK_SIZE);
+        }
+
+        state->resident [i - 1] = state->resident [-- state->nr_resident];
+        freed += RAM_CHUNK_SIZE;
+    }
+
+    pthread_mutex_unlock (&(state->lock));
+    mem_uncharge (mem, freed);
+
+    return freed;
+}
+
+/**
+ *  Set the bits in a chunk bitmap for all chunks overlapping a region.
+ */
+    PRIVATE void
+mark_range (map, offset, count)
+    uint64_t *map;          // bitmap to update.
+    off_t offset;           // start of the region.
+    size_t count;           // length of the region.
+{
+    if (count == 0)
+        return;
+
+    for (size_t i = CHUNK (offset); i <= CHUNK (offset + count - 1); i ++)
+        SET_BIT (map, i);
+}
+
+/**
+ *  Write every dirty chunk back to the device. File data is written and
+ *  synced before the metadata, so that the FAT never refers to clusters
+ *  whose contents have not reached the device.
+ *
+ *  Return value is 0 on success, or a negative errno.
+ */
+    PRIVATE int
+write_back (dev)
+    fat_device_t *dev;      // device to write back.
+{
+    struct ram_state *state = RAM_STATE (dev);
+    size_t meta_chunks = CHUNK (dev->meta_end + RAM_CHUNK_SIZE - 1);
+    bool wrote_data = false, wrote_meta = false;
+    struct timespec deadline;
+    int retval;
+
+    pthread_mutex_lock (&(state->flush_lock));
+
+    // file data gives way to reads, up to the deadline; the metadata is
+    // written straight out.
+    sched_deadline (&deadline);
+    retval = write_back_chunks (dev, meta_chunks, state->nr_chunks,
+      &deadline, &wrote_data);
+
+    if ((retval == 0) && (wrote_data == true))
+        retval = pread_backend.flush (dev);
+
+    if (retval == 0)
+        retval = write_back_chunks (dev, 0, meta_chunks, NULL, &wrote_meta);
+
+    if ((retval == 0) && (wrote_meta == true))
+        retval = pread_backend.flush (dev);
+
+    pthread_mutex_unlock (&(state->flush_lock));
+
+    return retval;
+}
+
+/**
+ *  Write back the dirty chunks in the range [first, last). Runs of dirty
+ *  chunks, of up to SCHED_WRITE_SLICE bytes, are copied into the bounce
+ *  buffer while holding the lock, and written out after releasing it, so
+ *  that writers are not held up by device IO. Given a deadline, each run
+ *  waits for reads in flight to finish before it is written. Called with
+ *  the flush lock held.
+ *
+ *  Return value is 0 on success, or a negative errno.
+ */
+    PRIVATE int
+write_back_chunks (dev, first, last, deadline, wrote)
+    fat_device_t *dev;      // device to write back.
+    size_t first;           // first chunk to consider.
+    size_t last;            // end of the range, exclusive.
+    const struct timespec *deadline;    // give way to reads until this.
+    bool *wrote;            // set to true if anything was written.
+{
+    struct ram_state *state = RAM_STATE (dev);
+    size_t i = first, run, length;
+    off_t start;
+    ssize_t n;
+
+    pthread_mutex_lock (&(state->lock));
+
+    while (i < last)
+    {
+        // skip quickly over clean words of the bitmap.
+        if (((i % BITS_PER_WORD) == 0) &&
+          (state->dirty [i / BITS_PER_WORD] == 0))
+        {
+            i += BITS_PER_WORD;
+            continue;
+        }
+
+        if (!TEST_BIT (state->dirty, i))
+        {
+            i ++;
+            continue;
+        }
+
+        for (run = 0; (i + run < last) && ((run + 1) * RAM_CHUNK_SIZE <=
+              SCHED_WRITE_SLICE) && TEST_BIT (state->dirty, i + run); run ++)
+        {
+            CLEAR_BIT (state->dirty, i + run);
+        }
+
+        start = (off_t) i * RAM_CHUNK_SIZE;
+        length = clip (dev, start, run * RAM_CHUNK_SIZE);
+        memcpy (state->bounce, state->image + start, length);
+        pthread_mutex_unlock (&(state->lock));
+
+        if (deadline != NULL)
+            sched_give_way (dev, deadline);
+
+        n = pread_backend.write (dev, start, state->bounce, length);
+        pthread_mutex_lock (&(state->lock));
+
+        if (n < 0)
+        {
+            // leave the chunks dirty, so they are tried again later.
+            mark_range (state->dirty, start, length);
+            pthread_mutex_unlock (&(state->lock));
+
+            return (int) n;
+        }
+
+        *wrote = true;
+        i += run;
+    }
+
+    pthread_mutex_unlock (&(state->lock));
+
+    return 0;
+}
+
+/**
+ *  Body of the write back thread. Wakes up every interval seconds to
+ *  write back dirty chunks, until told to stop by ram_close.
+ */
+    PRIVATE void *
+writer_main (arg)
+    void *arg;              // the device.
+{
+    fat_device_t *dev = arg;
+    struct ram_state *state = RAM_STATE (dev);
+    struct timespec deadline;
+    int retval;
+
+    pthread_mutex_lock (&(state->lock));
+
+    while (state->stopping == false)
+    {
+        clock_gettime (CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += state->interval;
+
+        while ((state->stopping == false) && (pthread_cond_timedwait (
+              &(state->wakeup), &(state->lock), &deadline) != ETIMEDOUT))
+        {
+            // spurious wake up; go back to sleep.
+        }
+
+        if (state->stopping == true)
+            break;
+
+        pthread_mutex_unlock (&(state->lock));
+
+        if ((retval = write_back (dev)) != 0)
+            warnx ("Write back failed: %s", strerror (-retval));
+
+        pthread_mutex_lock (&(state->lock));
+    }
+
+    pthread_mutex_unlock (&(state->lock));
+
+    return NULL;
+}
+
+
+// vim: ts=4 sw=4 et
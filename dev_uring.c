@@ -0,0 +1,486 @@
+/**
+ *  dev_uring.c
+ *
+ *  Device backend built on the Linux io_uring interface. Single reads and
+ *  writes gain little over pread, but batches given to dev_submit are
+ *  queued on the submission ring with a single system call, and all of
+ *  them are in flight on the device at once, rather than one at a time.
+ *
+ *  The rings are driven directly with the raw system calls, so there is
+ *  no dependency on liburing. If the kernel does not support io_uring
+ *  (or it has been disabled), opening the backend fails, and the device
+ *  layer falls back on pread.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "fat.h"
+#include "device.h"
+
+#if defined (__NR_io_uring_setup) && __has_include (<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+
+// backend operations.
+PRIVATE int uring_open (fat_device_t *dev, const char *path);
+
+#ifdef HAVE_IO_URING
+
+// Pointers into the shared submission and completion rings, which are
+// mapped from the kernel when the ring is created.
+struct uring_state
+{
+    int                     ring_fd;
+    unsigned int            entries;
+
+    // submission queue.
+    unsigned int            *sq_head;
+    unsigned int            *sq_tail;
+    unsigned int            *sq_mask;
+    unsigned int            *sq_array;
+    struct io_uring_sqe     *sqes;
+
+    // completion queue.
+    unsigned int            *cq_head;
+    unsigned int            *cq_tail;
+    unsigned int            *cq_mask;
+    struct io_uring_cqe     *cqes;
+
+    // mappings, for unmapping at close.
+    void                    *sq_ring;
+    void                    *cq_ring;
+    size_t                  sq_ring_size;
+    size_t                  cq_ring_size;
+
+    // only one thread at a time may drive the rings.
+    pthread_mutex_t         lock;
+};
+
+#define URING_STATE(dev)    ((struct uring_state *) (dev)->priv)
+
+
+PRIVATE void uring_close (fat_device_t *dev);
+PRIVATE ssize_t uring_read (fat_device_t *dev, off_t offset, void *buf,
+  size_t count);
+PRIVATE ssize_t uring_write (fat_device_t *dev, off_t offset,
+  const void *buf, size_t count);
+PRIVATE int uring_flush (fat_device_t *dev);
+PRIVATE int uring_submit (fat_device_t *dev, dev_request_t *reqs,
+  unsigned int nr_reqs);
+
+// local functions.
+PRIVATE int setup_rings (struct uring_state *state);
+PRIVATE int run_batch (fat_device_t *dev, dev_request_t *reqs,
+  unsigned int nr_reqs);
+PRIVATE void queue_request (fat_device_t *dev, dev_request_t *req,
+  struct iovec *iov, unsigned int tag);
+PRIVATE ssize_t single_request (fat_device_t *dev, int op, off_t offset,
+  void *buf, size_t count);
+
+
+PUBLIC const struct dev_backend uring_backend =
+{
+    .name       = "uring",
+    .open       = uring_open,
+    .close      = uring_close,
+    .read       = uring_read,
+    .write      = uring_write,
+    .flush      = uring_flush,
+    .discard    = dev_file_discard,
+    .copy       = dev_file_copy,
+    .submit     = uring_submit,
+};
+
+
+/**
+ *  Open the device file, and set up a ring for it.
+ */
+    PRIVATE int
+uring_open (dev, path)
+    fat_device_t *dev;      // device being opened.
+    const char *path;       // device file name.
+{
+    struct uring_state *state;
+    int retval;
+
+    if ((retval = dev_open_file (dev, path, 0)) != 0)
+        return retval;
+
+    state = safe_malloc (sizeof (struct uring_state));
+    memset (state, 0, sizeof (struct uring_state));
+
+    if ((retval = setup_rings (state)) != 0)
+    {
+        safe_free ((void **) &state);
+        return retval;
+    }
+
+    pthread_mutex_init (&(state->lock), NULL);
+    dev->priv = state;
+
+    return 0;
+}
+
+/**
+ *  Tear down the rings.
+ */
+    PRIVATE void
+uring_close (dev)
+    fat_device_t *dev;      // device being closed.
+{
+    struct uring_state *state = URING_STATE (dev);
+
+    munmap (state->sqes, state->entries * sizeof (struct io_uring_sqe));
+
+    if (state->cq_ring != state->sq_ring)
+        munmap (state->cq_ring, state->cq_ring_size);
+
+    munmap (state->sq_ring, state->sq_ring_size);
+    close (state->ring_fd);
+    pthread_mutex_destroy (&(state->lock));
+    safe_free ((void **) &(dev->priv));
+}
+
+/**
+ *  Read through the ring, resubmitting after short reads.
+ */
+    PRIVATE ssize_t
+uring_read (dev, offset, buf, count)
+    fat_device_t *dev;      // device to read from.
+    off_t offset;           // device offset.
+    void *buf;              // buffer to fill.
+    size_t count;           // bytes to read.
+{
+    return single_request (dev, DEV_OP_READ, offset, buf, count);
+}
+
+/**
+ *  Write through the ring, resubmitting after short writes.
+ */
+    PRIVATE ssize_t
+uring_write (dev, offset, buf, count)
+    fat_device_t *dev;      // device to write to.
+    off_t offset;           // device offset.
+    const void *buf;        // data to write.
+    size_t count;           // bytes to write.
+{
+    return single_request (dev, DEV_OP_WRITE, offset, (void *) buf, count);
+}
+
+/**
+ *  Flush the device's write cache.
+ */
+    PRIVATE int
+uring_flush (dev)
+    fat_device_t *dev;      // device to flush.
+{
+    dev_request_t req = { DEV_OP_FLUSH, 0, NULL, 0, 0 };
+
+    uring_submit (dev, &req, 1);
+
+    return (int) req.result;
+}
+
+/**
+ *  Submit a batch of requests. The batch is split up into chunks that
+ *  fit in the submission ring, and each chunk is submitted with one
+ *  system call, which also waits for every request in it to complete.
+ */
+    PRIVATE int
+uring_submit (dev, reqs, nr_reqs)
+    fat_device_t *dev;          // device to submit to.
+    dev_request_t *reqs;        // requests.
+    unsigned int nr_reqs;       // number of requests.
+{
+    struct uring_state *state = URING_STATE (dev);
+    unsigned int chunk;
+    int retval = 0;
+
+    pthread_mutex_lock (&(state->lock));
+
+    for ( ; (nr_reqs > 0) && (retval == 0); nr_reqs -= chunk, reqs += chunk)
+    {
+        chunk = MIN (nr_reqs, state->entries);
+        retval = run_batch (dev, reqs, chunk);
+    }
+
+    pthread_mutex_unlock (&(state->lock));
+
+    return retval;
+}
+
+/**
+ *  Create the ring, and map the submission queue, completion queue and
+ *  submission entries into our address space.
+ *
+ *  Return value is 0 on success, or a negative errno.
+ */
+    PRIVATE int
+setup_rings (state)
+    struct uring_state *state;  // state to fill in.
+{
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+
+    memset (&p, 0, sizeof (p));
+
+    if ((state->ring_fd = (int) syscall (__NR_io_uring_setup, URING_ENTRIES,
+            &p)) < 0)
+    {
+        return -errno;
+    }
+
+    state->entries = p.sq_entries;
+    state->sq_ring_size = p.sq_off.array + p.sq_entries *
+        sizeof (unsigned int);
+    state->cq_ring_size = p.cq_off.cqes + p.cq_entries *
+        sizeof (struct io_uring_cqe);
+
+    // newer kernels let both rings share one mapping.
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0)
+    {
+        state->sq_ring_size = MAX (state->sq_ring_size, state->cq_ring_size);
+        state->cq_ring_size = state->sq_ring_size;
+    }
+
+    sq = mmap (NULL, state->sq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, state->ring_fd, IORING_OFF_SQ_RING);
+
+    if (sq == MAP_FAILED)
+        goto fail;
+
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0)
+    {
+        cq = sq;
+    }
+    else
+    {
+        cq = mmap (NULL, state->cq_ring_size, PROT_READ | PROT_WRITE,
+          MAP_SHARED | MAP_POPULATE, state->ring_fd, IORING_OFF_CQ_RING);
+
+        if (cq == MAP_FAILED)
+        {
+            munmap (sq, state->sq_ring_size);
+            goto fail;
+        }
+    }
+
+    state->sqes = mmap (NULL, p.sq_entries * sizeof (struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, state->ring_fd,
+      IORING_OFF_SQES);
+
+    if (state->sqes == MAP_FAILED)
+    {
+        if (cq != sq)
+            munmap (cq, state->cq_ring_size);
+
+        munmap (sq, state->sq_ring_size);
+        goto fail;
+    }
+
+    state->sq_ring = sq;
+    state->cq_ring = cq;
+    state->sq_head = (unsigned int *) (sq + p.sq_off.head);
+    state->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+    state->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+    state->sq_array = (unsigned int *) (sq + p.sq_off.array);
+    state->cq_head = (unsigned int *) (cq + p.cq_off.head);
+    state->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+    state->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    return 0;
+
+fail:
+    close (state->ring_fd);
+    return -errno;
+}
+
+/**
+ *  Queue up to one ring's worth of requests, submit them, and reap all
+ *  the completions. Must be called with the ring locked.
+ *
+ *  Return value is 0 on success, or a negative errno if the ring itself
+ *  failed. Errors from individual requests are stored in their results.
+ */
+    PRIVATE int
+run_batch (dev, reqs, nr_reqs)
+    fat_device_t *dev;          // device concerned.
+    dev_request_t *reqs;        // requests to submit.
+    unsigned int nr_reqs;       // no more than the ring size.
+{
+    struct uring_state *state = URING_STATE (dev);
+    struct iovec iov [URING_ENTRIES];
+    unsigned int queued = 0, reaped = 0, head;
+    struct io_uring_cqe *cqe;
+    int n;
+
+    // discards cannot be done through the ring; do those synchronously,
+    // and queue everything else.
+    for (unsigned int i = 0; i < nr_reqs; i ++)
+    {
+        if (reqs [i].op == DEV_OP_DISCARD)
+        {
+            reqs [i].result = dev_file_discard (dev, reqs [i].offset,
+              (off_t) reqs [i].count);
+            continue;
+        }
+
+        queue_request (dev, &(reqs [i]), &(iov [i]), i);
+        queued += 1;
+    }
+
+    // publish the new tail to the kernel, submit, and wait for all the
+    // completions. io_uring_enter may return before all have arrived, in
+    // which case we go around again.
+    while (reaped < queued)
+    {
+        n = (int) syscall (__NR_io_uring_enter, state->ring_fd,
+          (reaped == 0) ? queued : 0, queued - reaped,
+          IORING_ENTER_GETEVENTS, NULL, 0);
+
+        if ((n < 0) && (errno != EINTR))
+            return -errno;
+
+        head = *(state->cq_head);
+
+        while (head != __atomic_load_n (state->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            cqe = &(state->cqes [head & *(state->cq_mask)]);
+            reqs [cqe->user_data].result = cqe->res;
+            head += 1;
+            reaped += 1;
+        }
+
+        __atomic_store_n (state->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+/**
+ *  Fill in a submission queue entry for a request, and add it to the
+ *  tail of the submission ring. The entry is tagged with the request's
+ *  index in its batch, which comes back in the completion.
+ */
+    PRIVATE void
+queue_request (dev, req, iov, tag)
+    fat_device_t *dev;          // device concerned.
+    dev_request_t *req;         // request to queue.
+    struct iovec *iov;          // storage for the request's iovec.
+    unsigned int tag;           // index in the batch.
+{
+    struct uring_state *state = URING_STATE (dev);
+    unsigned int tail = *(state->sq_tail);
+    unsigned int index = tail & *(state->sq_mask);
+    struct io_uring_sqe *sqe = &(state->sqes [index]);
+
+    memset (sqe, 0, sizeof (struct io_uring_sqe));
+    sqe->fd = dev->fd;
+    sqe->user_data = tag;
+
+    switch (req->op)
+    {
+    case DEV_OP_READ:
+    case DEV_OP_WRITE:
+        iov->iov_base = req->buf;
+        iov->iov_len = req->count;
+        sqe->opcode = (req->op == DEV_OP_READ) ? IORING_OP_READV :
+            IORING_OP_WRITEV;
+        sqe->off = (uint64_t) req->offset;
+        sqe->addr = (uint64_t) (uintptr_t) iov;
+        sqe->len = 1;
+        break;
+
+    case DEV_OP_FLUSH:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    }
+
+    state->sq_array [index] = index;
+    __atomic_store_n (state->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ *  Carry out a single read or write through the ring, resubmitting the
+ *  remainder after a short transfer.
+ *
+ *  Return value is the number of bytes transferred, or a negative errno.
+ */
+    PRIVATE ssize_t
+single_request (dev, op, offset, buf, count)
+    fat_device_t *dev;      // device concerned.
+    int op;                 // DEV_OP_READ or DEV_OP_WRITE.
+    off_t offset;           // device offset.
+    void *buf;              // buffer.
+    size_t count;           // bytes to transfer.
+{
+    dev_request_t req;
+    size_t total = 0;
+    int retval;
+
+    while (total < count)
+    {
+        req.op = op;
+        req.offset = offset + total;
+        req.buf = (char *) buf + total;
+        req.count = count - total;
+
+        if ((retval = uring_submit (dev, &req, 1)) != 0)
+            return retval;
+
+        if (req.result == -EINTR)
+            continue;
+
+        if (req.result < 0)
+            return req.result;
+
+        if (req.result == 0)
+            break;
+
+        total += req.result;
+    }
+
+    return (ssize_t) total;
+}
+
+#else // HAVE_IO_URING
+
+// without kernel support for io_uring, the backend exists, but can never
+// be opened.
+PUBLIC const struct dev_backend uring_backend =
+{
+    .name       = "uring",
+    .open       = uring_open,
+};
+
+
+/**
+ *  io_uring is not available on this host.
+ */
+    PRIVATE int
+uring_open (dev, path)
+    fat_device_t *dev;      // device being opened.
+    const char *path;       // device file name.
+{
+    return -ENOSYS;
+}
+
+#endif // HAVE_IO_URING
+
+
+// vim: ts=4 sw=4 et
@@ -0,0 +1,699 @@
+/**
+ *  device.c
+ *
+ *  Implementation of the procedures declared in device.h. This is the
+ *  generic half of the device layer: it selects a backend at mount time,
+ *  dispatches requests to it, and supplies fallback implementations of
+ *  any optional operations that a backend leaves out. Errors from the
+ *  backend are treated the same way as by the safe_* wrappers in utils.c,
+ *  by aborting the daemon.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <err.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "fat.h"
+#include "device.h"
+#include "iosched.h"
+
+
+// local functions.
+PRIVATE const struct dev_backend * default_backend (const char *path);
+PRIVATE ssize_t generic_readv (fat_device_t *dev, off_t offset,
+  const struct iovec *iov, int iovcnt, bool writing);
+PRIVATE ssize_t generic_request (fat_device_t *dev, dev_request_t *req);
+PRIVATE ssize_t generic_copy (fat_device_t *dev, off_t from, off_t to,
+  size_t count);
+
+
+// table of all backends, which may be selected by name at mount time.
+PRIVATE const struct dev_backend *backends [] =
+{
+    &pread_backend,
+    &direct_backend,
+    &mmap_backend,
+    &uring_backend,
+    &memory_backend,
+    &ram_backend,
+    &overlay_backend,
+    NULL
+};
+
+
+/**
+ *  Open a device using a given backend. If no backend is named, mapped
+ *  access is used for image files, and pread for block devices. Giving
+ *  an overlay file selects the overlay backend. If the chosen backend
+ *  cannot be used on this device, we fall back to pread.
+ *
+ *  Return value is the new device. Aborts on failure.
+ */
+    PUBLIC fat_device_t *
+dev_open (path, params)
+    const char *path;               // device or image file name.
+    const dev_params_t *params;     // tunables, or NULL for defaults.
+{
+    fat_device_t *dev = safe_malloc (sizeof (fat_device_t));
+    const struct dev_backend *backend;
+    dev_params_t defaults;
+    int retval;
+
+    if (params == NULL)
+    {
+        memset (&defaults, 0, sizeof (dev_params_t));
+        params = &defaults;
+    }
+
+    memset (dev, 0, sizeof (fat_device_t));
+    dev->fd = -1;
+    dev->block_size = DEV_BLOCK_SIZE;
+    dev->params = *params;
+
+    if (params->overlay != NULL)
+    {
+        backend = &overlay_backend;
+
+        if ((params->backend != NULL) &&
+          (strcmp (params->backend, overlay_backend.name) != 0))
+            errx (1, "The %s backend cannot be used with an overlay",
+              params->backend);
+    }
+    else if (params->backend == NULL)
+    {
+        backend = default_backend (path);
+    }
+    else if ((backend = dev_find_backend (params->backend)) == NULL)
+    {
+        errx (1, "Unknown device backend \"%s\"", params->backend);
+    }
+
+    dev->ops = backend;
+
+    if ((retval = backend->open (dev, path)) == 0)
+    {
+        sched_init (dev);
+        return dev;
+    }
+
+    // the backend could not be used. Any backend that works on a device
+    // file at all will work with pread. An overlay must not fall back,
+    // as pread would write to the device it was meant to protect.
+    if ((backend == &pread_backend) || (backend == &overlay_backend))
+        err (-retval, "Couldn't open %s", path);
+
+    warnx ("%s backend unavailable for %s (%s), using pread",
+      backend->name, path, strerror (-retval));
+
+    if ((dev->priv != NULL) && (backend->close != NULL))
+        backend->close (dev);
+
+    if (dev->fd != -1)
+        close (dev->fd);
+
+    memset (dev, 0, sizeof (fat_device_t));
+    dev->fd = -1;
+    dev->block_size = DEV_BLOCK_SIZE;
+    dev->params = *params;
+    dev->ops = &pread_backend;
+
+    if ((retval = pread_backend.open (dev, path)) != 0)
+        err (-retval, "Couldn't open %s", path);
+
+    sched_init (dev);
+
+    return dev;
+}
+
+/**
+ *  Start the backend's background activity, if it has any. Threads do not
+ *  survive the fork when the daemon detaches, so this is done from the
+ *  FUSE init method, rather than by dev_open.
+ */
+    PUBLIC void
+dev_start (dev)
+    fat_device_t *dev;      // device being started.
+{
+    int retval;
+
+    if (dev->ops->start == NULL)
+        return;
+
+    if ((retval = dev->ops->start (dev)) != 0)
+        err (-retval, "Couldn't start %s backend", dev->ops->name);
+}
+
+/**
+ *  Flush any outstanding writes, and release the device.
+ */
+    PUBLIC void
+dev_close (dev)
+    fat_device_t *dev;      // device being closed.
+{
+    dev_sync (dev);
+
+    if (dev->ops->close != NULL)
+        dev->ops->close (dev);
+
+    if (dev->fd != -1)
+        safe_close ("device", dev->fd);
+
+    sched_close (dev);
+    safe_free ((void **) &dev);
+}
+
+/**
+ *  Read count bytes from the device, starting at a given byte offset.
+ *
+ *  Reads are counted as in flight while they are done, so that bulk
+ *  write back gives way to them.
+ *
+ *  Return value is the number of bytes read, which will be less than
+ *  count if the read goes past the end of the device.
+ */
+    PUBLIC size_t
+dev_read (dev, offset, buf, count)
+    fat_device_t *dev;      // device to read from.
+    off_t offset;           // device offset, in bytes.
+    void *buf;              // buffer to store the data.
+    size_t count;           // number of bytes to read.
+{
+    ssize_t nread;
+
+    sched_read_begin (dev);
+    nread = dev->ops->read (dev, offset, buf, count);
+    sched_read_end (dev);
+
+    if (nread < 0)
+        err (-nread, "Error reading from device");
+
+    return (size_t) nread;
+}
+
+/**
+ *  Write count bytes to the device, starting at a given byte offset.
+ *
+ *  Return value is the number of bytes written.
+ */
+    PUBLIC size_t
+dev_write (dev, offset, buf, count)
+    fat_device_t *dev;      // device to write to.
+    off_t offset;           // device offset, in bytes.
+    const void *buf;        // data to write.
+    size_t count;           // number of bytes to write.
+{
+    ssize_t nwritten;
+
+    if ((nwritten = dev->ops->write (dev, offset, buf, count)) < 0)
+        err (-nwritten, "Error writing to device");
+
+    return (size_t) nwritten;
+}
+
+/**
+ *  Vectored read. The buffers are filled in order from consecutive
+ *  device offsets, starting at offset.
+ */
+    PUBLIC size_t
+dev_readv (dev, offset, iov, iovcnt)
+    fat_device_t *dev;          // device to read from.
+    off_t offset;               // device offset of the first buffer.
+    const struct iovec *iov;    // list of buffers.
+    int iovcnt;                 // number of buffers.
+{
+    ssize_t nread;
+
+    sched_read_begin (dev);
+
+    if (dev->ops->readv != NULL)
+    {
+        nread = dev->ops->readv (dev, offset, iov, iovcnt);
+    }
+    else
+    {
+        nread = generic_readv (dev, offset, iov, iovcnt, false);
+    }
+
+    sched_read_end (dev);
+
+    if (nread < 0)
+        err (-nread, "Error reading from device");
+
+    return (size_t) nread;
+}
+
+/**
+ *  Vectored write. The buffers are written in order to consecutive
+ *  device offsets, starting at offset.
+ */
+    PUBLIC size_t
+dev_writev (dev, offset, iov, iovcnt)
+    fat_device_t *dev;          // device to write to.
+    off_t offset;               // device offset of the first buffer.
+    const struct iovec *iov;    // list of buffers.
+    int iovcnt;                 // number of buffers.
+{
+    ssize_t nwritten;
+
+    if (dev->ops->writev != NULL)
+    {
+        nwritten = dev->ops->writev (dev, offset, iov, iovcnt);
+    }
+    else
+    {
+        nwritten = generic_readv (dev, offset, iov, iovcnt, true);
+    }
+
+    if (nwritten < 0)
+        err (-nwritten, "Error writing to device");
+
+    return (size_t) nwritten;
+}
+
+/**
+ *  Submit a batch of requests to the device. Backends that can have
+ *  several requests in flight at once (io_uring) will do so; otherwise
+ *  they are simply carried out one after another.
+ *
+ *  Return value is 0 once all requests have completed. The outcome of
+ *  each individual request is stored in its result field.
+ */
+    PUBLIC int
+dev_submit (dev, reqs, nr_reqs)
+    fat_device_t *dev;          // device to submit to.
+    dev_request_t *reqs;        // array of requests.
+    unsigned int nr_reqs;       // number of requests.
+{
+    if (dev->ops->submit != NULL)
+        return dev->ops->submit (dev, reqs, nr_reqs);
+
+    for (unsigned int i = 0; i < nr_reqs; i ++)
+        reqs [i].result = generic_request (dev, &(reqs [i]));
+
+    return 0;
+}
+
+/**
+ *  Copy a region of the device to another place on it. Backends working
+ *  on a device file can have the host copy the data, which may not need
+ *  to read it at all; if the host can't, or the backend has no copy
+ *  procedure, the data is copied through memory.
+ *
+ *  Return value is the number of bytes copied, which will be less than
+ *  count if either region runs past the end of the device.
+ */
+    PUBLIC size_t
+dev_copy (dev, from, to, count)
+    fat_device_t *dev;      // device concerned.
+    off_t from;             // start of the region to copy.
+    off_t to;               // where to copy it to.
+    size_t count;           // length of the region.
+{
+    ssize_t ncopied = -EOPNOTSUPP;
+
+    if (dev->ops->copy != NULL)
+        ncopied = dev->ops->copy (dev, from, to, count);
+
+    if ((ncopied == -EOPNOTSUPP) || (ncopied == -EXDEV) ||
+      (ncopied == -EINVAL) || (ncopied == -ENOSYS))
+    {
+        ncopied = generic_copy (dev, from, to, count);
+    }
+
+    if (ncopied < 0)
+        err (-ncopied, "Error copying on device");
+
+    return (size_t) ncopied;
+}
+
+/**
+ *  Discard a region of the device.
+ */
+    PUBLIC int
+dev_discard (dev, offset, length)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of the region.
+    off_t length;           // length of the region.
+{
+    if (dev->ops->discard == NULL)
+        return -EOPNOTSUPP;
+
+    return dev->ops->discard (dev, offset, length);
+}
+
+/**
+ *  Return a pointer to a region of the volume in memory, so that it can
+ *  be accessed in place. If the backend does not hold the volume in
+ *  memory, the return value is NULL, and the caller must fall back on
+ *  dev_read and dev_write.
+ */
+    PUBLIC void *
+dev_map (dev, offset, count)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of the region.
+    size_t count;           // length of the region.
+{
+    if (dev->ops->map == NULL)
+        return NULL;
+
+    return dev->ops->map (dev, offset, count);
+}
+
+/**
+ *  Record that a region returned by dev_map has been modified in place.
+ */
+    PUBLIC void
+dev_dirty (dev, offset, count)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of the modified region.
+    size_t count;           // length of the region.
+{
+    if (dev->ops->dirty != NULL)
+        dev->ops->dirty (dev, offset, count);
+}
+
+/**
+ *  Pass a hint about the expected access pattern for a region of the
+ *  device on to the backend. Hints are advisory, so failures are ignored.
+ */
+    PUBLIC void
+dev_advise (dev, offset, length, advice)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of the region.
+    size_t length;          // length of the region.
+    int advice;             // one of the DEV_ADV_* constants.
+{
+    if (dev->ops->advise != NULL)
+        dev->ops->advise (dev, offset, length, advice);
+}
+
+/**
+ *  Make all writes to the device durable.
+ */
+    PUBLIC void
+dev_sync (dev)
+    fat_device_t *dev;      // device to sync.
+{
+    int retval;
+
+    if (dev->ops->flush == NULL)
+        return;
+
+    if ((retval = dev->ops->flush (dev)) != 0)
+        err (-retval, "Error syncing device");
+}
+
+/**
+ *  Find the backend with a given name.
+ *
+ *  Return value is a pointer to the backend, or NULL if there is no such
+ *  backend.
+ */
+    PUBLIC const struct dev_backend *
+dev_find_backend (name)
+    const char *name;       // backend name, eg. "mmap".
+{
+    for (int i = 0; backends [i] != NULL; i ++)
+    {
+        if (strcmp (backends [i]->name, name) == 0)
+            return backends [i];
+    }
+
+    return NULL;
+}
+
+/**
+ *  Open the device file for a backend, and fill in the size, block size,
+ *  preferred IO size and type fields of the device structure.
+ *
+ *  Return value is 0 on success, or a negative errno.
+ */
+    PUBLIC int
+dev_open_file (dev, path, flags)
+    fat_device_t *dev;      // device being opened.
+    const char *path;       // device or image file name.
+    int flags;              // extra open flags, eg. O_DIRECT.
+{
+    struct stat st;
+    uint64_t size;
+    int sector_size;
+    unsigned int io_opt;
+
+    if ((dev->fd = open (path, (dev->read_only ? O_RDONLY : O_RDWR) |
+          flags)) == -1)
+        return -errno;
+
+    if (fstat (dev->fd, &st) != 0)
+        return -errno;
+
+    dev->is_blkdev = (S_ISBLK (st.st_mode) != 0);
+    dev->size = st.st_size;
+
+    // for block devices, the size and logical sector size have to be
+    // asked for.
+    if (dev->is_blkdev == true)
+    {
+        if (ioctl (dev->fd, BLKGETSIZE64, &size) == 0)
+            dev->size = (off_t) size;
+
+        if (ioctl (dev->fd, BLKSSZGET, &sector_size) == 0)
+            dev->block_size = (size_t) sector_size;
+
+        if (ioctl (dev->fd, BLKIOOPT, &io_opt) == 0)
+            dev->io_opt = (size_t) io_opt;
+    }
+
+    return 0;
+}
+
+/**
+ *  Discard a region of a device file. Block devices are sent a discard
+ *  request; for image files, the region is deallocated with a hole punch.
+ *
+ *  Return value is 0 on success, or a negative errno.
+ */
+    PUBLIC int
+dev_file_discard (dev, offset, length)
+    fat_device_t *dev;      // device concerned.
+    off_t offset;           // start of the region.
+    off_t length;           // length of the region.
+{
+    uint64_t range [2];
+
+    if (dev->is_blkdev == true)
+    {
+        range [0] = (uint64_t) offset;
+        range [1] = (uint64_t) length;
+
+        if (ioctl (dev->fd, BLKDISCARD, range) != 0)
+            return -errno;
+
+        return 0;
+    }
+
+    if (fallocate (dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+          offset, length) != 0)
+    {
+        return -errno;
+    }
+
+    return 0;
+}
+
+/**
+ *  Copy a region of a device file with copy_file_range, which lets the
+ *  host file system share the blocks, or the kernel copy them without
+ *  bringing them into user space.
+ *
+ *  Return value is the number of bytes copied, or a negative errno. If
+ *  the host can't copy within the file, nothing has been copied.
+ */
+    PUBLIC ssize_t
+dev_file_copy (dev, from, to, count)
+    fat_device_t *dev;      // device concerned.
+    off_t from;             // start of the region to copy.
+    off_t to;               // where to copy it to.
+    size_t count;           // length of the region.
+{
+    size_t total = 0;
+    ssize_t n;
+
+    while (total < count)
+    {
+        n = copy_file_range (dev->fd, &from, dev->fd, &to, count - total, 0);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // having started, the host can copy the rest too, so a later
+            // failure is a real error.
+            return (total == 0) ? -errno : -EIO;
+        }
+
+        // stop at the end of the device.
+        if (n == 0)
+            break;
+
+        total += (size_t) n;
+    }
+
+    return (ssize_t) total;
+}
+
+/**
+ *  Choose a backend to suit a given device. Image files are mapped into
+ *  memory on 64 bit hosts; anything else is accessed with pread.
+ */
+    PRIVATE const struct dev_backend *
+default_backend (path)
+    const char *path;       // device or image file name.
+{
+#ifdef MMAP_IMAGES
+    struct stat st;
+
+    if ((sizeof (void *) >= 8) && (stat (path, &st) == 0) &&
+      (S_ISREG (st.st_mode) != 0))
+    {
+        return &mmap_backend;
+    }
+#endif
+
+    return &pread_backend;
+}
+
+/**
+ *  Vectored IO built out of plain reads or writes, for backends that do
+ *  not provide readv and writev.
+ */
+    PRIVATE ssize_t
+generic_readv (dev, offset, iov, iovcnt, writing)
+    fat_device_t *dev;          // device concerned.
+    off_t offset;               // device offset of the first buffer.
+    const struct iovec *iov;    // list of buffers.
+    int iovcnt;                 // number of buffers.
+    bool writing;               // true for a write, false for a read.
+{
+    ssize_t total = 0, n;
+
+    for (int i = 0; i < iovcnt; i ++)
+    {
+        if (writing == true)
+        {
+            n = dev->ops->write (dev, offset, iov [i].iov_base,
+              iov [i].iov_len);
+        }
+        else
+        {
+            n = dev->ops->read (dev, offset, iov [i].iov_base,
+              iov [i].iov_len);
+        }
+
+        if (n < 0)
+            return n;
+
+        total += n;
+        offset += n;
+
+        // stop at the end of the device.
+        if ((size_t) n < iov [i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+/**
+ *  Carry out a single request from a batch synchronously.
+ *
+ *  Return value is the result to be stored in the request.
+ */
+    PRIVATE ssize_t
+generic_request (dev, req)
+    fat_device_t *dev;      // device concerned.
+    dev_request_t *req;     // request to carry out.
+{
+    switch (req->op)
+    {
+    case DEV_OP_READ:
+        return dev->ops->read (dev, req->offset, req->buf, req->count);
+
+    case DEV_OP_WRITE:
+        return dev->ops->write (dev, req->offset, req->buf, req->count);
+
+    case DEV_OP_FLUSH:
+        return (dev->ops->flush != NULL) ? dev->ops->flush (dev) : 0;
+
+    case DEV_OP_DISCARD:
+        return dev_discard (dev, req->offset, (off_t) req->count);
+
+    default:
+        return -EINVAL;
+    }
+}
+
+/**
+ *  Copy a region of the device through memory, for backends that have no
+ *  copy procedure, or whose host can't do it for them. Where the volume
+ *  is held in memory it is copied in place; otherwise a BULK_IO_SIZE
+ *  chunk at a time.
+ */
+    PRIVATE ssize_t
+generic_copy (dev, from, to, count)
+    fat_device_t *dev;      // device concerned.
+    off_t from;             // start of the region to copy.
+    off_t to;               // where to copy it to.
+    size_t count;           // length of the region.
+{
+    void *src, *dst, *buf;
+    ssize_t total = 0, n;
+    size_t chunk;
+
+    if (((src = dev_map (dev, from, count)) != NULL) &&
+      ((dst = dev_map (dev, to, count)) != NULL))
+    {
+        memcpy (dst, src, count);
+        dev_dirty (dev, to, count);
+        return (ssize_t) count;
+    }
+
+    buf = safe_malloc (MIN (count, BULK_IO_SIZE));
+
+    while ((size_t) total < count)
+    {
+        chunk = MIN (count - (size_t) total, BULK_IO_SIZE);
+
+        if ((n = dev->ops->read (dev, from + total, buf, chunk)) > 0)
+            n = dev->ops->write (dev, to + total, buf, (size_t) n);
+
+        if (n < 0)
+        {
+            total = n;
+            break;
+        }
+
+        total += n;
+
+        // stop at the end of the device.
+        if ((size_t) n < chunk)
+            break;
+    }
+
+    safe_free ((void **) &buf);
+
+    return total;
+}
+
+
+// vim: ts=4 sw=4 et
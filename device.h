@@ -0,0 +1,231 @@
+/**
+ *  device.h
+ *
+ *  Procedures for reading and writing the device (or image file) that
+ *  hosts a mounted Emphatic volume. All accesses to the underlying
+ *  storage go through these routines, which dispatch to one of several
+ *  interchangeable backends (pread, O_DIRECT, mmap, io_uring, memory,
+ *  overlay). File system code never touches the device file directly.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#ifndef MFATIC_DEVICE_H
+#define MFATIC_DEVICE_H
+
+#include <sys/uio.h>
+
+// needed for the fat_volume_t definition.
+#include "fat.h"
+
+
+// Hints describing how a region of the device is about to be accessed.
+// These are passed on to madvise for mapped images, or posix_fadvise
+// otherwise.
+#define DEV_ADV_NORMAL              0
+#define DEV_ADV_SEQUENTIAL          1
+#define DEV_ADV_RANDOM              2
+#define DEV_ADV_WILLNEED            3
+#define DEV_ADV_DONTNEED            4
+
+// operations that may be submitted as a batch with dev_submit.
+#define DEV_OP_READ                 0
+#define DEV_OP_WRITE                1
+#define DEV_OP_FLUSH                2
+#define DEV_OP_DISCARD              3
+
+
+// One request in a batch given to dev_submit. On completion, result
+// holds the number of bytes transferred, or a negative errno.
+typedef struct dev_request
+{
+    int                 op;
+    off_t               offset;
+    void                *buf;
+    size_t              count;
+    ssize_t             result;
+}
+dev_request_t;
+
+// Tunables given when opening a device, usually taken from the mount
+// options. Zeroed fields select the defaults in mfatic-config.h.
+typedef struct dev_params
+{
+    // backend name, or NULL to choose one to suit the device.
+    const char          *backend;
+
+    // for the ram backend: seconds between write backs, whether only the
+    // metadata (and recently used file data) is kept in memory, and the
+    // limit in megabytes on resident file data in that case.
+    unsigned int        writeback_interval;
+    bool                ram_meta_only;
+    unsigned int        ram_hot_limit;
+
+    // whether clusters are discarded on the device as they are released.
+    bool                discard;
+
+    // whether clusters are allocated from the start of the volume up,
+    // to keep a sparse image file small.
+    bool                alloc_compact;
+
+    // erase block size and RAID stripe width of the device, in kilobytes,
+    // which large allocations are aligned to, or 0 if not known.
+    unsigned int        align_kb;
+    unsigned int        stripe_kb;
+
+    // for the overlay backend: the delta file which takes every write,
+    // leaving the device itself untouched.
+    const char          *overlay;
+}
+dev_params_t;
+
+typedef struct fat_device fat_device_t;
+
+// The set of operations a backend provides. Only open, read and write
+// are mandatory; where any of the others are NULL, device.c falls
+// back on a generic implementation built from the mandatory ones.
+// Backend procedures return a negative errno on failure.
+struct dev_backend
+{
+    const char          *name;
+
+    int                 (*open) (fat_device_t *dev, const char *path);
+    int                 (*start) (fat_device_t *dev);
+    void                (*close) (fat_device_t *dev);
+
+    ssize_t             (*read) (fat_device_t *dev, off_t offset,
+                            void *buf, size_t count);
+    ssize_t             (*write) (fat_device_t *dev, off_t offset,
+                            const void *buf, size_t count);
+    ssize_t             (*readv) (fat_device_t *dev, off_t offset,
+                            const struct iovec *iov, int iovcnt);
+    ssize_t             (*writev) (fat_device_t *dev, off_t offset,
+                            const struct iovec *iov, int iovcnt);
+
+    int                 (*flush) (fat_device_t *dev);
+    int                 (*discard) (fat_device_t *dev, off_t offset,
+                            off_t length);
+    ssize_t             (*copy) (fat_device_t *dev, off_t from, off_t to,
+                            size_t count);
+    int                 (*submit) (fat_device_t *dev, dev_request_t *reqs,
+                            unsigned int nr_reqs);
+
+    void *              (*map) (fat_device_t *dev, off_t offset,
+                            size_t count);
+    void                (*dirty) (fat_device_t *dev, off_t offset,
+                            size_t count);
+    void                (*advise) (fat_device_t *dev, off_t offset,
+                            size_t length, int advice);
+};
+
+// An open device. One of these is attached to each mounted volume.
+struct fat_device
+{
+    const struct dev_backend    *ops;
+
+    // file descriptor for the device or image file. Backends which keep
+    // the whole volume elsewhere may close it and set this to -1.
+    int                 fd;
+    bool                is_blkdev;
+
+    // set by backends which never write to the device, to have it opened
+    // read-only.
+    bool                read_only;
+
+    // size of the device in bytes, and the logical block size, which is
+    // the unit of alignment for O_DIRECT transfers.
+    off_t               size;
+    size_t              block_size;
+
+    // preferred unit of IO reported by a block device, such as a RAID
+    // stripe, or 0 if it reports none.
+    size_t              io_opt;
+
+    // everything before this offset is file system metadata (the boot
+    // sector, FSINFO and FATs). Backends which reorder writes for
+    // durability use this to tell metadata from file data.
+    off_t               meta_end;
+
+    // the tunables the device was opened with.
+    dev_params_t        params;
+
+    // the write back scheduler (iosched.c).
+    struct io_sched     *sched;
+
+    // backend specific state.
+    void                *priv;
+};
+
+// the available backends.
+extern const struct dev_backend pread_backend;
+extern const struct dev_backend direct_backend;
+extern const struct dev_backend mmap_backend;
+extern const struct dev_backend uring_backend;
+extern const struct dev_backend memory_backend;
+extern const struct dev_backend ram_backend;
+extern const struct dev_backend overlay_backend;
+
+
+// open the device or image file at a given path, using the backend
+// named in params. params may be NULL, to use the defaults.
+extern fat_device_t * dev_open (const char *path,
+  const dev_params_t *params);
+extern void dev_close (fat_device_t *dev);
+
+// start any background activity of the backend, such as write back
+// threads. This must be called after the daemon has forked.
+extern void dev_start (fat_device_t *dev);
+
+// transfer bytes between the device, at a given byte offset, and a
+// buffer. Return value is the number of bytes transferred. These abort
+// on IO errors.
+extern size_t dev_read (fat_device_t *dev, off_t offset, void *buf,
+  size_t count);
+extern size_t dev_write (fat_device_t *dev, off_t offset,
+  const void *buf, size_t count);
+extern size_t dev_readv (fat_device_t *dev, off_t offset,
+  const struct iovec *iov, int iovcnt);
+extern size_t dev_writev (fat_device_t *dev, off_t offset,
+  const struct iovec *iov, int iovcnt);
+
+// submit a batch of requests. The backend may carry them out in any
+// order, or concurrently; this returns once all have completed.
+extern int dev_submit (fat_device_t *dev, dev_request_t *reqs,
+  unsigned int nr_reqs);
+
+// copy count bytes from one region of the device to another, without
+// passing them through the caller. The regions must not overlap. Return
+// value is the number of bytes copied. This aborts on IO errors.
+extern size_t dev_copy (fat_device_t *dev, off_t from, off_t to,
+  size_t count);
+
+// tell the device a region no longer holds useful data. Return value is
+// 0, or a negative errno if the device does not support discard.
+extern int dev_discard (fat_device_t *dev, off_t offset, off_t length);
+
+// get a pointer directly into the volume, if the backend keeps it in
+// memory, or NULL otherwise. Writes through this pointer must be followed
+// by a call to dev_dirty, so that they are flushed by dev_sync.
+extern void * dev_map (fat_device_t *dev, off_t offset, size_t count);
+extern void dev_dirty (fat_device_t *dev, off_t offset, size_t count);
+
+// give the backend a hint about how a region will be accessed.
+extern void dev_advise (fat_device_t *dev, off_t offset, size_t length,
+  int advice);
+
+// make all writes so far durable.
+extern void dev_sync (fat_device_t *dev);
+
+// look up a backend by name.
+extern const struct dev_backend * dev_find_backend (const char *name);
+
+// helpers for backends which work on a device file.
+extern int dev_open_file (fat_device_t *dev, const char *path, int flags);
+extern int dev_file_discard (fat_device_t *dev, off_t offset, off_t length);
+extern ssize_t dev_file_copy (fat_device_t *dev, off_t from, off_t to,
+  size_t count);
+
+
+#endif // MFATIC_DEVICE_H
+
+// vim: ts=4 sw=4 et
@@ -6,45 +6,214 @@
  *  Author: Matthew Signorini
  */
 
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
+#include <alloca.h>
 
 #include "mfatic-config.h"
 #include "const.h"
 #include "utils.h"
 #include "fat.h"
+#include "blkcache.h"
 #include "inode_table.h"
+#include "extent.h"
+#include "fat_alloc.h"
+#include "table.h"
+#include "volume.h"
 #include "fileio.h"
 #include "directory.h"
 
 
+// What is known about a directory that entries are being added to: the
+// number of entries in use, which is where the next one goes, how many
+// of those have been deleted since it was last compacted, and the
+// cluster after the first cluster of the last file created in it, which
+// is where the next new file is placed, so that the files of a directory
+// are kept together. These are kept for the last few
+// directories written, in a table indexed by i-node, so that creating a
+// file does not have to scan the directory.
+struct dir_cursor
+{
+    fat_entry_t         inode;
+    uint32_t            nr_entries;
+    uint32_t            nr_deleted;
+    fat_cluster_t       next_node;
+};
+
+// Directory state of one volume. The directory last opened by dir_open
+// is kept open, with its path, so that a burst of creates in the same
+// directory only has to look it up once.
+struct dir_cache
+{
+    struct dir_cursor   cursors [DIR_CURSOR_SLOTS];
+    char                *last_path;
+    fat_file_t          *last_dir;
+};
+
+
 // local functions.
 PRIVATE int root_direntry (fat_direntry_t *buffer);
 PRIVATE bool is_directory (fat_file_t *file);
 PRIVATE bool search_directory (fat_file_t *dir, const char *name,
   fat_direntry_t *found, unsigned int *index);
 PRIVATE void remove_separators (char *pathname);
-PRIVATE unsigned int get_directory_size (fat_file_t *dirfd);
+PRIVATE unsigned int get_directory_size (fat_file_t *dirfd,
+  uint32_t *nr_deleted);
+PRIVATE struct dir_cursor * get_cursor (fat_file_t *dirfd);
+PRIVATE void compact_directory (fat_file_t *dirfd,
+  struct dir_cursor *cursor);
+PRIVATE int grow_directory (fat_file_t *dirfd);
+PRIVATE void zero_clusters (fat_volume_t *v, fat_cluster_t first,
+  uint32_t count);
+
+
+/**
+ *  This should be called for each volume at mount time, to set up its
+ *  list of active directories.
+ */
+    PUBLIC void
+directory_init (v)
+    fat_volume_t *v;            // info about the mounted file system.
+{
+    v->open_dirs = NULL;
+
+    v->dir_cache = safe_malloc (sizeof (struct dir_cache));
+    memset (v->dir_cache, 0, sizeof (struct dir_cache));
+}
+
+/**
+ *  Open a directory, to add entries to. This behaves like fat_open, and
+ *  the handle is closed with fat_close, but the last directory opened is
+ *  remembered, so opening it again does not walk the path.
+ *
+ *  Return value is 0 on success, or a negative errno on failure.
+ */
+    PUBLIC int
+dir_open (path, fd)
+    const char *path;           // absolute path of the directory.
+    fat_file_t **fd;            // file handle to fill in.
+{
+    fat_volume_t *volume_info = vol_current ();
+    struct dir_cache *cache = volume_info->dir_cache;
+    int retval;
+
+    if ((cache->last_dir == NULL) || (strcmp (cache->last_path, path) != 0))
+    {
+        dir_forget_paths ();
+
+        if ((retval = fat_open (path, fd)) != 0)
+            return retval;
+
+        if (is_directory (*fd) == false)
+        {
+            fat_close (*fd);
+            return -ENOTDIR;
+        }
 
+        // the references taken by fat_open are kept by the cache.
+        cache->last_path = safe_malloc (strlen (path) + 1);
+        strcpy (cache->last_path, path);
+        cache->last_dir = *fd;
+    }
 
-// global pointer to the volume information struct for the mounted file
-// system.
-PRIVATE const fat_volume_t *volume_info;
+    // take the same references for the caller as fat_open would have,
+    // which fat_close will give back.
+    ilist_lookup_file (&(volume_info->open_files), fd,
+      cache->last_dir->inode);
 
-// list of currently active directories.
-PRIVATE file_list_t *active_dirs;
+    if ((*fd)->directory_inode != 0)
+        get_parent_fd ((*fd)->directory_inode);
 
+    return 0;
+}
 
 /**
- *  This should be called at mount time, to initialise the volume info
- *  structure.
+ *  Close the directory remembered by dir_open. This must be done whenever
+ *  the path of a directory may have changed, or a directory has been
+ *  removed.
  */
     PUBLIC void
-directory_init (v)
-    const fat_volume_t *v;      // info about the mounted file system.
+dir_forget_paths (void)
+{
+    struct dir_cache *cache = vol_current ()->dir_cache;
+
+    if (cache->last_dir == NULL)
+        return;
+
+    fat_close (cache->last_dir);
+    safe_free ((void **) &(cache->last_path));
+    cache->last_dir = NULL;
+}
+
+/**
+ *  Forget what is known about a directory's entries. Called when a new
+ *  directory is created, in case its first cluster belonged to one that
+ *  has been deleted.
+ */
+    PUBLIC void
+dir_forget (inode)
+    fat_entry_t inode;          // i-node of the directory.
+{
+    struct dir_cursor *cursor =
+        &(vol_current ()->dir_cache->cursors [inode % DIR_CURSOR_SLOTS]);
+
+    if (cursor->inode == inode)
+        cursor->inode = 0;
+}
+
+/**
+ *  Allocate the first cluster of a new file in a given directory. The
+ *  first file created in a directory, or the first since its cursor was
+ *  last dropped, goes after the directory's own clusters; each one after
+ *  that goes after the one before. A directory's files so end up
+ *  together, next to the directory, and reading all of them is a sweep
+ *  across a small part of the disk rather than a seek for each one.
+ *
+ *  Return value is the cluster allocated, or 0 if the volume is full.
+ */
+    PUBLIC fat_cluster_t
+dir_alloc_node (dirfd)
+    fat_file_t *dirfd;          // directory the file is created in.
+{
+    struct dir_cursor *cursor = get_cursor (dirfd);
+    fat_cluster_t node;
+
+    if (cursor->next_node == 0)
+        cursor->next_node = extent_last (&(dirfd->clusters)) + 1;
+
+    if ((node = fat_alloc_near (cursor->next_node)) != 0)
+        cursor->next_node = node + 1;
+
+    return node;
+}
+
+/**
+ *  Allocate the first cluster of a new subdirectory. A directory in the
+ *  root starts a tree of its own, in the middle of the largest free
+ *  region, so that separate trees are kept apart and each has room to
+ *  grow. Below that, a directory goes just after its parent's clusters,
+ *  so that walking down a tree does not seek across the disk. The
+ *  cluster is filled with free entries, so that the new directory starts
+ *  out empty.
+ *
+ *  Return value is the cluster allocated, or 0 if the volume is full.
+ */
+    PUBLIC fat_cluster_t
+dir_alloc_dir (dirfd)
+    fat_file_t *dirfd;          // parent of the new directory.
 {
-    volume_info = v;
-    active_dirs = NULL;
+    fat_cluster_t node;
+
+    if (dirfd->inode == dirfd->v->bpb->root_cluster)
+        node = fat_alloc_node ();
+    else
+        node = fat_alloc_near (extent_last (&(dirfd->clusters)) + 1);
+
+    if (node != 0)
+        zero_clusters (dirfd->v, node, 1);
+
+    return node;
 }
 
 /**
@@ -61,8 +230,18 @@ fat_lookup_dir (path, buffer, parent, index)
     fat_file_t **parent;        // file handle of the parent directory.
     unsigned int *index;        // put dir index here.
 {
-    char *file = strdupa (path);
+    size_t length = strlen (path);
+    char *file = alloca (length + 2);
     fat_file_t *parent_fd = NULL;
+    int retval;
+
+    // no parent is open, unless the lookup succeeds.
+    *parent = NULL;
+
+    // copy the path with a second null byte after it, which marks the end
+    // of the list of names once the separators are removed.
+    memcpy (file, path, length + 1);
+    file [length + 1] = '\0';
 
     // first, we will convert all the path separators into null bytes,
     // so that the path becomes a collection of file name strings.
@@ -78,7 +257,10 @@ fat_lookup_dir (path, buffer, parent, index)
     // name becomes the new file.
     while (*file != '\0')
     {
-        fat_open_fd (buffer, 0, 0, &parent_fd);
+        // a directory whose chain is corrupt cannot be opened, and
+        // nothing is left open.
+        if ((retval = fat_open_fd (buffer, NULL, 0, &parent_fd)) != 0)
+            return retval;
 
         // check the file is a directory.
         if (is_directory (parent_fd) != true)
@@ -115,52 +297,81 @@ fat_lookup_dir (path, buffer, parent, index)
 }
 
 /**
- *  Read a file's directory entry in O(1) time. This uses the directories
- *  i-node to find it's file descriptor, and an entry index to locate the
- *  desired entry.
+ *  Read ahead what looking up or opening the file with a given entry
+ *  will need, when the entry is being listed: the block of the FAT at
+ *  the start of its chain, and for a subdirectory, its first cluster.
+ *  Tree walkers like find and du stat or open everything they list, so
+ *  it is all about to be used. The dot entries, and deleted ones, are
+ *  skipped.
  */
     PUBLIC void
-get_directory_entry (buffer, inode, index)
-    fat_direntry_t *buffer;         // buffer to store the entry.
-    fat_entry_t inode;              // identifies the directory to read.
-    unsigned int index;             // entry to read.
+dir_prefetch (entry)
+    const fat_direntry_t *entry;    // entry being listed.
 {
-    fat_file_t *dirfd;
+    fat_volume_t *v = vol_current ();
+    fat_cluster_t first = DIR_CLUSTER_START (entry);
+
+    if (DIR_IS_DELETED (entry) || (strncmp (entry->fname, ".",
+          DIR_NAME_LEN) == 0) || (strncmp (entry->fname, "..",
+          DIR_NAME_LEN) == 0))
+    {
+        return;
+    }
 
-    // look up the directories fd in our list of active dirs.
-    if (ilist_lookup_file (&active_dirs, &dirfd, inode) != true)
+    if ((first < 2) || (first >= NR_CLUSTERS (v) + 2))
         return;
 
-    // seek to the entry requested, and read it into the caller's buffer.
-    fat_seek (dirfd, index * sizeof (fat_direntry_t), SEEK_SET);
-    fat_read (dirfd, buffer, sizeof (fat_direntry_t));
+    prefetch_fat_entry (first);
 
-    // decrement the refcount that was incremented by the lookup
-    // operation.
-    ilist_unlink (&active_dirs, inode);
+    if ((entry->attributes & ATTR_DIRECTORY) != 0)
+        blk_prefetch (CLUSTER_OFFSET (v, first), CLUSTER_SIZE (v));
 }
 
 /**
- *  Overwrite an existing directory entry with new values.
+ *  Return value is the byte offset on the device of a given entry in a
+ *  directory. The directory must be long enough to hold the entry.
  */
-    PUBLIC void
-put_directory_entry (buffer, inode, index)
-    const fat_direntry_t *buffer;   // new entry to write.
-    fat_entry_t inode;              // identifies directory to write on.
-    unsigned int index;             // entry to overwrite.
+    PUBLIC off_t
+dir_entry_offset (dirfd, index)
+    fat_file_t *dirfd;          // directory holding the entry.
+    unsigned int index;         // index of the entry.
 {
-    fat_file_t *dirfd;
+    size_t cluster_size = CLUSTER_SIZE (dirfd->v);
+    off_t offset = (off_t) index * sizeof (fat_direntry_t);
 
-    // lookup the directories fd.
-    if (ilist_lookup_file (&active_dirs, &dirfd, inode) != true)
+    return CLUSTER_OFFSET (dirfd->v, extent_lookup (&(dirfd->clusters),
+        offset / cluster_size, NULL)) + offset % cluster_size;
+}
+
+/**
+ *  Read a file's directory entry in O(1) time. The handle keeps the
+ *  entry's offset on the device, so this is one read from the block
+ *  cache. The root directory has no entry, and is left alone.
+ */
+    PUBLIC void
+get_directory_entry (buffer, fd)
+    fat_direntry_t *buffer;         // buffer to store the entry.
+    const fat_file_t *fd;           // file whose entry to read.
+{
+    if (fd->directory_inode == 0)
         return;
 
-    // seek to the appropriate entry, and write.
-    fat_seek (dirfd, index * sizeof (fat_direntry_t), SEEK_SET);
-    fat_write (dirfd, buffer, sizeof (fat_direntry_t));
+    blk_read (fd->dir_entry_offset, buffer, sizeof (fat_direntry_t));
+}
+
+/**
+ *  Overwrite a file's directory entry with new values. The write is left
+ *  in the block cache, to go out with the next flush.
+ */
+    PUBLIC void
+put_directory_entry (buffer, fd)
+    const fat_direntry_t *buffer;   // new entry to write.
+    const fat_file_t *fd;           // file whose entry to overwrite.
+{
+    if (fd->directory_inode == 0)
+        return;
 
-    // correct the refcount in the active dirs list.
-    ilist_unlink (&active_dirs, inode);
+    blk_write_back (fd->dir_entry_offset, buffer, sizeof (fat_direntry_t));
 }
 
 /**
@@ -172,8 +383,10 @@ put_directory_entry (buffer, inode, index)
 add_parent_dir (parent_fd)
     fat_file_t *parent_fd;      // file struct of the parent directory.
 {
+    fat_volume_t *volume_info = vol_current ();
+
     // add the fd to the list.
-    ilist_add (&active_dirs, parent_fd);
+    ilist_add (&(volume_info->open_dirs), parent_fd);
 
     return parent_fd->inode;
 }
@@ -187,9 +400,11 @@ add_parent_dir (parent_fd)
 get_parent_fd (inode)
     fat_entry_t inode;      // ID to search for.
 {
+    fat_volume_t *volume_info = vol_current ();
     fat_file_t *found;
 
-    if (ilist_lookup_file (&active_dirs, &found, inode) != true)
+    if (ilist_lookup_file (&(volume_info->open_dirs), &found,
+          inode) != true)
         return NULL;
 
     return found;
@@ -202,57 +417,167 @@ get_parent_fd (inode)
 release_parent_dir (inode)
     fat_entry_t inode;      // ID that is being unreferenced.
 {
-    ilist_unlink (&active_dirs, inode);
+    ilist_unlink (&(vol_current ()->open_dirs), inode);
 }
 
 /**
- *  Delete an existing directory entry from a given directory. This is
- *  done by swapping the entry to the end of the array of dir entries, and
- *  marking the last entry as free; equivalent to the method of deleting
- *  an item from an array by swapping with the end, and decrementing the
- *  array length.
+ *  Delete an existing directory entry from a given directory. The entry
+ *  is marked as deleted where it is, which takes a single block write,
+ *  and leaves every other entry at the index that open files know it
+ *  by. Once enough of the directory is deleted entries, it is compacted.
+ *
+ *  The mark is written through, unless write_back is true, in which case
+ *  it is left in the block cache to go out with the next batch.
  */
     PUBLIC void
-dir_delete_entry (dirfd, index)
+dir_delete_entry (dirfd, index, write_back)
     fat_file_t *dirfd;              // directory to delete from.
     unsigned int index;             // index of the entry to delete.
+    bool write_back;                // whether the mark can be delayed.
 {
-    fat_direntry_t last;
-    unsigned int last_index = get_directory_size (dirfd);
-
-    // seek to and read the last entry. This will then be used to overwrite
-    // the entry that is to be deleted.
-    fat_seek (dirfd, (last_index - 1) * sizeof (fat_direntry_t), SEEK_SET);
-    fat_read (dirfd, &last, sizeof (fat_direntry_t));
-
-    // now overwrite the entry that is to be deleted with the last entry
-    // in the directory; effectively a swap.
-    fat_seek (dirfd, index * sizeof (fat_direntry_t), SEEK_SET);
-    fat_write (dirfd, &last, sizeof (fat_direntry_t));
-
-    // and finally, overwrite the last entry, so that the first byte of
-    // the name is null, which identifies the entry as being unused.
-    last.fname [0] = '\0';
-    fat_seek (dirfd, (last_index - 1) * sizeof (fat_direntry_t), SEEK_SET);
-    fat_write (dirfd, &last, sizeof (fat_direntry_t));
+    struct dir_cursor *cursor = get_cursor (dirfd);
+    uint8_t marker = DIR_ENTRY_DELETED;
+    size_t per_cluster = CLUSTER_SIZE (dirfd->v) / sizeof (fat_direntry_t);
+
+    // the last entry can simply become the end of the directory.
+    if (index + 1 == cursor->nr_entries)
+    {
+        marker = '\0';
+        cursor->nr_entries -= 1;
+    }
+    else
+    {
+        cursor->nr_deleted += 1;
+    }
+
+    if (write_back == true)
+        blk_write_back (dir_entry_offset (dirfd, index), &marker, 1);
+    else
+        blk_write (dir_entry_offset (dirfd, index), &marker, 1);
+
+    if ((cursor->nr_deleted >= per_cluster) && (cursor->nr_deleted * 100 >=
+          cursor->nr_entries * DIR_COMPACT_PERCENT))
+    {
+        compact_directory (dirfd, cursor);
+    }
 }
 
 /**
  *  Add a new directory entry, given a file descriptor for the directory.
  *  New entries are simply appended onto the list of existing entries.
+ *  The entry is left in the block cache to be written out along with
+ *  any others added soon after it. If index is not NULL, the new entry's
+ *  index is stored there.
+ *
+ *  Return value is 0 on success, or -ENOSPC if the directory is full
+ *  and could not be grown.
  */
-    PUBLIC void
-dir_write_entry (dirfd, entry)
+    PUBLIC int
+dir_write_entry (dirfd, entry, index)
     fat_file_t *dirfd;              // directory to insert in.
     const fat_direntry_t *entry;    // new entry to write.
+    unsigned int *index;            // where to store the entry's index.
+{
+    struct dir_cursor *cursor = get_cursor (dirfd);
+
+    // add clusters if there is no room after the existing entries.
+    if (((size_t) cursor->nr_entries * sizeof (fat_direntry_t) >=
+          (size_t) extent_count (&(dirfd->clusters)) *
+          CLUSTER_SIZE (dirfd->v)) && (grow_directory (dirfd) != 0))
+    {
+        return -ENOSPC;
+    }
+
+    blk_write_back (dir_entry_offset (dirfd, cursor->nr_entries), entry,
+      sizeof (fat_direntry_t));
+
+    if (index != NULL)
+        *index = cursor->nr_entries;
+
+    cursor->nr_entries += 1;
+
+    return 0;
+}
+
+/**
+ *  Give an entry a new name, where it is. The entry is left in the block
+ *  cache to be written out with the next batch.
+ */
+    PUBLIC void
+dir_rename_entry (dirfd, index, name)
+    fat_file_t *dirfd;              // directory holding the entry.
+    unsigned int index;             // index of the entry.
+    const char *name;               // new name, of DIR_NAME_LEN bytes.
+{
+    blk_write_back (dir_entry_offset (dirfd, index) +
+      offsetof (fat_direntry_t, fname), name, DIR_NAME_LEN);
+}
+
+/**
+ *  Bring what is cached about a file up to date after it has been renamed
+ *  or moved, rather than forgetting it: the path of the directory kept
+ *  open by dir_open, if that is or is under the file, and the name and
+ *  location of the file's entry, if it is open.
+ */
+    PUBLIC void
+dir_entry_moved (oldpath, newpath, entry, newdir, index)
+    const char *oldpath;            // where the file was.
+    const char *newpath;            // where it is now.
+    const fat_direntry_t *entry;    // its entry, as now written.
+    fat_file_t *newdir;             // the directory it is now in.
+    unsigned int index;             // index of its entry there.
 {
-    unsigned int last_index = get_directory_size (dirfd);
+    fat_volume_t *volume_info = vol_current ();
+    struct dir_cache *cache = volume_info->dir_cache;
+    size_t length = strlen (oldpath);
+    file_list_t *item;
+    fat_file_t *fd;
+    char *path;
+
+    // replace the old path at the start of the cached path with the new.
+    if ((cache->last_path != NULL) &&
+      (strncmp (cache->last_path, oldpath, length) == 0) &&
+      ((cache->last_path [length] == '\0') ||
+       (cache->last_path [length] == '/')))
+    {
+        path = safe_malloc (strlen (newpath) +
+          strlen (cache->last_path + length) + 1);
+        strcpy (path, newpath);
+        strcat (path, cache->last_path + length);
+
+        safe_free ((void **) &(cache->last_path));
+        cache->last_path = path;
+    }
+
+    // find the file's handle, without taking a reference to it.
+    for (item = volume_info->open_files; item != NULL; item = item->next)
+    {
+        if (INODE (item) == (fat_entry_t) DIR_CLUSTER_START (entry))
+            break;
+    }
+
+    if (item == NULL)
+        return;
+
+    fd = item->file;
+
+    // each open of the handle holds a reference to its directory, and
+    // every one of them moves over to the new one, since each fat_close
+    // will give one back.
+    if (fd->directory_inode != newdir->inode)
+    {
+        for (unsigned int i = 0; i < item->refcount; i ++)
+        {
+            release_parent_dir (fd->directory_inode);
+            add_parent_dir (newdir);
+        }
 
-    // seek to after all the dir entries.
-    fat_seek (dirfd, last_index * sizeof (fat_direntry_t), SEEK_SET);
+        fd->directory_inode = newdir->inode;
+    }
 
-    // write in the new entry.
-    fat_write (dirfd, entry, sizeof (fat_direntry_t));
+    fd->dir_entry_index = index;
+    fd->dir_entry_offset = dir_entry_offset (newdir, index);
+    strncpy (fd->name, entry->fname, DIR_NAME_LEN);
 }
 
 /**
@@ -267,7 +592,24 @@ put_direntry_cluster (entry, value)
     fat_cluster_t value;        // cluster value to package.
 {
     entry->cluster_lsb = value & 0x0000FFFF;
-    entry->cluster_msb = (value & 0xFFFF0000) >> 15;
+    entry->cluster_msb = (value & 0xFFFF0000) >> 16;
+}
+
+/**
+ *  package a file name into it's directory entry structure. A leading
+ *  0xE5 byte is stored as DIR_ENTRY_E5_ESCAPE, so that the entry is not
+ *  taken for a deleted one.
+ */
+    PUBLIC void
+put_direntry_name (entry, name)
+    fat_direntry_t *entry;      // directory entry structure to modify.
+    const char *name;           // file name to package.
+{
+    strncpy (entry->fname, name, DIR_NAME_LEN);
+    entry->fname [DIR_NAME_LEN - 1] = '\0';
+
+    if ((uint8_t) entry->fname [0] == DIR_ENTRY_DELETED)
+        entry->fname [0] = (char) DIR_ENTRY_E5_ESCAPE;
 }
 
 /**
@@ -280,6 +622,8 @@ put_direntry_cluster (entry, value)
 root_direntry (entry_buf)
     fat_direntry_t *entry_buf;      // structure to fill in.
 {
+    const fat_volume_t *volume_info = vol_current ();
+
     // name is just '/'.
     entry_buf->fname [0] = '/';
     entry_buf->fname [1] = '\0';
@@ -328,6 +672,16 @@ search_directory (dir, name, found, index)
     fat_direntry_t *found;      // buffer to store a match.
     unsigned int *index;        // dir index will be stored here.
 {
+    char first = name [0];
+
+    // the first byte of the name is compared as it is stored. A name
+    // really starting with the escape byte is never stored.
+    if ((uint8_t) first == DIR_ENTRY_E5_ESCAPE)
+        return false;
+
+    if ((uint8_t) first == DIR_ENTRY_DELETED)
+        first = (char) DIR_ENTRY_E5_ESCAPE;
+
     // start searching at the start of the directory.
     fat_seek (dir, 0, SEEK_SET);
 
@@ -342,10 +696,15 @@ search_directory (dir, name, found, index)
         if (fat_read (dir, found, sizeof (fat_direntry_t)) == 0)
             return false;
 
+        // nothing follows the first free entry.
+        if (found->fname [0] == '\0')
+            return false;
+
         // increment the index count.
         *index += 1;
     }
-    while (strncmp (name, found->fname, DIR_NAME_LEN) != 0);
+    while (DIR_IS_DELETED (found) || (found->fname [0] != first) ||
+      (strncmp (name + 1, found->fname + 1, DIR_NAME_LEN - 1) != 0));
 
     // correct index counter for the final iteration of the loop.
     *index -= 1;
@@ -376,18 +735,22 @@ remove_separators (pathname)
 
 /**
  *  Return the number of directory entries that are in use in a given
- *  directory. This value is also the index at which a new entry should
- *  be written; after all the existing entries.
+ *  directory, including deleted entries that have not been compacted
+ *  away, which are also counted in nr_deleted. This value is also the
+ *  index at which a new entry should be written; after all the existing
+ *  entries.
  */
     PRIVATE unsigned int
-get_directory_size (dirfd)
+get_directory_size (dirfd, nr_deleted)
     fat_file_t *dirfd;      // file descriptor of target dir.
+    uint32_t *nr_deleted;   // set to the number of deleted entries.
 {
     unsigned int entry_count = 0;
     fat_direntry_t entry;
 
     // start at the beginning of the directory.
     fat_seek (dirfd, 0, SEEK_SET);
+    *nr_deleted = 0;
 
     // iteratively read directory entries from the file, until we either
     // reach the end of the file, or find a free directory entry.
@@ -396,17 +759,162 @@ get_directory_size (dirfd)
         // free directory entries are identified by having a NULL byte
         // as the first byte in the file name.
         if (entry.fname [0] == '\0')
-        {
             break;
+
+        if (DIR_IS_DELETED (&entry))
+            *nr_deleted += 1;
+
+        entry_count += 1;
+    }
+
+    return entry_count;
+}
+
+/**
+ *  Find the cursor for a directory, counting its entries if it is not
+ *  one of those in the table, and taking the place of whichever
+ *  directory was using that slot.
+ *
+ *  Return value is the directory's cursor.
+ */
+    PRIVATE struct dir_cursor *
+get_cursor (dirfd)
+    fat_file_t *dirfd;          // directory concerned.
+{
+    struct dir_cursor *cursor =
+        &(dirfd->v->dir_cache->cursors [dirfd->inode % DIR_CURSOR_SLOTS]);
+
+    if (cursor->inode != dirfd->inode)
+    {
+        cursor->inode = dirfd->inode;
+        cursor->nr_entries = get_directory_size (dirfd,
+          &(cursor->nr_deleted));
+        cursor->next_node = 0;
+    }
+
+    return cursor;
+}
+
+/**
+ *  Squeeze the deleted entries out of a directory, moving each entry
+ *  after the first deleted one down into the space. The moved entries are
+ *  rewritten in bulk, a run of clusters at a time, and the handles of
+ *  open files among them are given their new index. A readdir part way
+ *  through the directory may miss entries that move behind it, so this
+ *  is only done once deleted entries are a large part of the directory.
+ */
+    PRIVATE void
+compact_directory (dirfd, cursor)
+    fat_file_t *dirfd;              // directory to compact.
+    struct dir_cursor *cursor;      // the directory's cursor.
+{
+    size_t length = (size_t) cursor->nr_entries * sizeof (fat_direntry_t);
+    fat_direntry_t *entries = safe_malloc (length);
+    unsigned int *new_index = safe_malloc (cursor->nr_entries *
+      sizeof (unsigned int));
+    uint32_t first = cursor->nr_entries, live = 0;
+    file_list_t *item;
+
+    fat_seek (dirfd, 0, SEEK_SET);
+    fat_read (dirfd, entries, length);
+
+    for (uint32_t i = 0; i < cursor->nr_entries; i ++)
+    {
+        new_index [i] = live;
+
+        if (DIR_IS_DELETED (&(entries [i])))
+        {
+            first = MIN (first, i);
+            continue;
         }
-        else
+
+        entries [live ++] = entries [i];
+    }
+
+    // everything from the first deleted entry on is rewritten, and what
+    // is left after the live entries becomes free.
+    if (first < cursor->nr_entries)
+    {
+        memset (&(entries [live]), 0, (cursor->nr_entries - live) *
+          sizeof (fat_direntry_t));
+
+        fat_seek (dirfd, first * sizeof (fat_direntry_t), SEEK_SET);
+        fat_write (dirfd, &(entries [first]), (cursor->nr_entries - first) *
+          sizeof (fat_direntry_t));
+    }
+
+    for (item = dirfd->v->open_files; item != NULL; item = item->next)
+    {
+        if ((item->file->directory_inode == dirfd->inode) &&
+          (item->file->dir_entry_index < cursor->nr_entries))
         {
-            entry_count += 1;
+            item->file->dir_entry_index =
+                new_index [item->file->dir_entry_index];
+            item->file->dir_entry_offset = dir_entry_offset (dirfd,
+              item->file->dir_entry_index);
         }
     }
 
-    return entry_count;
+    cursor->nr_entries = live;
+    cursor->nr_deleted = 0;
+
+    safe_free ((void **) &new_index);
+    safe_free ((void **) &entries);
+}
+
+/**
+ *  Add clusters to a directory, and fill them with free entries. A
+ *  directory grows by as many clusters as it already has, up to
+ *  DIR_GROW_MAX bytes at a time, and each addition is a contiguous run
+ *  following on from the last where possible, so that even a large
+ *  directory is a few long runs that can be read sequentially.
+ *
+ *  Return value is 0 on success, or -ENOSPC if the volume is full.
+ */
+    PRIVATE int
+grow_directory (dirfd)
+    fat_file_t *dirfd;          // directory to grow.
+{
+    size_t cluster_size = CLUSTER_SIZE (dirfd->v);
+    uint32_t count = extent_count (&(dirfd->clusters)), added, run;
+    fat_cluster_t c;
+
+    added = alloc_contiguous (dirfd, MIN (MAX (count, 1),
+      MAX (DIR_GROW_MAX / cluster_size, 1)));
+
+    if (added == 0)
+        return -ENOSPC;
+
+    // the run may have been split up if the volume is fragmented.
+    for (uint32_t i = count; i < count + added; i += run)
+    {
+        c = extent_lookup (&(dirfd->clusters), i, &run);
+        run = MIN (run, count + added - i);
+        zero_clusters (dirfd->v, c, run);
+    }
+
+    dirfd->size = (size_t) extent_count (&(dirfd->clusters)) * cluster_size;
+
+    return 0;
 }
 
+/**
+ *  Fill a run of a directory's clusters with free entries. This goes
+ *  straight to the device, in one write, and updates any blocks of the
+ *  run that are still in the block cache.
+ */
+    PRIVATE void
+zero_clusters (v, first, count)
+    fat_volume_t *v;            // volume the clusters are on.
+    fat_cluster_t first;        // first cluster of the run.
+    uint32_t count;             // number of clusters.
+{
+    size_t length = (size_t) count * CLUSTER_SIZE (v);
+    void *zeroes = safe_malloc (length);
+
+    memset (zeroes, 0, length);
+    blk_write_data (CLUSTER_OFFSET (v, first), zeroes, length);
+    safe_free ((void **) &zeroes);
+}
 
 // vim: ts=4 sw=4 et
@@ -15,18 +15,43 @@
 #include "fat.h"
 
 
-// tell directory.c where the volume info is.
-extern void directory_init (const fat_volume_t *volinfo);
+// set up the list of active directories of a newly mounted volume.
+extern void directory_init (fat_volume_t *volinfo);
+
+// open a directory to create files in. The last directory opened this
+// way is kept open, and its path remembered, until dir_forget_paths is
+// called, which must be done when a directory is removed. The path is
+// fixed up by dir_entry_moved when a directory is moved.
+extern int dir_open (const char *path, fat_file_t **fd);
+extern void dir_forget_paths (void);
+
+// forget the cached state of a directory, whose i-node is being reused.
+extern void dir_forget (fat_entry_t inode);
+
+// allocate the first cluster for a new file, near the directory and its
+// other files.
+extern fat_cluster_t dir_alloc_node (fat_file_t *dirfd);
+
+// allocate the first cluster for a new subdirectory, next to its parent,
+// or apart from the other trees for a directory in the root, and fill it
+// with free entries.
+extern fat_cluster_t dir_alloc_dir (fat_file_t *dirfd);
 
 // look up the directory entry for a particular file.
 extern int fat_lookup_dir (const char *path, fat_direntry_t *buffer,
   fat_file_t **parent, unsigned int *index);
 
-// read or write a given entry from a given directory.
-extern void get_directory_entry (fat_direntry_t *buffer, 
-  fat_entry_t inode, unsigned int index);
+// read ahead the metadata a file listed in a directory will need.
+extern void dir_prefetch (const fat_direntry_t *entry);
+
+// byte offset on the device of a given entry in a directory.
+extern off_t dir_entry_offset (fat_file_t *dirfd, unsigned int index);
+
+// read or write an open file's own directory entry.
+extern void get_directory_entry (fat_direntry_t *buffer,
+  const fat_file_t *fd);
 extern void put_directory_entry (const fat_direntry_t *buffer,
-  fat_entry_t inode, unsigned int index);
+  const fat_file_t *fd);
 
 // Add a new directory to the active directories list.
 extern fat_entry_t add_parent_dir (fat_file_t *parent);
@@ -38,13 +63,24 @@ extern fat_file_t * get_parent_fd (fat_entry_t inode);
 // being closed.
 extern void release_parent_dir (fat_entry_t inode);
 
-// procedures to delete a directory entry, or write a new entry.
-extern void dir_delete_entry (fat_file_t *dirfd, unsigned int index);
-extern void dir_write_entry (fat_file_t *dirfd, 
-  const fat_direntry_t *entry);
+// procedures to delete a directory entry, write a new entry, or rename
+// an entry where it is.
+extern void dir_delete_entry (fat_file_t *dirfd, unsigned int index,
+  bool write_back);
+extern int dir_write_entry (fat_file_t *dirfd,
+  const fat_direntry_t *entry, unsigned int *index);
+extern void dir_rename_entry (fat_file_t *dirfd, unsigned int index,
+  const char *name);
+
+// update the path kept by dir_open, and the file's handle if it is open,
+// after a file has been renamed or moved.
+extern void dir_entry_moved (const char *oldpath, const char *newpath,
+  const fat_direntry_t *entry, fat_file_t *newdir, unsigned int index);
 
-// store a value in a directory entry's start cluster field.
+// store a value in a directory entry's start cluster field, or a name in
+// its name field.
 extern void put_direntry_cluster (fat_direntry_t *entry, fat_cluster_t val);
+extern void put_direntry_name (fat_direntry_t *entry, const char *name);
 
 
 #endif // MFATIC_DIRECTORY_H
@@ -139,14 +139,14 @@ update_atime (fd, new_atime)
     fat_direntry_t entry;
 
     // retrieve the file's directory entry.
-    get_directory_entry (&entry, fd->directory_inode, fd->dir_entry_index);
+    get_directory_entry (&entry, fd);
 
     // calculate the DOS format value for the accessed date field, and
     // store it in the dir entry.
     entry.access_date = (uint16_t) dos_date (new_atime);
 
     // write back the modified dir entry.
-    put_directory_entry (&entry, fd->directory_inode, fd->dir_entry_index);
+    put_directory_entry (&entry, fd);
 }
 
 /**
@@ -160,14 +160,14 @@ update_mtime (fd, new_mtime)
     fat_direntry_t entry;
 
     // retrieve directory entry for the file.
-    get_directory_entry (&entry, fd->directory_inode, fd->dir_entry_index);
+    get_directory_entry (&entry, fd);
 
     // store the new DOS format date and time values.
     entry.write_time = (uint16_t) dos_time (new_mtime);
     entry.write_date = (uint16_t) dos_date (new_mtime);
 
     // write the modified entry back.
-    put_directory_entry (&entry, fd->directory_inode, fd->dir_entry_index);
+    put_directory_entry (&entry, fd);
 }
 
 /**
@@ -0,0 +1,548 @@
+/**
+ *  extent.c
+ *
+ *  Implementation of extent maps. A map is an array of extents sorted by
+ *  their position in the file, grown by doubling as clusters are added.
+ *  A contiguous file of any size takes a single 12 byte extent, where a
+ *  list with one node per cluster would take gigabytes for the largest
+ *  files FAT32 allows.
+ *
+ *  Files with thousands of fragments are packed. Each block of
+ *  EXTENT_BLOCK_SIZE extents is encoded as a string of bytes, with every
+ *  extent stored as two variable length integers: the distance from the
+ *  end of the extent before to its start, and its length. The distance
+ *  may be negative, so it is zigzag encoded. Fragments of a file are
+ *  mostly close together, so an extent usually takes two to four bytes
+ *  instead of twelve. An index entry per block records where the block
+ *  starts, both in the file and in the packed bytes, so finding a cluster
+ *  is a binary search of the index followed by decoding one block.
+ *
+ *  Extents after the last block are kept unpacked, as the last one may
+ *  still grow. There is always at least one of them in a packed map.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <string.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "fat.h"
+#include "table.h"
+#include "extent.h"
+
+
+// index entry for a block of packed extents.
+struct extent_block
+{
+    uint32_t            logical;
+    uint32_t            offset;
+};
+
+// position while decoding a packed block. ext holds the extent most
+// recently decoded.
+struct block_cursor
+{
+    const uint8_t       *next;
+    const uint8_t       *end;
+    fat_extent_t        ext;
+};
+
+// longest encoding of a 32 bit integer.
+#define VARINT_MAX      5
+
+
+// local functions.
+PRIVATE void * resize (void *buffer, size_t used, size_t new_size);
+PRIVATE void pack_block (extent_map_t *map);
+PRIVATE void unpack_block (extent_map_t *map, uint32_t block);
+PRIVATE void push_extent (extent_map_t *map, const fat_extent_t *ext);
+PRIVATE void trim (extent_map_t *map);
+PRIVATE uint32_t find_block (const extent_map_t *map, uint32_t index);
+PRIVATE void cursor_start (const extent_map_t *map, uint32_t block,
+  struct block_cursor *cursor);
+PRIVATE bool cursor_next (struct block_cursor *cursor);
+PRIVATE void put_varint (extent_map_t *map, uint32_t value);
+PRIVATE uint32_t get_varint (const uint8_t **p);
+
+
+/**
+ *  Initialise an empty extent map.
+ */
+    PUBLIC void
+extent_init (map)
+    extent_map_t *map;      // map to initialise.
+{
+    memset (map, 0, sizeof (extent_map_t));
+}
+
+/**
+ *  Release the memory held by an extent map, leaving it empty.
+ */
+    PUBLIC void
+extent_free (map)
+    extent_map_t *map;      // map to empty.
+{
+    safe_free ((void **) &(map->extents));
+    safe_free ((void **) &(map->packed));
+    safe_free ((void **) &(map->blocks));
+    extent_init (map);
+}
+
+/**
+ *  Follow a cluster chain through the FAT, adding each cluster to the
+ *  map. Return value is 0 on success, or -EIO if the chain is longer than
+ *  the volume, which can only happen if it loops back on itself, or
+ *  leads to a cluster outside the volume, such as the bad cluster mark.
+ */
+    PUBLIC int
+extent_load (map, first, limit)
+    extent_map_t *map;      // empty map to fill in.
+    fat_cluster_t first;    // first cluster in the chain.
+    uint32_t limit;         // most clusters the chain can hold.
+{
+    fat_cluster_t this_cluster = first;
+
+    // a file with no clusters has a start cluster of 0.
+    while ((IS_LAST_CLUSTER (this_cluster) == false) &&
+      (IS_FREE_CLUSTER (this_cluster) == false))
+    {
+        // clusters are numbered from 2. One outside the volume must not
+        // be looked up, since its cell is not in the FAT.
+        if ((extent_count (map) == limit) || (this_cluster < 2) ||
+          (this_cluster - 2 >= limit))
+            return -EIO;
+
+        extent_append (map, this_cluster);
+
+        // The allocation table cell at index this_cluster contains the
+        // index for the next cluster in the chain.
+        this_cluster = get_fat_entry (this_cluster);
+    }
+
+    return 0;
+}
+
+/**
+ *  Add a cluster to the end of a file's map. If it follows on from the
+ *  last extent, that extent is extended; otherwise a new extent starts.
+ *  Once there are enough extents, the oldest are packed.
+ */
+    PUBLIC void
+extent_append (map, cluster)
+    extent_map_t *map;      // map to add to.
+    fat_cluster_t cluster;  // cluster index.
+{
+    fat_extent_t *last, ext;
+
+    if (map->nr_extents != 0)
+    {
+        last = &(map->extents [map->nr_extents - 1]);
+
+        if (last->start + last->length == cluster)
+        {
+            last->length += 1;
+            return;
+        }
+    }
+
+    ext.logical = extent_count (map);
+    ext.start = cluster;
+    ext.length = 1;
+    push_extent (map, &ext);
+
+    // pack a block at a time, leaving the newest extent unpacked. When a
+    // map is first packed, the array it was in is much larger than needed.
+    if (map->nr_extents > EXTENT_PACK_THRESHOLD)
+    {
+        while (map->nr_extents > EXTENT_BLOCK_SIZE)
+            pack_block (map);
+
+        trim (map);
+    }
+    else if ((map->nr_blocks != 0) &&
+      (map->nr_extents > EXTENT_BLOCK_SIZE))
+    {
+        pack_block (map);
+    }
+}
+
+/**
+ *  Return value is the number of clusters in a map.
+ */
+    PUBLIC uint32_t
+extent_count (map)
+    const extent_map_t *map;    // map concerned.
+{
+    const fat_extent_t *last;
+
+    if (map->nr_extents == 0)
+        return 0;
+
+    last = &(map->extents [map->nr_extents - 1]);
+    return last->logical + last->length;
+}
+
+/**
+ *  Return value is the last cluster of a file, or 0 if it has none.
+ */
+    PUBLIC fat_cluster_t
+extent_last (map)
+    const extent_map_t *map;    // map concerned.
+{
+    const fat_extent_t *last;
+
+    if (map->nr_extents == 0)
+        return 0;
+
+    last = &(map->extents [map->nr_extents - 1]);
+    return last->start + last->length - 1;
+}
+
+/**
+ *  Find the cluster at a given position in the file, by binary search of
+ *  the extents, or of the block index and then within the block.
+ */
+    PUBLIC fat_cluster_t
+extent_lookup (map, index, run)
+    const extent_map_t *map;    // map to search.
+    uint32_t index;             // position in the file, in clusters.
+    uint32_t *run;              // contiguous clusters from there, or NULL.
+{
+    uint32_t low = 0, high = map->nr_extents, mid;
+    const fat_extent_t *ext;
+    struct block_cursor cursor;
+
+    if (index >= extent_count (map))
+        return 0;
+
+    if ((map->nr_blocks != 0) && (index < map->extents [0].logical))
+    {
+        // the extent is packed. Decode its block until we reach it.
+        cursor_start (map, find_block (map, index), &cursor);
+
+        while ((cursor_next (&cursor) == true) &&
+          (cursor.ext.logical + cursor.ext.length <= index))
+        {
+            ;
+        }
+
+        ext = &(cursor.ext);
+    }
+    else
+    {
+        // find the last extent starting at or before index. Extents have
+        // no gaps between them, so that is the one holding index.
+        while (high - low > 1)
+        {
+            mid = low + (high - low) / 2;
+
+            if (map->extents [mid].logical <= index)
+                low = mid;
+            else
+                high = mid;
+        }
+
+        ext = &(map->extents [low]);
+    }
+
+    if (run != NULL)
+        *run = ext->length - (index - ext->logical);
+
+    return ext->start + (index - ext->logical);
+}
+
+/**
+ *  Drop clusters from the end of a map, so that nr_clusters remain. The
+ *  caller is responsible for releasing them in the FAT.
+ */
+    PUBLIC void
+extent_truncate (map, nr_clusters)
+    extent_map_t *map;      // map to shorten.
+    uint32_t nr_clusters;   // clusters to keep.
+{
+    fat_extent_t *last;
+
+    if (nr_clusters == 0)
+    {
+        extent_free (map);
+        return;
+    }
+
+    // if the new end is in a packed block, unpack that block, and throw
+    // away those after it.
+    if ((map->nr_blocks != 0) && (nr_clusters <= map->extents [0].logical))
+        unpack_block (map, find_block (map, nr_clusters - 1));
+
+    // drop whole extents beyond the new end.
+    while ((map->nr_extents != 0) &&
+      (map->extents [map->nr_extents - 1].logical >= nr_clusters))
+    {
+        map->nr_extents -= 1;
+    }
+
+    // then clip the one straddling it.
+    if (map->nr_extents != 0)
+    {
+        last = &(map->extents [map->nr_extents - 1]);
+        last->length = MIN (last->length, nr_clusters - last->logical);
+    }
+
+    trim (map);
+}
+
+/**
+ *  Move a buffer to a new allocation of a different size, keeping the
+ *  first used bytes.
+ *
+ *  Return value is the new buffer.
+ */
+    PRIVATE void *
+resize (buffer, used, new_size)
+    void *buffer;           // buffer to move, or NULL.
+    size_t used;            // bytes of it in use.
+    size_t new_size;        // size of the new allocation.
+{
+    void *new_buffer = safe_malloc (new_size);
+
+    if (used != 0)
+        memcpy (new_buffer, buffer, used);
+
+    safe_free (&buffer);
+
+    return new_buffer;
+}
+
+/**
+ *  Encode the first EXTENT_BLOCK_SIZE unpacked extents as a new block.
+ */
+    PRIVATE void
+pack_block (map)
+    extent_map_t *map;      // map concerned.
+{
+    fat_cluster_t prev_end = 0;
+    fat_extent_t *ext;
+    int32_t delta;
+
+    if (map->nr_blocks == map->blocks_capacity)
+    {
+        map->blocks_capacity = MAX (map->blocks_capacity * 2, 16);
+        map->blocks = resize (map->blocks, sizeof (struct extent_block) *
+          map->nr_blocks, sizeof (struct extent_block) *
+          map->blocks_capacity);
+    }
+
+    map->blocks [map->nr_blocks].logical = map->extents [0].logical;
+    map->blocks [map->nr_blocks].offset = (uint32_t) map->packed_size;
+    map->nr_blocks += 1;
+
+    for (uint32_t i = 0; i < EXTENT_BLOCK_SIZE; i ++)
+    {
+        ext = &(map->extents [i]);
+        delta = (int32_t) (ext->start - prev_end);
+
+        put_varint (map, ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31));
+        put_varint (map, ext->length);
+        prev_end = ext->start + ext->length;
+    }
+
+    map->nr_extents -= EXTENT_BLOCK_SIZE;
+    memmove (map->extents, map->extents + EXTENT_BLOCK_SIZE,
+      sizeof (fat_extent_t) * map->nr_extents);
+}
+
+/**
+ *  Make a packed block the unpacked end of the map, discarding all of the
+ *  extents after it.
+ */
+    PRIVATE void
+unpack_block (map, block)
+    extent_map_t *map;      // map concerned.
+    uint32_t block;         // block to unpack.
+{
+    struct block_cursor cursor;
+
+    map->nr_extents = 0;
+    cursor_start (map, block, &cursor);
+
+    while (cursor_next (&cursor) == true)
+        push_extent (map, &(cursor.ext));
+
+    map->packed_size = map->blocks [block].offset;
+    map->nr_blocks = block;
+}
+
+/**
+ *  Add an extent to the end of the unpacked array, doubling its capacity
+ *  if it is full.
+ */
+    PRIVATE void
+push_extent (map, ext)
+    extent_map_t *map;          // map to add to.
+    const fat_extent_t *ext;    // extent to add.
+{
+    if (map->nr_extents == map->capacity)
+    {
+        map->capacity = (map->capacity == 0) ? 1 : map->capacity * 2;
+        map->extents = resize (map->extents, sizeof (fat_extent_t) *
+          map->nr_extents, sizeof (fat_extent_t) * map->capacity);
+    }
+
+    map->extents [map->nr_extents] = *ext;
+    map->nr_extents += 1;
+}
+
+/**
+ *  Give back memory from any of a map's buffers that is less than a
+ *  quarter used, leaving room to double.
+ */
+    PRIVATE void
+trim (map)
+    extent_map_t *map;      // map concerned.
+{
+    uint32_t capacity;
+
+    capacity = 2 * MAX (map->nr_extents, 1);
+
+    if (map->capacity > 2 * capacity)
+    {
+        map->extents = resize (map->extents, sizeof (fat_extent_t) *
+          map->nr_extents, sizeof (fat_extent_t) * capacity);
+        map->capacity = capacity;
+    }
+
+    if ((map->packed != NULL) && (map->packed_capacity > 4 *
+          map->packed_size + 256))
+    {
+        map->packed_capacity = 2 * map->packed_size + 256;
+        map->packed = resize (map->packed, map->packed_size,
+          map->packed_capacity);
+    }
+
+    capacity = 2 * map->nr_blocks + 16;
+
+    if ((map->blocks != NULL) && (map->blocks_capacity > 2 * capacity))
+    {
+        map->blocks = resize (map->blocks, sizeof (struct extent_block) *
+          map->nr_blocks, sizeof (struct extent_block) * capacity);
+        map->blocks_capacity = capacity;
+    }
+}
+
+/**
+ *  Return value is the index of the packed block holding a given cluster
+ *  position, which must be before the unpacked extents.
+ */
+    PRIVATE uint32_t
+find_block (map, index)
+    const extent_map_t *map;    // map to search.
+    uint32_t index;             // position in the file, in clusters.
+{
+    uint32_t low = 0, high = map->nr_blocks, mid;
+
+    while (high - low > 1)
+    {
+        mid = low + (high - low) / 2;
+
+        if (map->blocks [mid].logical <= index)
+            low = mid;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/**
+ *  Get ready to decode a packed block.
+ */
+    PRIVATE void
+cursor_start (map, block, cursor)
+    const extent_map_t *map;        // map concerned.
+    uint32_t block;                 // block to decode.
+    struct block_cursor *cursor;    // cursor to set up.
+{
+    cursor->next = map->packed + map->blocks [block].offset;
+    cursor->end = (block + 1 < map->nr_blocks) ?
+        map->packed + map->blocks [block + 1].offset :
+        map->packed + map->packed_size;
+
+    // a block's first extent is stored relative to cluster 0, so it looks
+    // as if it follows an empty extent there.
+    cursor->ext.logical = map->blocks [block].logical;
+    cursor->ext.start = 0;
+    cursor->ext.length = 0;
+}
+
+/**
+ *  Decode the next extent from a block into the cursor.
+ *
+ *  Return value is false if the end of the block has been reached.
+ */
+    PRIVATE bool
+cursor_next (cursor)
+    struct block_cursor *cursor;    // block being decoded.
+{
+    fat_extent_t *ext = &(cursor->ext);
+    uint32_t zigzag;
+
+    if (cursor->next >= cursor->end)
+        return false;
+
+    zigzag = get_varint (&(cursor->next));
+
+    ext->logical += ext->length;
+    ext->start += ext->length + ((zigzag >> 1) ^ (0 - (zigzag & 1)));
+    ext->length = get_varint (&(cursor->next));
+
+    return true;
+}
+
+/**
+ *  Append an integer to the packed bytes, seven bits at a time, low bits
+ *  first. The top bit of each byte is set if more follow.
+ */
+    PRIVATE void
+put_varint (map, value)
+    extent_map_t *map;      // map to add to.
+    uint32_t value;         // integer to encode.
+{
+    if (map->packed_size + VARINT_MAX > map->packed_capacity)
+    {
+        map->packed_capacity = MAX (map->packed_capacity * 2, 256);
+        map->packed = resize (map->packed, map->packed_size,
+          map->packed_capacity);
+    }
+
+    while (value >= 0x80)
+    {
+        map->packed [map->packed_size ++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+
+    map->packed [map->packed_size ++] = (uint8_t) value;
+}
+
+/**
+ *  Decode an integer written by put_varint, advancing the pointer past it.
+ */
+    PRIVATE uint32_t
+get_varint (p)
+    const uint8_t **p;      // points to the encoded integer.
+{
+    uint32_t value = 0;
+    unsigned int shift = 0;
+
+    do
+    {
+        value |= (uint32_t) (**p & 0x7F) << shift;
+        shift += 7;
+    }
+    while ((*((*p) ++) & 0x80) != 0);
+
+    return value;
+}
+
+
+// vim: ts=4 sw=4 et
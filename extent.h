@@ -0,0 +1,51 @@
+/**
+ *  extent.h
+ *
+ *  Procedures for working with extent maps, which record the clusters of
+ *  an open file as runs of contiguous clusters, rather than one entry per
+ *  cluster. Looking up the cluster at a given file offset is a binary
+ *  search, rather than a walk down the chain.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#ifndef MFATIC_EXTENT_H
+#define MFATIC_EXTENT_H
+
+
+// need type definitions for extent_map_t.
+#include "fat.h"
+
+
+// initialise an empty map, or release the memory held by a map.
+extern void extent_init (extent_map_t *map);
+extern void extent_free (extent_map_t *map);
+
+// read a cluster chain from the FAT into an empty map. The walk gives up
+// after limit clusters, so that a corrupt, circular chain cannot hang the
+// daemon. Return value is 0, or -EIO if the chain is corrupt.
+extern int extent_load (extent_map_t *map, fat_cluster_t first,
+  uint32_t limit);
+
+// add a cluster to the end of the file.
+extern void extent_append (extent_map_t *map, fat_cluster_t cluster);
+
+// number of clusters in the map, and the last of them (or 0 if the map
+// is empty).
+extern uint32_t extent_count (const extent_map_t *map);
+extern fat_cluster_t extent_last (const extent_map_t *map);
+
+// Find the cluster at a given position within the file. If run is not
+// NULL, the number of contiguous clusters from there to the end of the
+// extent is stored there. Return value is the cluster index, or 0 if the
+// file is not that long.
+extern fat_cluster_t extent_lookup (const extent_map_t *map,
+  uint32_t index, uint32_t *run);
+
+// forget all clusters from position nr_clusters onwards.
+extern void extent_truncate (extent_map_t *map, uint32_t nr_clusters);
+
+
+#endif // MFATIC_EXTENT_H
+
+// vim: ts=4 sw=4 et
@@ -42,6 +42,10 @@ typedef uint32_t fat_cluster_t;
 #define END_CLUSTER_MARK    0x0FFFFFF8
 #define BAD_CLUSTER_MARK    0x0FFFFFF7
 
+// mask of the bits of a FAT entry that hold the cluster index. The top
+// four bits are reserved, and must be left as they are.
+#define FAT_ENTRY_MASK      0x0FFFFFFF
+
 #endif // MFATIC_32
 
 
@@ -121,6 +125,16 @@ typedef uint8_t fat_attr_t;
 #define FAT_START(v)        ((v)->bpb->nr_reserved_secs)
 #define FAT_SECTORS(v)      ((v)->bpb->sectors_per_fat)
 
+// bit 7 of the extension flags turns off FAT mirroring, leaving only the
+// FAT numbered by the low four bits in use.
+#define EXT_NO_MIRROR       0x0080
+#define EXT_ACTIVE_FAT      0x000F
+
+// the number, and the first sector, of the FAT the daemon uses.
+#define ACTIVE_FAT(v)       ((((v)->bpb->extension_flags & EXT_NO_MIRROR) \
+      != 0) ? ((v)->bpb->extension_flags & EXT_ACTIVE_FAT) : 0)
+#define ACTIVE_FAT_START(v) (FAT_START (v) + ACTIVE_FAT (v) * FAT_SECTORS (v))
+
 // fetch the size of a sector in bytes.
 #define SECTOR_SIZE(v)      ((v)->bpb->bps)
 
@@ -132,12 +146,19 @@ typedef uint8_t fat_attr_t;
       ((v)->bpb->nr_FATs * (v)->bpb->sectors_per_fat)) * SECTOR_SIZE (v))
 
 // get the offset in bytes of a given cluster on a given volume.
-// first parameter points to the volume struct, second to a cluster list
-// struct. Note that the clusters start at index 2, because the first two
+// first parameter points to the volume struct, second is the cluster
+// index. Note that the clusters start at index 2, because the first two
 // entries in the FAT are reserved. This is why we subtract 2 from the
-// cluster index.
+// cluster index. The arithmetic is done in off_t, as offsets on large
+// volumes do not fit in 32 bits.
 #define CLUSTER_OFFSET(v, cl) \
-    (DATA_START (v) + CLUSTER_SIZE (v) * ((cl)->cluster_id - 2))
+    ((off_t) DATA_START (v) + (off_t) CLUSTER_SIZE (v) * ((cl) - 2))
+
+// number of data clusters on the volume. Valid cluster indices run from 2
+// to NR_CLUSTERS + 1; the FAT usually has a few spare entries beyond that,
+// which do not correspond to any cluster.
+#define NR_CLUSTERS(v)      (((v)->bpb->nr_sectors - DATA_START (v) /  \
+      SECTOR_SIZE (v)) / (v)->bpb->spc)
 
 
 /**
@@ -262,6 +283,39 @@ typedef struct
 }
 __attribute__ ((packed)) fat_fsinfo_t;
 
+// Location and magic of the free space checkpoint. mfatic-mkfs writes a
+// summary of the free space in each allocation group into the reserved
+// sectors, starting at FREE_MAP_SECTOR, so that the first mount need not
+// scan the whole FAT. The daemon does not keep the checkpoint up to date,
+// so whoever first changes the FAT clears its magic.
+#define FREE_MAP_SECTOR             16
+#define FREE_MAP_MAGIC_LEN          8
+#define FREE_MAP_MAGIC              "MFATFREE"
+
+/**
+ *  header of the free space checkpoint. The checkpoint only applies to
+ *  the volume it was written for, with the group size it was written
+ *  with, and is followed directly by nr_groups group summaries.
+ */
+typedef struct
+{
+    char        magic [FREE_MAP_MAGIC_LEN];
+    uint32_t    volume_id;
+    uint32_t    nr_clusters;
+    uint32_t    group_size;
+    uint32_t    nr_groups;
+}
+__attribute__ ((packed)) fat_free_map_t;
+
+// summary of one allocation group in the checkpoint: its number of free
+// clusters, and the length of its longest free run.
+typedef struct
+{
+    uint32_t    nr_free;
+    uint32_t    longest;
+}
+__attribute__ ((packed)) fat_free_group_t;
+
 
 /**
  *  layout of a FAT32 directory entry.
@@ -305,19 +359,29 @@ __attribute__ ((packed)) fat_direntry_t;
 #define DIR_CLUSTER_START(d)        (((d)->cluster_msb << 16) | \
   ((d)->cluster_lsb))
 
+// The first byte of the name of a deleted entry. Deleted entries are left
+// where they are, and skipped over, until the directory is compacted. A
+// null byte there instead marks the end of the entries in use.
+#define DIR_ENTRY_DELETED           0xE5
+#define DIR_IS_DELETED(d)           ((uint8_t) (d)->fname [0] == \
+  DIR_ENTRY_DELETED)
+
+// A name that really starts with the marker's byte, as the UTF-8 of many
+// CJK characters does, has 0x05 stored there instead, as in the FAT
+// spec. Names that really start with 0x05 are refused.
+#define DIR_ENTRY_E5_ESCAPE         0x05
+
 
 /**
  *  This structure contains information about a mounted mfatic volume.
- *  The mfatic fuse daemon will maintain exactly one of these structures,
- *  as each instance of the daemon is responsible for servicing file
- *  requests on a single device, specified as a parameter to the mount
- *  command.
+ *  The mfatic fuse daemon keeps one of these for each volume it serves,
+ *  along with the state each part of the daemon keeps for the volume.
  */
-typedef struct
+typedef struct fat_volume
 {
-    // block device file descriptor, used by the fuse daemon for reading
-    // and writing on the disk itself.
-    int                 dev_fd;
+    // the device hosting the volume. All reading and writing on the disk
+    // itself is done through this, using the procedures in device.h.
+    struct fat_device   *dev;
 
     // permissions for accessing the block device.
     mode_t              mode;
@@ -329,18 +393,58 @@ typedef struct
     // pointers to in-memory copies of file system data structures.
     fat_super_block_t   *bpb;
     fat_fsinfo_t        *fsinfo;
+
+    // state kept for the volume by other modules, which is private to
+    // the module named: the metadata block cache (blkcache.c), the free
+    // space map (fat_alloc.c), the FAT if it is mapped (table.c), the
+    // lists of open files (fileio.c) and directories (directory.c), what
+    // is known of the directories being written (directory.c), the
+    // queue of requests waiting on the volume (qos.c), and the files
+    // pinned in memory (pin.c).
+    struct blk_cache    *blk_cache;
+    struct free_space   *free_space;
+    fat_entry_t         *fat_map;
+    struct inode_entry  *open_files;
+    struct inode_entry  *open_dirs;
+    struct dir_cache    *dir_cache;
+    struct qos_queue    *qos;
+    struct pin_set      *pins;
 }
 fat_volume_t;
 
 
-// allow clusters from the allocation table to be read into a linked list
-// in memory, allowing faster access to them.
-typedef struct cluster_list
+// a run of physically contiguous clusters belonging to a file. logical is
+// the position of the first of them within the file, counted in clusters.
+typedef struct
 {
-    fat_entry_t             cluster_id;
-    struct cluster_list     *next;
+    uint32_t            logical;
+    fat_cluster_t       start;
+    uint32_t            length;
 }
-cluster_list_t;
+fat_extent_t;
+
+// the clusters of a file, as an array of extents in file order. Files on
+// FAT are mostly contiguous, so this is usually much smaller than the
+// chain it describes; see extent.h.
+//
+// Badly fragmented files are packed: once a file has more than
+// EXTENT_PACK_THRESHOLD extents, all but the most recent are encoded into
+// blocks of EXTENT_BLOCK_SIZE, and the array holds only the extents after
+// the last block. See extent.c for the encoding.
+typedef struct
+{
+    fat_extent_t        *extents;
+    uint32_t            nr_extents;
+    uint32_t            capacity;
+
+    uint8_t             *packed;
+    size_t              packed_size;
+    size_t              packed_capacity;
+    struct extent_block *blocks;
+    uint32_t            nr_blocks;
+    uint32_t            blocks_capacity;
+}
+extent_map_t;
 
 
 /**
@@ -363,19 +467,22 @@ typedef struct
     // Each file can be uniquely identified based on the starting cluster.
     fat_entry_t     inode;
 
-    // linked list of clusters allocated to this file. By reading the
-    // entire list when the file is opened, we avoid having to repeatedly
-    // seek back to the allocation table, improving performance.
-    cluster_list_t  *clusters;
+    // map of the clusters allocated to this file. By reading the entire
+    // chain when the file is opened, we avoid having to repeatedly seek
+    // back to the allocation table, improving performance.
+    extent_map_t    clusters;
 
-    // pointer to the list entry of the cluster where the next read or
-    // write operation will take place.
-    cluster_list_t  *current_cluster;
+    // cluster where the next read or write operation will take place, or
+    // 0 if the offset is beyond the last cluster.
+    fat_cluster_t   current_cluster;
 
     // i-node of the file's parent directory, and index of this file's
-    // directory entry in the table.
+    // directory entry in the table. The entry's byte offset on the device
+    // is worked out once from the parent's cluster map, so that updating
+    // the entry needs no walk of the directory.
     fat_entry_t     directory_inode;
     unsigned int    dir_entry_index;
+    off_t           dir_entry_offset;
 
     // size of the file in bytes.
     size_t          size;
@@ -383,18 +490,24 @@ typedef struct
     // current offset into the file.
     off_t           offset;
 
+    // offset at which the last read finished. A read starting here is
+    // taken to be part of a sequential scan of the file.
+    off_t           seq_offset;
+
     // number of pointers pointing to this struct. This is equivalent to
     // the number of tables it is in (ie. 2 for directories, and 1 for
     // ordinary files).
     unsigned int    refcount;
 
-    // flags to determine if a file is marked for deletion.
+    // flags to determine if a file is marked for deletion, or pinned in
+    // memory.
     unsigned int    flags;
 }
 fat_file_t;
 
 // flags bitmap constants.
 #define FL_DELETE_ON_CLOSE          0x00000001
+#define FL_PINNED                   0x00000002
 
 
 #endif // MFATIC_FAT_H
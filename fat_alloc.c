@@ -4,130 +4,311 @@
  *  Implementation of procedures to manage the allocation policy of the
  *  Emphatic FAT driver.
  *
+ *  The free space map has to scale to the largest FAT32 volumes, with
+ *  2^28 clusters, so it is kept in two levels. The volume is divided into
+ *  groups of ALLOC_GROUP_SIZE clusters, and for each group we keep the
+ *  number of free clusters and the length of its longest free run, which
+ *  comes to a few tens of kilobytes on the largest volume. The free
+ *  extents within a group are only read from the FAT when clusters are
+ *  allocated there, and are cached under the memory accountant, so the
+ *  groups being written to stay resident and the rest cost nothing.
+ *
+ *  A free run crossing a group boundary is treated as two runs, so the
+ *  largest free region used to place new files is really the largest
+ *  within any one group. Groups are large enough that this makes little
+ *  difference in practice.
+ *
+ *  On sparse image files, spreading the trees out across the volume makes
+ *  the image take up its full size on the host. In compact mode, new
+ *  trees and large files are instead given the lowest free run, so the
+ *  volume fills from the start, and released clusters are discarded to
+ *  punch them out of the image again.
+ *
+ *  The group summaries are normally built by scanning the FAT at mount
+ *  time. A freshly formatted volume carries them in a checkpoint written
+ *  by mfatic-mkfs, which is loaded instead at the first mount, and then
+ *  dropped, as nothing keeps it up to date.
+ *
+ *  Large allocations start on a boundary of the device's allocation
+ *  unit, such as a flash erase block or a RAID stripe, where the free run
+ *  is long enough, so that their writes cover whole units.
+ *
+ *  With online discard, released runs are also queued, and the device is
+ *  told they are unused a batch at a time. A queued run is checked
+ *  against the free extents before it is sent, so clusters that were
+ *  reused in the meantime are never discarded.
+ *
  *  Author: Matthew Signorini
  */
 
-#include <unistd.h>     // needed for SEEK_SET
+#include <string.h>
+#include <time.h>
+#include <err.h>
+#include <pthread.h>
 
 #include "mfatic-config.h"
 #include "const.h"
 #include "utils.h"
 #include "fat.h"
+#include "device.h"
+#include "memacct.h"
+#include "blkcache.h"
+#include "volume.h"
 #include "table.h"
+#include "extent.h"
+#include "pin.h"
 #include "fat_alloc.h"
 
 
-// this structure is used to keep a list of what regions of contiguous
-// clusters are available.
-struct free_region
+// a run of contiguous free clusters.
+struct free_extent
 {
-    fat_entry_t         start;
-    unsigned            length;
-    struct free_region  *next;
+    fat_cluster_t       start;
+    uint32_t            length;
 };
 
+// the free extents within one group, sorted by starting cluster. Cached
+// groups are kept on a list in order of use, most recent first.
+struct group_map
+{
+    uint32_t            group;
+    struct free_extent  *extents;
+    uint32_t            nr_extents;
+    uint32_t            capacity;
+    struct group_map    *prev;
+    struct group_map    *next;
+};
 
-// local function declarations.
-PRIVATE void build_free_list (const fat_entry_t *buffer, size_t length,
-  unsigned int index, struct free_region **list, bool *prev_alloced);
-
-// functions for reading salient items from the free space map.
-PRIVATE fat_cluster_t get_nearest_free (fat_cluster_t near);
-PRIVATE struct free_region * get_largest_region (void);
-
-// higher order function for traversing the free space map to find a
-// desired region.
-PRIVATE struct free_region ** traverse_map (
-  struct free_region ** (*callback) (struct free_region **current,
-      struct free_region **candidate, fat_cluster_t cmp), 
-  fat_cluster_t cluster);
-
-// callbacks given to traverse_map by get_nearest and get_largest.
-PRIVATE struct free_region ** nearest (struct free_region **current,
-  struct free_region **candidate, fat_cluster_t cmp);
-PRIVATE struct free_region ** largest (struct free_region **current,
-  struct free_region **candidate, fat_cluster_t cmp);
+// summary of the free space in one group. longest is exact while the
+// group's extents are cached. Clusters released while they are not may
+// join runs together, so longest is raised to nr_free, which is an upper
+// bound, and the group is marked stale until its extents are next read.
+struct alloc_group
+{
+    uint32_t            nr_free;
+    uint32_t            longest;
+    bool                stale;
+    struct group_map    *map;
+};
 
-PRIVATE unsigned int distance (struct free_region *region, 
-  fat_cluster_t cluster);
+// The free space map of one volume.
+struct free_space
+{
+    // volume whose free space is being managed, and its number of
+    // clusters.
+    const fat_volume_t  *volume_info;
+    uint32_t            nr_clusters;
+
+    // per group summaries.
+    struct alloc_group  *groups;
+    uint32_t            nr_groups;
+
+    // cached group maps, most recently used first, and their accounting.
+    struct group_map    *mru_map;
+    struct group_map    *lru_map;
+    mem_cache_t         map_mem;
+
+    // If the volume's image is mapped, this points to the first FAT
+    // within the mapping; otherwise a group's entries are read into the
+    // buffer.
+    const fat_entry_t   *fat_map;
+    fat_entry_t         *entry_buffer;
+
+    // whether new trees and large files are packed in at the lowest free
+    // clusters, rather than spread out.
+    bool                compact;
+
+    // clusters in the device's allocation unit, and the first cluster
+    // on a unit boundary. align is 1 if allocations are not aligned.
+    uint32_t            align;
+    fat_cluster_t       align_phase;
+
+    // whether released clusters are discarded, the runs released since
+    // the last batch of discards was sent, and when that was.
+    bool                discard;
+    struct free_extent  *pending;
+    uint32_t            nr_pending;
+    time_t              last_discard;
+
+    // lock protecting all of the above, and the statistics.
+    pthread_mutex_t     alloc_lock;
+
+    // variables used to track statistics.
+    uint64_t            nr_allocated_clusters;
+    uint64_t            nr_available_clusters;
+};
 
-// merge a newly freed cluster into two neighbouring free regions.
-PRIVATE void merge_free_regions (struct free_region **left, 
-  struct free_region **right, fat_cluster_t released);
-PRIVATE struct free_region * merge_region (struct free_region *reg,
-  fat_cluster_t released);
+// a batch of discard requests being put together.
+struct discard_batch
+{
+    dev_request_t       *reqs;
+    unsigned int        nr_reqs;
+    unsigned int        capacity;
+};
 
+// memory used by a cached group.
+#define MAP_SIZE(m)     (sizeof (struct group_map) +    \
+      (m)->capacity * sizeof (struct free_extent))
 
-// global list of free regions.
-PRIVATE struct free_region *free_map;
 
-// variables used to track statistics.
-PRIVATE int nr_allocated_clusters;
-PRIVATE int nr_available_clusters;
+// local function declarations.
+PRIVATE const fat_entry_t * read_entries (struct free_space *space,
+  uint32_t group);
+PRIVATE void summarise_group (struct free_space *space, uint32_t group,
+  const fat_entry_t *entries);
+PRIVATE bool load_free_map (struct free_space *space);
+PRIVATE fat_cluster_t group_first (uint32_t group);
+PRIVATE uint32_t group_length (struct free_space *space, uint32_t group);
+PRIVATE uint32_t group_of (struct free_space *space, fat_cluster_t c);
+PRIVATE void init_alignment (struct free_space *space);
+PRIVATE fat_cluster_t align_up (struct free_space *space, fat_cluster_t c);
+
+// functions for managing the cache of group maps.
+PRIVATE struct group_map * load_group (struct free_space *space,
+  uint32_t group);
+PRIVATE void unlink_map (struct free_space *space, struct group_map *m);
+PRIVATE void evict_lru (struct free_space *space);
+PRIVATE size_t map_shrink (mem_cache_t *mem, size_t nbytes);
+
+// functions for finding and changing free extents.
+PRIVATE fat_cluster_t get_nearest_free (struct free_space *space,
+  fat_cluster_t near);
+PRIVATE fat_cluster_t nearest_in_group (struct free_space *space,
+  uint32_t group, fat_cluster_t near);
+PRIVATE uint32_t find_extent (const struct group_map *m, fat_cluster_t c);
+PRIVATE struct group_map * largest_run (struct free_space *space,
+  uint32_t *index);
+PRIVATE struct group_map * first_run (struct free_space *space,
+  uint32_t *index);
+PRIVATE fat_cluster_t take_free_run (struct free_space *space,
+  fat_cluster_t near, uint32_t length);
+PRIVATE void take_run (struct free_space *space, struct group_map *m,
+  uint32_t index, fat_cluster_t c, uint32_t length);
+PRIVATE void insert_extent (struct free_space *space, struct group_map *m,
+  uint32_t index, fat_cluster_t start, uint32_t length);
+PRIVATE void remove_extent (struct group_map *m, uint32_t index);
+PRIVATE void release_range (struct free_space *space, fat_cluster_t start,
+  uint32_t length);
+PRIVATE void free_run (struct free_space *space, fat_cluster_t start,
+  uint32_t length);
+PRIVATE void update_longest (struct free_space *space, uint32_t group);
+
+// functions for discarding free space.
+PRIVATE void queue_discard (struct free_space *space, fat_cluster_t start,
+  uint32_t length);
+PRIVATE void send_pending (struct free_space *space);
+PRIVATE void discard_free (struct free_space *space,
+  struct discard_batch *batch, fat_cluster_t start, fat_cluster_t end,
+  uint32_t min_length);
+PRIVATE int submit_discards (struct free_space *space,
+  struct discard_batch *batch, uint64_t *nr_discarded);
 
 
 /**
  *  Scan through the file allocation table on the device being mounted,
- *  and build a map of where the free clusters are located. This function
- *  should be called once, at mount time.
+ *  and build a summary of where the free clusters are located. This
+ *  function should be called once, at mount time.
  */
     PUBLIC void
 init_clusters_map (v)
-    const fat_volume_t *v;  // volume struct for the mounted filesystem.
+    fat_volume_t *v;        // volume struct for the mounted filesystem.
 {
-    struct free_region *current = safe_malloc (sizeof (struct free_region));
-    bool prev_alloced = true;
-    size_t nr_entries = SECTOR_SIZE (v) / sizeof (fat_entry_t);
+    struct free_space *space = safe_malloc (sizeof (struct free_space));
+    off_t fat_offset = (off_t) ACTIVE_FAT_START (v) * SECTOR_SIZE (v);
+    size_t fat_length = FAT_SECTORS (v) * SECTOR_SIZE (v);
+
+    memset (space, 0, sizeof (struct free_space));
+    pthread_mutex_init (&(space->alloc_lock), NULL);
+    space->volume_info = v;
+    v->free_space = space;
+
+    // A damaged boot sector could claim more clusters than the FAT has
+    // entries for. Only clusters with an entry can be used.
+    space->nr_clusters = MIN (NR_CLUSTERS (v), fat_length / FAT_ENTSIZE - 2);
+    space->nr_groups = (space->nr_clusters + ALLOC_GROUP_SIZE - 1) /
+        ALLOC_GROUP_SIZE;
+
+    space->groups = safe_malloc (sizeof (struct alloc_group) *
+      MAX (space->nr_groups, 1));
+    memset (space->groups, 0, sizeof (struct alloc_group) *
+      MAX (space->nr_groups, 1));
+
+    // If the image is mapped, we can scan the FAT in place. Otherwise the
+    // FAT is read one group at a time.
+    if ((space->fat_map = dev_map (v->dev, fat_offset, fat_length)) == NULL)
+        space->entry_buffer = safe_malloc (ALLOC_GROUP_SIZE * FAT_ENTSIZE);
+
+    // a new volume's summaries are in its checkpoint. Otherwise scan the
+    // FAT, letting the kernel know that we are about to read it from start
+    // to finish.
+    if (load_free_map (space) == false)
+    {
+        if (space->fat_map != NULL)
+            dev_advise (v->dev, fat_offset, fat_length, DEV_ADV_SEQUENTIAL);
 
-    nr_allocated_clusters = 0;
-    nr_available_clusters = 0;
+        for (uint32_t g = 0; g < space->nr_groups; g ++)
+            summarise_group (space, g, read_entries (space, g));
+    }
 
-    // FAT is stored in an integer number of sectors, so we will read it in
-    // blocks of one sector.
-    fat_entry_t *entry_buffer = safe_malloc (SECTOR_SIZE (v));
+    space->nr_allocated_clusters = space->nr_clusters -
+        space->nr_available_clusters;
 
-    // make sure the global var points to the start of the list.
-    free_map = current;
+    init_alignment (space);
 
-    // zero all fields in the first list entry, to handle the boundary
-    // condition where the device has no available clusters at all.
-    current->length = 0;
+    // the scan is finished. From now on, FAT accesses are random.
+    if (space->fat_map != NULL)
+        dev_advise (v->dev, fat_offset, fat_length, DEV_ADV_NORMAL);
 
-    // seek the device to the start of the FAT.
-    safe_seek (v->dev_fd, FAT_START (v) * SECTOR_SIZE (v), SEEK_SET);
+    // released clusters are discarded if the volume was mounted with
+    // the discard option, or packed in compact mode.
+    space->compact = v->dev->params.alloc_compact;
 
-    // step through each sector of the FAT, and process all the FAT entries
-    // in it.
-    for (unsigned int i = 0; i < FAT_SECTORS (v); i ++)
+    if ((v->dev->params.discard == true) || (space->compact == true))
     {
-        // read the next sector from the FAT.
-        safe_read (v->dev_fd, (void *) entry_buffer, SECTOR_SIZE (v));
-
-        // step through the FAT entries, building the free list.
-        build_free_list (entry_buffer, nr_entries, i, &current, 
-          &prev_alloced);
+        space->discard = true;
+        space->pending = safe_malloc (sizeof (struct free_extent) *
+          DISCARD_MAX_RUNS);
+        space->last_discard = time (NULL);
     }
 
-    // release the memory allocated to our sector buffer.
-    safe_free ((void **) &entry_buffer);
+    // the free extents of groups in use compete with the other caches for
+    // memory.
+    space->map_mem.name = "free map";
+    space->map_mem.shrink = map_shrink;
+    space->map_mem.priv = space;
+    mem_register (&(space->map_mem));
 }
 
 /**
  *  Return the number of clusters which are allocated to files.
  */
-    PUBLIC int
+    PUBLIC uint64_t
 used_clusters (void)
 {
-    return nr_allocated_clusters;
+    struct free_space *space = vol_current ()->free_space;
+    uint64_t retval;
+
+    pthread_mutex_lock (&(space->alloc_lock));
+    retval = space->nr_allocated_clusters;
+    pthread_mutex_unlock (&(space->alloc_lock));
+
+    return retval;
 }
 
 /**
  *  Return the number of clusters which are available for allocation.
  */
-    PUBLIC int
+    PUBLIC uint64_t
 free_clusters (void)
 {
-    return nr_available_clusters;
+    struct free_space *space = vol_current ()->free_space;
+    uint64_t retval;
+
+    pthread_mutex_lock (&(space->alloc_lock));
+    retval = space->nr_available_clusters;
+    pthread_mutex_unlock (&(space->alloc_lock));
+
+    return retval;
 }
 
 /**
@@ -144,72 +325,265 @@ free_clusters (void)
 new_cluster (near)
     fat_cluster_t near;         // current end of chain.
 {
-    fat_cluster_t chosen = get_nearest_free (near);
+    struct free_space *space = vol_current ()->free_space;
+    fat_cluster_t chosen;
+
+    pthread_mutex_lock (&(space->alloc_lock));
 
     // store the new allocation in the FAT.
-    put_fat_entry (chosen, END_CLUSTER_MARK);
-    put_fat_entry (near, chosen);
+    if ((chosen = get_nearest_free (space, near)) != 0)
+    {
+        put_fat_entry (chosen, END_CLUSTER_MARK);
 
-    // update the cluster allocation stats.
-    nr_allocated_clusters += 1;
-    nr_available_clusters -= 1;
+        if (near != 0)
+            put_fat_entry (near, chosen);
+    }
+
+    pthread_mutex_unlock (&(space->alloc_lock));
 
     return chosen;
 }
 
 /**
- *  Allocate a cluster for a newly created file. The policy used by
- *  Emphatic is to locate the largest contiguous run of free clusters,
- *  and allocate the cluster in the middle of it. The selected cluster
- *  will be marked as allocated in the FAT, and will hold the end of
- *  file marker.
+ *  Allocate a cluster for a new node that starts an area of the volume of
+ *  its own, such as a directory at the top of a tree, whose files are
+ *  then placed around it. The policy used by Emphatic is to locate the
+ *  largest contiguous run of free clusters, and allocate the cluster in
+ *  the middle of it. In compact mode, the lowest free cluster is taken
+ *  instead. The selected cluster will be marked as allocated in the FAT,
+ *  and will hold the end of file marker.
  *
- *  Return value is the index of the cluster chosen.
+ *  Return value is the index of the cluster chosen, or 0 if there are no
+ *  free clusters.
  */
     PUBLIC fat_cluster_t
 fat_alloc_node (void)
 {
-    struct free_region *longest = get_largest_region (), *right;
-    fat_entry_t chosen = longest->start + (longest->length / 2);
+    struct free_space *space = vol_current ()->free_space;
+    struct group_map *m;
+    fat_cluster_t chosen;
+    uint32_t i;
+
+    pthread_mutex_lock (&(space->alloc_lock));
+
+    m = (space->compact == true) ? first_run (space, &i) :
+        largest_run (space, &i);
+
+    if (m == NULL)
+    {
+        pthread_mutex_unlock (&(space->alloc_lock));
+        return 0;
+    }
 
-    // break up the free region into two smaller regions.
-    right = safe_malloc (sizeof (struct free_region));
-    right->start = chosen + 1;
-    right->length = longest->length - (chosen - longest->start);
-    longest->length = chosen - longest->start;
-    right->next = longest->next;
-    longest->next = right;
+    // split the run in the middle, or take its start in compact mode.
+    chosen = m->extents [i].start;
+
+    if (space->compact == false)
+        chosen += m->extents [i].length / 2;
+
+    take_run (space, m, i, chosen, 1);
 
     // mark the chosen cluster with the end of file sentinel in the FAT.
     put_fat_entry (chosen, END_CLUSTER_MARK);
 
+    pthread_mutex_unlock (&(space->alloc_lock));
+
+    return chosen;
+}
+
+/**
+ *  Allocate a cluster for a new file close to a given cluster, such as
+ *  just after the last file created in the same directory. The first
+ *  free cluster at or after near in its group is chosen, so that files
+ *  which are created and written one after another are laid out in that
+ *  order, each after the data of the last. Failing that, the nearest
+ *  free cluster in either direction is chosen.
+ *
+ *  Return value is the cluster chosen, or 0 if there are no free
+ *  clusters.
+ */
+    PUBLIC fat_cluster_t
+fat_alloc_near (near)
+    fat_cluster_t near;         // where the new file should go.
+{
+    struct free_space *space = vol_current ()->free_space;
+    uint32_t group = group_of (space, near), i;
+    fat_cluster_t chosen = 0;
+    struct group_map *m;
+
+    pthread_mutex_lock (&(space->alloc_lock));
+
+    if ((space->nr_groups != 0) && (space->groups [group].nr_free != 0))
+    {
+        m = load_group (space, group);
+
+        // the extent before i holds near, if near is free.
+        if (((i = find_extent (m, near)) > 0) && (near <
+              m->extents [i - 1].start + m->extents [i - 1].length))
+        {
+            chosen = near;
+            i -= 1;
+        }
+        else if (i < m->nr_extents)
+        {
+            chosen = m->extents [i].start;
+        }
+
+        if (chosen != 0)
+            take_run (space, m, i, chosen, 1);
+    }
+
+    if (chosen == 0)
+        chosen = get_nearest_free (space, near);
+
+    // mark the chosen cluster with the end of file sentinel in the FAT.
+    if (chosen != 0)
+        put_fat_entry (chosen, END_CLUSTER_MARK);
+
+    pthread_mutex_unlock (&(space->alloc_lock));
+
     return chosen;
 }
 
 /**
  *  Allocate one or more new clusters onto the end of an existing file.
+ *  Return value is the number of clusters allocated.
  */
-    PUBLIC void
+    PUBLIC size_t
 alloc_clusters (fd, nr_clusters)
     fat_file_t *fd;         // file to allocate clusters to.
     size_t nr_clusters;     // number of clusters to allocate.
 {
-    cluster_list_t *cp, *new_cluster;
+    fat_cluster_t last = extent_last (&(fd->clusters)), chosen;
+    size_t done;
 
-    // step to the end of file cluster.
-    for (cp = fd->clusters; cp->next != NULL; cp = cp->next)
-        ;
+    // Allocate clusters on the device for the file, chaining each onto
+    // the last, and add them to the file's map in memory.
+    for (done = 0; done < nr_clusters; done ++)
+    {
+        if ((chosen = new_cluster (last)) == 0)
+            break;
 
-    // Allocate clusters on the device for the file, and create new cluster
-    // list entries in memory.
-    for ( ; nr_clusters != 0; nr_clusters -= 1)
+        extent_append (&(fd->clusters), chosen);
+        last = chosen;
+    }
+
+    if ((done > 0) && ((fd->flags & FL_PINNED) != 0))
+        pin_resize (fd);
+
+    return done;
+}
+
+/**
+ *  Allocate a contiguous run of clusters onto the end of a file, for
+ *  files such as directories that are always read from start to end.
+ *  The run follows on from the file's last cluster if there is room
+ *  there, and is otherwise the free run nearest to it. If no free run is
+ *  long enough, the clusters are allocated one at a time instead, as by
+ *  alloc_clusters.
+ *
+ *  Return value is the number of clusters allocated.
+ */
+    PUBLIC size_t
+alloc_contiguous (fd, nr_clusters)
+    fat_file_t *fd;         // file to allocate clusters to.
+    uint32_t nr_clusters;   // length of the run wanted.
+{
+    struct free_space *space = vol_current ()->free_space;
+    fat_cluster_t last = extent_last (&(fd->clusters)), start;
+
+    if (nr_clusters == 0)
+        return 0;
+
+    pthread_mutex_lock (&(space->alloc_lock));
+
+    // chain the run together, and onto the end of the file.
+    if ((start = take_free_run (space, last + 1, nr_clusters)) != 0)
     {
-        new_cluster = safe_malloc (sizeof (cluster_list_t));
-        new_cluster->cluster_id = get_nearest_free (cp->cluster_id);
-        new_cluster->next = NULL;
-        cp->next = new_cluster;
-        cp = cp->next;
+        put_fat_chain (start, nr_clusters);
+
+        if (last != 0)
+            put_fat_entry (last, start);
     }
+
+    pthread_mutex_unlock (&(space->alloc_lock));
+
+    if (start == 0)
+        return alloc_clusters (fd, nr_clusters);
+
+    for (uint32_t i = 0; i < nr_clusters; i ++)
+        extent_append (&(fd->clusters), start + i);
+
+    if ((fd->flags & FL_PINNED) != 0)
+        pin_resize (fd);
+
+    return nr_clusters;
+}
+
+/**
+ *  Allocate clusters onto the end of a file that is being made large all
+ *  at once, such as one truncated up to the size it is going to be. They
+ *  are taken from the largest free region, a run at a time, rather than
+ *  next to the file, so that a big file does not use up the space that
+ *  the small files around it would grow into. In compact mode, they are
+ *  taken from the lowest free runs instead.
+ *
+ *  Return value is the number of clusters allocated.
+ */
+    PUBLIC size_t
+alloc_large (fd, nr_clusters)
+    fat_file_t *fd;         // file to allocate clusters to.
+    size_t nr_clusters;     // number of clusters to allocate.
+{
+    struct free_space *space = vol_current ()->free_space;
+    fat_cluster_t last = extent_last (&(fd->clusters)), start, end;
+    struct group_map *m;
+    uint32_t i, length;
+    size_t done = 0;
+
+    pthread_mutex_lock (&(space->alloc_lock));
+
+    while (done < nr_clusters)
+    {
+        m = (space->compact == true) ? first_run (space, &i) :
+            largest_run (space, &i);
+
+        if (m == NULL)
+            break;
+
+        start = m->extents [i].start;
+        end = start + m->extents [i].length;
+        length = MIN (m->extents [i].length, nr_clusters - done);
+
+        // begin on a unit boundary, unless that would leave too little
+        // of the run to fill a unit, or what is left of the file.
+        if (align_up (space, start) + MIN (length, space->align) <= end)
+        {
+            start = align_up (space, start);
+            length = MIN (length, end - start);
+        }
+
+        take_run (space, m, i, start, length);
+
+        // chain the run together, and onto the end of the file.
+        put_fat_chain (start, length);
+
+        if (last != 0)
+            put_fat_entry (last, start);
+
+        for (uint32_t j = 0; j < length; j ++)
+            extent_append (&(fd->clusters), start + j);
+
+        last = start + length - 1;
+        done += length;
+    }
+
+    pthread_mutex_unlock (&(space->alloc_lock));
+
+    if ((done > 0) && ((fd->flags & FL_PINNED) != 0))
+        pin_resize (fd);
+
+    return done;
 }
 
 /**
@@ -220,339 +594,1138 @@ alloc_clusters (fd, nr_clusters)
  */
     PUBLIC void
 release_cluster (c)
-    fat_cluster_t c;            // cluster offset, from start of data.
+    fat_cluster_t c;            // cluster index.
 {
-    struct free_region **left, **right, *temp = NULL;
+    struct free_space *space = vol_current ()->free_space;
+    pthread_mutex_lock (&(space->alloc_lock));
+    release_range (space, c, 1);
+    send_pending (space);
+    pthread_mutex_unlock (&(space->alloc_lock));
+}
 
-    // to start off, *left must equal NULL, or merge_free_regions will
-    // die.
-    left = &temp;
+/**
+ *  Shorten a file to a given number of clusters, releasing the rest back
+ *  to the free pool. With nr_clusters 0, this releases the whole file.
+ */
+    PUBLIC void
+truncate_clusters (fd, nr_clusters)
+    fat_file_t *fd;         // file to shorten.
+    uint32_t nr_clusters;   // clusters to keep.
+{
+    struct free_space *space = vol_current ()->free_space;
+    uint32_t count = extent_count (&(fd->clusters)), run;
+    fat_cluster_t c;
 
-    // The cluster being released must sit somewhere between two free
-    // regions. Step through the list of free regions until we find the
-    // bordering regions.
-    for (right = &free_map; (*right != NULL) && ((*right)->start < c); 
-      right = &((*right)->next))
+    if (nr_clusters >= count)
+        return;
+
+    // end the chain after the clusters that are kept.
+    if (nr_clusters != 0)
     {
-        left = right;
+        put_fat_entry (extent_lookup (&(fd->clusters), nr_clusters - 1,
+            NULL), END_CLUSTER_MARK);
     }
 
-    merge_free_regions (left, right, c);
+    // release the rest, a contiguous run at a time.
+    pthread_mutex_lock (&(space->alloc_lock));
 
-    // record the cluster as being available.
-    put_fat_entry (c, 0x00000000);
+    for (uint32_t i = nr_clusters; i < count; i += run)
+    {
+        c = extent_lookup (&(fd->clusters), i, &run);
+        release_range (space, c, run);
+    }
 
-    // update the allocation stats.
-    nr_allocated_clusters -= 1;
-    nr_available_clusters += 1;
+    send_pending (space);
+    pthread_mutex_unlock (&(space->alloc_lock));
+
+    extent_truncate (&(fd->clusters), nr_clusters);
+
+    // a pinned file lets go of the clusters it no longer has.
+    if ((fd->flags & FL_PINNED) != 0)
+        pin_resize (fd);
 }
 
 /**
- *  Step through a buffer of FAT entries, and build a list of free regions.
+ *  Tell the device that the free space on the volume holds nothing of
+ *  use, like fstrim. Every free run of at least min_length clusters is
+ *  discarded, a group at a time, so that allocation is only held up for
+ *  as long as one group's discards take.
+ *
+ *  Return value is the number of clusters discarded, or a negative errno
+ *  if the device does not support discard.
+ */
+    PUBLIC int64_t
+trim_free_space (min_length)
+    uint32_t min_length;        // shortest run worth discarding.
+{
+    struct free_space *space = vol_current ()->free_space;
+    struct discard_batch batch = {NULL, 0, 0};
+    uint64_t nr_discarded = 0;
+    int retval = 0;
+
+    min_length = MAX (min_length, 1);
+
+    for (uint32_t g = 0; (g < space->nr_groups) && (retval == 0); g ++)
+    {
+        pthread_mutex_lock (&(space->alloc_lock));
+
+        // everything queued for discard is covered by the trim.
+        if (g == 0)
+            space->nr_pending = 0;
+
+        if (space->groups [g].nr_free >= min_length)
+        {
+            discard_free (space, &batch, group_first (g),
+              group_first (g) + group_length (space, g), min_length);
+            retval = submit_discards (space, &batch, &nr_discarded);
+        }
+
+        pthread_mutex_unlock (&(space->alloc_lock));
+    }
+
+    safe_free ((void **) &(batch.reqs));
+
+    return (retval != 0) ? retval : (int64_t) nr_discarded;
+}
+
+/**
+ *  Get the FAT entries for a group's clusters, either in place in the
+ *  mapped image, or read into the entry buffer.
+ *
+ *  Return value points to the entry for the group's first cluster.
+ */
+    PRIVATE const fat_entry_t *
+read_entries (space, group)
+    struct free_space *space;   // free space map of the volume.
+    uint32_t group;             // group concerned.
+{
+    const fat_volume_t *v = space->volume_info;
+    fat_cluster_t first = group_first (group);
+
+    if (space->fat_map != NULL)
+        return space->fat_map + first;
+
+    dev_read (v->dev, (off_t) ACTIVE_FAT_START (v) * SECTOR_SIZE (v) +
+        (off_t) first * FAT_ENTSIZE,
+      space->entry_buffer, group_length (space, group) * FAT_ENTSIZE);
+
+    return space->entry_buffer;
+}
+
+/**
+ *  Count the free clusters in a group and find its longest free run,
+ *  without keeping the extents themselves.
  */
     PRIVATE void
-build_free_list (buffer, length, index, list, prev_alloced)
-    const fat_entry_t *buffer;  // buffer of FAT entries.
-    size_t length;              // number of entries in the buffer.
-    unsigned int index;         // which sector of the FAT is this.
-    struct free_region **list;  // points to the pointer to end of list.
-    bool *prev_alloced;         // true if the last FAT entry allocated.
-{
-    struct free_region *new;
-
-    // step through each FAT entry in the buffer, checking if it is marked
-    // as free. Any entry which does not contain the free cluster sentinel
-    // is deemed to be already allocated.
-    for (unsigned int i = 0; i < length; i ++)
-    {
-        // we can use this macro to compare a FAT entry to the free cluster
-        // sentinel.
-        if (IS_FREE_CLUSTER (buffer [i]))
+summarise_group (space, group, entries)
+    struct free_space *space;   // free space map of the volume.
+    uint32_t group;             // group concerned.
+    const fat_entry_t *entries; // the group's FAT entries.
+{
+    struct alloc_group *grp = &(space->groups [group]);
+    uint32_t run = 0, length = group_length (space, group);
+
+    grp->nr_free = grp->longest = 0;
+    grp->stale = false;
+
+    for (uint32_t i = 0; i < length; i ++)
+    {
+        if (IS_FREE_CLUSTER (entries [i]))
+        {
+            grp->nr_free += 1;
+            run += 1;
+            grp->longest = MAX (grp->longest, run);
+        }
+        else
+        {
+            run = 0;
+        }
+    }
+
+    space->nr_available_clusters += grp->nr_free;
+}
+
+/**
+ *  Load the group summaries from the free space checkpoint written by
+ *  mfatic-mkfs, and drop the checkpoint, as it will be out of date as
+ *  soon as anything is allocated. The checkpoint is only used if it was
+ *  written for this volume and group size, and agrees with the free count
+ *  in the FSINFO sector, which any other driver that has written to the
+ *  volume since would have changed.
+ *
+ *  Return value is true if the summaries were loaded, or false if the FAT
+ *  must be scanned.
+ */
+    PRIVATE bool
+load_free_map (space)
+    struct free_space *space;   // free space map of the volume.
+{
+    const fat_volume_t *v = space->volume_info;
+    off_t offset = (off_t) FREE_MAP_SECTOR * SECTOR_SIZE (v);
+    size_t length = space->nr_groups * sizeof (fat_free_group_t);
+    fat_free_group_t *summaries;
+    fat_free_map_t header;
+    uint64_t nr_free = 0;
+    bool valid = true;
+
+    // the checkpoint has to fit within the reserved sectors.
+    if (offset + (off_t) (sizeof (fat_free_map_t) + length) >
+      (off_t) FAT_START (v) * SECTOR_SIZE (v))
+        return false;
+
+    dev_read (v->dev, offset, &header, sizeof (fat_free_map_t));
+
+    if ((memcmp (header.magic, FREE_MAP_MAGIC, FREE_MAP_MAGIC_LEN) != 0) ||
+      (header.volume_id != v->bpb->volume_id) ||
+      (header.nr_clusters != space->nr_clusters) ||
+      (header.group_size != ALLOC_GROUP_SIZE) ||
+      (header.nr_groups != space->nr_groups))
+        return false;
+
+    summaries = safe_malloc (MAX (length, 1));
+    dev_read (v->dev, offset + sizeof (fat_free_map_t), summaries, length);
+
+    for (uint32_t g = 0; valid && (g < space->nr_groups); g ++)
+    {
+        valid = (summaries [g].nr_free <= group_length (space, g)) &&
+          (summaries [g].longest <= summaries [g].nr_free);
+        nr_free += summaries [g].nr_free;
+    }
+
+    if (valid && (nr_free == v->fsinfo->nr_free_clusters))
+    {
+        for (uint32_t g = 0; g < space->nr_groups; g ++)
+        {
+            space->groups [g].nr_free = summaries [g].nr_free;
+            space->groups [g].longest = summaries [g].longest;
+        }
+
+        space->nr_available_clusters = nr_free;
+    }
+    else
+        valid = false;
+
+    safe_free ((void **) &summaries);
+    vol_drop_free_map (v);
+
+    return valid;
+}
+
+/**
+ *  Return value is the first cluster in a group.
+ */
+    PRIVATE fat_cluster_t
+group_first (group)
+    uint32_t group;         // group concerned.
+{
+    return 2 + group * ALLOC_GROUP_SIZE;
+}
+
+/**
+ *  Return value is the number of clusters in a group. Only the last group
+ *  can be short.
+ */
+    PRIVATE uint32_t
+group_length (space, group)
+    struct free_space *space;   // free space map of the volume.
+    uint32_t group;             // group concerned.
+{
+    return MIN (ALLOC_GROUP_SIZE,
+      space->nr_clusters - group * ALLOC_GROUP_SIZE);
+}
+
+/**
+ *  Return value is the group holding a given cluster. Clusters outside
+ *  the volume are taken to be in the nearest group.
+ */
+    PRIVATE uint32_t
+group_of (space, c)
+    struct free_space *space;   // free space map of the volume.
+    fat_cluster_t c;            // cluster index.
+{
+    if ((c < 2) || (space->nr_groups == 0))
+        return 0;
+
+    return MIN ((c - 2) / ALLOC_GROUP_SIZE, space->nr_groups - 1);
+}
+
+/**
+ *  Work out the device's allocation unit in clusters, from the mount
+ *  options or what the device reports, and which clusters start on a
+ *  unit boundary, from where the data region starts. The unit is the
+ *  least common multiple of the erase block size and the stripe width,
+ *  so that a run aligned to it is aligned to both. Allocations are left
+ *  unaligned if no cluster can start on a boundary.
+ */
+    PRIVATE void
+init_alignment (space)
+    struct free_space *space;   // free space map of the volume.
+{
+    const fat_volume_t *v = space->volume_info;
+    const fat_device_t *dev = v->dev;
+    uint64_t unit = (uint64_t) dev->params.align_kb * 1024;
+    uint64_t stripe = (uint64_t) dev->params.stripe_kb * 1024;
+    uint64_t cluster_size = CLUSTER_SIZE (v), skew, a, b;
+
+    space->align = 1;
+    space->align_phase = 2;
+
+    if ((unit != 0) && (stripe != 0))
+    {
+        for (a = unit, b = stripe; b != 0; )
+        {
+            skew = a % b;
+            a = b;
+            b = skew;
+        }
+
+        unit = unit / a * stripe;
+    }
+    else if (unit == 0)
+    {
+        unit = (stripe != 0) ? stripe : (uint64_t) dev->io_opt;
+    }
+
+    // units no larger than a cluster need no alignment of their own.
+    if (unit <= cluster_size)
+        return;
+
+    // bytes from the start of the data region to the next boundary.
+    skew = (unit - (uint64_t) DATA_START (v) % unit) % unit;
+
+    if ((unit % cluster_size != 0) || (skew % cluster_size != 0))
+    {
+        warnx ("Clusters can't be aligned to %llu bytes; not aligning",
+          (unsigned long long) unit);
+        return;
+    }
+
+    space->align = (uint32_t) MIN (unit / cluster_size, ALLOC_GROUP_SIZE);
+    space->align_phase = 2 + (fat_cluster_t) (skew / cluster_size);
+}
+
+/**
+ *  Return value is the first cluster at or after c that starts on a
+ *  boundary of the device's allocation unit.
+ */
+    PRIVATE fat_cluster_t
+align_up (space, c)
+    struct free_space *space;   // free space map of the volume.
+    fat_cluster_t c;            // cluster to round up.
+{
+    if (c <= space->align_phase)
+        return space->align_phase;
+
+    return c + (space->align - (c - space->align_phase) % space->align) %
+        space->align;
+}
+
+/**
+ *  Get the free extents of a group, reading them from the FAT if they are
+ *  not cached. The group becomes the most recently used.
+ */
+    PRIVATE struct group_map *
+load_group (space, group)
+    struct free_space *space;   // free space map of the volume.
+    uint32_t group;             // group wanted.
+{
+    struct alloc_group *grp = &(space->groups [group]);
+    struct group_map *m = grp->map;
+    const fat_entry_t *entries;
+    uint32_t nr_runs = 0, length = group_length (space, group);
+    fat_cluster_t first = group_first (group);
+    bool prev_free = false;
+
+    if (m != NULL)
+    {
+        mem_hit (&(space->map_mem));
+        unlink_map (space, m);
+    }
+    else
+    {
+        mem_miss (&(space->map_mem), group);
+        entries = read_entries (space, group);
+
+        // count the runs first, so the extents can be allocated at the
+        // right size.
+        for (uint32_t i = 0; i < length; i ++)
         {
-            // If this is the first cluster in a free region, we will need
-            // to create a new entry in the list.
-            if (*prev_alloced != false)
+            if (IS_FREE_CLUSTER (entries [i]) && (prev_free == false))
+                nr_runs += 1;
+
+            prev_free = IS_FREE_CLUSTER (entries [i]);
+        }
+
+        m = safe_malloc (sizeof (struct group_map));
+        m->group = group;
+        m->nr_extents = 0;
+        m->capacity = MAX (nr_runs, 1);
+
+        while (mem_charge (&(space->map_mem), MAP_SIZE (m)) == false)
+            evict_lru (space);
+
+        m->extents = safe_malloc (sizeof (struct free_extent) *
+          m->capacity);
+
+        // now record the runs.
+        prev_free = false;
+
+        for (uint32_t i = 0; i < length; i ++)
+        {
+            if (IS_FREE_CLUSTER (entries [i]) == false)
             {
-                *prev_alloced = false;
-
-                // create the new item, and link into the list.
-                new = safe_malloc (sizeof (struct free_region));
-                new->start = (index * length) + i;
-                new->length = 1;
-                new->next = NULL;
-                (*list)->next = new;
-                *list = new;
+                prev_free = false;
+                continue;
+            }
+
+            if (prev_free == true)
+            {
+                m->extents [m->nr_extents - 1].length += 1;
             }
             else
             {
-                // not the first free cluster, so we just need to increment
-                // the length of the current region.
-                (*list)->length += 1;
+                m->extents [m->nr_extents].start = first + i;
+                m->extents [m->nr_extents].length = 1;
+                m->nr_extents += 1;
             }
 
-            // record stats.
-            nr_available_clusters += 1;
+            prev_free = true;
         }
-        else
-        {
-            // record for the next iteration that the last FAT entry was
-            // allocated to a file.
-            *prev_alloced = true;
 
-            // record stats.
-            nr_allocated_clusters += 1;
-        }
+        grp->map = m;
+        update_longest (space, group);
     }
+
+    // link at the most recently used end.
+    m->prev = NULL;
+    m->next = space->mru_map;
+
+    if (space->mru_map != NULL)
+        space->mru_map->prev = m;
+    else
+        space->lru_map = m;
+
+    space->mru_map = m;
+
+    return m;
+}
+
+/**
+ *  Unlink a group map from the list of cached maps.
+ */
+    PRIVATE void
+unlink_map (space, m)
+    struct free_space *space;   // free space map of the volume.
+    struct group_map *m;        // map to unlink.
+{
+    if (m->prev != NULL)
+        m->prev->next = m->next;
+    else
+        space->mru_map = m->next;
+
+    if (m->next != NULL)
+        m->next->prev = m->prev;
+    else
+        space->lru_map = m->prev;
+}
+
+/**
+ *  Drop the least recently used group map. Its summary stays exact, as
+ *  nothing has changed.
+ */
+    PRIVATE void
+evict_lru (space)
+    struct free_space *space;   // free space map of the volume.
+{
+    struct group_map *m = space->lru_map;
+
+    unlink_map (space, m);
+    space->groups [m->group].map = NULL;
+
+    mem_evicted (&(space->map_mem), m->group, MAP_SIZE (m));
+    mem_uncharge (&(space->map_mem), MAP_SIZE (m));
+
+    safe_free ((void **) &(m->extents));
+    safe_free ((void **) &m);
+}
+
+/**
+ *  Called by the memory accountant to make the cache of group maps
+ *  smaller. Gives up straight away if the allocator is in use.
+ *
+ *  Return value is the number of bytes released.
+ */
+    PRIVATE size_t
+map_shrink (mem, nbytes)
+    mem_cache_t *mem;       // the cache's accounting structure.
+    size_t nbytes;          // bytes to release.
+{
+    struct free_space *space = mem->priv;
+    size_t freed = 0;
+
+    if (pthread_mutex_trylock (&(space->alloc_lock)) != 0)
+        return 0;
+
+    while ((freed < nbytes) && (space->lru_map != NULL))
+    {
+        freed += MAP_SIZE (space->lru_map);
+        evict_lru (space);
+    }
+
+    pthread_mutex_unlock (&(space->alloc_lock));
+
+    return freed;
 }
 
 /**
  *  locate the nearest free cluster to a given cluster, and modify the
- *  free space map to indicate that it is used.
+ *  free space map to indicate that it is used. Groups are searched
+ *  outwards from near's group, and the nearest cluster within the first
+ *  groups found to have any free space is chosen.
  *
- *  Return value is the cluster which was selected.
+ *  Return value is the cluster which was selected, or 0 if there are no
+ *  free clusters.
  */
     PRIVATE fat_cluster_t
-get_nearest_free (near)
+get_nearest_free (space, near)
+    struct free_space *space;   // free space map of the volume.
     fat_cluster_t near;         // find the closest cluster to this one.
 {
-    // look up the nearest free region.
-    struct free_region **reg = traverse_map (&nearest, near), *temp;
-    fat_cluster_t alloc;
+    uint32_t home = group_of (space, near), best_group = 0;
+    fat_cluster_t candidate, best = 0;
+    uint64_t distance, best_distance = UINT64_MAX;
+    struct group_map *m;
 
-    // The cluster to allocate will be on either end of the free region,
-    // depending on whether near is on it's left or right.
-    if (near < (*reg)->start)
+    for (uint32_t d = 0; (best == 0) && (d < space->nr_groups); d ++)
     {
-        // allocate the first cluster in the region.
-        alloc = (*reg)->start;
-        (*reg)->start += 1;
+        // look at the groups d either side of home.
+        for (int side = -1; side <= 1; side += 2)
+        {
+            uint32_t g = (side < 0) ? home - d : home + d;
+
+            if (((side < 0) && (d > home)) || (g >= space->nr_groups) ||
+              ((side > 0) && (d == 0)) || (space->groups [g].nr_free == 0))
+            {
+                continue;
+            }
+
+            candidate = nearest_in_group (space, g, near);
+            distance = (candidate > near) ? candidate - near :
+                near - candidate;
+
+            if (distance < best_distance)
+            {
+                best = candidate;
+                best_group = g;
+                best_distance = distance;
+            }
+        }
     }
-    else
+
+    if (best == 0)
+        return 0;
+
+    // looking at the second group may have pushed the first out of the
+    // cache, so get it again.
+    m = load_group (space, best_group);
+    take_run (space, m, find_extent (m, best) - 1, best, 1);
+
+    return best;
+}
+
+/**
+ *  Find the free cluster in a group nearest to a given cluster. The group
+ *  must have at least one free cluster.
+ */
+    PRIVATE fat_cluster_t
+nearest_in_group (space, group, near)
+    struct free_space *space;   // free space map of the volume.
+    uint32_t group;             // group to search.
+    fat_cluster_t near;         // cluster to be near.
+{
+    struct group_map *m = load_group (space, group);
+    uint32_t i = find_extent (m, near);
+    fat_cluster_t left, right;
+
+    // the nearest cluster is either the end of the extent before near,
+    // or the start of the extent after it. Ties go forwards, so that a
+    // file with free space after it grows in ascending order and stays a
+    // single extent.
+    if (i == 0)
+        return m->extents [0].start;
+
+    left = m->extents [i - 1].start + m->extents [i - 1].length - 1;
+
+    if (i == m->nr_extents)
+        return left;
+
+    right = m->extents [i].start;
+
+    return ((right - near) <= (near - MIN (left, near))) ? right : left;
+}
+
+/**
+ *  Find the longest free run on the volume. If the summary of the group
+ *  that seems to have it is stale, the group is read to get the real
+ *  figure, and the groups are looked at again.
+ *
+ *  Return value is the map of the group holding the run, with the run's
+ *  index stored in index, or NULL if there are no free clusters.
+ */
+    PRIVATE struct group_map *
+largest_run (space, index)
+    struct free_space *space;   // free space map of the volume.
+    uint32_t *index;            // set to the index of the run.
+{
+    struct group_map *m;
+    uint32_t best, i;
+    bool stale;
+
+    do
     {
-        // allocate the last cluster in the free region.
-        alloc = (*reg)->start + (*reg)->length - 1;
+        best = 0;
+
+        for (uint32_t g = 1; g < space->nr_groups; g ++)
+        {
+            if (space->groups [g].longest > space->groups [best].longest)
+                best = g;
+        }
+
+        if ((space->nr_groups == 0) || (space->groups [best].longest == 0))
+            return NULL;
+
+        stale = space->groups [best].stale;
+        m = load_group (space, best);
     }
+    while (stale == true);
+
+    for (i = 0; m->extents [i].length != space->groups [best].longest; i ++)
+        ;
 
-    // decrement the length of the free region. If we have just allocated
-    // the last cluster, we will have to remove it from the free map.
-    (*reg)->length -= 1;
+    *index = i;
 
-    if ((*reg)->length == 0)
+    return m;
+}
+
+/**
+ *  Find the free run with the lowest cluster numbers on the volume.
+ *
+ *  Return value is the map of the group holding the run, with the run's
+ *  index stored in index, or NULL if there are no free clusters.
+ */
+    PRIVATE struct group_map *
+first_run (space, index)
+    struct free_space *space;   // free space map of the volume.
+    uint32_t *index;            // set to the index of the run.
+{
+    for (uint32_t g = 0; g < space->nr_groups; g ++)
     {
-        // unlink reg from the list.
-        temp = *reg;
-        *reg = (*reg)->next;
-        safe_free ((void **) &temp);
+        if (space->groups [g].nr_free != 0)
+        {
+            *index = 0;
+            return load_group (space, g);
+        }
     }
 
-    return alloc;
+    return NULL;
 }
 
 /**
- *  Find the largest free region on the volume.
+ *  Find a run of free clusters near a given cluster, and mark it as used.
+ *  A run starting at near itself is taken if there is one, so that a
+ *  file can be extended in place. Otherwise groups are searched outwards
+ *  from near's group, and within a group, the first run long enough
+ *  after near is preferred to the closest one before it.
+ *
+ *  Return value is the first cluster of the run, or 0 if there is no free
+ *  run that long.
  */
-    PRIVATE struct free_region *
-get_largest_region (void)
+    PRIVATE fat_cluster_t
+take_free_run (space, near, length)
+    struct free_space *space;   // free space map of the volume.
+    fat_cluster_t near;         // where the run should start.
+    uint32_t length;            // number of clusters wanted.
 {
-    return *(traverse_map (&largest, 0));
+    uint32_t home = group_of (space, near), i, j;
+    struct free_extent *ext;
+    struct group_map *m;
+
+    for (uint32_t d = 0; d < space->nr_groups; d ++)
+    {
+        // look at the group d after home, then the one d before.
+        for (int side = 1; side >= -1; side -= 2)
+        {
+            uint32_t g = (side < 0) ? home - d : home + d;
+
+            if (((side < 0) && ((d > home) || (d == 0))) ||
+              (g >= space->nr_groups) || (space->groups [g].longest < length))
+            {
+                continue;
+            }
+
+            m = load_group (space, g);
+            i = find_extent (m, near);
+
+            // the extent before i holds near, if near is free.
+            if ((i > 0) && (near + length <= m->extents [i - 1].start +
+                  m->extents [i - 1].length))
+            {
+                take_run (space, m, i - 1, near, length);
+                return near;
+            }
+
+            for (j = i; j < m->nr_extents; j ++)
+            {
+                if (m->extents [j].length >= length)
+                {
+                    near = m->extents [j].start;
+                    take_run (space, m, j, near, length);
+                    return near;
+                }
+            }
+
+            // take the end of a run before near, to stay closest to it.
+            for (j = i; j > 0; j --)
+            {
+                ext = &(m->extents [j - 1]);
+
+                if (ext->length >= length)
+                {
+                    near = ext->start + ext->length - length;
+                    take_run (space, m, j - 1, near, length);
+                    return near;
+                }
+            }
+        }
+    }
+
+    return 0;
 }
 
 /**
- *  Traverse the free space map and return a desireable region (ie. the
- *  largest region, or the closest to an existing allocated cluster).
- *
- *  This function takes two parameters, a pointer to a function which will
- *  be invoked on each item in the free space list, and a cluster index,
- *  for finding the closest free region (this may be 0 otherwise).
+ *  Return value is the index of the first extent in a group map starting
+ *  after cluster c. The extent holding c, if any, is the one before.
  */
-    PRIVATE struct free_region **
-traverse_map (callback, cluster)
-    struct free_region ** (*callback) (struct free_region **current, 
-      struct free_region **candidate, fat_cluster_t cmp);
-    fat_cluster_t cluster;      // cluster to locate closest free region.
+    PRIVATE uint32_t
+find_extent (m, c)
+    const struct group_map *m;  // map to search.
+    fat_cluster_t c;            // cluster to look for.
 {
-    struct free_region **current = &free_map, **candidate;
+    uint32_t low = 0, high = m->nr_extents, mid;
 
-    // step through all the items in the free space map.
-    for (candidate = &free_map; *candidate != NULL; 
-      candidate = &((*candidate)->next))
+    while (low < high)
     {
-        current = callback (current, candidate, cluster);
+        mid = low + (high - low) / 2;
+
+        if (m->extents [mid].start <= c)
+            low = mid + 1;
+        else
+            high = mid;
     }
 
-    return current;
+    return low;
 }
 
 /**
- *  Callback function to be given to traverse_map to find the nearest
- *  free region to a given cluster.
- *
- *  If candidate is closer to cmp than current, the return value will be
- *  candidate, otherwise this function returns current.
+ *  Allocate a run of clusters from within a free extent, which may
+ *  shrink, split in two or disappear.
  */
-    PRIVATE struct free_region **
-nearest (current, candidate, cmp)
-    struct free_region **current;   // current nearest region.
-    struct free_region **candidate; // possible closer region.
-    fat_cluster_t cmp;              // cluster to match to.
+    PRIVATE void
+take_run (space, m, index, c, length)
+    struct free_space *space;   // free space map of the volume.
+    struct group_map *m;        // group map holding the extent.
+    uint32_t index;             // index of the extent holding the run.
+    fat_cluster_t c;            // first cluster to allocate.
+    uint32_t length;            // number of clusters to allocate.
 {
-    if (distance (*candidate, cmp) < distance (*current, cmp))
+    struct free_extent *ext = &(m->extents [index]);
+    fat_cluster_t end = ext->start + ext->length;
+    uint32_t old_length = ext->length;
+
+    if (c == ext->start)
+    {
+        ext->start += length;
+        ext->length -= length;
+    }
+    else if (c + length == end)
     {
-        return candidate;
+        ext->length -= length;
     }
     else
     {
-        return current;
+        // split the extent either side of the run.
+        ext->length = c - ext->start;
+        insert_extent (space, m, index + 1, c + length, end - c - length);
     }
+
+    if (m->extents [index].length == 0)
+        remove_extent (m, index);
+
+    space->groups [m->group].nr_free -= length;
+
+    // update the allocation stats.
+    space->nr_allocated_clusters += length;
+    space->nr_available_clusters -= length;
+
+    // if the extent was the longest, another one may be now.
+    if (old_length == space->groups [m->group].longest)
+        update_longest (space, m->group);
 }
 
 /**
- *  Callback function to be given to traverse_map to find the largest
- *  free region by linear search of the in-memory free space map.
- *
- *  This function compares the length of current and candidate, and
- *  returns the region with the largest length.
+ *  Insert a free extent into a group map at a given index, doubling the
+ *  map's capacity if it is full.
  */
-    PRIVATE struct free_region **
-largest (current, candidate, cmp)
-    struct free_region **current;   // current max.
-    struct free_region **candidate; // next region being compared.
-    fat_cluster_t cmp;              // unused.
+    PRIVATE void
+insert_extent (space, m, index, start, length)
+    struct free_space *space;   // free space map of the volume.
+    struct group_map *m;        // map to insert into.
+    uint32_t index;             // where the new extent goes.
+    fat_cluster_t start;        // first free cluster.
+    uint32_t length;            // number of free clusters.
 {
-    if ((*candidate)->length > (*current)->length)
+    struct free_extent *extents;
+
+    if (m->nr_extents == m->capacity)
     {
-        return candidate;
+        // the map is in use, so the growth has to be allowed for, even if
+        // it takes the cache over its share.
+        mem_force_charge (&(space->map_mem), m->capacity *
+          sizeof (struct free_extent));
+
+        extents = safe_malloc (sizeof (struct free_extent) *
+          m->capacity * 2);
+        memcpy (extents, m->extents, sizeof (struct free_extent) *
+          m->nr_extents);
+        safe_free ((void **) &(m->extents));
+        m->extents = extents;
+        m->capacity *= 2;
     }
-    else
+
+    memmove (&(m->extents [index + 1]), &(m->extents [index]),
+      sizeof (struct free_extent) * (m->nr_extents - index));
+
+    m->extents [index].start = start;
+    m->extents [index].length = length;
+    m->nr_extents += 1;
+}
+
+/**
+ *  Remove an extent from a group map.
+ */
+    PRIVATE void
+remove_extent (m, index)
+    struct group_map *m;    // map concerned.
+    uint32_t index;         // extent to remove.
+{
+    m->nr_extents -= 1;
+
+    memmove (&(m->extents [index]), &(m->extents [index + 1]),
+      sizeof (struct free_extent) * (m->nr_extents - index));
+}
+
+/**
+ *  Mark a run of clusters as free in the FAT and the free space map.
+ *  Clusters outside the volume, which can only come from a damaged chain,
+ *  are ignored.
+ */
+    PRIVATE void
+release_range (space, start, length)
+    struct free_space *space;   // free space map of the volume.
+    fat_cluster_t start;        // first cluster to release.
+    uint32_t length;            // number of clusters.
+{
+    fat_cluster_t end = start + length, limit = space->nr_clusters + 2, piece;
+
+    start = MAX (start, 2);
+    end = MIN (end, limit);
+
+    if (start < end)
+        put_fat_free (start, end - start);
+
+    // the clusters may have belonged to a directory, whose blocks would
+    // otherwise linger in the metadata cache after they are reused.
+    if (start < end)
+    {
+        blk_invalidate (CLUSTER_OFFSET (space->volume_info, start),
+          (off_t) (end - start) * CLUSTER_SIZE (space->volume_info));
+    }
+
+    if ((space->discard == true) && (start < end))
+        queue_discard (space, start, end - start);
+
+    // record the run in each group it touches.
+    for ( ; start < end; start += piece)
     {
-        return current;
+        piece = MIN (end, group_first (group_of (space, start) + 1)) - start;
+        free_run (space, start, piece);
     }
 }
 
 /**
- *  calculate the closest distance from a free region to a given cluster.
+ *  Add a run of free clusters, all within one group, to the free space
+ *  map, merging it with the extents either side.
  */
-    PRIVATE unsigned int
-distance (region, cluster)
-    struct free_region *region;     // free region concerned.
-    fat_cluster_t cluster;          // cluster to find distance to.
+    PRIVATE void
+free_run (space, start, length)
+    struct free_space *space;   // free space map of the volume.
+    fat_cluster_t start;        // first free cluster.
+    uint32_t length;            // number of clusters.
 {
-    // the cluster could be on either the left or the right of the free
-    // region.
-    if (cluster < region->start)
+    uint32_t group = group_of (space, start), i, merged;
+    struct alloc_group *grp = &(space->groups [group]);
+    struct group_map *m = grp->map;
+    struct free_extent *left, *right;
+
+    grp->nr_free += length;
+
+    // update the allocation stats.
+    space->nr_allocated_clusters -= length;
+    space->nr_available_clusters += length;
+
+    // if the group is not cached, its extents will be read afresh when
+    // needed. All we know is that the longest run is no longer than the
+    // number of free clusters.
+    if (m == NULL)
+    {
+        grp->longest = grp->nr_free;
+        grp->stale = true;
+        return;
+    }
+
+    i = find_extent (m, start);
+    left = (i > 0) ? &(m->extents [i - 1]) : NULL;
+    right = (i < m->nr_extents) ? &(m->extents [i]) : NULL;
+
+    if ((left != NULL) && (left->start + left->length == start))
+    {
+        // extends the extent on the left, and may join it to the right.
+        left->length += length;
+        merged = i - 1;
+
+        if ((right != NULL) && (right->start == start + length))
+        {
+            left->length += right->length;
+            remove_extent (m, i);
+        }
+    }
+    else if ((right != NULL) && (right->start == start + length))
     {
-        // on the left. Return distance from the cluster to the start
-        // of the free region.
-        return region->start - cluster;
+        right->start = start;
+        right->length += length;
+        merged = i;
     }
     else
     {
-        // on the right. Return distance from the end of the free region
-        // to the cluster.
-        return cluster - (region->start + region->length);
+        insert_extent (space, m, i, start, length);
+        merged = i;
     }
+
+    grp->longest = MAX (grp->longest, m->extents [merged].length);
 }
 
 /**
- *  Given an index for a newly released cluster, and pointers to the free
- *  region structs for the free regions directly to the left and/or right
- *  of that cluster, merge the freed cluster into the free space map.
+ *  Work out the longest free run in a cached group.
  */
     PRIVATE void
-merge_free_regions (left, right, released)
-    struct free_region **left;      // left bordering free region.
-    struct free_region **right;     // and the right.
-    fat_cluster_t released;         // freed cluster.
+update_longest (space, group)
+    struct free_space *space;   // free space map of the volume.
+    uint32_t group;             // group concerned.
 {
-    // if there is no left bordering free region, the freed cluster is 
-    // before the first free region.
-    if ((*left == NULL) && (*right != NULL))
-    {
-        *right = merge_region (*right, released);
-    }
+    struct alloc_group *grp = &(space->groups [group]);
+
+    grp->longest = 0;
+    grp->stale = false;
+
+    for (uint32_t i = 0; i < grp->map->nr_extents; i ++)
+        grp->longest = MAX (grp->longest, grp->map->extents [i].length);
+}
+
+/**
+ *  Queue a run of released clusters to be discarded, merging it with a
+ *  queued run that it touches. If the queue is full, the run is left for
+ *  the next trim of the whole volume.
+ */
+    PRIVATE void
+queue_discard (space, start, length)
+    struct free_space *space;   // free space map of the volume.
+    fat_cluster_t start;        // first cluster released.
+    uint32_t length;            // number of clusters.
+{
+    struct free_extent *p;
 
-    // if the released cluster sits between two free regions...
-    if ((*left != NULL) && (*right != NULL))
+    // runs are usually released in order, so try the newest first.
+    for (uint32_t i = space->nr_pending; i > 0; i --)
     {
-        // Check if the freed cluster is immediately before the start of
-        // the right free region.
-        if (released == ((*right)->start - 1))
+        p = &(space->pending [i - 1]);
+
+        if (p->start + p->length == start)
         {
-            // yes. All we have to do, then, is change the start of the
-            // right free region to the freed cluster.
-            (*right)->start = released;
+            p->length += length;
+            return;
         }
-        else
+
+        if (start + length == p->start)
         {
-            // merge with the left free region.
-            *left = merge_region (*left, released);
+            p->start = start;
+            p->length += length;
+            return;
         }
     }
 
-    // if there is no free region on the right, then the freed cluster is
-    // after the very last free region.
-    if ((*left != NULL) && (*right == NULL))
+    if (space->nr_pending < DISCARD_MAX_RUNS)
     {
-        *left = merge_region (*left, released);
+        space->pending [space->nr_pending].start = start;
+        space->pending [space->nr_pending].length = length;
+        space->nr_pending += 1;
     }
 }
 
 /**
- *  Merge a free region with a nearby newly released cluster. If possible,
- *  this function will simply change the free region descriptor, provided
- *  that the freed cluster is adjacent to the free region; otherwise, a
- *  new free region of size 1 cluster is created and linked either before
- *  or after the existing free region.
- *
- *  Return value is a pointer to the new free region, which may be a list
- *  with two items. The tail of this list will be correctly set to point
- *  to any items on the end of the previous list.
+ *  Send the queued runs to the device as one batch of discards, if
+ *  DISCARD_INTERVAL seconds have passed since the last batch. The FAT is
+ *  written out first, so that the clusters are free on the device before
+ *  their data goes. Online discard is turned off if the device turns out
+ *  not to support it.
+ */
+    PRIVATE void
+send_pending (space)
+    struct free_space *space;   // free space map of the volume.
+{
+    struct discard_batch batch = {NULL, 0, 0};
+    time_t now = time (NULL);
+    fat_cluster_t start;
+
+    if ((space->nr_pending == 0) ||
+      (now - space->last_discard < DISCARD_INTERVAL))
+    {
+        return;
+    }
+
+    blk_flush ();
+
+    // only the parts of each run that are still free are discarded.
+    for (uint32_t i = 0; i < space->nr_pending; i ++)
+    {
+        start = space->pending [i].start;
+
+        discard_free (space, &batch, start, start +
+          space->pending [i].length, 1);
+    }
+
+    if (submit_discards (space, &batch, NULL) != 0)
+    {
+        warnx ("Discard is not supported by the device; turning it off");
+        space->discard = false;
+    }
+
+    safe_free ((void **) &(batch.reqs));
+    space->nr_pending = 0;
+    space->last_discard = now;
+}
+
+/**
+ *  Add discards for the free runs of at least min_length clusters within
+ *  a range of clusters to a batch.
  */
-    PRIVATE struct free_region *
-merge_region (reg, released)
-    struct free_region *reg;        // pointer to nearest free region.
-    fat_cluster_t released;         // cluster index that has been freed.
+    PRIVATE void
+discard_free (space, batch, start, end, min_length)
+    struct free_space *space;   // free space map of the volume.
+    struct discard_batch *batch;    // batch to add to.
+    fat_cluster_t start;        // first cluster of the range.
+    fat_cluster_t end;          // cluster after the range.
+    uint32_t min_length;        // shortest run to discard.
 {
-    struct free_region *new_reg = reg;
+    const fat_volume_t *v = space->volume_info;
+    fat_cluster_t group_end, from, to;
+    dev_request_t *reqs;
+    struct group_map *m;
+    uint32_t i;
 
-    // first, check if the released cluster forms a new free region.
-    if ((released < (reg->start - 1)) || (released > 
-          (reg->start + reg->length)))
+    for ( ; start < end; start = group_end)
     {
-        // create a new free region descriptor.
-        new_reg = safe_malloc (sizeof (struct free_region));
-        new_reg->start = released;
-        new_reg->length = 1;
+        m = load_group (space, group_of (space, start));
+        group_end = MIN (end, group_first (m->group) +
+          group_length (space, m->group));
+
+        // begin with the extent holding start, if there is one.
+        if ((i = find_extent (m, start)) > 0)
+            i -= 1;
 
-        // check if we need to link the new region before or after reg.
-        if (released > (reg->start + reg->length))
+        for ( ; (i < m->nr_extents) && (m->extents [i].start < group_end);
+          i ++)
         {
-            // link new_reg after reg.
-            new_reg->next = reg->next;
-            reg->next = new_reg;
+            from = MAX (start, m->extents [i].start);
+            to = MIN (group_end, m->extents [i].start +
+              m->extents [i].length);
+
+            if ((to <= from) || (to - from < min_length))
+                continue;
+
+            if (batch->nr_reqs == batch->capacity)
+            {
+                batch->capacity = MAX (batch->capacity * 2, 64);
+                reqs = safe_malloc (sizeof (dev_request_t) *
+                  batch->capacity);
+
+                if (batch->reqs != NULL)
+                {
+                    memcpy (reqs, batch->reqs, sizeof (dev_request_t) *
+                      batch->nr_reqs);
+                    safe_free ((void **) &(batch->reqs));
+                }
+
+                batch->reqs = reqs;
+            }
+
+            batch->reqs [batch->nr_reqs].op = DEV_OP_DISCARD;
+            batch->reqs [batch->nr_reqs].offset = CLUSTER_OFFSET (v, from);
+            batch->reqs [batch->nr_reqs].buf = NULL;
+            batch->reqs [batch->nr_reqs].count = (size_t) (to - from) *
+                CLUSTER_SIZE (v);
+            batch->nr_reqs += 1;
         }
-        else
+    }
+}
+
+/**
+ *  Send a batch of discards to the device, and empty it. The number of
+ *  clusters discarded is added to nr_discarded, if it is not NULL.
+ *
+ *  Return value is 0, or a negative errno if the device does not support
+ *  discard. Other failures are ignored, since discard is only a hint.
+ */
+    PRIVATE int
+submit_discards (space, batch, nr_discarded)
+    struct free_space *space;   // free space map of the volume.
+    struct discard_batch *batch;    // batch to send.
+    uint64_t *nr_discarded;     // running total of clusters discarded.
+{
+    size_t cluster_size = CLUSTER_SIZE (space->volume_info);
+    int retval = 0;
+
+    if (batch->nr_reqs == 0)
+        return 0;
+
+    dev_submit (space->volume_info->dev, batch->reqs, batch->nr_reqs);
+
+    for (unsigned int i = 0; i < batch->nr_reqs; i ++)
+    {
+        if ((batch->reqs [i].result == -EOPNOTSUPP) ||
+          (batch->reqs [i].result == -ENOTTY))
         {
-            // link before.
-            new_reg->next = reg;
+            retval = -EOPNOTSUPP;
+        }
+        else if ((batch->reqs [i].result == 0) && (nr_discarded != NULL))
+        {
+            *nr_discarded += batch->reqs [i].count / cluster_size;
         }
     }
 
-    // is the released cluster adjacent to the start of the free region?
-    // If so, move the start of reg to include the freed cluster.
-    if (released == (reg->start - 1))
-        reg->start -= 1;
-
-    // and likewise for a freed cluster adjacent to the end of the free
-    // region.
-    if (released == (reg->start + reg->length))
-        reg->length += 1;
+    batch->nr_reqs = 0;
 
-    // regardless of whether or not a new region was created, new region
-    // will always point to the updated state of the free space map.
-    return new_reg;
+    return retval;
 }
 
 
-
 // vim: ts=4 sw=4 et
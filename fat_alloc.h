@@ -16,30 +16,60 @@
 
 
 // initialise the map of the free space on a given volume.
-extern void init_clusters_map (const fat_volume_t *v);
+extern void init_clusters_map (fat_volume_t *v);
 
-// provide general usage statistics.
-extern int used_clusters (void);
-extern int free_clusters (void);
+// provide general usage statistics. A FAT32 volume can have up to 2^28
+// clusters, so these are 64 bit to leave room for arithmetic on them.
+extern uint64_t used_clusters (void);
+extern uint64_t free_clusters (void);
 
 // Find the unallocated cluster closest to near, and mark it as allocated.
-// return value is the cluster index of the cluster that was allocated.
-// This function will also modify the FAT, such that the newly allocated
-// cluster is marked with the end of chain sentinel, and near's entry
-// points to the newly allocated cluster.
+// return value is the cluster index of the cluster that was allocated, or
+// 0 if the volume is full. This function will also modify the FAT, such
+// that the newly allocated cluster is marked with the end of chain
+// sentinel, and near's entry points to the newly allocated cluster.
 extern fat_cluster_t new_cluster (fat_cluster_t near);
 
-// Allocate a cluster for a new file. In this case, the allocated cluster
-// will be in the middle of the largest contiguous region of free space,
-// ensuring that all files have maximal room to grow.
+// Allocate a cluster for a new node that starts an area of its own, such
+// as the top directory of a tree. The allocated cluster will be in the
+// middle of the largest contiguous region of free space, ensuring that
+// everything placed near it has maximal room to grow, or the lowest free
+// cluster in compact mode. Return value is 0 if the volume is full.
 extern fat_cluster_t fat_alloc_node (void);
 
-// Allocate multiple new clusters onto the end of an existing file.
-extern void alloc_clusters (fat_file_t *fd, size_t nr_clusters);
+// Allocate a cluster for a new file, at or after near if there is free
+// space there, so that files created together are kept together. Return
+// value is 0 if the volume is full.
+extern fat_cluster_t fat_alloc_near (fat_cluster_t near);
+
+// Allocate multiple new clusters onto the end of an existing file. Return
+// value is the number allocated, which is less than asked for if the
+// volume fills up.
+extern size_t alloc_clusters (fat_file_t *fd, size_t nr_clusters);
+
+// Allocate a contiguous run of clusters onto the end of a file, following
+// on from its last cluster where there is room. Falls back to allocating
+// them one at a time if no free run is long enough. Return value is the
+// number allocated.
+extern size_t alloc_contiguous (fat_file_t *fd, uint32_t nr_clusters);
+
+// Allocate clusters for a file that is being made large all at once,
+// from the largest free region rather than next to the file, or from the
+// lowest free runs in compact mode. Return value is the number allocated.
+extern size_t alloc_large (fat_file_t *fd, size_t nr_clusters);
 
 // mark a given cluster as being unallocated.
 extern void release_cluster (fat_cluster_t c);
 
+// release all but the first nr_clusters clusters of a file, and end the
+// chain in the FAT after those that remain.
+extern void truncate_clusters (fat_file_t *fd, uint32_t nr_clusters);
+
+// discard every free run of at least min_length clusters on the device.
+// Return value is the number of clusters discarded, or a negative errno
+// if the device does not support discard.
+extern int64_t trim_free_space (uint32_t min_length);
+
 
 #endif // MFATIC_FAT_ALLOC_H
 
@@ -15,10 +15,15 @@
 #include "const.h"
 #include "utils.h"
 #include "fat.h"
+#include "device.h"
+#include "blkcache.h"
 #include "inode_table.h"
 #include "table.h"
 #include "directory.h"
 #include "fat_alloc.h"
+#include "extent.h"
+#include "volume.h"
+#include "pin.h"
 #include "fileio.h"
 
 
@@ -27,26 +32,18 @@ PRIVATE off_t set_offset (fat_file_t *fd, off_t newoff);
 PRIVATE void update_current_cluster (fat_file_t *fd);
 PRIVATE size_t count_clusters (const fat_volume_t *v, size_t nbytes);
 PRIVATE size_t do_io (fat_file_t *fd, size_t nbytes, void *buffer,
-  size_t (*safe_io) (int, void *, size_t));
-
-
-// global list of files that are currently open.
-PRIVATE file_list_t *files_list;
-
-// pointer to the global volume information. This will be set by a call to
-// fileio_init at mount time.
-PRIVATE const fat_volume_t *volume_info;
+  bool writing);
 
 
 /**
- *  This should be called once at mount time, with a pointer to the volume
- *  info structure, which will be stored.
+ *  This should be called once for each volume at mount time, to set up
+ *  its list of open files.
  */
     PUBLIC void
 fileio_init (v)
-    const fat_volume_t *v;  // pointer to volume info for the mounted fs.
+    fat_volume_t *v;        // pointer to volume info for the mounted fs.
 {
-    volume_info = v;
+    v->open_files = NULL;
 }
 
 /**
@@ -57,20 +54,19 @@ fileio_init (v)
  *  Return value is 0 on success, or a negative errno on failure.
  */
     PUBLIC int
-fat_open_fd (entry, inode, index, fd)
+fat_open_fd (entry, parent, index, fd)
     const fat_direntry_t *entry;    // directory entry for the file.
-    fat_entry_t inode;              // parent dir inode.
+    fat_file_t *parent;             // parent dir, or NULL if not known.
     unsigned int index;             // dir entry index.
     fat_file_t **fd;                // file handle to be filled in.
 {
-    fat_entry_t this_cluster;
-    cluster_list_t **next_item;
+    fat_volume_t *volume_info = vol_current ();
 
     // check to see if the file is already open. If so, ilist_lookup_file
     // will store the pointer to *fd, and increment the references field,
     // which completes the open() routine.
-    if (ilist_lookup_file (&files_list, fd, DIR_CLUSTER_START (entry)) 
-      == true)
+    if (ilist_lookup_file (&(volume_info->open_files), fd,
+          DIR_CLUSTER_START (entry)) == true)
     {
         return 0;
     }
@@ -86,35 +82,50 @@ fat_open_fd (entry, inode, index, fd)
     (*fd)->name [DIR_NAME_LEN] = '\0';
 
     // read the chain of cluster addresses from the file allocation table
-    // on the disk, and store them in a linked list in memory, to minimise
-    // seek operations on the disk later on. 
-    this_cluster = DIR_CLUSTER_START (entry);
-    next_item = &((*fd)->clusters);
-
-    while (IS_LAST_CLUSTER (this_cluster) == false)
+    // on the disk, and store them in an extent map in memory, to minimise
+    // seek operations on the disk later on. The map packs itself if the
+    // file turns out to be badly fragmented. A chain longer than the
+    // volume must loop back on itself.
+    extent_init (&((*fd)->clusters));
+
+    if (extent_load (&((*fd)->clusters), DIR_CLUSTER_START (entry),
+          NR_CLUSTERS (volume_info)) != 0)
     {
-        // link a new item into the clusters list.
-        *next_item = safe_malloc (sizeof (cluster_list_t));
-        (*next_item)->cluster_id = this_cluster;
-        (*next_item)->next = NULL;
-        next_item = &((*next_item)->next);
-
-        // The allocation table cell at index this_cluster contains the
-        // index for the next cluster in the chain.
-        this_cluster = get_fat_entry (this_cluster);
+        extent_free (&((*fd)->clusters));
+        safe_free ((void **) &((*fd)->name));
+        safe_free ((void **) fd);
+        return -EIO;
     }
 
-    // store the file size, and set the current offset to 0.
+    // store the file size, and set the current offset to 0. Directories
+    // have no size recorded, and are as long as their chain of clusters.
+    (*fd)->v = volume_info;
     (*fd)->size = (size_t) entry->size;
+
+    if ((entry->attributes & ATTR_DIRECTORY) != 0)
+    {
+        (*fd)->size = (size_t) extent_count (&((*fd)->clusters)) *
+            CLUSTER_SIZE (volume_info);
+    }
     (*fd)->offset = 0;
-    (*fd)->current_cluster = (*fd)->clusters;
+    (*fd)->seq_offset = 0;
+    (*fd)->current_cluster = extent_lookup (&((*fd)->clusters), 0, NULL);
+    (*fd)->inode = DIR_CLUSTER_START (entry);
+    (*fd)->flags = 0;
     (*fd)->attributes = entry->attributes;
-    (*fd)->directory_inode = inode;
+    (*fd)->directory_inode = 0;
     (*fd)->dir_entry_index = index;
+    (*fd)->dir_entry_offset = 0;
+
+    if (parent != NULL)
+    {
+        (*fd)->directory_inode = parent->inode;
+        (*fd)->dir_entry_offset = dir_entry_offset (parent, index);
+    }
     (*fd)->refcount = 0;    // this will be incremented by ilist_add.
 
     // add the newly opened file to the open files list.
-    ilist_add (&files_list, *fd);
+    ilist_add (&(volume_info->open_files), *fd);
 
     return 0;
 }
@@ -130,7 +141,6 @@ fat_open (path, fd)
     fat_file_t **fd;        // file handle to fill in.
 {
     fat_file_t *pfd;
-    fat_entry_t inode = 0;
     unsigned int index;
     fat_direntry_t entry;
     int retval;
@@ -139,15 +149,12 @@ fat_open (path, fd)
     if ((retval = fat_lookup_dir (path, &entry, &pfd, &index)) != 0)
         return retval;
 
-    if (pfd != NULL)
-    {
-        inode = pfd->inode;
-    }
-
     // create a file structure.
-    if ((retval = fat_open_fd (&entry, inode, index, fd)) != 0)
+    if ((retval = fat_open_fd (&entry, pfd, index, fd)) != 0)
     {
-        fat_close (pfd);
+        if (pfd != NULL)
+            fat_close (pfd);
+
         return retval;
     }
 
@@ -165,10 +172,14 @@ fat_open (path, fd)
 fat_close (fd)
     fat_file_t *fd;     // pointer to file struct of file being closed.
 {
-    if (fd->directory_inode != 0)
-        release_parent_dir (fd->directory_inode);
+    fat_entry_t directory_inode = fd->directory_inode;
+
+    // the file goes first, since a file being deleted needs its parent
+    // to remove its entry from.
+    ilist_unlink (&(fd->v->open_files), fd->inode);
 
-    ilist_unlink (&files_list, fd->inode);
+    if (directory_inode != 0)
+        release_parent_dir (directory_inode);
 
     return 0;
 }
@@ -183,9 +194,19 @@ fat_read (fd, buffer, nbytes)
     size_t nbytes;      // number of bytes to read.
 {
     size_t total_read;
+    bool sequential = (fd->offset == fd->seq_offset);
 
-    // transfer clusters from the volume to the buffer using safe_read.
-    total_read = do_io (fd, nbytes, buffer, &safe_read);
+    // transfer clusters from the volume to the buffer.
+    total_read = do_io (fd, nbytes, buffer, false);
+    fd->seq_offset = fd->offset;
+
+    // if the file is being read sequentially, have the next cluster
+    // brought in while the caller deals with this lot.
+    if ((sequential == true) && (fd->current_cluster != 0))
+    {
+        dev_advise (fd->v->dev, CLUSTER_OFFSET (fd->v,
+            fd->current_cluster), CLUSTER_SIZE (fd->v), DEV_ADV_WILLNEED);
+    }
 
     return total_read;
 }
@@ -200,8 +221,8 @@ fat_write (fd, buffer, nbytes)
     const void *buffer; // data to write.
     size_t nbytes;      // no of bytes to be written.
 {
-    size_t cluster_size = CLUSTER_SIZE (volume_info);
-    size_t nr_clusters = count_clusters (volume_info, fd->size);
+    size_t cluster_size = CLUSTER_SIZE (fd->v);
+    size_t nr_clusters = count_clusters (fd->v, fd->size);
     size_t total_written, alloc_bytes;
 
     // will this write operation go past EOF? If so, we will have to
@@ -216,15 +237,100 @@ fat_write (fd, buffer, nbytes)
           cluster_size);
 
         // allocate new clusters.
-        alloc_clusters (fd, count_clusters (volume_info, alloc_bytes));
+        alloc_clusters (fd, count_clusters (fd->v, alloc_bytes));
     }
 
-    // transfer clusters from the buffer to the volume, using safe_write.
-    total_written = do_io (fd, nbytes, buffer, &safe_write);
+    // transfer clusters from the buffer to the volume.
+    total_written = do_io (fd, nbytes, (void *) buffer, true);
 
     return total_written;
 }
 
+/**
+ *  Overwrite a file with a copy of another on the same volume. The
+ *  destination is given all of the clusters it needs before any data is
+ *  moved, so that they are as contiguous as the free space allows, and
+ *  the data is then copied on the device, a run of clusters at a time,
+ *  rather than being read into the daemon and written out again.
+ *
+ *  Return value is 0 on success, or a negative errno.
+ */
+    PUBLIC int
+fat_copy (src, dst)
+    fat_file_t *src;    // file to copy.
+    fat_file_t *dst;    // file to overwrite.
+{
+    size_t cluster_size = CLUSTER_SIZE (src->v), block;
+    size_t nr_clusters = MAX (count_clusters (src->v, src->size), 1);
+    size_t remaining = src->size;
+    fat_cluster_t from, to;
+    uint32_t logical, src_run, dst_run;
+    fat_direntry_t entry;
+    int retval = 0;
+
+    if (((src->attributes | dst->attributes) & ATTR_DIRECTORY) != 0)
+        return -EISDIR;
+
+    if (src == dst)
+        return 0;
+
+    // check there is room before giving up the destination's clusters.
+    // Every file keeps its first cluster, which identifies it, and the
+    // rest are allocated after it, which is where fat_alloc_node left
+    // the most room.
+    if (nr_clusters > extent_count (&(dst->clusters)) + free_clusters ())
+        return -ENOSPC;
+
+    truncate_clusters (dst, 1);
+
+    if (alloc_clusters (dst, nr_clusters - 1) < nr_clusters - 1)
+    {
+        truncate_clusters (dst, 1);
+        retval = -ENOSPC;
+    }
+
+    for (logical = 0; (retval == 0) && (remaining > 0);
+      logical += MIN (src_run, dst_run))
+    {
+        from = extent_lookup (&(src->clusters), logical, &src_run);
+        to = extent_lookup (&(dst->clusters), logical, &dst_run);
+
+        if ((from == 0) || (to == 0))
+        {
+            retval = -EIO;
+            break;
+        }
+
+        block = MIN (remaining, (size_t) MIN (src_run, dst_run) *
+          cluster_size);
+
+        // the copy goes around the block cache, so have it forget what
+        // it holds of the destination first.
+        blk_invalidate (CLUSTER_OFFSET (dst->v, to), block);
+        dev_copy (src->v->dev, CLUSTER_OFFSET (src->v, from),
+          CLUSTER_OFFSET (dst->v, to), block);
+
+        remaining -= block;
+    }
+
+    // the copy dropped whatever was pinned of the destination, so pin it
+    // again, with its new contents.
+    if ((dst->flags & FL_PINNED) != 0)
+        pin_resize (dst);
+
+    // record the new size in the destination's directory entry. After a
+    // failure, the destination is left empty.
+    dst->size = (retval == 0) ? src->size : 0;
+    dst->offset = 0;
+    update_current_cluster (dst);
+
+    get_directory_entry (&entry, dst);
+    entry.size = (uint32_t) dst->size;
+    put_directory_entry (&entry, dst);
+
+    return retval;
+}
+
 /**
  *  Change the current offset in a file. Parameters are the same as the
  *  lseek system call.
@@ -291,28 +397,15 @@ set_offset (fd, newoff)
 
 /**
  *  Set the current cluster field of the file descriptor given as a param
- *  to point to the cluster list entry corresponding to the current file
- *  offset (as stored in the file descriptor).
+ *  to the cluster corresponding to the current file offset (as stored in
+ *  the file descriptor).
  */
     PRIVATE void
 update_current_cluster (fd)
     fat_file_t *fd;     // file descriptor to be updated.
 {
-    cluster_list_t *cp;
-    off_t i;
-
-    // step through the first n clusters in the cluster list, where n is
-    // the number of clusters before the file offset.
-    for (i = 0, cp = fd->clusters;
-      (i != fd->offset / CLUSTER_SIZE (volume_info)) && (cp != NULL);
-      i += 1, cp = cp->next)
-    {
-        ;
-    }
-
-    // cp now points to the cluster where subsequent read or write 
-    // operations should start.
-    fd->current_cluster = cp;
+    fd->current_cluster = extent_lookup (&(fd->clusters),
+      fd->offset / CLUSTER_SIZE (fd->v), NULL);
 }
 
 /**
@@ -336,36 +429,67 @@ count_clusters (v, nbytes)
 
 /**
  *  This function carries out a read or write operation on a file on a
- *  FAT file system. Take note: the fourth parameter is a pointer to an
- *  IO function (read or write), which must have the same declaration as
- *  safe_read or safe_write.
+ *  FAT file system. The fourth parameter selects the direction of the
+ *  transfer: true to write the buffer to the file, false to read.
  */
     PRIVATE size_t
-do_io (fd, nbytes, buffer, safe_io)
+do_io (fd, nbytes, buffer, writing)
     fat_file_t *fd;     // file handle.
     size_t nbytes;      // number of bytes to transfer.
     void *buffer;       // buffer to read from/write to.
-    size_t (*safe_io) (int, void *, size_t);
+    bool writing;       // true for a write, false for a read.
 {
-    size_t cluster_size = CLUSTER_SIZE (volume_info), block;
+    size_t cluster_size = CLUSTER_SIZE (fd->v), block;
     size_t total_bytes = 0;
-    cluster_list_t *this_cluster = fd->current_cluster;
-
-    // The first chunk of data to transfer will be either the remaining
-    // length in the current cluster, or nbytes, whichever is smaller.
-    block = (nbytes <= (cluster_size - fd->offset % cluster_size)) ?
-        nbytes : (cluster_size - fd->offset % cluster_size);
-
-    // transfer data cluster by cluster. Note that if nbytes is less than
-    // one cluster, this may transfer just a single block.
-    while ((nbytes > 0) && (this_cluster != NULL))
+    fat_cluster_t this_cluster;
+    uint32_t run;
+    off_t dev_offset;
+
+    // transfer data a contiguous run of clusters at a time, so that a
+    // file that is not fragmented takes a single device request. Note
+    // that if nbytes is less than one cluster, this may transfer just a
+    // single block.
+    while (nbytes > 0)
     {
-        // seek to the correct offset within the correct cluster, as 
-        // defined by the file offset.
-        safe_seek (volume_info->dev_fd, 
-          CLUSTER_OFFSET (volume_info, this_cluster) + 
-          (fd->offset % cluster_size), SEEK_SET);
-        safe_io (volume_info->dev_fd, buffer, block);
+        this_cluster = extent_lookup (&(fd->clusters),
+          fd->offset / cluster_size, &run);
+
+        if (this_cluster == 0)
+            break;
+
+        // The chunk to transfer is either the remaining length of the
+        // run, or nbytes, whichever is smaller.
+        block = MIN (nbytes, (size_t) run * cluster_size -
+          fd->offset % cluster_size);
+
+        // transfer to or from the correct offset within the correct
+        // cluster, as defined by the file offset.
+        dev_offset = CLUSTER_OFFSET (fd->v, this_cluster) +
+            (fd->offset % cluster_size);
+
+        // directories are metadata, and go through the block cache, so
+        // that writing a single entry writes a whole device block. Reads
+        // of pinned files are served from the blocks the cache keeps,
+        // and their writes go out in one piece, patching those blocks.
+        if ((fd->attributes & ATTR_DIRECTORY) != 0)
+        {
+            if (writing == true)
+                blk_write (dev_offset, buffer, block);
+            else
+                blk_read (dev_offset, buffer, block);
+        }
+        else if (((fd->flags & FL_PINNED) != 0) && (writing == false))
+        {
+            blk_read (dev_offset, buffer, block);
+        }
+        else if (writing == true)
+        {
+            blk_write_data (dev_offset, buffer, block);
+        }
+        else
+        {
+            dev_read (fd->v->dev, dev_offset, buffer, block);
+        }
 
         // update variables to track how much we still have to transfer.
         nbytes -= block;
@@ -374,13 +498,6 @@ do_io (fd, nbytes, buffer, safe_io)
 
         // update the file offset.
         fd->offset += block;
-
-        // the next chunk to be transferred is either a full cluster, or
-        // nbytes, whichever is smaller.
-        block = (nbytes <= cluster_size) ? nbytes : cluster_size;
-
-        // step to the next cluster.
-        this_cluster = this_cluster->next;
     }
 
     // update the current cluster field in the file descriptor, if
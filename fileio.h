@@ -17,13 +17,14 @@
 #include "fat.h"
 
 
-// called at mount time, with a pointer to the volume info struct for the
+// called at mount time, with a pointer to the volume info struct for each
 // file system being mounted.
-extern void fileio_init (const fat_volume_t *v);
+extern void fileio_init (fat_volume_t *v);
 
 // open a file based on it's directory entry. This is primarily used by
-// fat_lookup_dir during path name translation.
-extern int fat_open_fd (const fat_direntry_t *entry, fat_entry_t inode, 
+// fat_lookup_dir during path name translation, which has no parent to
+// give.
+extern int fat_open_fd (const fat_direntry_t *entry, fat_file_t *parent,
   unsigned int index, fat_file_t **fd);
 
 // conventional open.
@@ -34,6 +35,9 @@ extern int fat_close (fat_file_t *fd);
 extern size_t fat_read (fat_file_t *fd, void *buf, size_t nbytes);
 extern size_t fat_write (fat_file_t *fd, const void *buf, size_t nbytes);
 
+// overwrite dst with a copy of src, copying on the device.
+extern int fat_copy (fat_file_t *src, fat_file_t *dst);
+
 // change the current position in a file.
 extern off_t fat_seek (fat_file_t *fd, off_t offset, int whence);
 
@@ -11,6 +11,7 @@
 #include "utils.h"
 #include "fat.h"
 #include "create.h"
+#include "extent.h"
 #include "inode_table.h"
 
 
@@ -80,7 +81,6 @@ ilist_unlink (list, inode)
 {
     file_list_t **item = get_inode (list, inode), *temp;
     fat_file_t *fd;
-    cluster_list_t *prev = NULL, *cp;
 
     // check that we found an item.
     if (*item == NULL)
@@ -109,21 +109,9 @@ ilist_unlink (list, inode)
         fat_release (fd);
 
     // Free the memory used by the file structure, including the file
-    // name, and list of clusters.
+    // name, and map of clusters.
     safe_free ((void **) &(fd->name));
-
-    for (cp = fd->clusters; cp != NULL; cp = cp->next)
-    {
-        // release the item before the current item, as the current item
-        // is referenced by the loop update statement.
-        if (prev != NULL)
-            safe_free ((void **) &prev);
-
-        prev = cp;
-    }
-
-    // free the last item, and then the file struct.
-    safe_free ((void **) &prev);
+    extent_free (&(fd->clusters));
     safe_free ((void **) &fd);
 }
 
@@ -0,0 +1,225 @@
+/**
+ *  iosched.c
+ *
+ *  Schedules write back against the reads that requests are waiting on.
+ *  Write back comes in batches: the dirty blocks of the metadata cache,
+ *  or the dirty chunks of the ram backend. Each batch is written in order
+ *  of position on the device, with adjacent writes merged into one, so
+ *  that it goes out in a single sweep across the device rather than
+ *  seeking back and forth.
+ *
+ *  Every synchronous read is counted while it is in flight. Bulk data
+ *  write back gives way to them: before each slice of SCHED_WRITE_SLICE
+ *  bytes, it waits until no reads are in flight, so a read of the FAT or
+ *  a directory waits behind at most one slice rather than a whole batch.
+ *  A batch only gives way until its deadline, SCHED_WRITE_DEADLINE
+ *  milliseconds after it started, so that write back still finishes
+ *  under a constant stream of reads. Metadata write back never waits, as
+ *  the reads are as likely to be waiting for it as the other way round.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <sys/uio.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "fat.h"
+#include "device.h"
+#include "iosched.h"
+
+
+// the scheduler of one device.
+struct io_sched
+{
+    // synchronous reads in flight, and write backs waiting for them to
+    // finish. These are only changed with atomic operations; the lock
+    // is only taken to wait on, or signal, idle.
+    unsigned int        readers;
+    unsigned int        waiting;
+    pthread_mutex_t     lock;
+    pthread_cond_t      idle;
+};
+
+
+// local functions.
+PRIVATE int compare_offsets (const void *a, const void *b);
+
+
+/**
+ *  Set up the scheduler of a newly opened device.
+ */
+    PUBLIC void
+sched_init (dev)
+    fat_device_t *dev;      // device concerned.
+{
+    struct io_sched *s = safe_malloc (sizeof (struct io_sched));
+
+    memset (s, 0, sizeof (struct io_sched));
+    pthread_mutex_init (&(s->lock), NULL);
+    pthread_cond_init (&(s->idle), NULL);
+
+    dev->sched = s;
+}
+
+/**
+ *  Release the scheduler of a device being closed.
+ */
+    PUBLIC void
+sched_close (dev)
+    fat_device_t *dev;      // device concerned.
+{
+    struct io_sched *s = dev->sched;
+
+    pthread_mutex_destroy (&(s->lock));
+    pthread_cond_destroy (&(s->idle));
+    safe_free ((void **) &(dev->sched));
+}
+
+/**
+ *  Count a synchronous read as being in flight.
+ */
+    PUBLIC void
+sched_read_begin (dev)
+    fat_device_t *dev;      // device being read.
+{
+    __atomic_add_fetch (&(dev->sched->readers), 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ *  Count a synchronous read as finished, and wake any write back waiting
+ *  for the last one to finish.
+ */
+    PUBLIC void
+sched_read_end (dev)
+    fat_device_t *dev;      // device being read.
+{
+    struct io_sched *s = dev->sched;
+
+    if ((__atomic_sub_fetch (&(s->readers), 1, __ATOMIC_SEQ_CST) == 0) &&
+      (__atomic_load_n (&(s->waiting), __ATOMIC_SEQ_CST) > 0))
+    {
+        pthread_mutex_lock (&(s->lock));
+        pthread_cond_broadcast (&(s->idle));
+        pthread_mutex_unlock (&(s->lock));
+    }
+}
+
+/**
+ *  Find the deadline of a batch of write back starting now. It is on the
+ *  realtime clock, for pthread_cond_timedwait.
+ */
+    PUBLIC void
+sched_deadline (deadline)
+    struct timespec *deadline;  // filled in with the deadline.
+{
+    clock_gettime (CLOCK_REALTIME, deadline);
+    deadline->tv_sec += SCHED_WRITE_DEADLINE / 1000;
+    deadline->tv_nsec += (SCHED_WRITE_DEADLINE % 1000) * 1000000L;
+
+    if (deadline->tv_nsec >= 1000000000L)
+    {
+        deadline->tv_sec ++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ *  Wait until no synchronous reads are in flight, or the deadline
+ *  passes.
+ */
+    PUBLIC void
+sched_give_way (dev, deadline)
+    fat_device_t *dev;                  // device about to be written.
+    const struct timespec *deadline;    // give up waiting after this.
+{
+    struct io_sched *s = dev->sched;
+
+    if (__atomic_load_n (&(s->readers), __ATOMIC_SEQ_CST) == 0)
+        return;
+
+    // waiting is raised before readers is checked again, and the last
+    // reader checks waiting after lowering readers, so one of the two
+    // always sees the other.
+    pthread_mutex_lock (&(s->lock));
+    __atomic_add_fetch (&(s->waiting), 1, __ATOMIC_SEQ_CST);
+
+    while ((__atomic_load_n (&(s->readers), __ATOMIC_SEQ_CST) > 0) &&
+      (pthread_cond_timedwait (&(s->idle), &(s->lock), deadline) !=
+       ETIMEDOUT))
+    {
+        // woken by the last reader, or spuriously; check again.
+    }
+
+    __atomic_sub_fetch (&(s->waiting), 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock (&(s->lock));
+}
+
+/**
+ *  Write a batch of requests to the device in order of offset, with each
+ *  run of adjacent requests merged into one write of up to
+ *  SCHED_WRITE_SLICE bytes. The result of each request is filled in.
+ */
+    PUBLIC void
+sched_write_back (dev, reqs, nr_reqs)
+    fat_device_t *dev;          // device to write to.
+    dev_request_t *reqs;        // the writes, in any order.
+    unsigned int nr_reqs;       // number of requests.
+{
+    struct iovec *iov;
+    size_t length;
+    unsigned int run;
+
+    if (nr_reqs == 0)
+        return;
+
+    iov = safe_malloc (sizeof (struct iovec) * MIN (nr_reqs, IOV_MAX));
+    qsort (reqs, nr_reqs, sizeof (dev_request_t), compare_offsets);
+
+    for (unsigned int i = 0; i < nr_reqs; i += run)
+    {
+        length = 0;
+
+        for (run = 0; (i + run < nr_reqs) && (run < IOV_MAX); run ++)
+        {
+            dev_request_t *r = &(reqs [i + run]);
+
+            if ((run > 0) && ((r->offset != reqs [i].offset +
+                  (off_t) length) || (length + r->count >
+                  SCHED_WRITE_SLICE)))
+                break;
+
+            iov [run].iov_base = r->buf;
+            iov [run].iov_len = r->count;
+            r->result = (ssize_t) r->count;
+            length += r->count;
+        }
+
+        dev_writev (dev, reqs [i].offset, iov, (int) run);
+    }
+
+    safe_free ((void **) &iov);
+}
+
+/**
+ *  Order requests by their offset on the device, for qsort.
+ */
+    PRIVATE int
+compare_offsets (a, b)
+    const void *a;          // pointer to the first request.
+    const void *b;          // pointer to the second.
+{
+    off_t offset_a = ((const dev_request_t *) a)->offset;
+    off_t offset_b = ((const dev_request_t *) b)->offset;
+
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+
+// vim: ts=4 sw=4 et
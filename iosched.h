@@ -0,0 +1,50 @@
+/**
+ *  iosched.h
+ *
+ *  The write back scheduler, which sits between the write back caches
+ *  and the device backend. Batches of writes go out in order of their
+ *  position on the device, and bulk data write back gives way to the
+ *  synchronous reads that requests are waiting on, up to a deadline.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#ifndef MFATIC_IOSCHED_H
+#define MFATIC_IOSCHED_H
+
+#include <time.h>
+
+// need type definitions for fat_device_t and dev_request_t.
+#include "device.h"
+
+
+// set up and tear down the scheduler of a device. dev_open and dev_close
+// do this.
+extern void sched_init (fat_device_t *dev);
+extern void sched_close (fat_device_t *dev);
+
+// bracket a synchronous read of the device. dev_read and dev_readv do
+// this, so that write back can tell when reads are waiting.
+extern void sched_read_begin (fat_device_t *dev);
+extern void sched_read_end (fat_device_t *dev);
+
+// find the deadline for a batch of write back starting now, after which
+// it no longer gives way to reads.
+extern void sched_deadline (struct timespec *deadline);
+
+// wait until no synchronous reads are in flight, or the deadline passes.
+// Bulk write back calls this before each slice of SCHED_WRITE_SLICE
+// bytes it writes.
+extern void sched_give_way (fat_device_t *dev,
+  const struct timespec *deadline);
+
+// write a batch of write requests, in any order, to the device. They are
+// sorted by offset, and adjacent requests are merged into a single write
+// of up to SCHED_WRITE_SLICE bytes. Aborts on IO errors, like dev_write.
+extern void sched_write_back (fat_device_t *dev, dev_request_t *reqs,
+  unsigned int nr_reqs);
+
+
+#endif // MFATIC_IOSCHED_H
+
+// vim: ts=4 sw=4 et
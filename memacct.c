@@ -0,0 +1,527 @@
+/**
+ *  memacct.c
+ *
+ *  Implementation of the memory accountant declared in memacct.h.
+ *
+ *  Every cache starts with an equal share of the budget. A cache may grow
+ *  past its share while the budget as a whole is not used up; once it is,
+ *  caches over their share are shrunk to make room for those under it.
+ *
+ *  Shares are moved between caches by comparing their marginal hit
+ *  rates: the number of misses on recently evicted keys (ghost hits) per
+ *  byte evicted. A cache with many ghost hits would have gained from
+ *  more memory, and one with none would not miss a little less.
+ *
+ *  The budget itself is reduced while the kernel reports memory pressure
+ *  (PSI), or when an allocation fails, and grows back once the pressure
+ *  has passed.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "memacct.h"
+
+
+#define MEGABYTE                (1024 * 1024)
+
+// limits larger than this mean there is no limit.
+#define UNLIMITED               (1ULL << 60)
+
+
+// local functions.
+PRIVATE bool charge (mem_cache_t *cache, size_t nbytes, bool force);
+PRIVATE size_t cgroup_budget (void);
+PRIVATE uint64_t read_limit (const char *path);
+PRIVATE void count_event (void);
+PRIVATE void rebalance (void);
+PRIVATE double marginal_rate (const mem_cache_t *cache);
+PRIVATE bool check_pressure (void);
+PRIVATE void set_budget (size_t new_budget);
+PRIVATE void shrink_to_targets (void);
+
+
+// lock protects all of the accountant's state, and the accounting fields
+// of each registered cache, apart from the hit counters.
+PRIVATE pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// list of registered caches.
+PRIVATE mem_cache_t *caches;
+PRIVATE unsigned int nr_caches;
+
+// the budget we were given, and the budget in force, which is lower
+// while memory is short.
+PRIVATE size_t configured_budget = (size_t) MEM_BUDGET_DEFAULT * MEGABYTE;
+PRIVATE size_t budget = (size_t) MEM_BUDGET_DEFAULT * MEGABYTE;
+
+// bytes held by all caches together.
+PRIVATE size_t total_used;
+
+// lookups since mounting, used to decide when to rebalance, and the time
+// pressure was last checked.
+PRIVATE uint64_t events;
+PRIVATE time_t last_pressure_check;
+
+
+/**
+ *  Set the memory budget. This should be called once, before any caches
+ *  are registered.
+ */
+    PUBLIC void
+mem_init (nbytes)
+    size_t nbytes;          // budget, or 0 to work it out.
+{
+    if (nbytes == 0)
+        nbytes = cgroup_budget ();
+
+    if (nbytes == 0)
+        nbytes = (size_t) MEM_BUDGET_DEFAULT * MEGABYTE;
+
+    configured_budget = budget = nbytes;
+
+    // when an allocation fails, let safe_malloc try shrinking the caches
+    // before giving up.
+    set_reclaim_handler (mem_reclaim);
+}
+
+/**
+ *  Return value is the budget currently in force.
+ */
+    PUBLIC size_t
+mem_budget (void)
+{
+    size_t retval;
+
+    pthread_mutex_lock (&mem_lock);
+    retval = budget;
+    pthread_mutex_unlock (&mem_lock);
+
+    return retval;
+}
+
+/**
+ *  Add a cache to the list sharing the budget, and divide the budget
+ *  equally between all caches.
+ */
+    PUBLIC void
+mem_register (cache)
+    mem_cache_t *cache;     // cache to add.
+{
+    pthread_mutex_lock (&mem_lock);
+
+    cache->used = 0;
+    cache->hits = cache->misses = cache->ghost_hits = 0;
+    cache->ghost_bytes = 0;
+    cache->ghost_next = 0;
+
+    for (int i = 0; i < MEM_GHOST_ENTRIES; i ++)
+        cache->ghost_sizes [i] = 0;
+
+    cache->next = caches;
+    caches = cache;
+    nr_caches += 1;
+
+    for (mem_cache_t *cp = caches; cp != NULL; cp = cp->next)
+        cp->target = budget / nr_caches;
+
+    pthread_mutex_unlock (&mem_lock);
+}
+
+/**
+ *  Ask to grow a cache. The request is granted if there is budget to
+ *  spare, or if the cache is within its share; in the latter case, other
+ *  caches over their share are shrunk to make up the difference.
+ *
+ *  Return value is true if the bytes were charged to the cache.
+ */
+    PUBLIC bool
+mem_charge (cache, nbytes)
+    mem_cache_t *cache;     // cache wanting to grow.
+    size_t nbytes;          // size of the new item.
+{
+    return charge (cache, nbytes, false);
+}
+
+/**
+ *  Charge memory to a cache unconditionally.
+ */
+    PUBLIC void
+mem_force_charge (cache, nbytes)
+    mem_cache_t *cache;     // cache that has grown.
+    size_t nbytes;          // bytes added.
+{
+    charge (cache, nbytes, true);
+}
+
+/**
+ *  Charge bytes to a cache, if it may grow or force is set.
+ */
+    PRIVATE bool
+charge (cache, nbytes, force)
+    mem_cache_t *cache;     // cache wanting to grow.
+    size_t nbytes;          // size of the new item.
+    bool force;             // charge even if over the budget.
+{
+    mem_cache_t *victim = NULL;
+    size_t excess = 0;
+    bool granted;
+
+    pthread_mutex_lock (&mem_lock);
+
+    granted = (force == true) || (cache->used == 0) ||
+        (total_used + nbytes <= budget) ||
+        (cache->used + nbytes <= cache->target);
+
+    if (granted == true)
+    {
+        cache->used += nbytes;
+        total_used += nbytes;
+
+        // if we are now over budget, find the cache furthest over its
+        // share to take the difference from.
+        for (mem_cache_t *cp = caches; (total_used > budget) &&
+          (cp != NULL); cp = cp->next)
+        {
+            if ((cp != cache) && (cp->used > cp->target) &&
+              (cp->used - cp->target > excess))
+            {
+                victim = cp;
+                excess = cp->used - cp->target;
+            }
+        }
+
+        if (victim != NULL)
+            excess = MIN (excess, total_used - budget);
+    }
+
+    pthread_mutex_unlock (&mem_lock);
+
+    // the victim's shrink procedure will call mem_uncharge, so it must be
+    // called without the lock.
+    if (victim != NULL)
+        victim->shrink (victim, excess);
+
+    return granted;
+}
+
+/**
+ *  Record that a cache has released some memory.
+ */
+    PUBLIC void
+mem_uncharge (cache, nbytes)
+    mem_cache_t *cache;     // cache that has shrunk.
+    size_t nbytes;          // bytes released.
+{
+    pthread_mutex_lock (&mem_lock);
+
+    cache->used -= MIN (nbytes, cache->used);
+    total_used -= MIN (nbytes, total_used);
+
+    pthread_mutex_unlock (&mem_lock);
+}
+
+/**
+ *  Record a cache hit. Hits are frequent, so they are counted without
+ *  taking the lock.
+ */
+    PUBLIC void
+mem_hit (cache)
+    mem_cache_t *cache;     // cache that was hit.
+{
+    __atomic_fetch_add (&(cache->hits), 1, __ATOMIC_RELAXED);
+    count_event ();
+}
+
+/**
+ *  Record a cache miss on a given key, and check whether the key was
+ *  evicted recently.
+ */
+    PUBLIC void
+mem_miss (cache, key)
+    mem_cache_t *cache;     // cache that missed.
+    uint64_t key;           // key that was looked for.
+{
+    pthread_mutex_lock (&mem_lock);
+
+    cache->misses += 1;
+
+    for (int i = 0; i < MEM_GHOST_ENTRIES; i ++)
+    {
+        if ((cache->ghost_sizes [i] != 0) && (cache->ghosts [i] == key))
+        {
+            // count each eviction at most once.
+            cache->ghost_hits += 1;
+            cache->ghost_bytes -= cache->ghost_sizes [i];
+            cache->ghost_sizes [i] = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock (&mem_lock);
+    count_event ();
+}
+
+/**
+ *  Remember that a key has been evicted from a cache.
+ */
+    PUBLIC void
+mem_evicted (cache, key, nbytes)
+    mem_cache_t *cache;     // cache concerned.
+    uint64_t key;           // key of the evicted item.
+    size_t nbytes;          // size of the evicted item.
+{
+    unsigned int slot;
+
+    pthread_mutex_lock (&mem_lock);
+
+    slot = cache->ghost_next;
+    cache->ghost_next = (slot + 1) % MEM_GHOST_ENTRIES;
+
+    cache->ghost_bytes -= cache->ghost_sizes [slot];
+    cache->ghosts [slot] = key;
+    cache->ghost_sizes [slot] = nbytes;
+    cache->ghost_bytes += nbytes;
+
+    pthread_mutex_unlock (&mem_lock);
+}
+
+/**
+ *  Free memory when an allocation has failed. This is treated as a sign
+ *  of memory pressure, so the budget is cut, and caches are shrunk by at
+ *  least the size of the failed allocation.
+ *
+ *  Return value is the number of bytes released.
+ */
+    PUBLIC size_t
+mem_reclaim (nbytes)
+    size_t nbytes;          // size of the failed allocation.
+{
+    size_t freed = 0, wanted;
+
+    pthread_mutex_lock (&mem_lock);
+    set_budget (MAX (budget - budget / 4, (size_t) MEM_BUDGET_MIN *
+          MEGABYTE));
+    wanted = MAX (nbytes, budget / MEM_REBALANCE_STEPS);
+    pthread_mutex_unlock (&mem_lock);
+
+    // caches are never unregistered, so the list can be walked without
+    // the lock.
+    for (mem_cache_t *cp = caches; (cp != NULL) && (freed < wanted);
+      cp = cp->next)
+    {
+        freed += cp->shrink (cp, wanted - freed);
+    }
+
+    return freed;
+}
+
+/**
+ *  Work out a budget from the memory limit of our cgroup, trying the
+ *  version 2 hierarchy first.
+ *
+ *  Return value is the budget in bytes, or 0 if there is no limit.
+ */
+    PRIVATE size_t
+cgroup_budget (void)
+{
+    uint64_t limit;
+
+    if ((limit = read_limit ("/sys/fs/cgroup/memory.max")) == 0)
+        limit = read_limit ("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+
+    return (size_t) (limit / 100 * MEM_CGROUP_SHARE);
+}
+
+/**
+ *  Read a cgroup memory limit file.
+ *
+ *  Return value is the limit in bytes, or 0 if the file does not exist or
+ *  there is no limit.
+ */
+    PRIVATE uint64_t
+read_limit (path)
+    const char *path;       // limit file.
+{
+    unsigned long long limit = 0;
+    FILE *f;
+
+    if ((f = fopen (path, "r")) == NULL)
+        return 0;
+
+    // "max" means no limit, and will not parse as a number.
+    if ((fscanf (f, "%llu", &limit) != 1) || (limit >= UNLIMITED))
+        limit = 0;
+
+    fclose (f);
+
+    return (uint64_t) limit;
+}
+
+/**
+ *  Count a lookup, and rebalance every MEM_REBALANCE_PERIOD of them.
+ */
+    PRIVATE void
+count_event (void)
+{
+    if ((__atomic_add_fetch (&events, 1, __ATOMIC_RELAXED) %
+          MEM_REBALANCE_PERIOD) == 0)
+    {
+        rebalance ();
+    }
+}
+
+/**
+ *  Move one step of budget from the cache with the lowest marginal hit
+ *  rate to the one with the highest, and age the statistics. If memory
+ *  has become short, shrink the budget, and every cache with it.
+ */
+    PRIVATE void
+rebalance (void)
+{
+    mem_cache_t *best = NULL, *worst = NULL;
+    size_t step;
+    bool pressure;
+
+    pthread_mutex_lock (&mem_lock);
+
+    pressure = check_pressure ();
+    step = budget / MEM_REBALANCE_STEPS;
+
+    for (mem_cache_t *cp = caches; cp != NULL; cp = cp->next)
+    {
+        if ((best == NULL) || (marginal_rate (cp) > marginal_rate (best)))
+            best = cp;
+
+        // every cache keeps at least one step of the budget.
+        if ((cp->target >= 2 * step) && ((worst == NULL) ||
+              (marginal_rate (cp) < marginal_rate (worst))))
+        {
+            worst = cp;
+        }
+    }
+
+    if ((best != NULL) && (worst != NULL) && (best != worst) &&
+      (marginal_rate (best) > marginal_rate (worst)))
+    {
+        worst->target -= step;
+        best->target += step;
+    }
+
+    // halve the counts, so that the recent past counts for more.
+    for (mem_cache_t *cp = caches; cp != NULL; cp = cp->next)
+    {
+        cp->hits /= 2;
+        cp->misses /= 2;
+        cp->ghost_hits /= 2;
+    }
+
+    pthread_mutex_unlock (&mem_lock);
+
+    if (pressure == true)
+        shrink_to_targets ();
+}
+
+/**
+ *  Estimate how many extra hits a cache would get per byte of extra
+ *  memory. Called with the lock held.
+ */
+    PRIVATE double
+marginal_rate (cache)
+    const mem_cache_t *cache;   // cache concerned.
+{
+    if (cache->ghost_hits == 0)
+        return 0.0;
+
+    // the ghost hits were on keys which took up at most ghost_bytes, plus
+    // the bytes of the keys that were hit again.
+    return (double) cache->ghost_hits / (double) (cache->ghost_bytes + 1);
+}
+
+/**
+ *  Check the kernel's memory pressure stall information, at most once a
+ *  second. While some task has been stalled on memory for more than
+ *  MEM_PSI_THRESHOLD percent of the last ten seconds, the budget is cut
+ *  by a quarter; once the pressure goes away it grows back in eighths.
+ *  Called with the lock held.
+ *
+ *  Return value is true if the budget was cut.
+ */
+    PRIVATE bool
+check_pressure (void)
+{
+    time_t now = time (NULL);
+    double avg10;
+    FILE *f;
+    int n;
+
+    if (now == last_pressure_check)
+        return false;
+
+    last_pressure_check = now;
+
+    if ((f = fopen ("/proc/pressure/memory", "r")) == NULL)
+        return false;
+
+    n = fscanf (f, "some avg10=%lf", &avg10);
+    fclose (f);
+
+    if (n != 1)
+        return false;
+
+    if (avg10 >= MEM_PSI_THRESHOLD)
+    {
+        set_budget (MAX (budget - budget / 4, (size_t) MEM_BUDGET_MIN *
+              MEGABYTE));
+        return true;
+    }
+
+    if (budget < configured_budget)
+        set_budget (MIN (configured_budget, budget + configured_budget / 8));
+
+    return false;
+}
+
+/**
+ *  Change the budget in force, scaling every cache's share to match.
+ *  Called with the lock held.
+ */
+    PRIVATE void
+set_budget (new_budget)
+    size_t new_budget;      // the new budget, in bytes.
+{
+    if ((new_budget == budget) || (budget == 0))
+        return;
+
+    for (mem_cache_t *cp = caches; cp != NULL; cp = cp->next)
+        cp->target = (size_t) ((double) cp->target * new_budget / budget);
+
+    budget = new_budget;
+}
+
+/**
+ *  Shrink every cache which is over its share of the budget.
+ */
+    PRIVATE void
+shrink_to_targets (void)
+{
+    size_t excess;
+
+    for (mem_cache_t *cp = caches; cp != NULL; cp = cp->next)
+    {
+        pthread_mutex_lock (&mem_lock);
+        excess = (cp->used > cp->target) ? cp->used - cp->target : 0;
+        pthread_mutex_unlock (&mem_lock);
+
+        if (excess != 0)
+            cp->shrink (cp, excess);
+    }
+}
+
+
+// vim: ts=4 sw=4 et
@@ -0,0 +1,86 @@
+/**
+ *  memacct.h
+ *
+ *  The memory accountant, which shares one memory budget between all of
+ *  the daemon's caches. Each cache registers with the accountant, and
+ *  asks it before growing. The budget is divided between the caches
+ *  according to how much each would gain from more memory, and under
+ *  memory pressure the accountant shrinks caches rather than letting
+ *  allocations fail.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#ifndef MFATIC_MEMACCT_H
+#define MFATIC_MEMACCT_H
+
+
+typedef struct mem_cache mem_cache_t;
+
+// A cache known to the accountant. The owner fills in name, shrink and
+// priv before registering it; the remaining fields are maintained by
+// memacct.c.
+struct mem_cache
+{
+    const char          *name;
+
+    // release at least nbytes from the cache, calling mem_uncharge for
+    // whatever is freed. This may be called from any thread, while the
+    // caller holds locks of its own, so it must not block: a cache that
+    // cannot get its lock straight away should release nothing.
+    // Return value is the number of bytes released.
+    size_t              (*shrink) (mem_cache_t *cache, size_t nbytes);
+    void                *priv;
+
+    // bytes held, and the cache's current share of the budget.
+    size_t              used;
+    size_t              target;
+
+    // hits and misses since the last rebalance. Ghost hits are misses
+    // on keys that were evicted recently, which would have been hits
+    // had the cache been larger.
+    uint64_t            hits;
+    uint64_t            misses;
+    uint64_t            ghost_hits;
+
+    // ring of recently evicted keys, and the bytes they took up.
+    uint64_t            ghosts [MEM_GHOST_ENTRIES];
+    size_t              ghost_sizes [MEM_GHOST_ENTRIES];
+    size_t              ghost_bytes;
+    unsigned int        ghost_next;
+
+    mem_cache_t         *next;
+};
+
+
+// set the budget, in bytes. If it is 0, the budget is taken from the
+// cgroup memory limit, or a default if there is none.
+extern void mem_init (size_t budget);
+extern size_t mem_budget (void);
+
+// add a cache to those sharing the budget.
+extern void mem_register (mem_cache_t *cache);
+
+// ask to grow a cache by nbytes. Return value is true, and the bytes are
+// charged to the cache, if it may grow; otherwise the cache should evict
+// something and try again. A cache may always hold at least one item.
+extern bool mem_charge (mem_cache_t *cache, size_t nbytes);
+extern void mem_uncharge (mem_cache_t *cache, size_t nbytes);
+
+// charge memory that a cache cannot do without, such as growth of an item
+// that is in use. This always succeeds; other caches are shrunk instead.
+extern void mem_force_charge (mem_cache_t *cache, size_t nbytes);
+
+// report lookups, and evictions of a given key, so that the accountant
+// can judge how useful extra memory would be to each cache.
+extern void mem_hit (mem_cache_t *cache);
+extern void mem_miss (mem_cache_t *cache, uint64_t key);
+extern void mem_evicted (mem_cache_t *cache, uint64_t key, size_t nbytes);
+
+// shrink caches to free at least nbytes, when memory is short.
+extern size_t mem_reclaim (size_t nbytes);
+
+
+#endif // MFATIC_MEMACCT_H
+
+// vim: ts=4 sw=4 et
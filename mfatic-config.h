@@ -19,8 +19,139 @@
 // support FAT12/16.
 #define MFATIC_32
 
-// Number of FAT sectors to keep in the LRU cache.
-#define CACHE_SECTORS_MAX           128
+// Memory budget in megabytes shared by all caches, unless one is given
+// with the cache_size mount option, or the daemon runs in a cgroup with
+// a memory limit, in which case MEM_CGROUP_SHARE percent of the limit is
+// used. Under memory pressure the budget may be cut, down to
+// MEM_BUDGET_MIN megabytes.
+#define MEM_BUDGET_DEFAULT          256
+#define MEM_BUDGET_MIN              8
+#define MEM_CGROUP_SHARE            50
+
+// percentage of time stalled on memory, averaged over ten seconds, above
+// which the budget is cut.
+#define MEM_PSI_THRESHOLD           10.0
+
+// the budget is rebalanced between caches every MEM_REBALANCE_PERIOD
+// lookups, moving 1/MEM_REBALANCE_STEPS of it at a time. Each cache
+// remembers its last MEM_GHOST_ENTRIES evictions to judge its hit rate.
+#define MEM_REBALANCE_PERIOD        4096
+#define MEM_REBALANCE_STEPS         32
+#define MEM_GHOST_ENTRIES           256
+
+// Map regular image files into memory in their entirety by default,
+// instead of accessing them with read and write system calls. Block
+// devices default to the pread backend. Either can be overridden with
+// the backend mount option.
+#define MMAP_IMAGES
+
+// logical block size assumed for image files, and the alignment used for
+// O_DIRECT on them, since the host file system's requirements are not
+// easily found out.
+#define DEV_BLOCK_SIZE              512
+#define DIRECT_ALIGN                4096
+
+// size of the chunks used for large sequential transfers, such as loading
+// a whole volume into memory.
+#define BULK_IO_SIZE                (8 * 1024 * 1024)
+
+// number of entries in the io_uring submission queue.
+#define URING_ENTRIES               64
+
+// the ram backend tracks dirty data, and loads file data on demand, in
+// chunks of this size. Dirty chunks are written back every
+// RAM_WRITEBACK_INTERVAL seconds, and when only the metadata is kept
+// resident, at most RAM_HOT_LIMIT megabytes of file data are kept.
+#define RAM_CHUNK_SIZE              (64 * 1024)
+#define RAM_WRITEBACK_INTERVAL      5
+#define RAM_HOT_LIMIT               256
+
+// the overlay backend keeps changed data in its delta file in blocks of
+// this size, copying a block up from the device when part of it changes.
+#define OVERLAY_BLOCK_SIZE          4096
+
+// write back goes to the device in slices of at most SCHED_WRITE_SLICE
+// bytes. Bulk data write back waits before each slice until no reads are
+// in flight, but only for SCHED_WRITE_DEADLINE milliseconds after the
+// write back started; after that, it carries on regardless.
+#define SCHED_WRITE_SLICE           (1024 * 1024)
+#define SCHED_WRITE_DEADLINE        500
+
+// The free space manager divides the volume into groups of this many
+// clusters, and keeps a short summary of each. The free extents of a
+// group are only read from the FAT when allocating from it, and compete
+// with the other caches for memory.
+#define ALLOC_GROUP_SIZE            65536
+
+// files with more than EXTENT_PACK_THRESHOLD fragments keep their extent
+// maps delta encoded, in blocks of EXTENT_BLOCK_SIZE extents.
+#define EXTENT_PACK_THRESHOLD       1024
+#define EXTENT_BLOCK_SIZE           64
+
+// number of threads serving requests, shared between all the volumes
+// mounted by one daemon.
+#define WORKER_THREADS              8
+
+// requests on a volume are shared fairly between its clients (see qos.c).
+// Each request costs QOS_OP_COST bytes, as well as the data it moves.
+// Up to QOS_MAX_CLIENTS clients are told apart at once, and up to
+// QOS_MAX_WEIGHTS of them can be given weights. Once QOS_MAX_QUEUED
+// requests are waiting on a volume, no more are taken from the kernel,
+// and the queue is checked again every QOS_POLL_INTERVAL milliseconds.
+// Latencies are kept in a histogram of QOS_HIST_BUCKETS powers of two,
+// in microseconds.
+#define QOS_OP_COST                 (64 * 1024)
+#define QOS_MAX_CLIENTS             64
+#define QOS_MAX_WEIGHTS             16
+#define QOS_MAX_QUEUED              256
+#define QOS_POLL_INTERVAL           10
+#define QOS_HIST_BUCKETS            32
+
+// number of hash chains in the metadata block cache. New directory
+// entries are written back when BLK_DIRTY_LIMIT blocks are dirty, or
+// after at most BLK_WRITEBACK_INTERVAL seconds.
+#define BLK_HASH_BUCKETS            4096
+#define BLK_DIRTY_LIMIT             256
+#define BLK_WRITEBACK_INTERVAL      1
+
+// most blocks that can be waiting to be read ahead into the block cache
+// at once. Listing a directory reads ahead the FAT blocks and first
+// clusters of its files, so that walking a tree finds them cached.
+#define BLK_PREFETCH_MAX            256
+
+// pinned files (see pin.c) are kept in the block cache whatever else
+// needs the memory, so at most PIN_MAX_BYTES of them can be pinned on a
+// volume at once, and at most PIN_MAX_FILES files.
+#define PIN_MAX_BYTES               (256 * 1024 * 1024)
+#define PIN_MAX_FILES               64
+
+// number of directories whose entry count and allocation cursor are
+// remembered between creates.
+#define DIR_CURSOR_SLOTS            64
+
+// largest number of bytes by which a directory grows at once. Each time
+// a directory fills up, it grows by as much again as its current size,
+// up to this limit, in one contiguous run.
+#define DIR_GROW_MAX                (256 * 1024)
+
+// a directory is compacted once at least this percentage of its entries,
+// and at least a cluster's worth, are deleted entries.
+#define DIR_COMPACT_PERCENT         50
+
+// a file grown by at least this many bytes at once, by truncating it to a
+// larger size, has its clusters taken from the largest free region rather
+// than next to the other files in its directory.
+#define LARGE_FILE_SIZE             (4 * 1024 * 1024)
+
+// with the discard mount option, released clusters are collected into
+// runs, and sent to the device as one batch of discards at most every
+// DISCARD_INTERVAL seconds. At most DISCARD_MAX_RUNS runs are kept; any
+// more are left for the trim control command.
+#define DISCARD_INTERVAL            10
+#define DISCARD_MAX_RUNS            1024
+
+// most threads mfatic-fsck reads the FAT and walks the tree with.
+#define FSCK_MAX_THREADS            16
 
 // copyright string to print with version info.
 #define COPYRIGHT_STR               \
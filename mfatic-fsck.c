@@ -0,0 +1,1056 @@
+/**
+ *  mfatic-fsck.c
+ *
+ *  Offline checker for FAT32 volumes, built on the same library as the
+ *  FUSE daemon. The volume must not be mounted while it is checked.
+ *
+ *  The check runs in three passes. The active FAT is read into memory in
+ *  large chunks by several threads at once, comparing each chunk with
+ *  the same chunk of the mirrors as it goes. The directory tree is then
+ *  walked from a queue of directories shared by the same threads; each
+ *  cluster of every chain is claimed in a bitmap as it is followed, so a
+ *  cluster claimed twice is a cross-link or a loop. Finally the clusters
+ *  the FAT has allocated, but that no chain claimed, are counted as lost,
+ *  and the FSINFO sector is compared with the free space actually found.
+ *
+ *  Problems are collected while the tree is walked, and with -y they are
+ *  all repaired once it has been walked: chains are ended where they go
+ *  wrong, sizes are fixed to match the chains, entries whose first
+ *  cluster is unusable are emptied or deleted, and lost clusters freed.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <unistd.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "fat.h"
+#include "device.h"
+#include "volume.h"
+
+
+// exit codes, as for fsck (8).
+#define EXIT_CLEAN              0
+#define EXIT_CORRECTED          1
+#define EXIT_UNCORRECTED        4
+#define EXIT_OPERATIONAL        8
+
+// kinds of repair to be made once the tree has been walked.
+#define FIX_END_CHAIN           0
+#define FIX_SET_SIZE            1
+#define FIX_EMPTY_ENTRY         2
+#define FIX_DELETE_ENTRY        3
+
+// an unknown count or hint in the FSINFO sector.
+#define FSINFO_UNKNOWN          0xFFFFFFFF
+
+// byte offsets of the counts in the on disk FSINFO sector.
+#define FSINFO_COUNTS_OFFSET    488
+
+
+// a repair found while walking the tree. offset is the device offset of
+// the directory entry to change, and value the cluster whose chain ends,
+// or the new size of the file.
+typedef struct
+{
+    int             kind;
+    off_t           offset;
+    uint32_t        value;
+}
+fsck_fix_t;
+
+// a directory waiting to be checked. entry is the device offset of its
+// entry in its parent, or -1 for the root.
+struct dir_job
+{
+    fat_cluster_t   cluster;
+    off_t           entry;
+    char            *path;
+    struct dir_job  *next;
+};
+
+
+// functions for reading the FAT.
+PRIVATE void check_geometry (const char *path);
+PRIVATE void load_fat (void);
+PRIVATE void * load_main (void *arg);
+
+// functions for walking the directory tree.
+PRIVATE void walk_tree (void);
+PRIVATE void * walk_main (void *arg);
+PRIVATE void add_dir (fat_cluster_t cluster, off_t entry, char *path);
+PRIVATE struct dir_job * next_dir (void);
+PRIVATE void check_dir (struct dir_job *job);
+PRIVATE void check_file (const fat_direntry_t *d, off_t entry,
+  const char *path);
+PRIVATE uint32_t walk_chain (fat_cluster_t start, uint32_t limit,
+  const char *path, const char **reason);
+PRIVATE bool claim_cluster (fat_cluster_t c);
+PRIVATE char * child_path (const char *parent, const fat_direntry_t *d);
+
+// functions for finding and making repairs.
+PRIVATE void problem (int kind, off_t offset, uint32_t value,
+  const char *fmt, ...) __attribute__ ((format (printf, 4, 5)));
+PRIVATE void check_lost (void);
+PRIVATE void check_fsinfo (void);
+PRIVATE void check_backup (void);
+PRIVATE void repair (void);
+PRIVATE void fix_entry (const fsck_fix_t *fix);
+PRIVATE void set_entry (fat_cluster_t c, fat_entry_t value);
+PRIVATE void write_fat (void);
+
+// functions used by the main program.
+PRIVATE double elapsed (void);
+PRIVATE void print_usage (void);
+PRIVATE void print_version (void);
+
+
+// options given on the command line.
+PRIVATE bool repairing = false;
+PRIVATE bool verbose = false;
+PRIVATE unsigned int nr_threads;
+
+// the volume being checked, and the layout of its FATs. The active FAT
+// is read into fat, which is fat_bytes long, and has nr_entries entries
+// that correspond to clusters.
+PRIVATE fat_volume_t *v;
+PRIVATE fat_entry_t *fat;
+PRIVATE size_t fat_bytes;
+PRIVATE uint32_t nr_entries;
+PRIVATE unsigned int active_fat;
+PRIVATE bool mirrored;
+
+// FAT copies that differ from the active one, and the next chunk of the
+// FAT for a loader thread to read.
+PRIVATE unsigned int mirror_errors;
+PRIVATE size_t next_chunk;
+
+// a bit for each cluster, set once a chain has claimed the cluster.
+PRIVATE uint64_t *owned;
+
+// the queue of directories waiting to be checked. pending counts those
+// queued and those being checked, so the walk is over when it is 0.
+PRIVATE pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+PRIVATE pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+PRIVATE struct dir_job *queue;
+PRIVATE unsigned int pending;
+
+// repairs to be made, and counts of what was found.
+PRIVATE pthread_mutex_t fix_lock = PTHREAD_MUTEX_INITIALIZER;
+PRIVATE fsck_fix_t *fixes;
+PRIVATE size_t nr_fixes, fixes_size;
+PRIVATE unsigned int nr_problems;
+PRIVATE bool unfixable = false;
+PRIVATE bool fsinfo_stale = false;
+PRIVATE bool backup_differs = false;
+PRIVATE uint64_t nr_files, nr_dirs;
+PRIVATE uint64_t nr_lost, nr_free;
+
+// range of FAT entries changed by repairs, to be written out.
+PRIVATE uint32_t dirty_low = UINT32_MAX, dirty_high = 0;
+
+// start of the run, for timing the passes.
+PRIVATE struct timespec started;
+
+
+/**
+ *  Program entry point. Check the volume named on the command line, and
+ *  optionally repair it.
+ *
+ *  Return value is one of the exit codes of fsck (8).
+ */
+    PUBLIC int
+main (argc, argv)
+    int argc;           // number of command line arguments.
+    char *argv [];      // array of argument strings.
+{
+    dev_params_t params;
+    long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    memset (&params, 0, sizeof (dev_params_t));
+    nr_threads = (cpus < 1) ? 1 : MIN ((unsigned long) cpus,
+      FSCK_MAX_THREADS);
+
+    while ((opt = getopt (argc, argv, "nyrj:b:vhV")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            repairing = false;
+            break;
+
+        case 'y':
+        case 'r':
+            repairing = true;
+            break;
+
+        case 'j':
+            nr_threads = MAX (1, MIN (atoi (optarg), FSCK_MAX_THREADS));
+            break;
+
+        case 'b':
+            params.backend = optarg;
+            break;
+
+        case 'v':
+            verbose = true;
+            break;
+
+        case 'V':
+            print_version ();
+            return EXIT_CLEAN;
+
+        case 'h':
+            print_usage ();
+            return EXIT_CLEAN;
+
+        default:
+            print_usage ();
+            return EXIT_OPERATIONAL;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        print_usage ();
+        return EXIT_OPERATIONAL;
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &started);
+
+    // open the volume. This aborts if the device can't be opened.
+    v = vol_open (argv [optind], &params);
+    dev_start (v->dev);
+    check_geometry (argv [optind]);
+
+    load_fat ();
+    if (verbose)
+        printf ("FAT read in %.3fs\n", elapsed ());
+
+    walk_tree ();
+    if (verbose)
+        printf ("tree walked in %.3fs\n", elapsed ());
+
+    check_backup ();
+
+    // without the root, every cluster would be lost, so there is nothing
+    // more to be learnt.
+    if (unfixable)
+    {
+        printf ("%s: root directory is unusable, not repairing\n",
+          argv [optind]);
+    }
+    else
+    {
+        check_lost ();
+        check_fsinfo ();
+
+        printf ("%s: %llu files, %llu directories, %llu/%lu clusters "
+          "free\n", argv [optind], (unsigned long long) nr_files,
+          (unsigned long long) nr_dirs, (unsigned long long) nr_free,
+          (unsigned long) NR_CLUSTERS (v));
+    }
+
+    if (repairing && (nr_problems != 0 || fsinfo_stale) &&
+      unfixable == false)
+    {
+        repair ();
+        if (verbose)
+            printf ("repaired in %.3fs\n", elapsed ());
+    }
+
+    dev_close (v->dev);
+
+    if (unfixable)
+        return EXIT_UNCORRECTED;
+    else if (nr_problems == 0)
+        return EXIT_CLEAN;
+    else
+        return repairing ? EXIT_CORRECTED : EXIT_UNCORRECTED;
+}
+
+/**
+ *  Make sure the boot sector describes a layout that can be checked,
+ *  before trusting it to find the FAT and clusters. Exits if it does
+ *  not.
+ */
+    PRIVATE void
+check_geometry (path)
+    const char *path;       // name of the device, for messages.
+{
+    fat_super_block_t *sb = v->bpb;
+    const char *reason = NULL;
+
+    if (vol_fsinfo_valid (v) == false)
+        reason = "bad FSINFO magic";
+    else if (sb->bps < 512 || sb->bps > 4096 || (sb->bps & (sb->bps - 1)))
+        reason = "bad sector size";
+    else if (sb->spc == 0 || (sb->spc & (sb->spc - 1)))
+        reason = "bad cluster size";
+    else if (sb->nr_FATs == 0 || sb->sectors_per_fat == 0)
+        reason = "no FAT";
+    else if ((off_t) DATA_START (v) >= (off_t) sb->nr_sectors * sb->bps)
+        reason = "no data region";
+    else if ((uint64_t) sb->sectors_per_fat * sb->bps / FAT_ENTSIZE <
+      (uint64_t) NR_CLUSTERS (v) + 2)
+        reason = "FAT too small for the volume";
+
+    if (reason != NULL)
+    {
+        fprintf (stderr, "%s: %s: %s. Are you sure it is a valid FAT32 "
+          "file system?\n", PROGNAME, path, reason);
+        exit (EXIT_OPERATIONAL);
+    }
+
+    fat_bytes = (size_t) sb->sectors_per_fat * sb->bps;
+    nr_entries = NR_CLUSTERS (v) + 2;
+
+    mirrored = (sb->extension_flags & EXT_NO_MIRROR) == 0;
+    active_fat = mirrored ? 0 : (sb->extension_flags & EXT_ACTIVE_FAT);
+
+    if (active_fat >= sb->nr_FATs)
+    {
+        fprintf (stderr, "%s: %s: active FAT %u does not exist.\n",
+          PROGNAME, path, active_fat);
+        exit (EXIT_OPERATIONAL);
+    }
+}
+
+/**
+ *  Read the active FAT into memory, and compare the mirrors with it.
+ *  Each thread reads BULK_IO_SIZE bytes at a time, so that a large FAT
+ *  is read with as many large requests in flight as there are threads.
+ */
+    PRIVATE void
+load_fat (void)
+{
+    pthread_t threads [FSCK_MAX_THREADS];
+
+    fat = safe_malloc (fat_bytes);
+    owned = safe_malloc ((nr_entries / 64 + 1) * sizeof (uint64_t));
+    memset (owned, 0, (nr_entries / 64 + 1) * sizeof (uint64_t));
+
+    for (unsigned int i = 0; i < nr_threads; i ++)
+        pthread_create (&(threads [i]), NULL, load_main, NULL);
+
+    for (unsigned int i = 0; i < nr_threads; i ++)
+        pthread_join (threads [i], NULL);
+
+    for (unsigned int i = 0; i < v->bpb->nr_FATs; i ++)
+    {
+        if (mirror_errors & (1u << i))
+        {
+            problem (-1, 0, 0, "FAT %u differs from FAT %u", i, active_fat);
+            break;
+        }
+    }
+}
+
+/**
+ *  Main procedure of a thread reading the FAT. Takes chunks of it in
+ *  turn until it has all been read.
+ */
+    PRIVATE void *
+load_main (arg)
+    void *arg;          // unused.
+{
+    char *mirror = mirrored ? safe_malloc (BULK_IO_SIZE) : NULL;
+    off_t fat_start = (off_t) FAT_START (v) * SECTOR_SIZE (v);
+    size_t chunk, count;
+
+    (void) arg;
+
+    while ((chunk = __atomic_fetch_add (&next_chunk, BULK_IO_SIZE,
+      __ATOMIC_RELAXED)) < fat_bytes)
+    {
+        count = MIN (BULK_IO_SIZE, fat_bytes - chunk);
+        dev_read (v->dev, fat_start + active_fat * fat_bytes + chunk,
+          (char *) fat + chunk, count);
+
+        for (unsigned int i = 0; mirrored && i < v->bpb->nr_FATs; i ++)
+        {
+            if (i == active_fat)
+                continue;
+
+            dev_read (v->dev, fat_start + i * fat_bytes + chunk, mirror,
+              count);
+            if (memcmp (mirror, (char *) fat + chunk, count) != 0)
+                __atomic_fetch_or (&mirror_errors, 1u << i,
+                  __ATOMIC_RELAXED);
+        }
+    }
+
+    safe_free ((void **) &mirror);
+    return NULL;
+}
+
+/**
+ *  Walk the directory tree from the root, with nr_threads threads taking
+ *  directories from a shared queue. Every chain reached is claimed in
+ *  the ownership bitmap as it is followed.
+ */
+    PRIVATE void
+walk_tree (void)
+{
+    pthread_t threads [FSCK_MAX_THREADS];
+    char *root = safe_malloc (1);
+
+    root [0] = '\0';
+    add_dir (v->bpb->root_cluster, -1, root);
+
+    for (unsigned int i = 0; i < nr_threads; i ++)
+        pthread_create (&(threads [i]), NULL, walk_main, NULL);
+
+    for (unsigned int i = 0; i < nr_threads; i ++)
+        pthread_join (threads [i], NULL);
+}
+
+/**
+ *  Main procedure of a thread walking the tree. Checks directories from
+ *  the queue until there are none left, and none being checked that
+ *  could add more.
+ */
+    PRIVATE void *
+walk_main (arg)
+    void *arg;          // unused.
+{
+    struct dir_job *job;
+
+    (void) arg;
+
+    while ((job = next_dir ()) != NULL)
+    {
+        check_dir (job);
+        safe_free ((void **) &(job->path));
+        safe_free ((void **) &job);
+
+        pthread_mutex_lock (&queue_lock);
+        if (-- pending == 0)
+            pthread_cond_broadcast (&queue_cond);
+        pthread_mutex_unlock (&queue_lock);
+    }
+
+    return NULL;
+}
+
+/**
+ *  Queue a directory to be checked. Takes over the path string.
+ */
+    PRIVATE void
+add_dir (cluster, entry, path)
+    fat_cluster_t cluster;  // first cluster of the directory.
+    off_t entry;            // offset of its entry, or -1 for the root.
+    char *path;             // path of the directory, for messages.
+{
+    struct dir_job *job = safe_malloc (sizeof (struct dir_job));
+
+    job->cluster = cluster;
+    job->entry = entry;
+    job->path = path;
+
+    pthread_mutex_lock (&queue_lock);
+    job->next = queue;
+    queue = job;
+    pending ++;
+    pthread_cond_signal (&queue_cond);
+    pthread_mutex_unlock (&queue_lock);
+}
+
+/**
+ *  Take a directory from the queue, waiting for one if the queue is
+ *  empty but other threads are still checking directories.
+ *
+ *  Return value is the directory, or NULL once the walk is over.
+ */
+    PRIVATE struct dir_job *
+next_dir (void)
+{
+    struct dir_job *job;
+
+    pthread_mutex_lock (&queue_lock);
+    while (queue == NULL && pending != 0)
+        pthread_cond_wait (&queue_cond, &queue_lock);
+
+    if ((job = queue) != NULL)
+        queue = job->next;
+    pthread_mutex_unlock (&queue_lock);
+
+    return job;
+}
+
+/**
+ *  Check a directory: claim its chain, then check each entry in it,
+ *  queueing the subdirectories and checking the files on the spot.
+ */
+    PRIVATE void
+check_dir (job)
+    struct dir_job *job;    // directory to check.
+{
+    size_t cluster_size = CLUSTER_SIZE (v);
+    size_t per_cluster = cluster_size / sizeof (fat_direntry_t);
+    fat_cluster_t *clusters, c = job->cluster;
+    const char *reason;
+    fat_direntry_t *d;
+    uint32_t n;
+    char *buffer;
+
+    if ((n = walk_chain (job->cluster, 0, job->path, &reason)) == 0)
+    {
+        if (job->entry < 0)
+        {
+            printf ("/: root directory's first cluster %u %s\n",
+              job->cluster, reason);
+            pthread_mutex_lock (&fix_lock);
+            unfixable = true;
+            nr_problems ++;
+            pthread_mutex_unlock (&fix_lock);
+        }
+        else
+        {
+            problem (FIX_DELETE_ENTRY, job->entry, 0, "%s: first cluster "
+              "%u %s, deleting directory", job->path, job->cluster, reason);
+        }
+
+        return;
+    }
+
+    __atomic_fetch_add (&nr_dirs, 1, __ATOMIC_RELAXED);
+
+    // read the directory in, a run of contiguous clusters at a time.
+    clusters = safe_malloc (n * sizeof (fat_cluster_t));
+    buffer = safe_malloc (n * cluster_size);
+    for (uint32_t i = 0, run = 0; i < n; i ++, c = fat [c] & FAT_ENTRY_MASK)
+    {
+        clusters [i] = c;
+        if (i + 1 == n || (fat [c] & FAT_ENTRY_MASK) != c + 1)
+        {
+            dev_read (v->dev, CLUSTER_OFFSET (v, clusters [run]),
+              buffer + run * cluster_size, (i + 1 - run) * cluster_size);
+            run = i + 1;
+        }
+    }
+
+    for (size_t i = 0; i < n * per_cluster; i ++)
+    {
+        off_t offset = CLUSTER_OFFSET (v, clusters [i / per_cluster]) +
+          (off_t) (i % per_cluster) * sizeof (fat_direntry_t);
+
+        d = (fat_direntry_t *) buffer + i;
+
+        // skip deleted entries, long name entries and the volume label,
+        // and stop at the end of the entries in use.
+        if (d->fname [0] == '\0')
+            break;
+        else if (DIR_IS_DELETED (d) || d->attributes == 0x0F ||
+          (d->attributes & (ATTR_VOLUME_ID | ATTR_DIRECTORY)) ==
+          ATTR_VOLUME_ID)
+            continue;
+        else if (strncmp (d->fname, ".", DIR_NAME_LEN) == 0 ||
+          strncmp (d->fname, "..", DIR_NAME_LEN) == 0 ||
+          strncmp (d->fname, ".          ", DIR_NAME_LEN) == 0 ||
+          strncmp (d->fname, "..         ", DIR_NAME_LEN) == 0)
+            continue;
+
+        if ((d->attributes & ATTR_DIRECTORY) == 0)
+        {
+            char *path = child_path (job->path, d);
+
+            check_file (d, offset, path);
+            safe_free ((void **) &path);
+        }
+        else if (DIR_CLUSTER_START (d) == 0)
+        {
+            char *path = child_path (job->path, d);
+
+            problem (FIX_DELETE_ENTRY, offset, 0, "%s: directory has no "
+              "clusters, deleting it", path);
+            safe_free ((void **) &path);
+        }
+        else
+        {
+            add_dir (DIR_CLUSTER_START (d), offset,
+              child_path (job->path, d));
+        }
+    }
+
+    safe_free ((void **) &buffer);
+    safe_free ((void **) &clusters);
+}
+
+/**
+ *  Check a file: claim its chain, and make sure the chain is as long as
+ *  the file's size says it should be. A file always has at least one
+ *  cluster, unless it has none at all, as new files are given their
+ *  first cluster when they are created.
+ */
+    PRIVATE void
+check_file (d, entry, path)
+    const fat_direntry_t *d;    // directory entry of the file.
+    off_t entry;                // device offset of the entry.
+    const char *path;           // path of the file, for messages.
+{
+    size_t cluster_size = CLUSTER_SIZE (v);
+    uint32_t expected, n;
+    const char *reason;
+
+    __atomic_fetch_add (&nr_files, 1, __ATOMIC_RELAXED);
+
+    if (DIR_CLUSTER_START (d) == 0)
+    {
+        if (d->size != 0)
+            problem (FIX_SET_SIZE, entry, 0, "%s: file has no clusters, "
+              "but a size of %u", path, d->size);
+        return;
+    }
+
+    expected = MAX (1, ((uint64_t) d->size + cluster_size - 1) /
+      cluster_size);
+
+    if ((n = walk_chain (DIR_CLUSTER_START (d), expected, path, &reason))
+      == 0)
+    {
+        problem (FIX_EMPTY_ENTRY, entry, 0, "%s: first cluster %u %s, "
+          "truncating file to 0", path, DIR_CLUSTER_START (d), reason);
+    }
+    else if (n < expected)
+    {
+        problem (FIX_SET_SIZE, entry, n * cluster_size, "%s: size %u is "
+          "past the end of the chain, setting it to %lu", path, d->size,
+          (unsigned long) (n * cluster_size));
+    }
+}
+
+/**
+ *  Follow a chain from its first cluster, claiming each cluster in it.
+ *  The chain is cut short at the first cluster that is out of range,
+ *  free, bad or already claimed by another chain (or earlier in this
+ *  one), by ending it at the cluster before. A chain longer than limit
+ *  clusters is ended after limit clusters; the rest of it is left
+ *  unclaimed, to be found as lost clusters.
+ *
+ *  Return value is the number of clusters claimed, or 0 if the first
+ *  cluster is unusable, in which case reason says why.
+ */
+    PRIVATE uint32_t
+walk_chain (start, limit, path, reason)
+    fat_cluster_t start;    // first cluster of the chain.
+    uint32_t limit;         // most clusters to follow, or 0 for no limit.
+    const char *path;       // file the chain belongs to, for messages.
+    const char **reason;    // set to why the chain ends early.
+{
+    fat_cluster_t c = start, prev = 0;
+    uint32_t n = 0;
+
+    while (true)
+    {
+        if (c < 2 || c >= nr_entries)
+            *reason = "is outside the volume";
+        else if (IS_FREE_CLUSTER (fat [c]))
+            *reason = "is free";
+        else if (IS_BAD_CLUSTER (fat [c]))
+            *reason = "is marked bad";
+        else if (claim_cluster (c) == false)
+            *reason = "is cross-linked, or loops";
+        else
+        {
+            n ++;
+            if (IS_LAST_CLUSTER (fat [c]))
+                return n;
+
+            if (n == limit)
+            {
+                problem (FIX_END_CHAIN, 0, c, "%s: chain is longer than "
+                  "the file, ending it at cluster %u", path, c);
+                return n;
+            }
+
+            prev = c;
+            c = fat [c] & FAT_ENTRY_MASK;
+            continue;
+        }
+
+        if (prev != 0)
+        {
+            problem (FIX_END_CHAIN, 0, prev, "%s: cluster %u %s, ending "
+              "chain at cluster %u", path, c, *reason, prev);
+        }
+
+        return n;
+    }
+}
+
+/**
+ *  Claim a cluster for the chain being followed.
+ *
+ *  Return value is false if some chain had already claimed it.
+ */
+    PRIVATE bool
+claim_cluster (c)
+    fat_cluster_t c;        // cluster to claim.
+{
+    uint64_t bit = (uint64_t) 1 << (c % 64);
+
+    return (__atomic_fetch_or (&(owned [c / 64]), bit, __ATOMIC_RELAXED) &
+      bit) == 0;
+}
+
+/**
+ *  Build the path of a directory entry, for messages.
+ *
+ *  Return value is the path, which must be freed by the caller.
+ */
+    PRIVATE char *
+child_path (parent, d)
+    const char *parent;         // path of the directory holding it.
+    const fat_direntry_t *d;    // the entry.
+{
+    size_t length = strlen (parent);
+    char *path = safe_malloc (length + DIR_NAME_LEN + 2);
+    size_t name_length = strnlen (d->fname, DIR_NAME_LEN);
+
+    // names may be padded with spaces, 8.3 style.
+    while (name_length > 0 && d->fname [name_length - 1] == ' ')
+        name_length --;
+
+    memcpy (path, parent, length);
+    path [length] = '/';
+    memcpy (path + length + 1, d->fname, name_length);
+    path [length + 1 + name_length] = '\0';
+
+    return path;
+}
+
+/**
+ *  Report a problem, and remember how to repair it. A kind of -1 is
+ *  repaired without a record, by a pass of its own.
+ */
+    PRIVATE void
+problem (int kind, off_t offset, uint32_t value, const char *fmt, ...)
+{
+    va_list args;
+
+    pthread_mutex_lock (&fix_lock);
+
+    va_start (args, fmt);
+    vprintf (fmt, args);
+    va_end (args);
+    putchar ('\n');
+
+    nr_problems ++;
+
+    if (kind >= 0)
+    {
+        if (nr_fixes == fixes_size)
+        {
+            fsck_fix_t *bigger;
+
+            fixes_size = MAX (64, fixes_size * 2);
+            bigger = safe_malloc (fixes_size * sizeof (fsck_fix_t));
+            if (nr_fixes != 0)
+                memcpy (bigger, fixes, nr_fixes * sizeof (fsck_fix_t));
+            safe_free ((void **) &fixes);
+            fixes = bigger;
+        }
+
+        fixes [nr_fixes].kind = kind;
+        fixes [nr_fixes].offset = offset;
+        fixes [nr_fixes].value = value;
+        nr_fixes ++;
+    }
+
+    pthread_mutex_unlock (&fix_lock);
+}
+
+/**
+ *  Find the clusters that are allocated in the FAT, but were not claimed
+ *  by any chain reached from the root, and count the free clusters.
+ */
+    PRIVATE void
+check_lost (void)
+{
+    uint64_t runs = 0;
+    bool in_run = false;
+
+    for (fat_cluster_t c = 2; c < nr_entries; c ++)
+    {
+        bool lost = false;
+
+        if (IS_FREE_CLUSTER (fat [c]))
+            nr_free ++;
+        else if (IS_BAD_CLUSTER (fat [c]) == false &&
+          (owned [c / 64] & ((uint64_t) 1 << (c % 64))) == 0)
+        {
+            lost = true;
+            nr_lost ++;
+            runs += in_run ? 0 : 1;
+        }
+
+        in_run = lost;
+    }
+
+    if (nr_lost != 0)
+    {
+        problem (-1, 0, 0, "%llu lost clusters in %llu runs, %s",
+          (unsigned long long) nr_lost, (unsigned long long) runs,
+          repairing ? "freeing them" : "not freed");
+    }
+}
+
+/**
+ *  Compare the free count and first free hint in the FSINFO sector with
+ *  the FAT. The daemon does not keep these up to date, and they are only
+ *  hints, so a stale count is noted and corrected, but not counted as a
+ *  problem.
+ */
+    PRIVATE void
+check_fsinfo (void)
+{
+    fat_fsinfo_t *fsinfo = v->fsinfo;
+    uint64_t will_be_free = nr_free + (repairing ? nr_lost : 0);
+
+    if (fsinfo->nr_free_clusters != FSINFO_UNKNOWN &&
+      fsinfo->nr_free_clusters != will_be_free)
+    {
+        printf ("FSINFO free count is %u, should be %llu\n",
+          fsinfo->nr_free_clusters, (unsigned long long) will_be_free);
+        fsinfo_stale = true;
+    }
+
+    if (fsinfo->first_free_cluster != FSINFO_UNKNOWN &&
+      (fsinfo->first_free_cluster < 2 ||
+      fsinfo->first_free_cluster >= nr_entries))
+    {
+        printf ("FSINFO first free cluster %u is outside the volume\n",
+          fsinfo->first_free_cluster);
+        fsinfo_stale = true;
+    }
+}
+
+/**
+ *  Compare the backup boot sector, if there is one, with the boot
+ *  sector.
+ */
+    PRIVATE void
+check_backup (void)
+{
+    size_t sector_size = SECTOR_SIZE (v);
+    uint16_t backup = v->bpb->boot_backup_sector;
+    char *primary, *copy;
+
+    if (backup == 0 || backup == 0xFFFF || backup >= FAT_START (v))
+        return;
+
+    primary = safe_malloc (sector_size);
+    copy = safe_malloc (sector_size);
+    dev_read (v->dev, 0, primary, sector_size);
+    dev_read (v->dev, (off_t) backup * sector_size, copy, sector_size);
+
+    if (memcmp (primary, copy, sector_size) != 0)
+    {
+        problem (-1, 0, 0, "backup boot sector differs from the boot "
+          "sector");
+        backup_differs = true;
+    }
+
+    safe_free ((void **) &primary);
+    safe_free ((void **) &copy);
+}
+
+/**
+ *  Make all the repairs collected while checking. Entries are fixed in
+ *  their directories, and then the FAT is changed in memory and written
+ *  out to every copy, along with the boot sector backup and the counts
+ *  in the FSINFO sector.
+ */
+    PRIVATE void
+repair (void)
+{
+    uint32_t counts [2];
+
+    // a free space checkpoint left by mfatic-mkfs won't match the FAT
+    // once it is repaired.
+    vol_drop_free_map (v);
+
+    for (size_t i = 0; i < nr_fixes; i ++)
+    {
+        if (fixes [i].kind == FIX_END_CHAIN)
+            set_entry (fixes [i].value, END_CLUSTER_MARK);
+        else
+            fix_entry (&(fixes [i]));
+    }
+
+    // free the lost clusters.
+    for (fat_cluster_t c = 2; nr_lost != 0 && c < nr_entries; c ++)
+    {
+        if (IS_FREE_CLUSTER (fat [c]) == false &&
+          IS_BAD_CLUSTER (fat [c]) == false &&
+          (owned [c / 64] & ((uint64_t) 1 << (c % 64))) == 0)
+            set_entry (c, 0);
+    }
+
+    write_fat ();
+
+    if (backup_differs)
+    {
+        char *primary = safe_malloc (SECTOR_SIZE (v));
+
+        dev_read (v->dev, 0, primary, SECTOR_SIZE (v));
+        dev_write (v->dev, (off_t) v->bpb->boot_backup_sector *
+          SECTOR_SIZE (v), primary, SECTOR_SIZE (v));
+        safe_free ((void **) &primary);
+    }
+
+    // the first free hint is left for the driver to find, as it places
+    // clusters by its own policy anyway.
+    counts [0] = nr_free + nr_lost;
+    counts [1] = FSINFO_UNKNOWN;
+    dev_write (v->dev, (off_t) v->bpb->fsinfo_sector * SECTOR_SIZE (v) +
+      FSINFO_COUNTS_OFFSET, counts, sizeof (counts));
+
+    dev_sync (v->dev);
+}
+
+/**
+ *  Change a directory entry, as a repair says.
+ */
+    PRIVATE void
+fix_entry (fix)
+    const fsck_fix_t *fix;      // the repair to make.
+{
+    fat_direntry_t d;
+
+    dev_read (v->dev, fix->offset, &d, sizeof (fat_direntry_t));
+
+    switch (fix->kind)
+    {
+    case FIX_SET_SIZE:
+        d.size = fix->value;
+        break;
+
+    case FIX_EMPTY_ENTRY:
+        d.cluster_msb = 0;
+        d.cluster_lsb = 0;
+        d.size = 0;
+        break;
+
+    case FIX_DELETE_ENTRY:
+        d.fname [0] = (char) DIR_ENTRY_DELETED;
+        break;
+    }
+
+    dev_write (v->dev, fix->offset, &d, sizeof (fat_direntry_t));
+}
+
+/**
+ *  Change an entry of the in memory FAT, keeping its reserved bits, and
+ *  remember that it needs writing out.
+ */
+    PRIVATE void
+set_entry (c, value)
+    fat_cluster_t c;        // cluster whose entry is to change.
+    fat_entry_t value;      // new value for the entry.
+{
+    fat [c] = (fat [c] & ~FAT_ENTRY_MASK) | value;
+    dirty_low = MIN (dirty_low, c);
+    dirty_high = MAX (dirty_high, c);
+}
+
+/**
+ *  Write the changed part of the FAT out to every copy in use, or all of
+ *  it, if the mirrors did not match.
+ */
+    PRIVATE void
+write_fat (void)
+{
+    size_t sector_size = SECTOR_SIZE (v);
+    off_t fat_start = (off_t) FAT_START (v) * sector_size;
+    size_t low, high;
+
+    if (mirror_errors != 0)
+    {
+        low = 0;
+        high = fat_bytes;
+    }
+    else if (dirty_low <= dirty_high)
+    {
+        low = (size_t) dirty_low * FAT_ENTSIZE / sector_size * sector_size;
+        high = MIN (fat_bytes, ((size_t) dirty_high * FAT_ENTSIZE /
+          sector_size + 1) * sector_size);
+    }
+    else
+        return;
+
+    for (unsigned int i = 0; i < v->bpb->nr_FATs; i ++)
+    {
+        if (mirrored || i == active_fat)
+            dev_write (v->dev, fat_start + i * fat_bytes + low,
+              (char *) fat + low, high - low);
+    }
+}
+
+/**
+ *  Time since the run started, in seconds.
+ */
+    PRIVATE double
+elapsed (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - started.tv_sec) +
+      (now.tv_nsec - started.tv_nsec) / 1e9;
+}
+
+/**
+ *  Print out a brief summary of how this program should be used.
+ */
+    PRIVATE void
+print_usage (void)
+{
+    printf ("mfatic-fsck: offline checker for FAT32 file systems.\n\n"
+      "USAGE:\n"
+      "\tmfatic-fsck [-hV]\n"
+      "\tmfatic-fsck [-n | -y] [-v] [-j threads] [-b backend] device\n\n"
+      "COMMAND LINE OPTIONS:\n"
+      "\t-h           print this information\n"
+      "\t-V           print version information\n"
+      "\t-n           check only, changing nothing. This is the default.\n"
+      "\t-y           repair any problems found. The volume must not be\n"
+      "\t             mounted.\n"
+      "\t-v           print how long each pass took.\n"
+      "\t-j threads   number of threads to check with. The default is\n"
+      "\t             one per CPU, up to %d.\n"
+      "\t-b backend   how to access the device, as for mfatic-fuse.\n\n"
+      "EXIT STATUS:\n"
+      "\t0 no problems, 1 problems repaired, 4 problems left, 8 the\n"
+      "\tvolume could not be checked.\n", FSCK_MAX_THREADS);
+}
+
+/**
+ *  Print out version and copyright information.
+ */
+    PRIVATE void
+print_version (void)
+{
+    printf ("mfatic-fsck: offline checker for FAT32 file systems.\n\n"
+      "Version: %s\n\n"
+      "This is free and open source software. Please see the file COPYING\n"
+      "for the terms under which you may use, modify and redistribute\n"
+      "this software. This software has no warranty.\n\n"
+      "%s\n", VERSION_STR, COPYRIGHT_STR);
+}
+
+
+// vim: ts=4 sw=4 et
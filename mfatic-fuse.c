@@ -1,51 +1,88 @@
 /**
  *  mfatic-fuse.c
  *
- *  Fuse daemon for mounting an Emphatic file system, and methods for
+ *  Fuse daemon for mounting Emphatic file systems, and methods for
  *  carrying out file operations on an Emphatic fs.
  *
+ *  One daemon can serve any number of volumes, each mounted on its own
+ *  directory. Requests from all of them are picked up by a single pool
+ *  of worker threads, and all the volumes' caches share one memory
+ *  budget. Each volume's requests wait in its queue, which shares them
+ *  out fairly between the users or processes making them (see qos.c).
+ *
  *  Author: Matthew Signorini
  */
 
 #include <unistd.h>
-#include <getopt.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <fuse_opt.h>
 
 #include "mfatic-config.h"
 #include "const.h"
 #include "utils.h"
 #include "fat.h"
+#include "device.h"
+#include "blkcache.h"
 #include "directory.h"
+#include "extent.h"
 #include "fat_alloc.h"
 #include "stat.h"
 #include "table.h"
 #include "create.h"
 #include "dostimes.h"
 #include "fileio.h"
-
-
-// minimum number of paramaters for mounting a volume, and offsets of
-// device and directory from the *end* of argv.
-#define MIN_ARGS                2
-#define DEVICE_INDEX            2
-#define MOUNTPOINT_INDEX        1
+#include "control.h"
+#include "memacct.h"
+#include "qos.h"
+#include "pin.h"
+#include "volume.h"
+
+
+// keys for the command line options handled by parse_option.
+#define KEY_HELP                0
+#define KEY_VERSION             1
+#define KEY_QOS_WEIGHT          2
+#define KEY_PIN                 3
+
+// declare a "-o name=value" mount option, stored in a field of the
+// mount_options structure. MFATIC_FLAG declares an option which sets a
+// field to a given value.
+#define MFATIC_OPT(t, field)    { t, offsetof (struct mount_options, field), 0 }
+#define MFATIC_FLAG(t, field, v) \
+    { t, offsetof (struct mount_options, field), v }
 
 // array indices for the two item array passed to the utimens method.
 #define ATIME_INDEX             0
 #define MTIME_INDEX             1
 
+// opcodes of the requests that transfer data, from <linux/fuse.h>.
+#define OPCODE_READ             15
+#define OPCODE_WRITE            16
+
 
 // Declarations for methods to handle file operations on an mfatic file
 // system.
 PRIVATE void * mfatic_mount (struct fuse_conn_info *conn);
+PRIVATE void mfatic_umount (void *private_data);
 PRIVATE int mfatic_open (const char *name, struct fuse_file_info *fd);
 PRIVATE int mfatic_read (const char *name, char *buf, size_t nbytes, 
   off_t off, struct fuse_file_info *fd);
 PRIVATE int mfatic_write (const char *name, const char *buf, size_t nbytes,
   off_t off, struct fuse_file_info *fd);
 PRIVATE int mfatic_release (const char *name, struct fuse_file_info *fd);
+PRIVATE int mfatic_fsync (const char *name, int datasync,
+  struct fuse_file_info *fd);
 PRIVATE int mfatic_getattr (const char *name, struct stat *st);
 PRIVATE int mfatic_fgetattr (const char *name, struct stat *st,
   struct fuse_file_info *file);
@@ -58,27 +95,142 @@ PRIVATE int mfatic_readdir (const char *path, void *buf,
 PRIVATE int mfatic_rename (const char *old, const char *new);
 PRIVATE int mfatic_truncate (const char *path, off_t length);
 PRIVATE int mfatic_utimens (const char *path, const struct timespec *tv);
+PRIVATE int mfatic_setxattr (const char *path, const char *name,
+  const char *value, size_t size, int flags);
+PRIVATE int mfatic_getxattr (const char *path, const char *name,
+  char *value, size_t size);
 
 // functions used by the main program of the FUSE daemon.
-PRIVATE void parse_command_opts (int argc, char **argv);
+PRIVATE void parse_command_opts (struct fuse_args *args);
+PRIVATE int parse_option (void *data, const char *arg, int key,
+  struct fuse_args *outargs);
+PRIVATE int parse_weight (const char *arg);
+PRIVATE int parse_pin (const char *arg);
+PRIVATE void grow_mounts (void);
+PRIVATE int serve_mounts (struct fuse_args *args);
+PRIVATE void * worker_main (void *arg);
+PRIVATE void run_request (void *arg);
+PRIVATE struct fuse_request * get_request (void);
+PRIVATE void put_request (struct fuse_request *req);
+PRIVATE void stop_workers (int signum);
 PRIVATE void init_volume (const char *devname, fat_volume_t **volinfo);
-PRIVATE bool verify_magic (const char *str1, const char *str2, 
-  unsigned int length);
 PRIVATE void print_usage (void);
 PRIVATE void print_version (void);
 
 
-// Pointer to a struct containing information about the mounted file system
-PRIVATE fat_volume_t *volume_info;
+// A volume being served, and the directory it is mounted on. The code
+// that serves a volume was written for one request at a time, so the
+// volume's queue runs its requests one after another. Requests on
+// different volumes still run in parallel.
+struct mount_point
+{
+    char                *device;
+    char                *directory;
+    fat_volume_t        *volume;
+    struct fuse_chan    *chan;
+    struct fuse         *fuse;
+};
+
+// A request received from the kernel, waiting its turn in the queue of
+// the volume it is for. Free ones are kept on a list for reuse.
+struct fuse_request
+{
+    struct mount_point  *mount;
+    struct fuse_chan    *ch;
+    size_t              length;
+    struct fuse_request *next;
+    char                buf [];
+};
+
+// The start of every request from the kernel, laid out as in
+// <linux/fuse.h>, which cannot be included along with the FUSE library's
+// own headers. For reads and writes, the size of the transfer follows
+// the file handle and offset.
+struct request_header
+{
+    uint32_t            len;
+    uint32_t            opcode;
+    uint64_t            unique;
+    uint64_t            nodeid;
+    uint32_t            uid;
+    uint32_t            gid;
+    uint32_t            pid;
+    uint32_t            padding;
+    uint64_t            fh;
+    uint64_t            offset;
+    uint32_t            size;
+};
 
 // This struct is used by the main loop in the FUSE library to dispatch
 // to our methods for handling operations on an mfatic fs, such as open,
 // read write and so on.
 PRIVATE struct fuse_operations mfatic_callbacks;
 
-// pointer to a string containing the name of the device file that 
-// contains the file system being mounted.
-PRIVATE char *device_file;
+// the volumes named on the command line. A device given without a mount
+// point leaves an incomplete entry at the end.
+PRIVATE struct mount_point *mounts;
+PRIVATE unsigned int nr_mounts;
+
+// size of the buffer needed to receive a request from the kernel, and
+// the requests that are not in use.
+PRIVATE size_t request_size;
+PRIVATE struct fuse_request *free_requests;
+PRIVATE pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// a signal to stop is passed on to the workers by making this pipe
+// readable, since any one of them may be blocked in poll.
+PRIVATE int stop_pipe [2];
+
+// Emphatic specific mount options, given as "-o name=value" on the
+// command line. Anything not listed here is passed on to FUSE.
+PRIVATE struct mount_options
+{
+    // how the device is to be accessed.
+    dev_params_t        dev;
+
+    // memory budget for all caches, in megabytes, or 0 for the default.
+    unsigned int        cache_size;
+
+    // number of threads serving requests, or 0 for the default.
+    unsigned int        threads;
+
+    // how requests are shared out between clients.
+    qos_params_t        qos;
+
+    // paths to pin in memory on each volume, from its mount point.
+    char                *pins [PIN_MAX_FILES];
+    unsigned int        nr_pins;
+}
+mount_opts;
+
+PRIVATE const struct fuse_opt mfatic_opts [] =
+{
+    MFATIC_OPT ("backend=%s", dev.backend),
+    MFATIC_OPT ("writeback=%u", dev.writeback_interval),
+    MFATIC_FLAG ("ram_mode=full", dev.ram_meta_only, false),
+    MFATIC_FLAG ("ram_mode=meta", dev.ram_meta_only, true),
+    MFATIC_OPT ("ram_hot=%u", dev.ram_hot_limit),
+    MFATIC_FLAG ("discard", dev.discard, true),
+    MFATIC_FLAG ("alloc=spread", dev.alloc_compact, false),
+    MFATIC_FLAG ("alloc=compact", dev.alloc_compact, true),
+    MFATIC_OPT ("align=%u", dev.align_kb),
+    MFATIC_OPT ("stripe=%u", dev.stripe_kb),
+    MFATIC_OPT ("overlay=%s", dev.overlay),
+    MFATIC_OPT ("cache_size=%u", cache_size),
+    MFATIC_OPT ("threads=%u", threads),
+    MFATIC_FLAG ("qos=uid", qos.mode, QOS_BY_UID),
+    MFATIC_FLAG ("qos=pid", qos.mode, QOS_BY_PID),
+    MFATIC_FLAG ("qos=off", qos.mode, QOS_OFF),
+    MFATIC_OPT ("qos_mbps=%u", qos.mbps),
+    MFATIC_OPT ("qos_iops=%u", qos.iops),
+    FUSE_OPT_KEY ("qos_weight=", KEY_QOS_WEIGHT),
+    FUSE_OPT_KEY ("pin=", KEY_PIN),
+    FUSE_OPT_KEY ("-h", KEY_HELP),
+    FUSE_OPT_KEY ("--help", KEY_HELP),
+    FUSE_OPT_KEY ("-v", KEY_VERSION),
+    FUSE_OPT_KEY ("--version", KEY_VERSION),
+    FUSE_OPT_END
+};
 
 
 /**
@@ -89,6 +241,7 @@ main (argc, argv)
     int argc;       // number of command line parameters.
     char **argv;    // list of parameters.
 {
+    struct fuse_args args = FUSE_ARGS_INIT (argc, argv);
     int retval;
 
     // initialise the FUSE callbacks structure.
@@ -105,28 +258,335 @@ main (argc, argv)
     mfatic_callbacks.write      = mfatic_write;
     mfatic_callbacks.statfs     = mfatic_statfs;
     mfatic_callbacks.release    = mfatic_release;
+    mfatic_callbacks.fsync      = mfatic_fsync;
     mfatic_callbacks.opendir    = mfatic_open;
     mfatic_callbacks.readdir    = mfatic_readdir;
     mfatic_callbacks.releasedir = mfatic_release;
     mfatic_callbacks.init       = mfatic_mount;
+    mfatic_callbacks.destroy    = mfatic_umount;
     mfatic_callbacks.utimens    = mfatic_utimens;
+    mfatic_callbacks.setxattr   = mfatic_setxattr;
+    mfatic_callbacks.getxattr   = mfatic_getxattr;
 
-    // process any options salient to the FUSE daemon. This is only
-    // really help and version; other options are passed on to the FUSE
+    // process any options salient to the FUSE daemon, and remove them
+    // from the argument list. Other options are passed on to the FUSE
     // framework.
-    parse_command_opts (argc, argv);
+    parse_command_opts (&args);
+
+    // set the memory budget before any caches are created.
+    mem_init ((size_t) mount_opts.cache_size * 1024 * 1024);
+
+    // each volume would need a delta file of its own.
+    if ((mount_opts.dev.overlay != NULL) && (nr_mounts > 1))
+        errx (1, "An overlay can only be used when mounting one volume");
 
-    // attempt to open the device file, and read the super block and other
-    // important structures.
-    init_volume (device_file, &volume_info);
+    // attempt to open each device file, and read the super block and
+    // other important structures.
+    for (unsigned int i = 0; i < nr_mounts; i ++)
+        init_volume (mounts [i].device, &(mounts [i].volume));
 
-    // enter the FUSE framework. This will result in the program becoming
-    // a daemon.
-    retval = fuse_main (argc - 1, argv, &mfatic_callbacks, NULL);
+    // mount the volumes, and serve them. This will result in the program
+    // becoming a daemon.
+    retval = serve_mounts (&args);
+    fuse_opt_free_args (&args);
 
     return retval;
 }
 
+/**
+ *  Mount each volume, and serve requests on all of them from a shared pool
+ *  of worker threads, until they have all been unmounted or the daemon is
+ *  told to stop.
+ *
+ *  Return value is the program's exit status.
+ */
+    PRIVATE int
+serve_mounts (args)
+    struct fuse_args *args;     // options to pass on to FUSE.
+{
+    struct fuse_args mount_args;
+    struct sigaction sa;
+    pthread_t *workers;
+    unsigned int nr_workers = (mount_opts.threads != 0) ?
+        mount_opts.threads : WORKER_THREADS;
+    int multithreaded, foreground;
+
+    // pick out the generic options, like -f and -s. The mount points have
+    // already been taken off the command line.
+    if (fuse_parse_cmdline (args, NULL, &multithreaded, &foreground) != 0)
+        return 1;
+
+    if (multithreaded == 0)
+        nr_workers = 1;
+
+    // each mount parses the remaining options for itself, so give each a
+    // copy of them. The volume is kept as the file system's private data.
+    for (unsigned int i = 0; i < nr_mounts; i ++)
+    {
+        mounts [i].volume->qos = qos_create (&(mount_opts.qos), run_request);
+        mount_args = (struct fuse_args) FUSE_ARGS_INIT (0, NULL);
+
+        for (int j = 0; j < args->argc; j ++)
+            fuse_opt_add_arg (&mount_args, args->argv [j]);
+
+        mounts [i].chan = fuse_mount (mounts [i].directory, &mount_args);
+
+        if (mounts [i].chan != NULL)
+        {
+            mounts [i].fuse = fuse_new (mounts [i].chan, &mount_args,
+              &mfatic_callbacks, sizeof (struct fuse_operations),
+              mounts [i].volume);
+        }
+
+        fuse_opt_free_args (&mount_args);
+
+        if ((mounts [i].chan == NULL) || (mounts [i].fuse == NULL))
+        {
+            warnx ("Couldn't mount %s on %s", mounts [i].device,
+              mounts [i].directory);
+
+            if (mounts [i].chan != NULL)
+                fuse_unmount (mounts [i].directory, mounts [i].chan);
+
+            while (i -- > 0)
+            {
+                fuse_unmount (mounts [i].directory, mounts [i].chan);
+                fuse_destroy (mounts [i].fuse);
+            }
+
+            return 1;
+        }
+
+        // the workers wait for requests with poll, and more than one may
+        // wake for the same request, so the losers must not block.
+        fcntl (fuse_chan_fd (mounts [i].chan), F_SETFL, O_NONBLOCK);
+        request_size = MAX (request_size,
+          fuse_chan_bufsize (mounts [i].chan));
+    }
+
+    if (fuse_daemonize (foreground) != 0)
+        return 1;
+
+    // stop cleanly on the usual signals.
+    if (pipe (stop_pipe) != 0)
+        err (1, "pipe");
+
+    memset (&sa, 0, sizeof (struct sigaction));
+    sa.sa_handler = stop_workers;
+    sigaction (SIGHUP, &sa, NULL);
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction (SIGPIPE, &sa, NULL);
+
+    workers = safe_malloc (sizeof (pthread_t) * nr_workers);
+
+    for (unsigned int i = 0; i < nr_workers; i ++)
+        pthread_create (&(workers [i]), NULL, worker_main, NULL);
+
+    for (unsigned int i = 0; i < nr_workers; i ++)
+        pthread_join (workers [i], NULL);
+
+    // unmounting calls mfatic_umount for each volume.
+    for (unsigned int i = 0; i < nr_mounts; i ++)
+    {
+        fuse_unmount (mounts [i].directory, mounts [i].chan);
+        fuse_destroy (mounts [i].fuse);
+    }
+
+    safe_free ((void **) &workers);
+
+    return 0;
+}
+
+/**
+ *  Main loop of a worker thread. Waits for a request on any of the
+ *  mounted volumes, and hands it to that volume's queue, which runs it
+ *  in this thread unless another is already running the queue's
+ *  requests. A volume with QOS_MAX_QUEUED requests waiting is left out
+ *  of the wait until its queue has gone down. The loop ends when every
+ *  volume has been unmounted, or the daemon is stopped.
+ */
+    PRIVATE void *
+worker_main (arg)
+    void *arg;                  // unused.
+{
+    struct pollfd fds [nr_mounts + 1];
+    unsigned int which [nr_mounts];
+    struct fuse_request *req = get_request ();
+    struct request_header *header;
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    unsigned int nr_fds, nr_live;
+    size_t bytes;
+    int res, timeout, due;
+
+    while (true)
+    {
+        // wait on every volume that is still mounted and can take more
+        // requests, and the stop pipe. The wait is cut short when a
+        // queue has requests that become due, or is full.
+        nr_fds = nr_live = 0;
+        timeout = -1;
+
+        for (unsigned int i = 0; i < nr_mounts; i ++)
+        {
+            if (fuse_session_exited (fuse_get_session (mounts [i].fuse)))
+                continue;
+
+            nr_live ++;
+
+            if ((due = qos_next_due (mounts [i].volume->qos)) >= 0)
+                timeout = (timeout < 0) ? due : MIN (timeout, due);
+
+            if (qos_queued (mounts [i].volume->qos) >= QOS_MAX_QUEUED)
+            {
+                timeout = (timeout < 0) ? QOS_POLL_INTERVAL :
+                    MIN (timeout, QOS_POLL_INTERVAL);
+                continue;
+            }
+
+            fds [nr_fds].fd = fuse_chan_fd (mounts [i].chan);
+            fds [nr_fds].events = POLLIN;
+            which [nr_fds ++] = i;
+        }
+
+        if (nr_live == 0)
+            break;
+
+        fds [nr_fds].fd = stop_pipe [0];
+        fds [nr_fds].events = POLLIN;
+
+        if ((res = poll (fds, nr_fds + 1, timeout)) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        if (fds [nr_fds].revents != 0)
+            break;
+
+        if (res == 0)
+        {
+            for (unsigned int i = 0; i < nr_mounts; i ++)
+                qos_kick (mounts [i].volume->qos);
+
+            continue;
+        }
+
+        for (unsigned int i = 0; i < nr_fds; i ++)
+        {
+            if (fds [i].revents == 0)
+                continue;
+
+            se = fuse_get_session (mounts [which [i]].fuse);
+            ch = mounts [which [i]].chan;
+
+            // another worker may have taken the request already. A
+            // volume that has been unmounted reads as 0, and its session
+            // is marked as exited.
+            if ((res = fuse_chan_recv (&ch, req->buf, request_size)) <= 0)
+            {
+                if ((res != -EAGAIN) && (res != -EINTR) && (res != 0))
+                    fuse_session_exit (se);
+
+                continue;
+            }
+
+            // the client is known from the request header, before the
+            // request is decoded and fuse_get_context can say.
+            header = (struct request_header *) req->buf;
+            bytes = 0;
+
+            if (((header->opcode == OPCODE_READ) ||
+                (header->opcode == OPCODE_WRITE)) &&
+              ((size_t) res >= sizeof (struct request_header)))
+            {
+                bytes = header->size;
+            }
+
+            req->mount = &(mounts [which [i]]);
+            req->ch = ch;
+            req->length = (size_t) res;
+            qos_submit (req->mount->volume->qos, header->uid, header->pid,
+              bytes, req);
+
+            req = get_request ();
+        }
+    }
+
+    put_request (req);
+
+    return NULL;
+}
+
+/**
+ *  Carry out a request, with its volume as the thread's current volume.
+ *  Called by the volume's queue when the request's turn comes.
+ */
+    PRIVATE void
+run_request (arg)
+    void *arg;                  // the request.
+{
+    struct fuse_request *req = arg;
+
+    vol_set_current (req->mount->volume);
+    fuse_session_process (fuse_get_session (req->mount->fuse), req->buf,
+      req->length, req->ch);
+
+    put_request (req);
+}
+
+/**
+ *  Return value is a request buffer, from the free list if there is one.
+ */
+    PRIVATE struct fuse_request *
+get_request (void)
+{
+    struct fuse_request *req;
+
+    pthread_mutex_lock (&free_lock);
+
+    if ((req = free_requests) != NULL)
+        free_requests = req->next;
+
+    pthread_mutex_unlock (&free_lock);
+
+    if (req == NULL)
+        req = safe_malloc (sizeof (struct fuse_request) + request_size);
+
+    return req;
+}
+
+/**
+ *  Put a request buffer that is no longer needed on the free list.
+ */
+    PRIVATE void
+put_request (req)
+    struct fuse_request *req;   // the buffer.
+{
+    pthread_mutex_lock (&free_lock);
+    req->next = free_requests;
+    free_requests = req;
+    pthread_mutex_unlock (&free_lock);
+}
+
+/**
+ *  Signal handler to stop the daemon. Wakes all of the workers, which
+ *  then return.
+ */
+    PRIVATE void
+stop_workers (signum)
+    int signum;                 // ignored.
+{
+    char c = 0;
+
+    if (write (stop_pipe [1], &c, 1) == -1)
+        return;
+}
+
 /**
  *  Complete the mounting process by invoking the init procedures of the
  *  various components of the Emphatic FUSE daemon. This procedure involves
@@ -134,22 +594,52 @@ main (argc, argv)
  *  map out where the free space is on the device, so it is a Good Thing
  *  that it is done after the mount program has daemonised.
  *
- *  The return value from this struct is kept by FUSE in the private_data
- *  field of fuse_context. Seeing as we do not make use of that, this
- *  procedure will return NULL.
+ *  This is called by the worker that picks up the volume's first request,
+ *  with the volume already set as its current volume. The return value is
+ *  kept by FUSE in the private_data field of fuse_context, and given back
+ *  to mfatic_umount.
  */
     PRIVATE void *
 mfatic_mount (conn)
     struct fuse_conn_info *conn;    // ignored.
 {
+    fat_volume_t *v = vol_current ();
+
+    // start any background threads for the device before anything else,
+    // as they do not survive FUSE daemonising.
+    dev_start (v->dev);
+    blk_init (v);
+
     // call all the init functions.
-    directory_init (volume_info);
-    init_clusters_map (volume_info);
-    fileio_init (volume_info);
-    stat_init (volume_info);
-    table_init (volume_info);
+    directory_init (v);
+    init_clusters_map (v);
+    fileio_init (v);
+    table_init (v);
+    pin_init (v);
+
+    // warm the pinned files now, so that the first use of each is
+    // already served from memory.
+    for (unsigned int i = 0; i < mount_opts.nr_pins; i ++)
+    {
+        if (pin_add (mount_opts.pins [i]) != 0)
+            warnx ("Couldn't pin %s", mount_opts.pins [i]);
+    }
 
-    return NULL;
+    return v;
+}
+
+/**
+ *  Called by FUSE as the file system is unmounted. Make sure everything
+ *  we have written reaches the device, and close it.
+ */
+    PRIVATE void
+mfatic_umount (private_data)
+    void *private_data;             // the volume being unmounted.
+{
+    fat_volume_t *v = private_data;
+
+    blk_close (v);
+    dev_close (v->dev);
 }
 
 /**
@@ -178,7 +668,7 @@ mfatic_open (path, fd)
     }
 
     // save a pointer to the file struct.
-    fd->fh = (int) newfile;
+    fd->fh = (uint64_t) (uintptr_t) newfile;
 
     return 0;
 }
@@ -194,7 +684,7 @@ mfatic_release (path, fd)
     const char *path;           // absolute path. Unused.
     struct fuse_file_info *fd;
 {
-    fat_file_t *oldfd = (fat_file_t *) fd->fh;
+    fat_file_t *oldfd = (fat_file_t *) (uintptr_t) fd->fh;
 
     // release the memory allocated to the file struct.
     fat_close (oldfd);
@@ -202,6 +692,22 @@ mfatic_release (path, fd)
     return 0;
 }
 
+/**
+ *  Flush all writes to the device. We do not track which writes belong
+ *  to which file, so this syncs the whole volume.
+ */
+    PRIVATE int
+mfatic_fsync (path, datasync, fd)
+    const char *path;           // absolute path. Unused.
+    int datasync;               // metadata need not be synced. Ignored.
+    struct fuse_file_info *fd;  // file handle. Unused.
+{
+    blk_flush ();
+    dev_sync (vol_current ()->dev);
+
+    return 0;
+}
+
 /**
  *  Read nbytes from a file, starting at offset bytes from the start, and
  *  store them in buf.
@@ -216,7 +722,7 @@ mfatic_read (name, buf, nbytes, offset, fd)
     off_t offset;               // where to start reading.
     struct fuse_file_info *fd;  // file handle.
 {
-    fat_file_t *rf = (fat_file_t *) fd->fh;
+    fat_file_t *rf = (fat_file_t *) (uintptr_t) fd->fh;
 
     // update the access time field for this file.
     update_atime (rf, time (NULL));
@@ -244,7 +750,7 @@ mfatic_write (name, buf, nbytes, offset, fd)
     off_t offset;               // where to start writing.
     struct fuse_file_info *fd;  // file handle.
 {
-    fat_file_t *wf = (fat_file_t *) fd->fh;
+    fat_file_t *wf = (fat_file_t *) (uintptr_t) fd->fh;
 
     // update the time of last modification.
     update_mtime (wf, time (NULL));
@@ -323,13 +829,13 @@ mfatic_statfs (name, st)
     struct statvfs *st;     // buffer to store fs information.
 {
     // store the cluster size. Fragments are 1 cluster in size.
-    st->f_bsize = CLUSTER_SIZE (volume_info);
+    st->f_bsize = CLUSTER_SIZE (vol_current ());
     st->f_frsize = st->f_bsize;
 
     // information on the number of clusters which are allocated or
     // available is gathered at mount time by the free space manager.
-    st->f_blocks = used_clusters () + free_clusters ();
-    st->f_bfree = free_clusters ();
+    st->f_blocks = (fsblkcnt_t) (used_clusters () + free_clusters ());
+    st->f_bfree = (fsblkcnt_t) free_clusters ();
     st->f_bavail = st->f_bfree;
 
     // At present, we do not support long file names; only the old 8.3
@@ -390,7 +896,7 @@ mfatic_readdir (path, buffer, filler, offset, fd)
     off_t offset;                   // index of first direntry to read.
     struct fuse_file_info *fd;      // directory file handle.
 {
-    fat_file_t *dirfd = (fat_file_t *) fd->fh;
+    fat_file_t *dirfd = (fat_file_t *) (uintptr_t) fd->fh;
     fat_direntry_t entry;
     struct stat attrs;
 
@@ -402,17 +908,33 @@ mfatic_readdir (path, buffer, filler, offset, fd)
     }
 
     // iteratively read entries until the filler function indicates that
-    // we have filled the buffer.
-    do
+    // we have filled the buffer, or we reach the end of the directory.
+    while ((fat_read (dirfd, &entry, sizeof (fat_direntry_t)) != 0) &&
+      (entry.fname [0] != '\0'))
     {
-        // read the next entry.
-        fat_read (dirfd, &entry, sizeof (fat_direntry_t));
+        offset += 1;
+
+        // deleted entries stay where they are until the directory is
+        // compacted, and are skipped.
+        if (DIR_IS_DELETED (&entry))
+            continue;
+
         entry.fname [DIR_NAME_LEN - 1] = '\0';
 
+        // whatever is listed is likely to be looked up next, so have its
+        // metadata read in while the listing goes back to the caller.
+        dir_prefetch (&entry);
+
         // unpack file attribute information from the directory entry.
         unpack_attributes (&entry, &attrs);
+
+        // a leading 0xE5 is stored escaped.
+        if ((uint8_t) entry.fname [0] == DIR_ENTRY_E5_ESCAPE)
+            entry.fname [0] = (char) DIR_ENTRY_DELETED;
+
+        if (filler (buffer, entry.fname, &attrs, offset) == 1)
+            break;
     }
-    while (filler (buffer, entry.fname, &attrs, offset += 1) != 1);
 
     return 0;
 }
@@ -442,9 +964,10 @@ mfatic_truncate (path, length)
 {
     fat_file_t *fd;
     int retval;
-    const char zero = '\0';
-    cluster_list_t *prev = NULL;
-    size_t oldsize;
+    void *zeroes;
+    size_t oldsize, cluster_size = CLUSTER_SIZE (vol_current ());
+    uint32_t needed, have, added;
+    off_t chunk;
 
     // open the target file.
     if ((retval = fat_open (path, &fd)) != 0)
@@ -460,39 +983,53 @@ mfatic_truncate (path, length)
     if (oldsize > length)
     {
         // truncated legnth is shorter than existing size, so we will
-        // delete the excess, releasing clusters to the free pool.
-        // First, mark the current cluster as End of File.
-        put_fat_entry (fd->current_cluster->cluster_id, END_CLUSTER_MARK);
-
-        // now step through all the remaining clusters in the list, and
-        // release them to the free space pool.
-        for (cluster_list_t *cp = fd->current_cluster->next; cp != NULL;
-          cp = cp->next)
-        {
-            release_cluster (cp->cluster_id);
-
-            // release the previous item in the list, if there was a
-            // previous.
-            if (prev != NULL)
-                safe_free ((void **) &prev);
-
-            prev = cp;
-        }
-
-        // release the last item in the linked list.
-        safe_free ((void **) &prev);
+        // delete the excess, releasing clusters to the free pool. Every
+        // file keeps at least its first cluster, which identifies it.
+        truncate_clusters (fd, MAX ((length + cluster_size - 1) /
+            cluster_size, 1));
     }
     else if (oldsize < length)
     {
-        // truncatesd length is longer than the existing file size. In
-        // this case, we allocate extra clusters, and zero them. This can
-        // be done simply with a write operation.
-        for (int i = 0; i < (length - oldsize); i ++)
+        // truncated length is longer than the existing file size. In this
+        // case, we allocate extra clusters first. A file made much larger
+        // at once is being given the size it is going to have, so its
+        // clusters come from the largest free region, clear of the small
+        // files that were placed around its first cluster.
+        needed = (length + cluster_size - 1) / cluster_size;
+        have = extent_count (&(fd->clusters));
+
+        if (needed > have)
+        {
+            if (length - oldsize >= LARGE_FILE_SIZE)
+                added = alloc_large (fd, needed - have);
+            else
+                added = alloc_clusters (fd, needed - have);
+
+            if (added < needed - have)
+            {
+                truncate_clusters (fd, MAX (have, 1));
+                fd->size = oldsize;
+                fat_close (fd);
+                return -ENOSPC;
+            }
+        }
+
+        // then zero the new part of the file, a cluster at a time.
+        zeroes = safe_malloc (cluster_size);
+        memset (zeroes, 0, cluster_size);
+        fat_seek (fd, oldsize, SEEK_SET);
+
+        for (off_t done = oldsize; done < length; done += chunk)
         {
-            fat_write (fd, &zero, 1);
+            chunk = MIN ((off_t) cluster_size, length - done);
+            fat_write (fd, zeroes, (size_t) chunk);
         }
+
+        safe_free ((void **) &zeroes);
     }
 
+    fat_close (fd);
+
     return 0;
 }
 
@@ -531,61 +1068,201 @@ mfatic_utimens (path, tv)
     return 0;
 }
 
+/**
+ *  Extended attributes cannot be stored on a FAT file system, so setting
+ *  one is used instead as a way of sending a control command to the
+ *  daemon. See control.h.
+ */
+    PRIVATE int
+mfatic_setxattr (path, name, value, size, flags)
+    const char *path;       // file the attribute is set on.
+    const char *name;       // attribute name.
+    const char *value;      // attribute value.
+    size_t size;            // length of the value.
+    int flags;              // create or replace. Ignored.
+{
+    return control_command (path, name, value, size);
+}
+
+/**
+ *  Getting one of our extended attributes answers a query about the
+ *  daemon, such as the latencies seen by each client. See control.h.
+ */
+    PRIVATE int
+mfatic_getxattr (path, name, value, size)
+    const char *path;       // file the attribute is asked for on.
+    const char *name;       // attribute name.
+    char *value;            // buffer for the value.
+    size_t size;            // size of the buffer, or 0 to ask the length.
+{
+    return control_query (path, name, value, size);
+}
+
 /**
  *  Parse any command line options given to the Emphatic mount command
  *  line. Note that this procedure only deals with Emphatic specific
- *  options (help and version), and there may also be options for FUSE,
- *  which will be ignored by this procedure.
+ *  options (help, version, and the -o options in mfatic_opts), and there
+ *  may also be options for FUSE, which are left in the argument list.
  */
     PRIVATE void
-parse_command_opts (argc, argv)
-    int argc;           // number of options given.
-    char **argv;        // vector of text options.
+parse_command_opts (args)
+    struct fuse_args *args;     // command line arguments.
 {
-    int index, c;
-    static const struct option opts [] =
+    if (fuse_opt_parse (args, &mount_opts, mfatic_opts, parse_option) != 0)
+        exit (1);
+
+    // If we reach this point, we must be mounting devices. Check that
+    // each has a mount point.
+    if ((nr_mounts == 0) || (mounts [nr_mounts - 1].directory == NULL))
     {
-        {"help",    no_argument,    0, 'h'},
-        {"version", no_argument,    0, 'v'},
-        {0,         0,              0, 0}
-    };
-
-    // check for help or version options. getopt_long returns -1 once
-    // we run out of command line parameters to process.
-    while ((c = getopt_long (argc, argv, "hv", opts, &index)) != -1)
+        print_usage ();
+        exit (1);
+    }
+}
+
+/**
+ *  Called by fuse_opt_parse for each argument which is not handled by
+ *  a template in mfatic_opts. Non option arguments are taken in pairs, of
+ *  a device and the directory to mount it on, and are removed from the
+ *  list; anything else is kept for FUSE.
+ *
+ *  Return value is 0 to discard the argument, 1 to keep it, or -1 on an
+ *  error.
+ */
+    PRIVATE int
+parse_option (data, arg, key, outargs)
+    void *data;                 // mount options. Unused.
+    const char *arg;            // the argument.
+    int key;                    // which kind of argument it is.
+    struct fuse_args *outargs;  // arguments to be passed on to FUSE.
+{
+    switch (key)
     {
-        switch (c)
-        {
-        case 'h':
-            // print usage info and exit.
-            print_usage ();
-            exit (0);
-            break;
+    case KEY_HELP:
+        // print usage info and exit.
+        print_usage ();
+        exit (0);
+
+    case KEY_VERSION:
+        // print version info and exit.
+        print_version ();
+        exit (0);
+
+    case KEY_QOS_WEIGHT:
+        // a client's weight, given as id:weight.
+        return parse_weight (arg);
 
-        case 'v':
-            // print version info and exit.
-            print_version ();
-            exit (0);
+    case KEY_PIN:
+        // a path to pin.
+        return parse_pin (arg);
+
+    case FUSE_OPT_KEY_NONOPT:
+        // start a new entry if the last is complete.
+        if ((nr_mounts == 0) || (mounts [nr_mounts - 1].directory != NULL))
+        {
+            grow_mounts ();
+            mounts [nr_mounts - 1].device = safe_malloc (strlen (arg) + 1);
+            strcpy (mounts [nr_mounts - 1].device, arg);
+        }
+        else
+        {
+            mounts [nr_mounts - 1].directory =
+                safe_malloc (strlen (arg) + 1);
+            strcpy (mounts [nr_mounts - 1].directory, arg);
         }
+
+        return 0;
     }
 
-    // If we reach this point, we must be mounting a device. Do a sanity
-    // test on the length of the parameter list provided on the command
-    // line, to attempt to catch errors, like not specifying a device or
-    // mount point.
-    if (argc < MIN_ARGS)
+    return 1;
+}
+
+/**
+ *  Parse a qos_weight=ID:WEIGHT option, giving the user or process ID a
+ *  share of its volumes in proportion to WEIGHT. Others have a weight of
+ *  1.
+ *
+ *  Return value is 0 to discard the option, or -1 if it is invalid.
+ */
+    PRIVATE int
+parse_weight (arg)
+    const char *arg;            // the option.
+{
+    qos_params_t *qos = &(mount_opts.qos);
+    unsigned int id, weight;
+    char extra;
+
+    if ((sscanf (arg, "qos_weight=%u:%u%c", &id, &weight, &extra) != 2) ||
+      (weight == 0))
     {
-        // too few parameters.
-        print_usage ();
-        exit (0);
+        warnx ("Invalid option %s", arg);
+        return -1;
+    }
+
+    if (qos->nr_weights == QOS_MAX_WEIGHTS)
+    {
+        warnx ("At most %d clients can be given weights", QOS_MAX_WEIGHTS);
+        return -1;
+    }
+
+    qos->weights [qos->nr_weights].id = id;
+    qos->weights [qos->nr_weights].weight = weight;
+    qos->nr_weights ++;
+
+    return 0;
+}
+
+/**
+ *  Parse a pin=PATH option, naming a file or directory to keep in memory,
+ *  by its path from the mount point.
+ *
+ *  Return value is 0 to discard the option, or -1 if it is invalid.
+ */
+    PRIVATE int
+parse_pin (arg)
+    const char *arg;            // the option.
+{
+    const char *path = arg + strlen ("pin=");
+
+    if (path [0] != '/')
+    {
+        warnx ("Pinned paths start from the mount point, with a /: %s",
+          path);
+        return -1;
     }
 
-    // device and mountpoint parameters should be at the end of the
-    // parameter list.
-    device_file = argv [argc - DEVICE_INDEX];
+    if (mount_opts.nr_pins == PIN_MAX_FILES)
+    {
+        warnx ("At most %d files can be pinned", PIN_MAX_FILES);
+        return -1;
+    }
 
-    // swap the mountpoint and device args for FUSE.
-    argv [argc - DEVICE_INDEX] = argv [argc - MOUNTPOINT_INDEX];
+    mount_opts.pins [mount_opts.nr_pins] = safe_malloc (strlen (path) + 1);
+    strcpy (mount_opts.pins [mount_opts.nr_pins], path);
+    mount_opts.nr_pins ++;
+
+    return 0;
+}
+
+/**
+ *  Add an empty entry to the end of the table of mounts.
+ */
+    PRIVATE void
+grow_mounts (void)
+{
+    struct mount_point *bigger;
+
+    bigger = safe_malloc (sizeof (struct mount_point) * (nr_mounts + 1));
+    memset (bigger, 0, sizeof (struct mount_point) * (nr_mounts + 1));
+
+    if (mounts != NULL)
+    {
+        memcpy (bigger, mounts, sizeof (struct mount_point) * nr_mounts);
+        safe_free ((void **) &mounts);
+    }
+
+    mounts = bigger;
+    nr_mounts += 1;
 }
 
 /**
@@ -598,37 +1275,12 @@ init_volume (devname, volinfo)
     const char *devname;        // device file hosting our file system.
     fat_volume_t **volinfo;     // this will be set by init_volume.
 {
-    int devfd;
-    fat_super_block_t *sb;
-    fat_fsinfo_t *fsinfo;
-
-    // open the device file. This will abort on errors.
-    devfd = safe_open (devname, O_RDWR);
-
-    // now allocate memory for the various data structures.
-    *volinfo = safe_malloc (sizeof (fat_volume_t));
-    sb = safe_malloc (sizeof (fat_super_block_t));
-    fsinfo = safe_malloc (sizeof (fat_fsinfo_t));
-
-    // read in the FAT32 super block (or BPB, if you are Old School).
-    safe_seek (devfd, 0, SEEK_SET);
-    safe_read (devfd, sb, sizeof (fat_super_block_t));
-
-    // read in the fs info sector, field by field as it is not a one to
-    // one mapping of the on disk structure (we ommit all the unused space
-    // to save memory).
-    safe_seek (devfd, sb->fsinfo_sector * sb->bps, SEEK_SET);
-    safe_read (devfd, &(fsinfo->magic1), FSINFO_MAGIC1_LEN);
-    safe_seek (devfd, 480, SEEK_CUR);
-    safe_read (devfd, &(fsinfo->magic2), FSINFO_MAGIC2_LEN + 8);
-    safe_seek (devfd, 12, SEEK_CUR);
-    safe_read (devfd, &(fsinfo->magic3), FSINFO_MAGIC3_LEN);
+    // open the device file, with the backend named on the command line.
+    // This will abort on errors.
+    *volinfo = vol_open (devname, &(mount_opts.dev));
 
     // check fsinfo magics.
-    if ((verify_magic (FSINFO_MAGIC1, fsinfo->magic1, FSINFO_MAGIC1_LEN) &&
-          verify_magic (FSINFO_MAGIC2, fsinfo->magic2, FSINFO_MAGIC2_LEN) &&
-          verify_magic (FSINFO_MAGIC3, fsinfo->magic3, FSINFO_MAGIC3_LEN))
-      != true)
+    if (vol_fsinfo_valid (*volinfo) != true)
     {
         // magics don't match. That would indicate that the device is not
         // formatted as a FAT file system, and we should not continue any
@@ -638,39 +1290,6 @@ init_volume (devname, volinfo)
           PROGNAME, devname);
         exit (1);
     }
-
-    // fill in the volume info structure.
-    (*volinfo)->dev_fd = devfd;
-    (*volinfo)->bpb = sb;
-    (*volinfo)->fsinfo = fsinfo;
-}
-
-/**
- *  compare two magics, of a given length, regardless of the presence
- *  of NULL bytes. This procedure steps along the two strings for as long
- *  as they remain identical (including identical null bytes) returning
- *  only when it reaches the specified length to compare, or a non matching
- *  character is found.
- *
- *  Return value is true if the strings are identical, or fals if they
- *  differ.
- */
-    PRIVATE bool
-verify_magic (str1, str2, length)
-    const char *str1;       // expected value.
-    const char *str2;       // actual magic on the device.
-    unsigned int length;    // length to compare for.
-{
-    // step along both strings until we either find a differing character,
-    // or we reach the end, as specified by length.
-    for (unsigned int i = 0; i < length; i ++)
-    {
-        if (str1 [i] != str2 [i])
-            return false;
-    }
-
-    // if we reach this point, the strings must be identical.
-    return true;
 }
 
 /**
@@ -682,10 +1301,65 @@ print_usage (void)
     printf ("mfatic-fuse: FUSE mount tool for FAT32 file systems.\n\n"
       "USAGE:\n"
       "\tmfatic-fuse [-hv]\n"
-      "\tmfatic-fuse [options] device directory\n\n"
+      "\tmfatic-fuse [options] device directory [device directory ...]\n\n"
       "COMMAND LINE OPTIONS:\n"
       "\t-h --help    print this information\n"
       "\t-v --version print version information\n"
+      "\t-o backend=NAME\n"
+      "\t             how to access the device: pread, direct, mmap,\n"
+      "\t             uring or memory. The default is mmap for image\n"
+      "\t             files, and pread for block devices. ram keeps\n"
+      "\t             the volume in memory, writing changes back in\n"
+      "\t             the background.\n"
+      "\t-o writeback=SECS\n"
+      "\t             interval between write backs with backend=ram.\n"
+      "\t-o ram_mode=full|meta\n"
+      "\t             with backend=ram, keep the whole volume in memory,\n"
+      "\t             or only the metadata and recently used data.\n"
+      "\t-o ram_hot=MB\n"
+      "\t             limit on file data kept with ram_mode=meta.\n"
+      "\t-o discard\n"
+      "\t             tell the device about clusters as they are freed,\n"
+      "\t             in batches. Otherwise, set user.mfatic.trim on\n"
+      "\t             the mount point now and then, like fstrim.\n"
+      "\t-o alloc=spread|compact\n"
+      "\t             spread new directory trees and large files out\n"
+      "\t             across the volume, leaving room to grow, or pack\n"
+      "\t             them in from the start, discarding freed space,\n"
+      "\t             to keep a sparse image file small.\n"
+      "\t-o align=KB\n"
+      "\t-o stripe=KB\n"
+      "\t             erase block size and RAID stripe width. Large\n"
+      "\t             files are given runs of clusters starting on\n"
+      "\t             these boundaries. By default, the optimal IO\n"
+      "\t             size reported by a block device is used.\n"
+      "\t-o overlay=FILE\n"
+      "\t             leave the device untouched, and keep all changes\n"
+      "\t             in FILE, which is created if need be. Deleting\n"
+      "\t             FILE after unmounting discards the changes.\n"
+      "\t-o cache_size=MB\n"
+      "\t             memory budget shared by all caches. The default\n"
+      "\t             is half the cgroup memory limit, if there is one.\n"
+      "\t-o threads=N\n"
+      "\t             number of threads serving requests on all of the\n"
+      "\t             volumes together.\n"
+      "\t-o qos=uid|pid|off\n"
+      "\t             share each volume fairly between users, or\n"
+      "\t             processes, or serve requests in order. Latencies\n"
+      "\t             of each are reported by user.mfatic.qos.\n"
+      "\t-o qos_weight=ID:WEIGHT\n"
+      "\t             give a user or process WEIGHT times the share of\n"
+      "\t             others. May be given more than once.\n"
+      "\t-o qos_mbps=MB\n"
+      "\t-o qos_iops=N\n"
+      "\t             limit each user or process to MB megabytes, and N\n"
+      "\t             requests, a second.\n"
+      "\t-o pin=PATH\n"
+      "\t             keep the file or directory at PATH, and the\n"
+      "\t             directories leading to it, in memory. May be\n"
+      "\t             given more than once. Set user.mfatic.pin or\n"
+      "\t             user.mfatic.unpin on a file to pin it or unpin\n"
+      "\t             it, and get user.mfatic.pins for a list.\n"
       "\toptions      FUSE specific options. See the man page for\n"
       "\t             fuse(8) for a list.\n");
 }
@@ -0,0 +1,608 @@
+/**
+ *  mfatic-mkfs.c
+ *
+ *  Formats a device or image file as a FAT32 volume.
+ *
+ *  Formatting a large volume is mostly a matter of clearing the FATs,
+ *  which on a 2 TB volume come to a gigabyte or so. They are cleared with
+ *  large writes, BULK_IO_SIZE bytes each and several in flight at once,
+ *  all starting on the alignment boundary. On an image file the region is
+ *  punched out instead, which leaves it sparse, and a target that is
+ *  known to read as zeros already need not be cleared at all.
+ *
+ *  The FATs and the data region are placed on a chosen boundary, such as
+ *  a flash erase block or RAID stripe, so that the daemon's aligned
+ *  allocations line up with the device. A summary of the free space is
+ *  also written in the reserved sectors, which saves the daemon from
+ *  scanning the whole FAT the first time the volume is mounted.
+ *
+ *  The boot sector is written last, so a format that is interrupted does
+ *  not leave behind something that looks like a volume.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <err.h>
+#include <time.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "fat.h"
+#include "device.h"
+
+
+// the sectors of the standard FAT32 layout: boot sector, FSINFO sector,
+// and their backups.
+#define BOOT_SECTOR             0
+#define FSINFO_SECTOR           1
+#define BACKUP_BOOT_SECTOR      6
+#define BACKUP_FSINFO_SECTOR    7
+
+// fewest reserved sectors to leave, as is usual for FAT32.
+#define MIN_RESERVED            32
+
+// limits on the number of clusters of a FAT32 volume.
+#define MIN_CLUSTERS            65525
+#define MAX_CLUSTERS            0x0FFFFFF5
+
+// most clearing writes in flight at once.
+#define ZERO_BATCH              8
+
+// byte offsets of the fields in the on disk FSINFO sector, and of the
+// file system type string and signature in the boot sector.
+#define FSINFO_MAGIC2_OFFSET    484
+#define FSINFO_MAGIC3_OFFSET    508
+#define FS_TYPE_OFFSET          82
+#define SIGNATURE_OFFSET        510
+
+
+// functions for working out the layout.
+PRIVATE void open_target (const char *path);
+PRIVATE void plan_layout (void);
+PRIVATE uint32_t clusters_for (uint32_t fat_sectors);
+PRIVATE uint32_t fat_sectors_for (uint64_t nr_clusters);
+PRIVATE uint32_t round_up (uint64_t sectors);
+
+// functions for writing the volume out.
+PRIVATE void zero_region (off_t offset, off_t length);
+PRIVATE void write_fats (void);
+PRIVATE void write_free_map (void);
+PRIVATE void write_fsinfo (void);
+PRIVATE void write_boot (void);
+
+// functions used by the main program.
+PRIVATE void print_usage (void);
+PRIVATE void print_version (void);
+
+
+// options given on the command line. Sizes of 0 are worked out from the
+// device.
+PRIVATE unsigned int sector_size = 0;
+PRIVATE unsigned int cluster_kb = 0;
+PRIVATE unsigned int align_kb = 0;
+PRIVATE unsigned int nr_fats = 2;
+PRIVATE uint64_t image_mb = 0;
+PRIVATE const char *label = "NO NAME";
+PRIVATE bool zeroed = false;
+PRIVATE bool discard_first = false;
+
+// the volume being made. Its boot sector is filled in as the layout is
+// worked out, so the usual macros can be used on it.
+PRIVATE fat_volume_t volume;
+PRIVATE fat_volume_t *v = &volume;
+PRIVATE fat_super_block_t sb;
+
+// sectors in the alignment unit, and the volume's size in sectors.
+PRIVATE uint32_t align_sectors;
+PRIVATE uint32_t total_sectors;
+
+
+/**
+ *  Program entry point. Format the device named on the command line.
+ *
+ *  Return value is 0 on success. Errors are fatal.
+ */
+    PUBLIC int
+main (argc, argv)
+    int argc;           // number of command line arguments.
+    char *argv [];      // array of argument strings.
+{
+    dev_params_t params;
+    struct timespec now;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "S:c:a:f:s:n:i:zDhV")) != -1)
+    {
+        switch (opt)
+        {
+        case 'S':
+            sector_size = atoi (optarg);
+            break;
+
+        case 'c':
+            cluster_kb = atoi (optarg);
+            break;
+
+        case 'a':
+            align_kb = atoi (optarg);
+            break;
+
+        case 'f':
+            nr_fats = atoi (optarg);
+            break;
+
+        case 's':
+            image_mb = strtoull (optarg, NULL, 0);
+            break;
+
+        case 'n':
+            label = optarg;
+            break;
+
+        case 'i':
+            sb.volume_id = strtoul (optarg, NULL, 16);
+            break;
+
+        case 'z':
+            zeroed = true;
+            break;
+
+        case 'D':
+            discard_first = true;
+            break;
+
+        case 'V':
+            print_version ();
+            return 0;
+
+        case 'h':
+            print_usage ();
+            return 0;
+
+        default:
+            print_usage ();
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        print_usage ();
+        return 1;
+    }
+
+    if (sb.volume_id == 0)
+    {
+        clock_gettime (CLOCK_REALTIME, &now);
+        sb.volume_id = (uint32_t) now.tv_sec ^ (uint32_t) now.tv_nsec;
+    }
+
+    // create or extend an image file, if asked to, and open the target.
+    // Writes are all large, and made once, so there is nothing to be
+    // gained by mapping an image.
+    open_target (argv [optind]);
+    memset (&params, 0, sizeof (dev_params_t));
+    params.backend = "pread";
+    v->dev = dev_open (argv [optind], &params);
+    v->bpb = &sb;
+
+    plan_layout ();
+
+    printf ("%s: %lu clusters of %u bytes, %u FATs of %u sectors, data "
+      "at byte %llu\n", argv [optind], (unsigned long) NR_CLUSTERS (v),
+      (unsigned int) CLUSTER_SIZE (v), nr_fats, sb.sectors_per_fat,
+      (unsigned long long) DATA_START (v));
+
+    if (discard_first)
+        dev_discard (v->dev, 0, (off_t) total_sectors * sector_size);
+
+    // clear the reserved sectors, the FATs and the root directory, and
+    // fill in everything but the boot sector.
+    zero_region (0, DATA_START (v));
+    zero_region (CLUSTER_OFFSET (v, sb.root_cluster), CLUSTER_SIZE (v));
+    write_fats ();
+    write_free_map ();
+    write_fsinfo ();
+    dev_sync (v->dev);
+
+    // then make it a volume.
+    write_boot ();
+    dev_sync (v->dev);
+    dev_close (v->dev);
+
+    return 0;
+}
+
+/**
+ *  Create an image file of the size given with -s, or extend an existing
+ *  one to that size. Does nothing if no size was given.
+ */
+    PRIVATE void
+open_target (path)
+    const char *path;       // image file name.
+{
+    struct stat st;
+    int fd;
+
+    if (image_mb == 0)
+        return;
+
+    if ((fd = open (path, O_RDWR | O_CREAT, 0644)) == -1)
+        err (1, "%s", path);
+
+    if (fstat (fd, &st) != 0)
+        err (1, "%s", path);
+
+    if (S_ISREG (st.st_mode) == 0)
+        errx (1, "%s: -s is only for image files", path);
+
+    if ((st.st_size < (off_t) (image_mb * 1024 * 1024)) &&
+      (ftruncate (fd, (off_t) (image_mb * 1024 * 1024)) != 0))
+        err (1, "%s", path);
+
+    safe_close (path, fd);
+}
+
+/**
+ *  Work out the layout of the volume, and fill in the boot sector to
+ *  describe it. The reserved sectors and each FAT are a whole number of
+ *  alignment units long, so that the FATs and the data region all start
+ *  on a boundary.
+ */
+    PRIVATE void
+plan_layout (void)
+{
+    uint64_t upper, map_bytes;
+    uint32_t smaller, cluster_size;
+
+    if (sector_size == 0)
+        sector_size = MAX (v->dev->block_size, 512);
+
+    if ((sector_size < 512) || (sector_size > 4096) ||
+      (sector_size & (sector_size - 1)))
+        errx (1, "sector size must be 512, 1024, 2048 or 4096 bytes");
+
+    total_sectors = MIN (v->dev->size / sector_size, UINT32_MAX);
+
+    // choose a cluster size for the volume's size, as other formatters
+    // do, if none was asked for.
+    if (cluster_kb == 0)
+    {
+        uint64_t gb = (uint64_t) total_sectors * sector_size >> 30;
+
+        cluster_kb = (gb < 8) ? 4 : (gb < 16) ? 8 : (gb < 32) ? 16 : 32;
+    }
+
+    cluster_size = cluster_kb * 1024;
+    if ((cluster_size < sector_size) || (cluster_size > 65536) ||
+      (cluster_size & (cluster_size - 1)))
+        errx (1, "cluster size must be a power of 2, from the sector size "
+          "to 64 KB");
+
+    // align to a cluster, or the device's optimal IO size, unless told
+    // otherwise.
+    if (align_kb == 0)
+        align_kb = MAX (cluster_size, v->dev->io_opt) / 1024;
+
+    if (((align_kb * 1024) % sector_size) != 0)
+        errx (1, "alignment must be a multiple of the sector size");
+
+    if ((nr_fats < 1) || (nr_fats > 4))
+        errx (1, "there must be from 1 to 4 FATs");
+
+    align_sectors = MAX (1, align_kb * 1024 / sector_size);
+
+    sb.jmpBoot [0] = 0xEB;
+    sb.jmpBoot [1] = 0x58;
+    sb.jmpBoot [2] = 0x90;
+    memcpy (sb.OEM_name, "MFATIC  ", OEM_LEN);
+    sb.bps = sector_size;
+    sb.spc = cluster_size / sector_size;
+    sb.nr_FATs = nr_fats;
+    sb.media = 0xF8;
+    sb.sectors_per_track = 63;
+    sb.nr_heads = 255;
+    sb.nr_sectors = total_sectors;
+    sb.root_cluster = 2;
+    sb.fsinfo_sector = FSINFO_SECTOR;
+    sb.boot_backup_sector = BACKUP_BOOT_SECTOR;
+    sb.drive_num = 0x80;
+    sb.boot_sig = 0x29;
+    memset (sb.vol_label, ' ', LABEL_LEN);
+    memcpy (sb.vol_label, label, MIN (strlen (label), LABEL_LEN));
+
+    // leave room for the free space checkpoint, sized for the most
+    // clusters there could be.
+    upper = total_sectors / sb.spc;
+    map_bytes = sizeof (fat_free_map_t) + sizeof (fat_free_group_t) *
+      ((upper + ALLOC_GROUP_SIZE - 1) / ALLOC_GROUP_SIZE);
+    sb.nr_reserved_secs = round_up (MAX (MIN_RESERVED, FREE_MAP_SECTOR +
+        (map_bytes + sector_size - 1) / sector_size));
+
+    // a FAT big enough for every cluster would be a little too big, as
+    // the FATs take up some of the space. Shrink it while the clusters
+    // that are left still fit.
+    sb.sectors_per_fat = fat_sectors_for (upper);
+    while (true)
+    {
+        smaller = fat_sectors_for (clusters_for (sb.sectors_per_fat));
+
+        if ((smaller >= sb.sectors_per_fat) ||
+          (fat_sectors_for (clusters_for (smaller)) > smaller))
+            break;
+
+        sb.sectors_per_fat = smaller;
+    }
+
+    if ((uint64_t) DATA_START (v) / sector_size >= total_sectors)
+        errx (1, "device is too small");
+
+    if (NR_CLUSTERS (v) < MIN_CLUSTERS)
+        errx (1, "%lu clusters is too few for FAT32; use smaller clusters",
+          (unsigned long) NR_CLUSTERS (v));
+
+    if (NR_CLUSTERS (v) > MAX_CLUSTERS)
+        errx (1, "%lu clusters is too many for FAT32; use larger clusters",
+          (unsigned long) NR_CLUSTERS (v));
+}
+
+/**
+ *  Return value is the number of clusters that fit on the volume, if each
+ *  FAT is a given number of sectors long.
+ */
+    PRIVATE uint32_t
+clusters_for (fat_sectors)
+    uint32_t fat_sectors;   // sectors in each FAT.
+{
+    uint64_t used = sb.nr_reserved_secs + (uint64_t) nr_fats * fat_sectors;
+
+    if (used >= total_sectors)
+        return 0;
+
+    return (total_sectors - used) / sb.spc;
+}
+
+/**
+ *  Return value is the number of sectors each FAT needs to hold a given
+ *  number of clusters, rounded up to the alignment unit.
+ */
+    PRIVATE uint32_t
+fat_sectors_for (nr_clusters)
+    uint64_t nr_clusters;   // clusters on the volume.
+{
+    return round_up (((nr_clusters + 2) * FAT_ENTSIZE + sector_size - 1) /
+      sector_size);
+}
+
+/**
+ *  Return value is a number of sectors, rounded up to a whole number of
+ *  alignment units.
+ */
+    PRIVATE uint32_t
+round_up (sectors)
+    uint64_t sectors;       // sectors to round up.
+{
+    return (sectors + align_sectors - 1) / align_sectors * align_sectors;
+}
+
+/**
+ *  Make a region of the device read as zeros. On an image file, the
+ *  region is punched out. Otherwise it is written over, BULK_IO_SIZE
+ *  bytes at a time, with up to ZERO_BATCH writes in flight at once. A
+ *  target given as already zeroed is left alone.
+ */
+    PRIVATE void
+zero_region (offset, length)
+    off_t offset;           // start of the region.
+    off_t length;           // length of the region.
+{
+    dev_request_t reqs [ZERO_BATCH];
+    unsigned int nr_reqs = 0;
+    char *zeros;
+
+    if (zeroed || (length == 0))
+        return;
+
+    if ((v->dev->is_blkdev == false) &&
+      (dev_discard (v->dev, offset, length) == 0))
+        return;
+
+    zeros = safe_malloc (BULK_IO_SIZE);
+    memset (zeros, 0, BULK_IO_SIZE);
+
+    while (length > 0)
+    {
+        reqs [nr_reqs].op = DEV_OP_WRITE;
+        reqs [nr_reqs].offset = offset;
+        reqs [nr_reqs].buf = zeros;
+        reqs [nr_reqs].count = MIN (BULK_IO_SIZE, length);
+
+        offset += reqs [nr_reqs].count;
+        length -= reqs [nr_reqs].count;
+
+        if ((++ nr_reqs == ZERO_BATCH) || (length == 0))
+        {
+            dev_submit (v->dev, reqs, nr_reqs);
+
+            for (unsigned int i = 0; i < nr_reqs; i ++)
+            {
+                if (reqs [i].result != (ssize_t) reqs [i].count)
+                    errx (1, "write failed at byte %lld",
+                      (long long) reqs [i].offset);
+            }
+
+            nr_reqs = 0;
+        }
+    }
+
+    safe_free ((void **) &zeros);
+}
+
+/**
+ *  Write the first sector of each FAT, which holds the two reserved
+ *  entries and the end of the root directory's chain. The rest of the
+ *  FATs has already been cleared.
+ */
+    PRIVATE void
+write_fats (void)
+{
+    fat_entry_t *head = safe_malloc (sector_size);
+
+    memset (head, 0, sector_size);
+    head [0] = 0x0FFFFF00 | sb.media;
+    head [1] = 0x0FFFFFFF;
+    head [sb.root_cluster] = END_CLUSTER_MARK;
+
+    for (unsigned int i = 0; i < nr_fats; i ++)
+    {
+        dev_write (v->dev, (off_t) (FAT_START (v) + i * FAT_SECTORS (v)) *
+          sector_size, head, sector_size);
+    }
+
+    safe_free ((void **) &head);
+}
+
+/**
+ *  Write the free space checkpoint. Every cluster is free, but for the
+ *  root directory's, which is the first cluster of the first group.
+ */
+    PRIVATE void
+write_free_map (void)
+{
+    uint32_t nr_clusters = NR_CLUSTERS (v);
+    uint32_t nr_groups = (nr_clusters + ALLOC_GROUP_SIZE - 1) /
+      ALLOC_GROUP_SIZE;
+    size_t length = sizeof (fat_free_map_t) +
+      nr_groups * sizeof (fat_free_group_t);
+    fat_free_map_t *header = safe_malloc (length);
+    fat_free_group_t *groups = (fat_free_group_t *) (header + 1);
+
+    memcpy (header->magic, FREE_MAP_MAGIC, FREE_MAP_MAGIC_LEN);
+    header->volume_id = sb.volume_id;
+    header->nr_clusters = nr_clusters;
+    header->group_size = ALLOC_GROUP_SIZE;
+    header->nr_groups = nr_groups;
+
+    for (uint32_t g = 0; g < nr_groups; g ++)
+    {
+        groups [g].nr_free = MIN (ALLOC_GROUP_SIZE,
+          nr_clusters - g * ALLOC_GROUP_SIZE);
+        groups [g].longest = groups [g].nr_free;
+    }
+
+    groups [0].nr_free --;
+    groups [0].longest --;
+
+    dev_write (v->dev, (off_t) FREE_MAP_SECTOR * sector_size, header,
+      length);
+    safe_free ((void **) &header);
+}
+
+/**
+ *  Write the FSINFO sector, and its backup.
+ */
+    PRIVATE void
+write_fsinfo (void)
+{
+    char *sector = safe_malloc (sector_size);
+    uint32_t counts [2];
+
+    memset (sector, 0, sector_size);
+    memcpy (sector, FSINFO_MAGIC1, FSINFO_MAGIC1_LEN);
+    memcpy (sector + FSINFO_MAGIC2_OFFSET, FSINFO_MAGIC2,
+      FSINFO_MAGIC2_LEN);
+    memcpy (sector + FSINFO_MAGIC3_OFFSET, FSINFO_MAGIC3,
+      FSINFO_MAGIC3_LEN);
+
+    // all but the root directory's cluster are free.
+    counts [0] = NR_CLUSTERS (v) - 1;
+    counts [1] = sb.root_cluster + 1;
+    memcpy (sector + FSINFO_MAGIC2_OFFSET + FSINFO_MAGIC2_LEN, counts,
+      sizeof (counts));
+
+    dev_write (v->dev, (off_t) FSINFO_SECTOR * sector_size, sector,
+      sector_size);
+    dev_write (v->dev, (off_t) BACKUP_FSINFO_SECTOR * sector_size, sector,
+      sector_size);
+    safe_free ((void **) &sector);
+}
+
+/**
+ *  Write the boot sector, and its backup.
+ */
+    PRIVATE void
+write_boot (void)
+{
+    char *sector = safe_malloc (sector_size);
+
+    memset (sector, 0, sector_size);
+    memcpy (sector, &sb, sizeof (fat_super_block_t));
+    memcpy (sector + FS_TYPE_OFFSET, "FAT32   ", 8);
+    sector [SIGNATURE_OFFSET] = 0x55;
+    sector [SIGNATURE_OFFSET + 1] = (char) 0xAA;
+
+    dev_write (v->dev, (off_t) BACKUP_BOOT_SECTOR * sector_size, sector,
+      sector_size);
+    dev_write (v->dev, (off_t) BOOT_SECTOR * sector_size, sector,
+      sector_size);
+    safe_free ((void **) &sector);
+}
+
+/**
+ *  Print out a brief summary of how this program should be used.
+ */
+    PRIVATE void
+print_usage (void)
+{
+    printf ("mfatic-mkfs: make a FAT32 file system.\n\n"
+      "USAGE:\n"
+      "\tmfatic-mkfs [-hV]\n"
+      "\tmfatic-mkfs [options] device\n\n"
+      "COMMAND LINE OPTIONS:\n"
+      "\t-h           print this information\n"
+      "\t-V           print version information\n"
+      "\t-s MB        create an image file of this size, or extend an\n"
+      "\t             existing one.\n"
+      "\t-S bytes     sector size. The default is the device's.\n"
+      "\t-c KB        cluster size. The default depends on the size of\n"
+      "\t             the volume, from 4 KB up to 32 KB.\n"
+      "\t-a KB        start the FATs and the data region on a boundary\n"
+      "\t             of this size, such as the erase block or RAID\n"
+      "\t             stripe. The default is the device's optimal IO\n"
+      "\t             size, or the cluster size.\n"
+      "\t-f count     number of FATs. The default is 2.\n"
+      "\t-n label     volume label.\n"
+      "\t-i id        volume serial number, in hex.\n"
+      "\t-D           discard the whole device first.\n"
+      "\t-z           the device already reads as zeros, so need not be\n"
+      "\t             cleared; say on a device that zeroes discarded\n"
+      "\t             blocks, after -D. Image files are always left\n"
+      "\t             sparse.\n");
+}
+
+/**
+ *  Print out version and copyright information.
+ */
+    PRIVATE void
+print_version (void)
+{
+    printf ("mfatic-mkfs: make a FAT32 file system.\n\n"
+      "Version: %s\n\n"
+      "This is free and open source software. Please see the file COPYING\n"
+      "for the terms under which you may use, modify and redistribute\n"
+      "this software. This software has no warranty.\n\n"
+      "%s\n", VERSION_STR, COPYRIGHT_STR);
+}
+
+
+// vim: ts=4 sw=4 et
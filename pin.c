@@ -0,0 +1,563 @@
+/**
+ *  pin.c
+ *
+ *  Pinning of hot files in memory. Some files, like indexes and lookup
+ *  tables, are read all the time, and should never have to wait on the
+ *  device, however much else is going through the caches.
+ *
+ *  A pin keeps open the file and every directory on the path to it, from
+ *  the root down, so that all of their extent maps stay in memory, and
+ *  opening the file again finds its handle in the list of open files.
+ *  It then pins in the block cache the blocks of each directory up to
+ *  and including the entry for the next name in the path, which is as
+ *  far as a lookup of the path reads, and every block of the file. The
+ *  file is marked with FL_PINNED, which sends its reads and writes
+ *  through the block cache (fileio.c), so that its data is served from
+ *  memory, and writes update the pinned copy as they go to the device.
+ *
+ *  The regions pinned are remembered, to be unpinned again exactly, and
+ *  are worked out again whenever the file is given clusters or loses
+ *  them (fat_alloc.c), or is moved.
+ *
+ *  If the whole volume is in memory, the block cache is bypassed, and
+ *  only the handles are kept open.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <alloca.h>
+#include <err.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "fat.h"
+#include "blkcache.h"
+#include "extent.h"
+#include "fileio.h"
+#include "volume.h"
+#include "pin.h"
+
+
+// A region of the device pinned in the block cache.
+struct pin_range
+{
+    off_t               offset;
+    off_t               length;
+};
+
+// A pinned path. files holds the handles kept open: the root, each
+// directory in the path, and the pinned file last.
+struct pin
+{
+    char                *path;
+    fat_file_t          **files;
+    unsigned int        nr_files;
+    struct pin_range    *ranges;
+    unsigned int        nr_ranges;
+    unsigned int        max_ranges;
+    off_t               bytes;
+    struct pin          *next;
+};
+
+// The pins of one volume.
+struct pin_set
+{
+    struct pin          *pins;
+    unsigned int        nr_pins;
+    off_t               bytes;
+};
+
+
+// local procedures.
+PRIVATE struct pin * find_pin (struct pin_set *set, const char *path);
+PRIVATE int open_files (struct pin *p);
+PRIVATE void close_files (struct pin *p);
+PRIVATE void add_ranges (struct pin *p);
+PRIVATE void add_span (struct pin *p, fat_file_t *fd, off_t length);
+PRIVATE void grow_ranges (struct pin *p);
+PRIVATE void pin_ranges (struct pin *p);
+PRIVATE void unpin_ranges (struct pin *p);
+PRIVATE void unlink_pin (struct pin_set *set, struct pin *p);
+PRIVATE void free_pin (struct pin *p);
+
+// the file a pin is for.
+#define PINNED_FILE(p)      ((p)->files [(p)->nr_files - 1])
+
+
+/**
+ *  Set up the empty pin list of a volume, at mount time.
+ */
+    PUBLIC void
+pin_init (v)
+    fat_volume_t *v;            // volume being mounted.
+{
+    v->pins = safe_malloc (sizeof (struct pin_set));
+    memset (v->pins, 0, sizeof (struct pin_set));
+}
+
+/**
+ *  Pin the file or directory at a given absolute path. Pinning a path
+ *  that is already pinned does nothing.
+ *
+ *  Return value is 0 on success, or a negative errno. -ENOSPC means that
+ *  pinning the file would go over PIN_MAX_BYTES or PIN_MAX_FILES.
+ */
+    PUBLIC int
+pin_add (path)
+    const char *path;           // absolute path within the volume.
+{
+    struct pin_set *set = vol_current ()->pins;
+    size_t length = strlen (path);
+    struct pin *p;
+    int retval;
+
+    if (path [0] != '/')
+        return -EINVAL;
+
+    // a trailing separator names the same directory as none.
+    while ((length > 1) && (path [length - 1] == '/'))
+        length --;
+
+    p = safe_malloc (sizeof (struct pin));
+    memset (p, 0, sizeof (struct pin));
+    p->path = safe_malloc (length + 1);
+    memcpy (p->path, path, length);
+    p->path [length] = '\0';
+
+    if (find_pin (set, p->path) != NULL)
+    {
+        free_pin (p);
+        return 0;
+    }
+
+    if (set->nr_pins == PIN_MAX_FILES)
+    {
+        free_pin (p);
+        return -ENOSPC;
+    }
+
+    if ((retval = open_files (p)) != 0)
+    {
+        free_pin (p);
+        return retval;
+    }
+
+    // work out what is to be pinned, and check it fits, before reading
+    // any of it in.
+    add_ranges (p);
+
+    if (set->bytes + p->bytes > PIN_MAX_BYTES)
+    {
+        close_files (p);
+        free_pin (p);
+        return -ENOSPC;
+    }
+
+    pin_ranges (p);
+    PINNED_FILE (p)->flags |= FL_PINNED;
+
+    p->next = set->pins;
+    set->pins = p;
+    set->nr_pins ++;
+    set->bytes += p->bytes;
+
+    return 0;
+}
+
+/**
+ *  Unpin a path pinned by pin_add.
+ *
+ *  Return value is 0 on success, or -ENOENT if the path is not pinned.
+ */
+    PUBLIC int
+pin_remove (path)
+    const char *path;           // absolute path within the volume.
+{
+    struct pin_set *set = vol_current ()->pins;
+    struct pin *p;
+
+    if ((p = find_pin (set, path)) == NULL)
+        return -ENOENT;
+
+    unlink_pin (set, p);
+    unpin_ranges (p);
+    close_files (p);
+    free_pin (p);
+
+    return 0;
+}
+
+/**
+ *  Work out a pinned file's regions again, after its clusters have
+ *  changed. The old regions are unpinned first, so that clusters the
+ *  file has given up are no longer held; those it kept are found again
+ *  at the MRU end of the LRU list, where they were just put. A file that
+ *  grows is kept pinned even if that takes its volume over PIN_MAX_BYTES,
+ *  which only limits what can be pinned.
+ */
+    PUBLIC void
+pin_resize (fd)
+    fat_file_t *fd;             // pinned file that has changed size.
+{
+    struct pin_set *set = fd->v->pins;
+    struct pin *p;
+
+    for (p = set->pins; (p != NULL) && (PINNED_FILE (p) != fd); p = p->next)
+        ;
+
+    if (p == NULL)
+        return;
+
+    set->bytes -= p->bytes;
+    unpin_ranges (p);
+    add_ranges (p);
+    pin_ranges (p);
+    set->bytes += p->bytes;
+}
+
+/**
+ *  Follow pinned files that have been moved: the file at oldpath, and if
+ *  it is a directory, everything pinned below it. Each is pinned again
+ *  by its new path, since the directories leading to it have changed.
+ */
+    PUBLIC void
+pin_moved (oldpath, newpath)
+    const char *oldpath;        // where the file was.
+    const char *newpath;        // where it is now.
+{
+    struct pin_set *set = vol_current ()->pins;
+    size_t length = strlen (oldpath);
+    struct pin *p, *next, *moved = NULL;
+    char *path;
+
+    // take the pins that have moved off the list, before pinning them
+    // again, so that the new paths are not mistaken for pins already
+    // there.
+    for (p = set->pins; p != NULL; p = next)
+    {
+        next = p->next;
+
+        if ((strncmp (p->path, oldpath, length) != 0) ||
+          ((p->path [length] != '\0') && (p->path [length] != '/')))
+        {
+            continue;
+        }
+
+        unlink_pin (set, p);
+        unpin_ranges (p);
+        close_files (p);
+
+        p->next = moved;
+        moved = p;
+    }
+
+    for (p = moved; p != NULL; p = next)
+    {
+        next = p->next;
+
+        path = alloca (strlen (newpath) + strlen (p->path + length) + 1);
+        strcpy (path, newpath);
+        strcat (path, p->path + length);
+
+        if (pin_add (path) != 0)
+            warnx ("Couldn't pin %s again after it was moved", path);
+
+        free_pin (p);
+    }
+}
+
+/**
+ *  Forget the pin of a file that is about to be deleted, so that it can
+ *  be, once the caller has closed it. The file need not be pinned.
+ */
+    PUBLIC void
+pin_forget (fd)
+    fat_file_t *fd;             // file being deleted.
+{
+    struct pin_set *set = fd->v->pins;
+    struct pin *p;
+
+    if ((fd->flags & FL_PINNED) == 0)
+        return;
+
+    for (p = set->pins; (p != NULL) && (PINNED_FILE (p) != fd); p = p->next)
+        ;
+
+    if (p == NULL)
+        return;
+
+    unlink_pin (set, p);
+    unpin_ranges (p);
+    close_files (p);
+    free_pin (p);
+}
+
+/**
+ *  Write a table of the pinned paths into a buffer, with the number of
+ *  bytes of the volume each holds in memory. The last line has the
+ *  memory taken by all of the pinned blocks, which can be less than the
+ *  total, where pins share blocks.
+ *
+ *  Return value is the length of the whole table.
+ */
+    PUBLIC size_t
+pin_report (buf, size)
+    char *buf;                  // buffer for the table.
+    size_t size;                // size of the buffer, which may be 0.
+{
+    struct pin_set *set = vol_current ()->pins;
+    size_t len = 0;
+
+    // snprintf says how long the output would have been, so the length
+    // is counted in full, even once the buffer is full.
+#define REPORT(...) \
+    len += snprintf (buf + MIN (len, size), (len < size) ? size - len : 0, \
+      __VA_ARGS__)
+
+    REPORT ("%14s %s\n", "bytes", "path");
+
+    for (struct pin *p = set->pins; p != NULL; p = p->next)
+        REPORT ("%14llu %s\n", (unsigned long long) p->bytes, p->path);
+
+    REPORT ("%14llu %s\n", (unsigned long long) blk_pinned_bytes (),
+      "(memory)");
+
+#undef REPORT
+
+    return len;
+}
+
+/**
+ *  Look up a pinned path.
+ *
+ *  Return value is the pin, or NULL if the path is not pinned.
+ */
+    PRIVATE struct pin *
+find_pin (set, path)
+    struct pin_set *set;        // pins of the volume.
+    const char *path;           // path to look for.
+{
+    struct pin *p;
+
+    for (p = set->pins; (p != NULL) && (strcmp (p->path, path) != 0);
+      p = p->next)
+    {
+        ;
+    }
+
+    return p;
+}
+
+/**
+ *  Open the root, each directory in a pin's path, and the pinned file.
+ *
+ *  Return value is 0 on success, or a negative errno, in which case
+ *  nothing is left open.
+ */
+    PRIVATE int
+open_files (p)
+    struct pin *p;              // pin to open the files of.
+{
+    char *prefix = strdupa (p->path), *sep, c;
+    unsigned int nr_names = 0;
+    int retval;
+
+    for (sep = prefix + 1; *sep != '\0'; sep ++)
+        nr_names += (*sep == '/') ? 1 : 0;
+
+    if (prefix [1] != '\0')
+        nr_names ++;
+
+    p->files = safe_malloc (sizeof (fat_file_t *) * (nr_names + 1));
+    p->nr_files = 0;
+
+    if ((retval = fat_open ("/", &(p->files [0]))) != 0)
+        return retval;
+
+    p->nr_files = 1;
+
+    // open each prefix of the path, by ending the string at each
+    // separator in turn.
+    for (sep = prefix + 1; p->nr_files <= nr_names; sep ++)
+    {
+        if ((*sep != '/') && (*sep != '\0'))
+            continue;
+
+        c = *sep;
+        *sep = '\0';
+        retval = fat_open (prefix, &(p->files [p->nr_files]));
+        *sep = c;
+
+        if (retval != 0)
+        {
+            close_files (p);
+            return retval;
+        }
+
+        p->nr_files ++;
+    }
+
+    return 0;
+}
+
+/**
+ *  Close the files opened by open_files, the pinned file first.
+ */
+    PRIVATE void
+close_files (p)
+    struct pin *p;              // pin to close the files of.
+{
+    if (p->nr_files > 0)
+        PINNED_FILE (p)->flags &= ~FL_PINNED;
+
+    while (p->nr_files > 0)
+    {
+        p->nr_files --;
+        fat_close (p->files [p->nr_files]);
+    }
+}
+
+/**
+ *  Work out the regions of the device a pin covers: each directory up to
+ *  the entry of the next name in the path, and all of the file.
+ */
+    PRIVATE void
+add_ranges (p)
+    struct pin *p;              // pin to work out.
+{
+    p->nr_ranges = 0;
+    p->bytes = 0;
+
+    for (unsigned int i = 1; i < p->nr_files; i ++)
+    {
+        add_span (p, p->files [i - 1], (off_t) (p->files [i]->
+          dir_entry_index + 1) * sizeof (fat_direntry_t));
+    }
+
+    // all of the file's clusters, so that the pin does not depend on the
+    // size recorded, which can lag behind the clusters being written.
+    add_span (p, PINNED_FILE (p), (off_t) extent_count (&(PINNED_FILE (p)->
+      clusters)) * CLUSTER_SIZE (p->files [0]->v));
+}
+
+/**
+ *  Add the regions holding the start of a file to a pin, a run of
+ *  contiguous clusters at a time.
+ */
+    PRIVATE void
+add_span (p, fd, length)
+    struct pin *p;              // pin to add to.
+    fat_file_t *fd;             // file the region is in.
+    off_t length;               // bytes from the start of the file.
+{
+    size_t cluster_size = CLUSTER_SIZE (fd->v);
+    fat_cluster_t cluster;
+    uint32_t logical = 0, run;
+    off_t chunk;
+
+    while (length > 0)
+    {
+        if ((cluster = extent_lookup (&(fd->clusters), logical, &run)) == 0)
+            break;
+
+        chunk = MIN (length, (off_t) (run * cluster_size));
+
+        if (p->nr_ranges == p->max_ranges)
+            grow_ranges (p);
+
+        p->ranges [p->nr_ranges].offset = CLUSTER_OFFSET (fd->v, cluster);
+        p->ranges [p->nr_ranges].length = chunk;
+        p->nr_ranges ++;
+        p->bytes += chunk;
+
+        logical += run;
+        length -= chunk;
+    }
+}
+
+/**
+ *  Double the room for regions in a pin.
+ */
+    PRIVATE void
+grow_ranges (p)
+    struct pin *p;              // pin concerned.
+{
+    struct pin_range *bigger;
+
+    p->max_ranges = MAX (p->max_ranges * 2, 4);
+    bigger = safe_malloc (sizeof (struct pin_range) * p->max_ranges);
+
+    if (p->ranges != NULL)
+    {
+        memcpy (bigger, p->ranges, sizeof (struct pin_range) *
+          p->nr_ranges);
+        safe_free ((void **) &(p->ranges));
+    }
+
+    p->ranges = bigger;
+}
+
+/**
+ *  Pin each of a pin's regions in the block cache.
+ */
+    PRIVATE void
+pin_ranges (p)
+    struct pin *p;              // pin concerned.
+{
+    for (unsigned int i = 0; i < p->nr_ranges; i ++)
+        blk_pin (p->ranges [i].offset, p->ranges [i].length);
+}
+
+/**
+ *  Unpin each of a pin's regions, and forget them.
+ */
+    PRIVATE void
+unpin_ranges (p)
+    struct pin *p;              // pin concerned.
+{
+    for (unsigned int i = 0; i < p->nr_ranges; i ++)
+        blk_unpin (p->ranges [i].offset, p->ranges [i].length);
+
+    p->nr_ranges = 0;
+}
+
+/**
+ *  Take a pin off its volume's list.
+ */
+    PRIVATE void
+unlink_pin (set, p)
+    struct pin_set *set;        // pins of the volume.
+    struct pin *p;              // pin to take off.
+{
+    struct pin **pp;
+
+    for (pp = &(set->pins); *pp != p; pp = &((*pp)->next))
+        ;
+
+    *pp = p->next;
+    set->nr_pins --;
+    set->bytes -= p->bytes;
+}
+
+/**
+ *  Release the memory of a pin, whose files have been closed.
+ */
+    PRIVATE void
+free_pin (p)
+    struct pin *p;              // pin to free.
+{
+    if (p->ranges != NULL)
+        safe_free ((void **) &(p->ranges));
+
+    if (p->files != NULL)
+        safe_free ((void **) &(p->files));
+
+    safe_free ((void **) &(p->path));
+    safe_free ((void **) &p);
+}
+
+
+// vim: ts=4 sw=4 et
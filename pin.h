@@ -0,0 +1,46 @@
+/**
+ *  pin.h
+ *
+ *  Pinning of hot files in memory. A pinned file's extent map, the
+ *  directory entries leading to it, and its data are kept in the
+ *  daemon's caches until it is unpinned, so that using it never waits
+ *  on the device. Files are pinned by path, with the pin mount option,
+ *  or the pin and unpin control commands.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#ifndef MFATIC_PIN_H
+#define MFATIC_PIN_H
+
+// needed for the fat_volume_t and fat_file_t definitions.
+#include "fat.h"
+
+
+// set up the pin list of a newly mounted volume. Must be called after
+// the block cache and the lists of open files have been set up.
+extern void pin_init (fat_volume_t *v);
+
+// pin the file or directory at a given path, reading it all in now, or
+// unpin it. Return value is 0 on success, or a negative errno.
+extern int pin_add (const char *path);
+extern int pin_remove (const char *path);
+
+// bring a pinned file's pins up to date, after clusters have been added
+// to it or taken away. Called for files with FL_PINNED set.
+extern void pin_resize (fat_file_t *fd);
+
+// follow a file, or everything in a directory, that has been moved, or
+// forget the pin of a file that is about to be deleted.
+extern void pin_moved (const char *oldpath, const char *newpath);
+extern void pin_forget (fat_file_t *fd);
+
+// write a table of the pinned files, and the memory each takes up, into
+// buf. Return value is the length of the whole table, which may be more
+// than size.
+extern size_t pin_report (char *buf, size_t size);
+
+
+#endif // MFATIC_PIN_H
+
+// vim: ts=4 sw=4 et
@@ -0,0 +1,558 @@
+/**
+ *  qos.c
+ *
+ *  Fair scheduling of requests between the clients of a volume. Requests
+ *  on a volume are carried out one at a time, and used to be taken in
+ *  the order they arrived, so a client with many requests outstanding,
+ *  like a big sequential copy, held up everyone else's for as long as it
+ *  had requests queued.
+ *
+ *  Instead, requests are queued per client, and the queues are served by
+ *  start-time fair queueing. Each request is given a start tag, in
+ *  virtual time: the later of the virtual time now, and the finish tag
+ *  of the client's previous request. Its finish tag is the start plus
+ *  its cost divided by the client's weight, where the cost is
+ *  QOS_OP_COST bytes plus the data it transfers, so that both bandwidth
+ *  and request rate are shared out. The request with the lowest start
+ *  tag is run next, and the virtual time moves on to its start tag. A
+ *  client that has been idle starts at the virtual time, ahead of the
+ *  backlog of a busy one, so its requests wait behind at most one of the
+ *  busy client's, rather than all of them.
+ *
+ *  Clients may also be limited in bandwidth and request rate, with token
+ *  buckets holding up to a second's worth of each. A client that has run
+ *  out of tokens is passed over until they have been topped up; the
+ *  worker threads poll for that, using qos_next_due.
+ *
+ *  A histogram of the latency of each client's requests, from when they
+ *  were queued until they were done, is kept for qos_report.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "qos.h"
+
+
+#define NS_PER_SEC          1000000000ULL
+#define NS_PER_USEC         1000ULL
+#define BYTES_PER_MB        (1024.0 * 1024.0)
+
+// A queued request, and what is needed to schedule it.
+struct qos_request
+{
+    void                *req;
+    uint32_t            client_id;
+    size_t              bytes;
+    uint64_t            start;
+    uint64_t            received;
+    struct qos_request  *next;
+};
+
+// A client of the volume: a user, or a process.
+struct qos_client
+{
+    uint32_t            id;
+    unsigned int        weight;
+    bool                in_use;
+
+    // the finish tag of the client's last request, and the requests
+    // waiting, oldest first.
+    uint64_t            finish;
+    struct qos_request  *head;
+    struct qos_request  *tail;
+
+    // token buckets for the limits, and when they were last topped up.
+    double              byte_tokens;
+    double              op_tokens;
+    uint64_t            refilled;
+
+    // requests and bytes served, a histogram of latencies with bucket b
+    // counting those under 2^b microseconds, and the longest latency.
+    uint64_t            nr_requests;
+    uint64_t            nr_bytes;
+    uint64_t            latency [QOS_HIST_BUCKETS];
+    uint64_t            max_latency;
+    uint64_t            last_active;
+};
+
+struct qos_queue
+{
+    const qos_params_t  *params;
+    void                (*run) (void *req);
+
+    // lock protects everything below. running is true while a thread
+    // is carrying out the queue's requests.
+    pthread_mutex_t     lock;
+    bool                running;
+    uint64_t            vtime;
+    unsigned int        nr_queued;
+    struct qos_client   clients [QOS_MAX_CLIENTS];
+};
+
+
+// local functions.
+PRIVATE void drain (qos_queue_t *q);
+PRIVATE struct qos_request * next_request (qos_queue_t *q, uint64_t now);
+PRIVATE struct qos_client * find_client (qos_queue_t *q, uint32_t id,
+  uint64_t now);
+PRIVATE void refill (const qos_queue_t *q, struct qos_client *c,
+  uint64_t now);
+PRIVATE uint64_t due_in (const qos_queue_t *q, const struct qos_client *c);
+PRIVATE void record (qos_queue_t *q, const struct qos_request *r,
+  uint64_t now);
+PRIVATE uint64_t percentile (const struct qos_client *c,
+  unsigned int percent);
+PRIVATE uint64_t now_ns (void);
+
+
+/**
+ *  Make an empty queue for a volume.
+ *
+ *  Return value is the new queue.
+ */
+    PUBLIC qos_queue_t *
+qos_create (params, run)
+    const qos_params_t *params;     // tunables, kept by reference.
+    void (*run) (void *req);        // carries out a request.
+{
+    qos_queue_t *q = safe_malloc (sizeof (qos_queue_t));
+
+    memset (q, 0, sizeof (qos_queue_t));
+    q->params = params;
+    q->run = run;
+    pthread_mutex_init (&(q->lock), NULL);
+
+    return q;
+}
+
+/**
+ *  Queue a request, and run the queue unless another thread is running
+ *  it already.
+ */
+    PUBLIC void
+qos_submit (q, uid, pid, bytes, req)
+    qos_queue_t *q;         // queue of the volume.
+    uint32_t uid;           // user making the request.
+    uint32_t pid;           // process making the request.
+    size_t bytes;           // data to be read or written.
+    void *req;              // the request, given back to run.
+{
+    struct qos_request *r = safe_malloc (sizeof (struct qos_request));
+    uint64_t now = now_ns ();
+    struct qos_client *c;
+
+    r->req = req;
+    r->bytes = bytes;
+    r->received = now;
+    r->next = NULL;
+
+    switch (q->params->mode)
+    {
+    case QOS_BY_UID:
+        r->client_id = uid;
+        break;
+
+    case QOS_BY_PID:
+        r->client_id = pid;
+        break;
+
+    default:
+        r->client_id = 0;
+        break;
+    }
+
+    pthread_mutex_lock (&(q->lock));
+
+    c = find_client (q, r->client_id, now);
+    r->start = MAX (q->vtime, c->finish);
+    c->finish = r->start + (QOS_OP_COST + bytes) / c->weight;
+    c->last_active = now;
+
+    if (c->tail != NULL)
+        c->tail->next = r;
+    else
+        c->head = r;
+
+    c->tail = r;
+    q->nr_queued ++;
+
+    if (q->running == false)
+    {
+        q->running = true;
+        drain (q);
+    }
+
+    pthread_mutex_unlock (&(q->lock));
+}
+
+/**
+ *  Run any requests that are due, unless another thread is running the
+ *  queue.
+ */
+    PUBLIC void
+qos_kick (q)
+    qos_queue_t *q;         // queue of the volume.
+{
+    pthread_mutex_lock (&(q->lock));
+
+    if ((q->running == false) && (q->nr_queued > 0))
+    {
+        q->running = true;
+        drain (q);
+    }
+
+    pthread_mutex_unlock (&(q->lock));
+}
+
+/**
+ *  Return value is the number of requests waiting on a queue.
+ */
+    PUBLIC unsigned int
+qos_queued (q)
+    qos_queue_t *q;         // queue of the volume.
+{
+    return __atomic_load_n (&(q->nr_queued), __ATOMIC_RELAXED);
+}
+
+/**
+ *  Find how long it will be until a request held back by a limit may
+ *  run. Requests that are not held back are run by the thread running
+ *  the queue, so only matter if no thread is.
+ *
+ *  Return value is the number of milliseconds, rounded up, or -1 if no
+ *  requests are waiting, or a thread is running the queue.
+ */
+    PUBLIC int
+qos_next_due (q)
+    qos_queue_t *q;         // queue of the volume.
+{
+    uint64_t now = now_ns (), soonest = UINT64_MAX;
+    struct qos_client *c;
+
+    pthread_mutex_lock (&(q->lock));
+
+    if ((q->running == false) && (q->nr_queued > 0))
+    {
+        for (unsigned int i = 0; i < QOS_MAX_CLIENTS; i ++)
+        {
+            c = &(q->clients [i]);
+
+            if (c->head == NULL)
+                continue;
+
+            refill (q, c, now);
+            soonest = MIN (soonest, due_in (q, c));
+        }
+    }
+
+    pthread_mutex_unlock (&(q->lock));
+
+    if (soonest == UINT64_MAX)
+        return -1;
+
+    return (int) ((soonest + NS_PER_SEC / 1000 - 1) / (NS_PER_SEC / 1000));
+}
+
+/**
+ *  Write a table of the clients' requests, bytes transferred and
+ *  latencies in microseconds into a buffer. Latencies are the upper
+ *  bounds of histogram buckets, apart from the maximum.
+ *
+ *  Return value is the length of the table, not counting the null.
+ */
+    PUBLIC size_t
+qos_report (q, buf, size)
+    qos_queue_t *q;         // queue of the volume.
+    char *buf;              // buffer for the table.
+    size_t size;            // size of the buffer, which may be 0.
+{
+    const char *kind [] = {"uid", "pid", "all"};
+    struct qos_client *c;
+    size_t len;
+
+    // snprintf says how long the output would have been, so the length
+    // is counted in full, even once the buffer is full.
+#define REPORT(...) \
+    len += snprintf (buf + MIN (len, size), (len < size) ? size - len : 0, \
+      __VA_ARGS__)
+
+    len = 0;
+    REPORT ("%-16s %10s %14s %9s %9s %9s\n", "client", "requests", "bytes",
+      "p50_us", "p99_us", "max_us");
+
+    pthread_mutex_lock (&(q->lock));
+
+    for (unsigned int i = 0; i < QOS_MAX_CLIENTS; i ++)
+    {
+        c = &(q->clients [i]);
+
+        if ((c->in_use == false) || (c->nr_requests == 0))
+            continue;
+
+        REPORT ("%s %-12u %10llu %14llu %9llu %9llu %9llu\n",
+          kind [q->params->mode], (unsigned int) c->id,
+          (unsigned long long) c->nr_requests,
+          (unsigned long long) c->nr_bytes,
+          (unsigned long long) percentile (c, 50),
+          (unsigned long long) percentile (c, 99),
+          (unsigned long long) (c->max_latency / NS_PER_USEC));
+    }
+
+    pthread_mutex_unlock (&(q->lock));
+
+#undef REPORT
+
+    return len;
+}
+
+/**
+ *  Run requests until none are left that are due. The lock is dropped
+ *  while each request is carried out, so that others can be queued in
+ *  the meantime. Called with the lock held, and running set.
+ */
+    PRIVATE void
+drain (q)
+    qos_queue_t *q;         // queue of the volume.
+{
+    struct qos_request *r;
+
+    while ((r = next_request (q, now_ns ())) != NULL)
+    {
+        pthread_mutex_unlock (&(q->lock));
+        q->run (r->req);
+        pthread_mutex_lock (&(q->lock));
+
+        record (q, r, now_ns ());
+        safe_free ((void **) &r);
+    }
+
+    q->running = false;
+}
+
+/**
+ *  Take the request to run next off the queue: the one with the lowest
+ *  start tag, among the clients that are within their limits. Called
+ *  with the lock held.
+ *
+ *  Return value is the request, or NULL if none are due.
+ */
+    PRIVATE struct qos_request *
+next_request (q, now)
+    qos_queue_t *q;         // queue of the volume.
+    uint64_t now;           // the time now, in nanoseconds.
+{
+    struct qos_client *best = NULL, *c;
+    struct qos_request *r;
+
+    for (unsigned int i = 0; i < QOS_MAX_CLIENTS; i ++)
+    {
+        c = &(q->clients [i]);
+
+        if (c->head == NULL)
+            continue;
+
+        refill (q, c, now);
+
+        if ((due_in (q, c) == 0) &&
+          ((best == NULL) || (c->head->start < best->head->start)))
+            best = c;
+    }
+
+    if (best == NULL)
+        return NULL;
+
+    r = best->head;
+    best->head = r->next;
+
+    if (best->head == NULL)
+        best->tail = NULL;
+
+    // the byte bucket may go into debt for a large request, which the
+    // client then waits out before its next.
+    best->byte_tokens -= (double) r->bytes;
+    best->op_tokens -= 1.0;
+    q->vtime = r->start;
+    q->nr_queued --;
+
+    return r;
+}
+
+/**
+ *  Find the slot of a client, giving it one if it has none. When all of
+ *  the slots are taken, the one that has been idle longest is reused;
+ *  if none are idle, the client shares the last slot.
+ *
+ *  Return value is the client's slot.
+ */
+    PRIVATE struct qos_client *
+find_client (q, id, now)
+    qos_queue_t *q;         // queue of the volume.
+    uint32_t id;            // the client's user or process id.
+    uint64_t now;           // the time now, in nanoseconds.
+{
+    struct qos_client *c, *idlest = NULL;
+
+    for (unsigned int i = 0; i < QOS_MAX_CLIENTS; i ++)
+    {
+        c = &(q->clients [i]);
+
+        if ((c->in_use == true) && (c->id == id))
+            return c;
+
+        if ((c->in_use == false) && (idlest == NULL))
+            idlest = c;
+    }
+
+    for (unsigned int i = 0; (idlest == NULL) && (i < QOS_MAX_CLIENTS); i ++)
+    {
+        c = &(q->clients [i]);
+
+        if ((c->head == NULL) && ((idlest == NULL) ||
+            (c->last_active < idlest->last_active)))
+            idlest = c;
+    }
+
+    if (idlest == NULL)
+        return &(q->clients [QOS_MAX_CLIENTS - 1]);
+
+    memset (idlest, 0, sizeof (struct qos_client));
+    idlest->id = id;
+    idlest->in_use = true;
+    idlest->weight = 1;
+    idlest->finish = q->vtime;
+    idlest->byte_tokens = q->params->mbps * BYTES_PER_MB;
+    idlest->op_tokens = q->params->iops;
+    idlest->refilled = now;
+
+    for (unsigned int i = 0; i < q->params->nr_weights; i ++)
+    {
+        if (q->params->weights [i].id == id)
+            idlest->weight = q->params->weights [i].weight;
+    }
+
+    return idlest;
+}
+
+/**
+ *  Top up a client's token buckets for the time since they were last
+ *  topped up, to at most a second's worth.
+ */
+    PRIVATE void
+refill (q, c, now)
+    const qos_queue_t *q;   // queue of the volume.
+    struct qos_client *c;   // client concerned.
+    uint64_t now;           // the time now, in nanoseconds.
+{
+    double elapsed = (double) (now - c->refilled) / NS_PER_SEC;
+    double max_bytes = q->params->mbps * BYTES_PER_MB;
+
+    c->refilled = now;
+    c->byte_tokens = MIN (c->byte_tokens + elapsed * max_bytes, max_bytes);
+    c->op_tokens = MIN (c->op_tokens + elapsed * q->params->iops,
+      (double) q->params->iops);
+}
+
+/**
+ *  Return value is the number of nanoseconds until a client is within
+ *  its limits again, which is 0 if it is within them now.
+ */
+    PRIVATE uint64_t
+due_in (q, c)
+    const qos_queue_t *q;           // queue of the volume.
+    const struct qos_client *c;     // client concerned.
+{
+    double wait = 0.0;
+
+    // clients are not told apart with QOS_OFF, so limits do not apply.
+    if (q->params->mode == QOS_OFF)
+        return 0;
+
+    if ((q->params->mbps != 0) && (c->byte_tokens <= 0.0))
+        wait = (1.0 - c->byte_tokens) / (q->params->mbps * BYTES_PER_MB);
+
+    if ((q->params->iops != 0) && (c->op_tokens < 1.0))
+        wait = MAX (wait, (1.0 - c->op_tokens) / q->params->iops);
+
+    return (uint64_t) (wait * NS_PER_SEC);
+}
+
+/**
+ *  Count a finished request in its client's statistics, if the client
+ *  still has its slot. Called with the lock held.
+ */
+    PRIVATE void
+record (q, r, now)
+    qos_queue_t *q;                 // queue of the volume.
+    const struct qos_request *r;    // the request.
+    uint64_t now;                   // when it finished, in nanoseconds.
+{
+    uint64_t latency = now - r->received, usec = latency / NS_PER_USEC;
+    unsigned int bucket = 0;
+    struct qos_client *c;
+
+    while ((bucket < QOS_HIST_BUCKETS - 1) && ((1ULL << bucket) <= usec))
+        bucket ++;
+
+    for (unsigned int i = 0; i < QOS_MAX_CLIENTS; i ++)
+    {
+        c = &(q->clients [i]);
+
+        if ((c->in_use == false) || (c->id != r->client_id))
+            continue;
+
+        c->nr_requests ++;
+        c->nr_bytes += r->bytes;
+        c->latency [bucket] ++;
+        c->max_latency = MAX (c->max_latency, latency);
+        c->last_active = now;
+
+        return;
+    }
+}
+
+/**
+ *  Return value is the latency, in microseconds, under which a given
+ *  percentage of a client's requests were done, rounded up to a
+ *  histogram bucket boundary.
+ */
+    PRIVATE uint64_t
+percentile (c, percent)
+    const struct qos_client *c;     // client concerned.
+    unsigned int percent;           // percentage of requests.
+{
+    uint64_t wanted = (c->nr_requests * percent + 99) / 100, seen = 0;
+
+    for (unsigned int b = 0; b < QOS_HIST_BUCKETS; b ++)
+    {
+        seen += c->latency [b];
+
+        if (seen >= wanted)
+            return 1ULL << b;
+    }
+
+    return 1ULL << (QOS_HIST_BUCKETS - 1);
+}
+
+/**
+ *  Return value is the time on the monotonic clock, in nanoseconds.
+ */
+    PRIVATE uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * NS_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+
+// vim: ts=4 sw=4 et
@@ -0,0 +1,77 @@
+/**
+ *  qos.h
+ *
+ *  Fair scheduling of requests between the clients of a volume. Each
+ *  volume has a queue, which runs its requests one at a time, choosing
+ *  between clients in proportion to their weights, and holding back any
+ *  client that is over its bandwidth or request rate limit.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#ifndef MFATIC_QOS_H
+#define MFATIC_QOS_H
+
+#include <stdint.h>
+
+
+// how requests are attributed to clients: by user id, by process id, or
+// not at all, which serves every request in the order it came in.
+#define QOS_BY_UID              0
+#define QOS_BY_PID              1
+#define QOS_OFF                 2
+
+// Tunables, usually taken from the mount options. Zeroed limits are
+// unlimited.
+typedef struct qos_params
+{
+    int                 mode;
+
+    // limits applying to each client, in megabytes and requests a
+    // second.
+    unsigned int        mbps;
+    unsigned int        iops;
+
+    // weights of particular clients; all others have a weight of 1.
+    struct
+    {
+        uint32_t        id;
+        unsigned int    weight;
+    }
+    weights [QOS_MAX_WEIGHTS];
+    unsigned int        nr_weights;
+}
+qos_params_t;
+
+typedef struct qos_queue qos_queue_t;
+
+
+// make a queue for a volume. run is called to carry out each request,
+// never for more than one request at a time.
+extern qos_queue_t * qos_create (const qos_params_t *params,
+  void (*run) (void *req));
+
+// queue a request from a given user and process, which will transfer
+// bytes of data. If no other thread is running the queue's requests,
+// this thread runs them, until there are none left that are due.
+extern void qos_submit (qos_queue_t *q, uint32_t uid, uint32_t pid,
+  size_t bytes, void *req);
+
+// run any requests that have become due since their clients were held
+// back by a limit, unless another thread is already running them.
+extern void qos_kick (qos_queue_t *q);
+
+// number of requests waiting, and the number of milliseconds until a
+// request held back by a limit becomes due, or -1 if there are none.
+extern unsigned int qos_queued (qos_queue_t *q);
+extern int qos_next_due (qos_queue_t *q);
+
+// write a table of each client's requests, bytes and latencies into buf,
+// as text. Return value is the length of the whole table, which may be
+// more than size, as with snprintf.
+extern size_t qos_report (qos_queue_t *q, char *buf, size_t size);
+
+
+#endif // MFATIC_QOS_H
+
+// vim: ts=4 sw=4 et
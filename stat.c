@@ -20,24 +20,10 @@
 #include "utils.h"
 #include "fat.h"
 #include "dostimes.h"
+#include "volume.h"
 #include "stat.h"
 
 
-// global pointer to information about the mounted volume.
-PRIVATE const fat_volume_t *volume_info;
-
-
-/**
- *  Initialise the pointer to information about the mounted volume.
- *  This should be called once at mount time.
- */
-    PUBLIC void
-stat_init (info)
-    const fat_volume_t *info;
-{
-    volume_info = info;
-}
-
 /**
  *  Extract a file's metadata from it's directory entry.
  */
@@ -46,6 +32,7 @@ unpack_attributes (entry, buffer)
     const fat_direntry_t *entry;    // dir entry to extract info from.
     struct stat *buffer;            // place to store info.
 {
+    const fat_volume_t *volume_info = vol_current ();
     blkcnt_t nr_blocks;
     mode_t file_mode;
 
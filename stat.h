@@ -14,10 +14,6 @@
 #include "fat.h"
 
 
-// called at mount time with a pointer to information about the volume
-// being mounted.
-extern void stat_init (const fat_volume_t *info);
-
 // get file metadata from the file's directory entry.
 extern void unpack_attributes (const fat_direntry_t *entry, 
   struct stat *buffer);
@@ -2,278 +2,268 @@
  *  table.c
  *
  *  Provides routines to retrieve and modify entries in the file 
- *  allocation table (FAT). Internally, this module caches FAT sectors
- *  on an LRU (least recently used) basis, with write through, meaning
- *  writes to a FAT entry go straight to the hardware, and the cache is
- *  always consistent with the state of the FAT. This should not have
- *  an adverse effect on performance, because writes would normally be
- *  much less frequent than reads, however this hypothesis could be the
- *  subject of testing...
+ *  allocation table (FAT). FAT sectors are read and written through the
+ *  metadata block cache (blkcache.c), which is write through, so the
+ *  FAT on the device is always up to date. Writing an entry merges it
+ *  into the cached block that holds it, and writes the whole block out,
+ *  rather than writing 4 bytes in the middle of a device block.
+ *
+ *  Entries are read from the first FAT. Unless the volume has turned
+ *  mirroring off, every write to it is made to the other copies too, so
+ *  that they stay the same, as other systems and fsck expect. With
+ *  mirroring off, only the FAT the extension flags name is used.
+ *
+ *  If the volume's image is mapped into memory, the FAT is accessed in
+ *  place instead.
  *
  *  Author: Matthew Signorini
  */
 
-#include <unistd.h>
-
 #include "mfatic-config.h"
 #include "const.h"
 #include "utils.h"
 #include "fat.h"
+#include "device.h"
+#include "blkcache.h"
+#include "volume.h"
 #include "table.h"
 
 
-// Each item in the cache contains a key (the sector index, where 0 is
-// the first sector in the FAT) and a pointer to the data from that sector.
-typedef struct cache_entry
-{
-    unsigned int            key;
-    fat_entry_t             *sector;
-    struct cache_entry      *next;
-}
-cache_entry_t;
-
-// At the top level, the cache needs two pointers, to the head and tail of
-// the linked list of cache items, and also the number of "available 
-// slots", or the number of items that are permitted to be added to the
-// list. The lru field points to the head of the list, where the least
-// recently used item is removed; and mru points to the tail of the list
-// where the most recently used item is appended.
-struct fat_cluster_cache
-{
-    cache_entry_t           *lru;
-    cache_entry_t           *mru;
-    unsigned int            available;
-};
-
-
-// local procedures for manipulating linked lists of cache items.
-PRIVATE void add_to_mru (cache_entry_t *new_item);
-PRIVATE cache_entry_t * unlink_item (cache_entry_t **item_pointer);
-PRIVATE bool lookup_item (cache_entry_t **found, unsigned int key);
+// byte offset on the device of a given FAT entry.
+#define ENTRY_OFFSET(v, e)  ((off_t) ACTIVE_FAT_START (v) * \
+                             SECTOR_SIZE (v) + (off_t) (e) * FAT_ENTSIZE)
 
-// function to fetch a given FAT sector from the cache.
-PRIVATE fat_entry_t * get_sector (unsigned int index);
 
-
-// global pointer to the volume information for the file system that we
-// have mounted.
-PRIVATE const fat_volume_t *volume_info;
-
-// global cache structure.
-PRIVATE struct fat_cluster_cache cache;
+// local functions.
+PRIVATE void put_fat_run (fat_entry_t first, uint32_t count, bool chain);
+PRIVATE void mirror_fat (const fat_volume_t *v, off_t offset,
+  size_t count);
 
 
 /**
- *  Initialise the pointer to volume information. Should only be called
- *  once at mount time.
+ *  Find out whether the volume's FAT can be accessed in place. Should only
+ *  be called once for each volume, at mount time.
  */
     PUBLIC void
 table_init (v)
-    const fat_volume_t *v;      // pointer to volume information.
+    fat_volume_t *v;            // pointer to volume information.
 {
-    volume_info = v;
-
-    // initialise the cache structure's fields.
-    cache.lru = cache.mru = NULL;
-    cache.available = CACHE_SECTORS_MAX;
+    // If the volume's image is mapped into memory, point to the FAT in use
+    // within the mapping, and the cache is bypassed altogether.
+    v->fat_map = dev_map (v->dev, (off_t) ACTIVE_FAT_START (v) *
+      SECTOR_SIZE (v), FAT_SECTORS (v) * SECTOR_SIZE (v));
+
+    // the whole FAT is read on nearly every request, so ask for it to be
+    // kept resident.
+    if (v->fat_map != NULL)
+    {
+        dev_advise (v->dev, (off_t) ACTIVE_FAT_START (v) *
+          SECTOR_SIZE (v), FAT_SECTORS (v) * SECTOR_SIZE (v),
+          DEV_ADV_WILLNEED);
+    }
 }
 
 /**
  *  Read the contents of a given cell in the FAT. Return value is the cell
- *  contents.
+ *  contents, without the reserved top four bits. The cell must be within
+ *  the FAT, which is not checked here.
  */
     PUBLIC fat_entry_t
 get_fat_entry (entry)
     fat_entry_t entry;      // index of the cell to read.
 {
-    fat_entry_t *sector;
-    unsigned int fat_offset, sector_index;
+    const fat_volume_t *volume_info = vol_current ();
+    fat_entry_t value;
 
-    // get the offset of the required FAT entry in bytes.
-    fat_offset = entry * FAT_ENTSIZE;
+    // if the FAT is mapped, just index into it.
+    if (volume_info->fat_map != NULL)
+        return volume_info->fat_map [entry] & FAT_ENTRY_MASK;
 
-    // get the index of the sector that contains that entry.
-    sector_index = fat_offset / SECTOR_SIZE (volume_info);
+    blk_read (ENTRY_OFFSET (volume_info, entry), &value,
+      sizeof (fat_entry_t));
 
-    // fetch the sector.
-    sector = get_sector (sector_index);
+    return value & FAT_ENTRY_MASK;
+}
 
-    // calculate the offset of the entry into the sector.
-    fat_offset = (fat_offset % SECTOR_SIZE (volume_info)) / 
-        sizeof (fat_entry_t);
+/**
+ *  Have the block of the FAT holding a given entry read into the cache in
+ *  the background, as the chain starting there is about to be followed.
+ */
+    PUBLIC void
+prefetch_fat_entry (entry)
+    fat_entry_t entry;      // index of the cell to be read.
+{
+    const fat_volume_t *volume_info = vol_current ();
 
-    // return the FAT entry from within the sector.
-    return sector [fat_offset];
+    if (volume_info->fat_map == NULL)
+        blk_prefetch (ENTRY_OFFSET (volume_info, entry), FAT_ENTSIZE);
 }
 
 /**
- *  Write a new value to a particular entry in the FAT. This procedure
- *  uses "no write allocate", ie. if the FAT sector being written to is
- *  not present in the cache, it will not be brought in.
+ *  Write a new value to a particular entry in the FAT.
  */
     PUBLIC void
 put_fat_entry (entry, val)
     fat_entry_t entry;          // index of FAT entry to write to.
     fat_entry_t val;            // value to write there.
 {
-    unsigned int offset, index;
-    size_t sector_size = SECTOR_SIZE (volume_info);
-    fat_entry_t old_val;
-
-    // calculate sector index, and offset within that sector.
-    offset = entry * FAT_ENTSIZE;
-    index = offset / sector_size;
-    offset %= sector_size;
-
-    // seek the device file to the correct byte offset of the FAT entry
-    // that is to be written to.
-    safe_seek (volume_info->dev_fd, 
-      (FAT_START (volume_info) + index) * sector_size + offset,
-      SEEK_SET);
+    const fat_volume_t *volume_info = vol_current ();
+    off_t dev_offset = ENTRY_OFFSET (volume_info, entry);
+    fat_entry_t *fat_map = volume_info->fat_map, old_val;
 
     // FAT32 entries are only 28 bits long, and the most significant 4
     // bits are reserved, and must not be overwritten on writes. Instead,
     // we have to read the existing contents, and OR them into the new
-    // value.
-    safe_read (volume_info->dev_fd, &old_val, sizeof (fat_entry_t));
-    safe_seek (volume_info->dev_fd, -1 * sizeof (fat_entry_t), SEEK_CUR);
+    // value. With a mapped FAT, this can be done in place.
+    if (fat_map != NULL)
+    {
+        fat_map [entry] = (fat_map [entry] & 0xF0000000) |
+            (val & 0x0FFFFFFF);
+        dev_dirty (volume_info->dev, dev_offset, FAT_ENTSIZE);
+        mirror_fat (volume_info, dev_offset, FAT_ENTSIZE);
+        return;
+    }
+
+    // the block holding the entry is cached by the read, so the write
+    // does not have to read it again.
+    blk_read (dev_offset, &old_val, sizeof (fat_entry_t));
     val = (old_val & 0xF0000000) | (val & 0x0FFFFFFF);
 
-    // write in the new value.
-    safe_write (volume_info->dev_fd, &val, sizeof (fat_entry_t));
+    blk_write (dev_offset, &val, sizeof (fat_entry_t));
+    mirror_fat (volume_info, dev_offset, sizeof (fat_entry_t));
 }
 
 /**
- *  Add a new cache item to the head of the linked list of cache entries.
+ *  Chain a run of consecutive clusters together in the FAT, with the end
+ *  of chain sentinel after the last of them. The entries are adjacent,
+ *  so they are all written at once, rather than one block write each.
  */
-    PRIVATE void
-add_to_mru (new_item)
-    cache_entry_t *new_item;    // item to be added.
+    PUBLIC void
+put_fat_chain (first, count)
+    fat_entry_t first;          // first cluster of the run.
+    uint32_t count;             // number of clusters in the run.
 {
-    cache_entry_t *temp;
-
-    // check the available slot count. If it is zero, we need to evict
-    // the least recently used item.
-    if (cache.available == 0)
-    {
-        // unlink and free the least recently used item from the head of
-        // the list.
-        temp = unlink_item (&(cache.lru));
-
-        // free the sector contents, then the list structure.
-        safe_free ((void **) &(temp->sector));
-        safe_free ((void **) &temp);
-    }
-    else
-    {
-        cache.available -= 1;
-    }
-
-    // link the new item onto the tail of the list.
-    new_item->next = NULL;
-
-    if (cache.mru == NULL)
-    {
-        cache.lru = new_item;
-        cache.mru = new_item;
-    }
-    else
-    {
-        cache.mru->next = new_item;
-    }
+    put_fat_run (first, count, true);
 }
 
 /**
- *  unlink an item from a linked list of cache entries, given a pointer
- *  to the next field of the preceding item.
- *
- *  Return value is a pointer to the item that was unlinked from the list.
+ *  Mark a run of consecutive clusters free in the FAT. As with chaining,
+ *  the entries are written together, a piece of up to BULK_IO_SIZE at a
+ *  time, rather than one block write each.
  */
-    PRIVATE cache_entry_t *
-unlink_item (item_pointer)
-    cache_entry_t **item_pointer;
+    PUBLIC void
+put_fat_free (first, count)
+    fat_entry_t first;          // first cluster of the run.
+    uint32_t count;             // number of clusters in the run.
 {
-    cache_entry_t *temp = *item_pointer;
-
-    // unlink the item. Remember to increment the number of available
-    // cache slots, because one slot becomes free as a result of unlinking.
-    *item_pointer = (*item_pointer)->next;
-    cache.available += 1;
+    uint32_t piece;
 
-    return temp;
+    for ( ; count > 0; first += piece, count -= piece)
+    {
+        piece = MIN (count, BULK_IO_SIZE / FAT_ENTSIZE);
+        put_fat_run (first, piece, false);
+    }
 }
 
 /**
- *  Search for a cache item that matches a given key. If found, that item
- *  will be unlinked from the cache item list, and added to the MRU end,
- *  and the variable pointed to by the found parameter will be set to
- *  point to the cache item. 
- *
- *  Return value is true if an item was found, or false if not.
+ *  Write a run of adjacent entries with one read-modify-write of the
+ *  blocks holding them, either chaining the clusters together, or
+ *  marking them free.
  */
-    PRIVATE bool
-lookup_item (found, key)
-    cache_entry_t **found;      // address of var to point to found item.
-    unsigned int key;           // key to match to.
+    PRIVATE void
+put_fat_run (first, count, chain)
+    fat_entry_t first;          // first cluster of the run.
+    uint32_t count;             // number of clusters in the run.
+    bool chain;                 // true to chain them, false to free them.
 {
-    cache_entry_t **cp;
+    const fat_volume_t *volume_info = vol_current ();
+    off_t dev_offset = ENTRY_OFFSET (volume_info, first);
+    size_t length = (size_t) count * FAT_ENTSIZE;
+    fat_entry_t *entries, next;
 
-    // step through the cache from the start of the list (LRU end) until
-    // we either find a matching item, or reach the end of the list.
-    for (cp = &(cache.lru); (*cp != NULL) && ((*cp)->key != key);
-      cp = &((*cp)->next))
+    if (volume_info->fat_map != NULL)
     {
-        ;
+        entries = volume_info->fat_map + first;
+    }
+    else
+    {
+        entries = safe_malloc (length);
+        blk_read (dev_offset, entries, length);
     }
 
-    // have we found a match for the key?
-    if (*cp != NULL)
+    // keep the reserved bits of each entry, as put_fat_entry does.
+    for (uint32_t i = 0; i < count; i ++)
     {
-        // yes. Point *found to the matching item, move the item to the
-        // MRU end of the list and return true.
-        *found = *cp;
-        add_to_mru (unlink_item (cp));
-        return true;
+        if (chain == false)
+            next = 0x00000000;
+        else
+            next = (i + 1 < count) ? first + i + 1 : END_CLUSTER_MARK;
+
+        entries [i] = (entries [i] & 0xF0000000) | (next & 0x0FFFFFFF);
     }
 
-    // if we reach this point, we did not find a match. Return false.
-    return false;
+    if (volume_info->fat_map != NULL)
+    {
+        dev_dirty (volume_info->dev, dev_offset, length);
+        mirror_fat (volume_info, dev_offset, length);
+    }
+    else
+    {
+        blk_write (dev_offset, entries, length);
+        mirror_fat (volume_info, dev_offset, length);
+        safe_free ((void **) &entries);
+    }
 }
 
 /**
- *  Fetch a given sector from within the FAT.
- *
- *  Return value is a pointer to a buffer of size one sector containing
- *  the contents of the FAT sector.
+ *  Bring each copy of the FAT up to date with entries just written to the
+ *  first, if the volume keeps them mirrored. The whole blocks holding the
+ *  entries are copied out of the cache, or the mapping, so that each copy
+ *  gets block writes rather than a few bytes at a time; these are
+ *  aligned on the device as long as the FATs are. Nothing reads the
+ *  copies, so they are written past the cache, rather than taking up room
+ *  in it.
  */
-    PRIVATE fat_entry_t *
-get_sector (index)
-    unsigned int index;         // sector index, from start of FAT.
+    PRIVATE void
+mirror_fat (v, offset, count)
+    const fat_volume_t *v;      // volume the FAT belongs to.
+    off_t offset;               // where the entries are in the first FAT.
+    size_t count;               // length in bytes.
 {
-    cache_entry_t *cache_item;
+    off_t fat_start = (off_t) FAT_START (v) * SECTOR_SIZE (v);
+    off_t fat_bytes = (off_t) FAT_SECTORS (v) * SECTOR_SIZE (v);
+    off_t block = (off_t) MAX ((size_t) SECTOR_SIZE (v),
+      v->dev->block_size);
+    off_t low, high;
+    char *blocks;
+
+    if ((v->bpb->nr_FATs < 2) ||
+      ((v->bpb->extension_flags & EXT_NO_MIRROR) != 0))
+        return;
+
+    // the blocks holding the entries, as offsets within the FAT.
+    low = (offset - fat_start) / block * block;
+    high = MIN (fat_bytes, (offset - fat_start + (off_t) count + block - 1) /
+      block * block);
+
+    if (v->fat_map != NULL)
+    {
+        blocks = (char *) v->fat_map + low;
+    }
+    else
+    {
+        blocks = safe_malloc ((size_t) (high - low));
+        blk_read (fat_start + low, blocks, (size_t) (high - low));
+    }
 
-    // first try looking up the item in the cache. Is it already there?
-    if (lookup_item (&cache_item, index) == false)
+    for (unsigned int i = 1; i < v->bpb->nr_FATs; i ++)
     {
-        // not found, so we will need to read the FAT sector in and add it
-        // to the cache.
-        cache_item = safe_malloc (sizeof (cache_entry_t));
-        cache_item->key = index;
-        cache_item->sector = safe_malloc (SECTOR_SIZE (volume_info));
-
-        // seek to and read in the FAT sector.
-        safe_seek (volume_info->dev_fd,
-          (FAT_START (volume_info) + index) * SECTOR_SIZE (volume_info),
-          SEEK_SET);
-        safe_read (volume_info->dev_fd, cache_item->sector, 
-          SECTOR_SIZE (volume_info));
-
-        // add the new cache item to the MRU end of the cache list.
-        add_to_mru (cache_item);
+        blk_write_data (fat_start + i * fat_bytes + low, blocks,
+          (size_t) (high - low));
     }
 
-    return cache_item->sector;
+    if (v->fat_map == NULL)
+        safe_free ((void **) &blocks);
 }
 
-
 // vim: ts=4 sw=4 et
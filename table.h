@@ -11,16 +11,28 @@
 #define MFATIC_TABLE_H
 
 
-// this should be called once, at mount time, to initialise a pointer
-// to the volume structure.
-extern void table_init (const fat_volume_t *volume);
+// this should be called once for each volume, at mount time, to find
+// out whether its FAT is mapped into memory.
+extern void table_init (fat_volume_t *volume);
 
 // These routines fetch or write to given cells in the file allocation
-// table. Write through LRU caching is implemented internally to avoid large
-// overheads for small IO operations.
+// table of the calling thread's volume. Write through caching in the
+// metadata block cache avoids large overheads for small IO operations.
 extern fat_entry_t get_fat_entry (fat_entry_t entry);
 extern void put_fat_entry (fat_entry_t entry, fat_entry_t val);
 
+// read the part of the FAT holding an entry into the cache in the
+// background, ahead of it being used.
+extern void prefetch_fat_entry (fat_entry_t entry);
+
+// chain together count consecutive clusters starting at first, ending the
+// chain after the last, with a single write.
+extern void put_fat_chain (fat_entry_t first, uint32_t count);
+
+// mark count consecutive clusters starting at first free, writing each
+// block of the FAT they are in once.
+extern void put_fat_free (fat_entry_t first, uint32_t count);
+
 
 #endif // MFATIC_TABLE_H
 
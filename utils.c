@@ -23,6 +23,10 @@
 #include "utils.h"
 
 
+// called by safe_malloc to free up memory when an allocation fails.
+PRIVATE size_t ( *reclaim_handler ) ( size_t nbytes );
+
+
 /**
  *  wrapper to open system call. Only returns a valid file descriptor.
  */
@@ -102,7 +106,9 @@ safe_seek ( fd, offset, whence )
 }
 
 /**
- *  wrapper for malloc. Catches return value of NULL.
+ *  wrapper for malloc. Catches return value of NULL. If a reclaim handler
+ *  has been set, it is given the chance to free up memory, and the
+ *  allocation is retried for as long as it manages to free something.
  */
     PUBLIC void *
 safe_malloc ( nbytes )
@@ -110,7 +116,12 @@ safe_malloc ( nbytes )
 {
     void *mem = malloc ( nbytes );
 
-    // TODO: call a program defined abort procedure?
+    while ( ( mem == NULL ) && ( reclaim_handler != NULL ) &&
+      ( reclaim_handler ( nbytes ) != 0 ) )
+    {
+        mem = malloc ( nbytes );
+    }
+
     if ( mem == NULL )
         err ( errno, "Failed allocating memory" );
 
@@ -142,5 +153,15 @@ safe_free ( freepp )
     // TODO: log an error, or abort?
 }
 
+/**
+ *  Set the procedure called by safe_malloc when memory runs out.
+ */
+    PUBLIC void
+set_reclaim_handler ( handler )
+    size_t ( *handler ) ( size_t nbytes );  // frees memory, or NULL.
+{
+    reclaim_handler = handler;
+}
+
 
 // vim: ts=4 sw=4 et
@@ -21,6 +21,10 @@ extern size_t safe_write ( int fd, const void *buffer, size_t count );
 extern void * safe_malloc ( size_t nbytes );
 extern void safe_free ( void **freepp );
 
+// set a procedure for safe_malloc to call when an allocation fails, which
+// tries to free up at least nbytes, and returns the number of bytes freed.
+extern void set_reclaim_handler ( size_t (*handler) ( size_t nbytes ) );
+
 
 #endif // UTILS_H
 
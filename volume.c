@@ -0,0 +1,161 @@
+/**
+ *  volume.c
+ *
+ *  Tracks which volume each thread of the daemon is working on. The
+ *  thread that picks up a request from a mount sets its volume before
+ *  carrying the request out, and everything it calls finds the volume's
+ *  state from there. Also opens a volume's device, and reads in the
+ *  structures that describe its layout.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#include <string.h>
+
+#include "mfatic-config.h"
+#include "const.h"
+#include "utils.h"
+#include "fat.h"
+#include "device.h"
+#include "volume.h"
+
+
+// the volume the thread is working on.
+PRIVATE __thread fat_volume_t *current_volume;
+
+
+// local function declarations.
+PRIVATE bool verify_magic (const char *str1, const char *str2,
+  unsigned int length);
+
+
+/**
+ *  Set the volume that the calling thread is working on.
+ */
+    PUBLIC void
+vol_set_current (v)
+    fat_volume_t *v;        // the volume.
+{
+    current_volume = v;
+}
+
+/**
+ *  Return value is the volume the calling thread is working on.
+ */
+    PUBLIC fat_volume_t *
+vol_current (void)
+{
+    return current_volume;
+}
+
+/**
+ *  Open the device holding a volume, and read in its boot sector (or
+ *  BPB, if you are Old School) and FSINFO sector. The device is told
+ *  where the metadata ends, once the layout is known.
+ *
+ *  Return value is the new volume. Aborts if the device can't be opened.
+ */
+    PUBLIC fat_volume_t *
+vol_open (path, params)
+    const char *path;               // device or image file name.
+    const dev_params_t *params;     // device tunables, or NULL.
+{
+    fat_volume_t *v = safe_malloc (sizeof (fat_volume_t));
+    fat_super_block_t *sb = safe_malloc (sizeof (fat_super_block_t));
+    fat_fsinfo_t *fsinfo = safe_malloc (sizeof (fat_fsinfo_t));
+    off_t fsinfo_offset;
+
+    memset (v, 0, sizeof (fat_volume_t));
+    v->dev = dev_open (path, params);
+
+    dev_read (v->dev, 0, sb, sizeof (fat_super_block_t));
+
+    // read in the fs info sector, field by field as it is not a one to
+    // one mapping of the on disk structure (we ommit all the unused space
+    // to save memory).
+    fsinfo_offset = (off_t) sb->fsinfo_sector * sb->bps;
+    dev_read (v->dev, fsinfo_offset, &(fsinfo->magic1),
+      FSINFO_MAGIC1_LEN);
+    dev_read (v->dev, fsinfo_offset + 484, &(fsinfo->magic2),
+      FSINFO_MAGIC2_LEN + 8);
+    dev_read (v->dev, fsinfo_offset + 508, &(fsinfo->magic3),
+      FSINFO_MAGIC3_LEN);
+
+    v->bpb = sb;
+    v->fsinfo = fsinfo;
+    v->dev->meta_end = DATA_START (v);
+
+    return v;
+}
+
+/**
+ *  Check the signatures in a volume's FSINFO sector. If they don't
+ *  match, the device is not formatted as a FAT32 file system.
+ *
+ *  Return value is true if all three match.
+ */
+    PUBLIC bool
+vol_fsinfo_valid (v)
+    const fat_volume_t *v;      // volume to check.
+{
+    return verify_magic (FSINFO_MAGIC1, v->fsinfo->magic1,
+        FSINFO_MAGIC1_LEN) &&
+      verify_magic (FSINFO_MAGIC2, v->fsinfo->magic2, FSINFO_MAGIC2_LEN) &&
+      verify_magic (FSINFO_MAGIC3, v->fsinfo->magic3, FSINFO_MAGIC3_LEN);
+}
+
+/**
+ *  Clear the magic of the volume's free space checkpoint, so that it is
+ *  not trusted once the FAT has changed. Does nothing if the volume has
+ *  no checkpoint, or has reserved no room for one.
+ */
+    PUBLIC void
+vol_drop_free_map (v)
+    const fat_volume_t *v;  // volume concerned.
+{
+    off_t offset = (off_t) FREE_MAP_SECTOR * SECTOR_SIZE (v);
+    char magic [FREE_MAP_MAGIC_LEN];
+
+    if (offset + (off_t) sizeof (fat_free_map_t) >
+      (off_t) FAT_START (v) * SECTOR_SIZE (v))
+        return;
+
+    dev_read (v->dev, offset, magic, FREE_MAP_MAGIC_LEN);
+
+    if (verify_magic (FREE_MAP_MAGIC, magic, FREE_MAP_MAGIC_LEN))
+    {
+        memset (magic, 0, FREE_MAP_MAGIC_LEN);
+        dev_write (v->dev, offset, magic, FREE_MAP_MAGIC_LEN);
+    }
+}
+
+/**
+ *  compare two magics, of a given length, regardless of the presence
+ *  of NULL bytes. This procedure steps along the two strings for as long
+ *  as they remain identical (including identical null bytes) returning
+ *  only when it reaches the specified length to compare, or a non matching
+ *  character is found.
+ *
+ *  Return value is true if the strings are identical, or fals if they
+ *  differ.
+ */
+    PRIVATE bool
+verify_magic (str1, str2, length)
+    const char *str1;       // expected value.
+    const char *str2;       // actual magic on the device.
+    unsigned int length;    // length to compare for.
+{
+    // step along both strings until we either find a differing character,
+    // or we reach the end, as specified by length.
+    for (unsigned int i = 0; i < length; i ++)
+    {
+        if (str1 [i] != str2 [i])
+            return false;
+    }
+
+    // if we reach this point, the strings must be identical.
+    return true;
+}
+
+
+// vim: ts=4 sw=4 et
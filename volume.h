@@ -0,0 +1,42 @@
+/**
+ *  volume.h
+ *
+ *  One daemon can serve several volumes at once. Everything the daemon
+ *  knows about a volume hangs off its fat_volume_t, and each thread
+ *  records which volume the request it is carrying out is for, so that
+ *  the rest of the daemon need not pass the volume around explicitly.
+ *
+ *  Volumes are opened here too, for the daemon and the offline tools.
+ *
+ *  Author: Matthew Signorini
+ */
+
+#ifndef MFATIC_VOLUME_H
+#define MFATIC_VOLUME_H
+
+
+// need type definitions for fat_volume_t and dev_params_t.
+#include "fat.h"
+#include "device.h"
+
+
+// set the volume the calling thread is working on, and get it back.
+extern void vol_set_current (fat_volume_t *v);
+extern fat_volume_t * vol_current (void);
+
+// open the device holding a volume, with the given device tunables, and
+// read in its boot sector and FSINFO sector. Aborts if the device can't
+// be opened. vol_fsinfo_valid checks the FSINFO sector's signatures,
+// which are the sign of a FAT32 volume.
+extern fat_volume_t * vol_open (const char *path,
+  const dev_params_t *params);
+extern bool vol_fsinfo_valid (const fat_volume_t *v);
+
+// clear the magic of the volume's free space checkpoint, if it has one,
+// once the FAT is about to change under it.
+extern void vol_drop_free_map (const fat_volume_t *v);
+
+
+#endif // MFATIC_VOLUME_H
+
+// vim: ts=4 sw=4 et